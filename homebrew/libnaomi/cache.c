@@ -0,0 +1,280 @@
+#include <stdint.h>
+#include <string.h>
+#include "naomi/cache.h"
+#include "naomi/system.h"
+#include "naomi/interrupt.h"
+#include "irqstate.h"
+
+#define CCR *((volatile uint32_t *)0xFF00001C)
+
+#define CCR_OCE 0x0001
+#define CCR_WT 0x0002
+#define CCR_CB 0x0004
+#define CCR_OCI 0x0008
+#define CCR_ORA 0x0020
+#define CCR_OIX 0x0080
+#define CCR_ICE 0x0100
+#define CCR_ICI 0x0800
+#define CCR_IIX 0x8000
+
+// Operand cache on in copy-back mode everywhere, instruction cache on, and both of them
+// invalidated. This is what real games set up.
+#define CCR_DEFAULT (CCR_ICI | CCR_ICE | CCR_CB | CCR_OCE)
+
+// The operand cache address array. Writing zero to an entry writes it back if it is
+// dirty and then marks it invalid.
+#define OC_ADDRESS_ARRAY 0xF4000000
+#define OC_ENTRIES 512
+
+// Where the two halves of the operand cache RAM show up when CCR.ORA is set.
+#define OCRAM_BASE_LOW 0x7C001000
+#define OCRAM_BASE_HIGH 0x7C003000
+#define OCRAM_PIECE_SIZE 4096
+
+#define OCRAM_LINES (CACHE_OCRAM_SIZE / CACHE_LINE_SIZE)
+#define OCRAM_LINES_PER_PIECE (OCRAM_PIECE_SIZE / CACHE_LINE_SIZE)
+
+// For every line of operand cache RAM, how many lines the allocation starting there is,
+// or 0 if it isn't the start of an allocation. Lines inside an allocation are OCRAM_USED.
+#define OCRAM_USED 0xFF
+static uint8_t ocram_lines[OCRAM_LINES];
+static int ocram_enabled = 0;
+
+static int _cache_skip(void *addr)
+{
+    // Nothing is ever cached through the uncached mirror.
+    return (((uint32_t)addr) & 0xE0000000) == UNCACHED_MIRROR;
+}
+
+void cache_writeback(void *addr, unsigned int amount)
+{
+    if (_cache_skip(addr) || amount == 0)
+    {
+        return;
+    }
+
+    uint32_t end = ((uint32_t)addr) + amount;
+    for (uint32_t line = ((uint32_t)addr) & ~(CACHE_LINE_SIZE - 1); line < end; line += CACHE_LINE_SIZE)
+    {
+        __asm__("ocbwb @%0" : : "r"(line) : "memory");
+    }
+}
+
+void cache_invalidate(void *addr, unsigned int amount)
+{
+    if (_cache_skip(addr) || amount == 0)
+    {
+        return;
+    }
+
+    uint32_t end = ((uint32_t)addr) + amount;
+    for (uint32_t line = ((uint32_t)addr) & ~(CACHE_LINE_SIZE - 1); line < end; line += CACHE_LINE_SIZE)
+    {
+        __asm__("ocbi @%0" : : "r"(line) : "memory");
+    }
+}
+
+void cache_purge(void *addr, unsigned int amount)
+{
+    if (_cache_skip(addr) || amount == 0)
+    {
+        return;
+    }
+
+    uint32_t end = ((uint32_t)addr) + amount;
+    for (uint32_t line = ((uint32_t)addr) & ~(CACHE_LINE_SIZE - 1); line < end; line += CACHE_LINE_SIZE)
+    {
+        __asm__("ocbp @%0" : : "r"(line) : "memory");
+    }
+}
+
+void cache_prefetch(void *addr, unsigned int amount)
+{
+    if (_cache_skip(addr) || amount == 0)
+    {
+        return;
+    }
+
+    uint32_t end = ((uint32_t)addr) + amount;
+    for (uint32_t line = ((uint32_t)addr) & ~(CACHE_LINE_SIZE - 1); line < end; line += CACHE_LINE_SIZE)
+    {
+        __asm__("pref @%0" : : "r"(line));
+    }
+}
+
+static void __attribute__((noinline)) _cache_set_ccr(uint32_t value)
+{
+    // Only ever called through the uncached mirror, since the cache can't be reconfigured
+    // by code that is running out of it.
+    CCR = value;
+
+    // The change doesn't take effect for a few instructions, and nothing can touch the
+    // cache until it does.
+    __asm__ volatile(
+        "nop\n"
+        "nop\n"
+        "nop\n"
+        "nop\n"
+        "nop\n"
+        "nop\n"
+        "nop\n"
+        "nop\n"
+    );
+}
+
+static void _cache_write_ccr(uint32_t value)
+{
+    void (*uncached)(uint32_t) = (void (*)(uint32_t))((((uint32_t)_cache_set_ccr) & 0x1FFFFFFF) | UNCACHED_MIRROR);
+    uncached(value);
+}
+
+static void _cache_purge_all()
+{
+    // Write back and invalidate every line in the operand cache, whatever it holds.
+    for (unsigned int entry = 0; entry < OC_ENTRIES; entry++)
+    {
+        *((volatile uint32_t *)(OC_ADDRESS_ARRAY | (entry * CACHE_LINE_SIZE))) = 0;
+    }
+}
+
+int cache_ocram_enable()
+{
+    uint32_t old_interrupts = irq_disable();
+    if (ocram_enabled)
+    {
+        irq_restore(old_interrupts);
+        return -1;
+    }
+
+    // The half of the cache that becomes RAM might have dirty lines in it, so get
+    // everything out to memory first. This leaves every line invalid, so there's no
+    // need for CCR.OCI as well. Worse, it would throw away anything written to the
+    // stack between here and the CCR write, such as the return address for the call.
+    _cache_purge_all();
+    _cache_write_ccr((CCR & ~CCR_ICI) | CCR_ORA);
+
+    memset(ocram_lines, 0, sizeof(ocram_lines));
+    ocram_enabled = 1;
+    irq_restore(old_interrupts);
+
+    return 0;
+}
+
+void cache_ocram_disable()
+{
+    uint32_t old_interrupts = irq_disable();
+    if (ocram_enabled)
+    {
+        // The RAM half goes back to being cache with garbage tags, so make sure it all
+        // starts out invalid without losing anything the other half was holding. As
+        // above, the purge is enough on its own and CCR.OCI would only lose stack writes.
+        _cache_purge_all();
+        _cache_write_ccr(CCR & ~(CCR_ORA | CCR_ICI));
+        ocram_enabled = 0;
+    }
+    irq_restore(old_interrupts);
+}
+
+static void *_cache_ocram_address(unsigned int line)
+{
+    uint32_t base = line < OCRAM_LINES_PER_PIECE ? OCRAM_BASE_LOW : OCRAM_BASE_HIGH;
+    return (void *)(base + ((line % OCRAM_LINES_PER_PIECE) * CACHE_LINE_SIZE));
+}
+
+static int _cache_ocram_line(void *ptr)
+{
+    uint32_t addr = (uint32_t)ptr;
+    if (addr >= OCRAM_BASE_LOW && addr < (OCRAM_BASE_LOW + OCRAM_PIECE_SIZE))
+    {
+        return (addr - OCRAM_BASE_LOW) / CACHE_LINE_SIZE;
+    }
+    if (addr >= OCRAM_BASE_HIGH && addr < (OCRAM_BASE_HIGH + OCRAM_PIECE_SIZE))
+    {
+        return OCRAM_LINES_PER_PIECE + ((addr - OCRAM_BASE_HIGH) / CACHE_LINE_SIZE);
+    }
+
+    return -1;
+}
+
+void *cache_ocram_malloc(unsigned int size)
+{
+    if (size == 0 || size > CACHE_OCRAM_MAX_ALLOCATION)
+    {
+        return 0;
+    }
+
+    unsigned int needed = (size + (CACHE_LINE_SIZE - 1)) / CACHE_LINE_SIZE;
+    void *ptr = 0;
+
+    uint32_t old_interrupts = irq_disable();
+    if (ocram_enabled)
+    {
+        // First fit, making sure we never straddle the two pieces.
+        unsigned int start = 0;
+        unsigned int free = 0;
+        for (unsigned int line = 0; line < OCRAM_LINES; line++)
+        {
+            if ((line % OCRAM_LINES_PER_PIECE) == 0)
+            {
+                free = 0;
+            }
+
+            if (ocram_lines[line] != 0)
+            {
+                free = 0;
+                continue;
+            }
+            if (free == 0)
+            {
+                start = line;
+            }
+            free++;
+
+            if (free == needed)
+            {
+                ocram_lines[start] = needed;
+                for (unsigned int i = start + 1; i < start + needed; i++)
+                {
+                    ocram_lines[i] = OCRAM_USED;
+                }
+                ptr = _cache_ocram_address(start);
+                break;
+            }
+        }
+    }
+    irq_restore(old_interrupts);
+
+    return ptr;
+}
+
+void cache_ocram_free(void *ptr)
+{
+    uint32_t old_interrupts = irq_disable();
+    int line = _cache_ocram_line(ptr);
+    if (ocram_enabled && line >= 0)
+    {
+        unsigned int count = ocram_lines[line];
+        if (count == 0 || count == OCRAM_USED)
+        {
+            _irq_display_invariant("ocram failure", "attempt to free %08lx which was not allocated", (uint32_t)ptr);
+        }
+        for (unsigned int i = line; i < line + count; i++)
+        {
+            ocram_lines[i] = 0;
+        }
+    }
+    irq_restore(old_interrupts);
+}
+
+void _cache_init()
+{
+    // Invalidate both caches and turn them on, as is done in real games.
+    _cache_write_ccr(CCR_DEFAULT);
+    ocram_enabled = 0;
+}
+
+void _cache_free()
+{
+    // Leave the cache the way we found it for whatever runs next.
+    cache_ocram_disable();
+}
@@ -11,6 +11,8 @@
 #define NAOMI_DIMM_PARAMETERH ((volatile uint16_t *)0xA05F7048)
 #define NAOMI_DIMM_STATUS ((volatile uint16_t *)0xA05F704C)
 
+#define HOLLY_INTERRUPT_DIMM_COMMS (1 << HOLLY_EXTERNAL_INTERRUPT_DIMM_COMMS)
+
 #define CONST_NO_DIMM 0xFFFF
 #define CONST_DIMM_HAS_COMMAND 0x8000
 #define CONST_DIMM_COMMAND_MASK 0x7E00
@@ -19,6 +21,29 @@
 static peek_call_t global_peek_hook = 0;
 static poke_call_t global_poke_hook = 0;
 
+// Answering a command takes a few steps, since the DIMM needs a short delay before it
+// will see our response and then takes a while to drop the interrupt once we acknowledge
+// it. Rather than spinning inside the interrupt for all of that, the interrupt handler
+// stages the response and a soft timer walks through the rest.
+#define DIMM_STATE_IDLE 0
+#define DIMM_STATE_REPLY 1
+#define DIMM_STATE_REPLIED 2
+#define DIMM_STATE_ACKNOWLEDGED 3
+
+// I don't know why the reply delay is necessary. Without it, the net dimm flat out
+// never receives responses and won't reboot homebrew when sending a new image.
+#define DIMM_REPLY_DELAY 5
+#define DIMM_POLL_INTERVAL 5
+
+static soft_timer_t *dimm_timer = 0;
+static int dimm_state = DIMM_STATE_IDLE;
+static uint16_t reply_command = 0;
+static uint16_t reply_offsetl = 0;
+static uint16_t reply_paraml = 0;
+static uint16_t reply_paramh = 0;
+
+void _dimm_reply_cb(soft_timer_t *timer, void *param);
+
 int check_has_dimm_inserted()
 {
     if (*NAOMI_DIMM_COMMAND == CONST_NO_DIMM) {
@@ -27,12 +52,12 @@ int check_has_dimm_inserted()
     return 1;
 }
 
-void _dimm_command_handler()
+int _dimm_command_handler(unsigned int type, unsigned int bit, void *param)
 {
     // Keep track of the top 8 bits of the address for peek/poke commands.
     static uint32_t base_address = 0;
 
-    if ((*HOLLY_EXTERNAL_IRQ_STATUS & HOLLY_INTERRUPT_DIMM_COMMS) != 0)
+    if (dimm_state == DIMM_STATE_IDLE && (*HOLLY_EXTERNAL_IRQ_STATUS & HOLLY_INTERRUPT_DIMM_COMMS) != 0)
     {
         uint16_t dimm_command = *NAOMI_DIMM_COMMAND;
         if (dimm_command & CONST_DIMM_HAS_COMMAND)
@@ -189,60 +214,84 @@ void _dimm_command_handler()
                 }
             }
 
-            // I don't know why this wait is necessary. If I remove it, the net dimm
-            // flat out never receives responses and won't reboot homebrew when sending
-            // a new image.
-            timer_wait(5);
-
-            // Acknowledge the command, return the response.
-            *NAOMI_DIMM_COMMAND = (dimm_command & CONST_DIMM_COMMAND_MASK) | (retval & 0xFF);
-            *NAOMI_DIMM_OFFSETL = offsetl;
-            *NAOMI_DIMM_PARAMETERL = paraml;
-            *NAOMI_DIMM_PARAMETERH = paramh;
+            // Stage the response, it gets written out once the reply delay is up.
+            reply_command = (dimm_command & CONST_DIMM_COMMAND_MASK) | (retval & 0xFF);
+            reply_offsetl = offsetl;
+            reply_paraml = paraml;
+            reply_paramh = paramh;
+            dimm_state = DIMM_STATE_REPLY;
+        }
+        else {
+            /* Acknowledge the command */
             *NAOMI_DIMM_STATUS = *NAOMI_DIMM_STATUS | 0x100;
+            dimm_state = DIMM_STATE_ACKNOWLEDGED;
+        }
+
+        // Keep the interrupt masked while we finish the transaction from the timer,
+        // since it stays asserted until the acknowledge goes through.
+        _holly_interrupt_mask(type, bit);
+        soft_timer_start(dimm_timer, DIMM_REPLY_DELAY, 0);
+    }
+
+    return HOLLY_INTERRUPT_HANDLED;
+}
+
+void _dimm_reply_cb(soft_timer_t *timer, void *param)
+{
+    if (dimm_state == DIMM_STATE_REPLY)
+    {
+        // Acknowledge the command, return the response.
+        *NAOMI_DIMM_COMMAND = reply_command;
+        *NAOMI_DIMM_OFFSETL = reply_offsetl;
+        *NAOMI_DIMM_PARAMETERL = reply_paraml;
+        *NAOMI_DIMM_PARAMETERH = reply_paramh;
+        *NAOMI_DIMM_STATUS = *NAOMI_DIMM_STATUS | 0x100;
+        dimm_state = DIMM_STATE_REPLIED;
+    }
 
-            do {
-                /* Do a spinloop to wait for external IRQ to clear. */
-            } while ((*HOLLY_EXTERNAL_IRQ_STATUS & HOLLY_INTERRUPT_DIMM_COMMS) != 0);
+    if (dimm_state == DIMM_STATE_REPLIED || dimm_state == DIMM_STATE_ACKNOWLEDGED)
+    {
+        if ((*HOLLY_EXTERNAL_IRQ_STATUS & HOLLY_INTERRUPT_DIMM_COMMS) != 0)
+        {
+            // The external IRQ hasn't cleared yet, so check back shortly.
+            soft_timer_start(timer, DIMM_POLL_INTERVAL, 0);
+            return;
+        }
 
+        if (dimm_state == DIMM_STATE_REPLIED)
+        {
             /* Send interrupt to the DIMM itself saying we have data. */
             *NAOMI_DIMM_STATUS = *NAOMI_DIMM_STATUS & 0xFFFE;
         }
-        else {
-            /* Acknowledge the command */
-            *NAOMI_DIMM_STATUS = *NAOMI_DIMM_STATUS | 0x100;
-            do {
-                /* Do a spinloop to wait for external IRQ to clear. */
-            } while ((*HOLLY_EXTERNAL_IRQ_STATUS & HOLLY_INTERRUPT_DIMM_COMMS) != 0);
-        }
+
+        // Ready for the next command.
+        dimm_state = DIMM_STATE_IDLE;
+        _holly_interrupt_unmask(HOLLY_INTERRUPT_TYPE_EXTERNAL, HOLLY_EXTERNAL_INTERRUPT_DIMM_COMMS);
     }
 }
 
 void _dimm_comms_init()
 {
-    uint32_t old_interrupts = irq_disable();
-
     if (check_has_dimm_inserted())
     {
-        if ((*HOLLY_EXTERNAL_IRQ_2_MASK & HOLLY_INTERRUPT_DIMM_COMMS) == 0)
+        dimm_state = DIMM_STATE_IDLE;
+        dimm_timer = soft_timer_create(_dimm_reply_cb, 0, SOFT_TIMER_IRQ);
+        if (dimm_timer != 0)
         {
-            *HOLLY_EXTERNAL_IRQ_2_MASK = *HOLLY_EXTERNAL_IRQ_2_MASK | HOLLY_INTERRUPT_DIMM_COMMS;
+            holly_interrupt_register(HOLLY_INTERRUPT_TYPE_EXTERNAL, HOLLY_EXTERNAL_INTERRUPT_DIMM_COMMS, _dimm_command_handler, 0, 0);
         }
     }
-
-    irq_restore(old_interrupts);
 }
 
 void _dimm_comms_free()
 {
-    uint32_t old_interrupts = irq_disable();
-
-    if ((*HOLLY_EXTERNAL_IRQ_2_MASK & HOLLY_INTERRUPT_DIMM_COMMS) != 0)
+    holly_interrupt_unregister(HOLLY_INTERRUPT_TYPE_EXTERNAL, HOLLY_EXTERNAL_INTERRUPT_DIMM_COMMS);
+    if (dimm_timer != 0)
     {
-        *HOLLY_EXTERNAL_IRQ_2_MASK = *HOLLY_EXTERNAL_IRQ_2_MASK & (~HOLLY_INTERRUPT_DIMM_COMMS);
+        soft_timer_destroy(dimm_timer);
+        dimm_timer = 0;
     }
-
-    irq_restore(old_interrupts);
+    dimm_state = DIMM_STATE_IDLE;
 }
 
 void dimm_comms_attach_hooks(peek_call_t peek_hook, poke_call_t poke_hook)
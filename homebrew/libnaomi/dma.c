@@ -0,0 +1,347 @@
+#include <stdint.h>
+#include "naomi/system.h"
+#include "naomi/cache.h"
+#include "naomi/interrupt.h"
+#include "naomi/thread.h"
+#include "irqstate.h"
+#include "holly.h"
+
+// Prototypes of functions we don't want in the public headers.
+uint32_t _irq_read_sr();
+
+// SH-4 DMAC registers for the two channels we use. Channel 1 is free for auto-request
+// memory to memory copies, channel 2 is wired to HOLLY's TA/texture memory path.
+#define DMAC_SAR1 *((volatile uint32_t *)0xFFA00010)
+#define DMAC_DAR1 *((volatile uint32_t *)0xFFA00014)
+#define DMAC_DMATCR1 *((volatile uint32_t *)0xFFA00018)
+#define DMAC_CHCR1 *((volatile uint32_t *)0xFFA0001C)
+#define DMAC_SAR2 *((volatile uint32_t *)0xFFA00020)
+#define DMAC_DMATCR2 *((volatile uint32_t *)0xFFA00028)
+#define DMAC_CHCR2 *((volatile uint32_t *)0xFFA0002C)
+
+// Source and destination incrementing, auto-request, cycle steal, 32-byte units and
+// an interrupt at the end.
+#define DMAC_CHCR1_COPY 0x5445
+
+// Source incrementing, external request from HOLLY, burst, 32-byte units. HOLLY
+// tells us when it's done, so no interrupt is needed from the DMAC.
+#define DMAC_CHCR2_VRAM 0x12C1
+
+// What _enter() sets channel 2 up as. Maple doesn't work without it, so we put it back
+// this way whenever we're done using the channel ourselves.
+#define DMAC_CHCR2_IDLE 0x1201
+
+#define DMAC_CHCR_TE 0x2
+#define DMAC_CHCR_DE 0x1
+
+// HOLLY's side of the channel 2 transfer, which takes the destination in its own
+// address space and starts the transfer.
+#define HOLLY_CH2_DEST *((volatile uint32_t *)0xA05F6800)
+#define HOLLY_CH2_LEN *((volatile uint32_t *)0xA05F6804)
+#define HOLLY_CH2_START *((volatile uint32_t *)0xA05F6808)
+#define HOLLY_LMMODE0 *((volatile uint32_t *)0xA05F6884)
+
+// LMMODE0 picks which layout the channel 2 path writes VRAM in. The 64-bit layout is
+// what the texture area at 0x04000000 uses, and the 32-bit layout is what the area at
+// VRAM_BASE uses, which is where the framebuffers and everything else live.
+#define HOLLY_LMMODE_64BIT 0
+#define HOLLY_LMMODE_32BIT 1
+
+// Where VRAM shows up when written through the channel 2 path.
+#define HOLLY_CH2_VRAM_BASE 0x11000000
+
+// The G2 bus DMA that talks to the AICA's sound RAM. There are four channels but
+// only the first is used for the AICA.
+#define G2_AICA_DMA_DEST *((volatile uint32_t *)0xA05F7800)
+#define G2_AICA_DMA_SRC *((volatile uint32_t *)0xA05F7804)
+#define G2_AICA_DMA_LEN *((volatile uint32_t *)0xA05F7808)
+#define G2_AICA_DMA_DIR *((volatile uint32_t *)0xA05F780C)
+#define G2_AICA_DMA_TRIGGER *((volatile uint32_t *)0xA05F7810)
+#define G2_AICA_DMA_ENABLE *((volatile uint32_t *)0xA05F7814)
+#define G2_AICA_DMA_START *((volatile uint32_t *)0xA05F7818)
+#define G2_DMA_WAIT_STATE *((volatile uint32_t *)0xA05F7890)
+#define G2_DMA_PROTECTION *((volatile uint32_t *)0xA05F78BC)
+
+// Disable the channel once the transfer is done instead of restarting it.
+#define G2_DMA_LEN_END 0x80000000
+
+#define DMA_ENGINE_RAM 0
+#define DMA_ENGINE_VRAM 1
+#define DMA_ENGINE_SOUNDRAM 2
+
+typedef struct
+{
+    int engine;
+    uint32_t dest;
+    uint32_t src;
+    unsigned int amount;
+    semaphore_t *semaphore;
+    hw_memcpy_callback_t callback;
+    void *param;
+} dma_request_t;
+
+// Requests are run one at a time in the order they were made, so that a request never
+// sees memory that an earlier one hasn't finished writing yet.
+static dma_request_t dma_queue[MAX_DMA_REQUESTS];
+static unsigned int dma_head = 0;
+static unsigned int dma_count = 0;
+static int dma_running = 0;
+static int dma_initialized = 0;
+
+static uint32_t _dma_physical(void *addr)
+{
+    return ((uint32_t)addr) & 0x1FFFFFFF;
+}
+
+static int _dma_engine(uint32_t dest)
+{
+    if (dest >= RAM_BASE && dest < (RAM_BASE + RAM_SIZE))
+    {
+        return DMA_ENGINE_RAM;
+    }
+    if (dest >= VRAM_BASE && dest < (VRAM_BASE + VRAM_SIZE))
+    {
+        return DMA_ENGINE_VRAM;
+    }
+    if (dest >= SOUNDRAM_BASE && dest < (SOUNDRAM_BASE + SOUNDRAM_SIZE))
+    {
+        return DMA_ENGINE_SOUNDRAM;
+    }
+
+    return -1;
+}
+
+static void _dma_ch2_idle()
+{
+    DMAC_CHCR2 = 0;
+    DMAC_SAR2 = 0;
+    DMAC_CHCR2 = DMAC_CHCR2_IDLE;
+}
+
+static void _dma_start(dma_request_t *request)
+{
+    dma_running = 1;
+
+    switch (request->engine)
+    {
+        case DMA_ENGINE_RAM:
+        {
+            DMAC_CHCR1 = 0;
+            DMAC_SAR1 = request->src;
+            DMAC_DAR1 = request->dest;
+            DMAC_DMATCR1 = request->amount >> 5;
+            DMAC_CHCR1 = DMAC_CHCR1_COPY;
+            break;
+        }
+        case DMA_ENGINE_VRAM:
+        {
+            DMAC_CHCR2 = 0;
+            DMAC_SAR2 = request->src;
+            DMAC_DMATCR2 = request->amount >> 5;
+            DMAC_CHCR2 = DMAC_CHCR2_VRAM;
+
+            // We only accept destinations at VRAM_BASE, so write them in the same 32-bit
+            // layout that the CPU sees there.
+            HOLLY_LMMODE0 = HOLLY_LMMODE_32BIT;
+            HOLLY_CH2_DEST = HOLLY_CH2_VRAM_BASE | (request->dest - VRAM_BASE);
+            HOLLY_CH2_LEN = request->amount;
+            HOLLY_CH2_START = 1;
+            break;
+        }
+        case DMA_ENGINE_SOUNDRAM:
+        {
+            G2_AICA_DMA_DEST = request->dest;
+            G2_AICA_DMA_SRC = request->src;
+            G2_AICA_DMA_LEN = request->amount | G2_DMA_LEN_END;
+            G2_AICA_DMA_DIR = 0;
+            G2_AICA_DMA_TRIGGER = 0;
+            G2_AICA_DMA_ENABLE = 1;
+            G2_AICA_DMA_START = 1;
+            break;
+        }
+    }
+}
+
+static int _dma_complete()
+{
+    // The request at the head of the queue just finished, so retire it and kick off
+    // the next one. Returns nonzero if we woke up a thread.
+    if (!dma_running || dma_count == 0)
+    {
+        return 0;
+    }
+
+    dma_request_t request = dma_queue[dma_head];
+    dma_head = (dma_head + 1) % MAX_DMA_REQUESTS;
+    dma_count--;
+    dma_running = 0;
+
+    int woken = 0;
+    if (request.semaphore)
+    {
+        woken = _semaphore_release_irq(request.semaphore);
+    }
+    if (request.callback)
+    {
+        // This might queue up another request and start it, so only start the
+        // next one ourselves if it didn't.
+        request.callback(request.param);
+    }
+
+    if (!dma_running && dma_count > 0)
+    {
+        _dma_start(&dma_queue[dma_head]);
+    }
+
+    return woken;
+}
+
+int _dma_interrupt()
+{
+    // Channel 1 finished, acknowledge it so it doesn't fire again.
+    DMAC_CHCR1 &= ~(DMAC_CHCR_TE | DMAC_CHCR_DE);
+    return _dma_complete();
+}
+
+static int _dma_holly_done(unsigned int type, unsigned int bit, void *param)
+{
+    if (bit == HOLLY_NORMAL_INTERRUPT_CH2_DMA_DONE)
+    {
+        _dma_ch2_idle();
+    }
+    else
+    {
+        G2_AICA_DMA_ENABLE = 0;
+    }
+
+    return _dma_complete() ? HOLLY_INTERRUPT_WOKEN : HOLLY_INTERRUPT_HANDLED;
+}
+
+static int _hw_memcpy_async(void *dest, void *src, unsigned int amount, semaphore_t *semaphore, hw_memcpy_callback_t callback, void *param)
+{
+    if (!dma_initialized || amount == 0)
+    {
+        return 0;
+    }
+    if ((((uint32_t)dest) & 0x1F) != 0 || (((uint32_t)src) & 0x1F) != 0 || (amount & 0x1F) != 0)
+    {
+        return 0;
+    }
+
+    uint32_t physical_dest = _dma_physical(dest);
+    uint32_t physical_src = _dma_physical(src);
+    int engine = _dma_engine(physical_dest);
+    if (engine < 0 || _dma_engine(physical_src) != DMA_ENGINE_RAM)
+    {
+        return 0;
+    }
+
+    if (amount < HW_MEMCPY_ASYNC_MINIMUM && !_irq_was_disabled(_irq_read_sr()))
+    {
+        // Not worth setting up a DMA for. As long as nothing is ahead of us in the queue
+        // we can just do it right now with the store queues.
+        uint32_t old_interrupts = irq_disable();
+        int idle = dma_count == 0;
+        irq_restore(old_interrupts);
+
+        if (idle)
+        {
+            hw_memcpy(dest, src, amount);
+            if (semaphore)
+            {
+                semaphore_release(semaphore);
+            }
+            if (callback)
+            {
+                // Callbacks always run with interrupts disabled, so do the same here.
+                old_interrupts = irq_disable();
+                callback(param);
+                irq_restore(old_interrupts);
+            }
+            return 1;
+        }
+    }
+
+    // Make sure the DMA sees what the CPU wrote, and that nothing the CPU has cached
+    // for the destination gets written back over the top of the copy later.
+    cache_writeback(src, amount);
+    cache_purge(dest, amount);
+
+    uint32_t old_interrupts = irq_disable();
+    if (dma_count == MAX_DMA_REQUESTS)
+    {
+        irq_restore(old_interrupts);
+        return 0;
+    }
+
+    dma_request_t *request = &dma_queue[(dma_head + dma_count) % MAX_DMA_REQUESTS];
+    request->engine = engine;
+    request->dest = physical_dest;
+    request->src = physical_src;
+    request->amount = amount;
+    request->semaphore = semaphore;
+    request->callback = callback;
+    request->param = param;
+    dma_count++;
+
+    if (!dma_running)
+    {
+        _dma_start(&dma_queue[dma_head]);
+    }
+    irq_restore(old_interrupts);
+
+    return 1;
+}
+
+int hw_memcpy_async(void *dest, void *src, unsigned int amount, semaphore_t *done)
+{
+    return _hw_memcpy_async(dest, src, amount, done, 0, 0);
+}
+
+int hw_memcpy_async_callback(void *dest, void *src, unsigned int amount, hw_memcpy_callback_t callback, void *param)
+{
+    return _hw_memcpy_async(dest, src, amount, 0, callback, param);
+}
+
+int hw_memcpy_async_pending()
+{
+    uint32_t old_interrupts = irq_disable();
+    int pending = dma_count;
+    irq_restore(old_interrupts);
+
+    return pending;
+}
+
+void _dma_init()
+{
+    dma_head = 0;
+    dma_count = 0;
+    dma_running = 0;
+
+    // Open up the G2 bus so that DMA can reach all of sound RAM.
+    G2_DMA_WAIT_STATE = 27;
+    G2_DMA_PROTECTION = 0x4659404F;
+
+    holly_interrupt_register(HOLLY_INTERRUPT_TYPE_NORMAL, HOLLY_NORMAL_INTERRUPT_CH2_DMA_DONE, _dma_holly_done, 0, 0);
+    holly_interrupt_register(HOLLY_INTERRUPT_TYPE_NORMAL, HOLLY_NORMAL_INTERRUPT_G2_AICA_DMA_DONE, _dma_holly_done, 0, 0);
+    dma_initialized = 1;
+}
+
+void _dma_free()
+{
+    uint32_t old_interrupts = irq_disable();
+    dma_initialized = 0;
+
+    // Anything still in flight gets abandoned, since we're shutting down anyway.
+    DMAC_CHCR1 = 0;
+    _dma_ch2_idle();
+    G2_AICA_DMA_ENABLE = 0;
+
+    dma_head = 0;
+    dma_count = 0;
+    dma_running = 0;
+    irq_restore(old_interrupts);
+
+    holly_interrupt_unregister(HOLLY_INTERRUPT_TYPE_NORMAL, HOLLY_NORMAL_INTERRUPT_CH2_DMA_DONE);
+    holly_interrupt_unregister(HOLLY_INTERRUPT_TYPE_NORMAL, HOLLY_NORMAL_INTERRUPT_G2_AICA_DMA_DONE);
+}
@@ -0,0 +1,215 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <sys/reent.h>
+#include "naomi/interrupt.h"
+#include "naomi/thread.h"
+#include "irqstate.h"
+
+// The state of whatever thread is currently running, as managed by sh-crt0.s.
+extern irq_state_t *irq_state;
+
+// Prototypes of functions we don't want in the public headers.
+uint32_t _irq_read_sr();
+
+// Set in SR when we are running inside of an interrupt handler, since the handler
+// swaps to the second register bank.
+#define SR_RB 0x20000000
+
+// Owner recorded for the heap lock when it is held from inside an interrupt handler,
+// since the current state at that point belongs to whatever thread was interrupted.
+#define HEAP_OWNER_INTERRUPT ((void *)0xFFFFFFFF)
+
+// Small allocations are rounded up to one of HEAP_CACHE_CLASSES power-of-two sizes
+// starting at 16 bytes, and freed blocks are kept in a per-thread cache of up to
+// HEAP_CACHE_DEPTH blocks per size. Allocating out of this cache needs no lock since
+// only the owning thread ever touches it.
+#define HEAP_CACHE_MIN_SHIFT 4
+#define HEAP_CACHE_DEPTH 32
+#define HEAP_CACHE_SIZE(class) (1 << (HEAP_CACHE_MIN_SHIFT + (class)))
+
+static mutex_t heap_mutex;
+static int heap_locking = 0;
+static void *heap_owner = 0;
+static unsigned int heap_depth = 0;
+
+void _heap_init()
+{
+    // Threads and interrupts are up, so from now on we need to lock the heap.
+    heap_owner = 0;
+    heap_depth = 0;
+    mutex_init(&heap_mutex);
+    heap_locking = 1;
+}
+
+void _heap_free()
+{
+    // Stop locking and caching first, so that giving back our own cache goes
+    // straight to the heap.
+    heap_locking = 0;
+    if (irq_state)
+    {
+        _heap_cache_flush(&irq_state->heap_cache);
+    }
+    mutex_free(&heap_mutex);
+}
+
+void __malloc_lock(struct _reent *reent)
+{
+    if (!heap_locking)
+    {
+        // Nothing else can be running, so there is nothing to protect against.
+        return;
+    }
+
+    uint32_t old_interrupts = irq_disable();
+    void *self = (old_interrupts & SR_RB) ? HEAP_OWNER_INTERRUPT : irq_state;
+
+    // Newlib will recursively lock the heap, for instance when realloc calls malloc.
+    if (heap_depth > 0 && heap_owner == self)
+    {
+        heap_depth++;
+        irq_restore(old_interrupts);
+        return;
+    }
+
+    if (_irq_was_disabled(old_interrupts))
+    {
+        // We can't block with interrupts disabled, since that would never let the
+        // thread holding the lock run again. Whatever is holding the heap got preempted
+        // in the middle of an operation, so it is not safe to continue. Callers aren't
+        // supposed to use the heap from here at all, see naomi/system.h.
+        if (!mutex_try_lock(&heap_mutex))
+        {
+            _irq_display_invariant("heap failure", "heap locked by another thread while interrupts are disabled");
+        }
+        irq_restore(old_interrupts);
+    }
+    else
+    {
+        // Block in the scheduler until the heap is free, leaving interrupts enabled.
+        irq_restore(old_interrupts);
+        mutex_lock(&heap_mutex);
+    }
+
+    heap_owner = self;
+    heap_depth = 1;
+}
+
+void __malloc_unlock(struct _reent *reent)
+{
+    if (!heap_locking)
+    {
+        return;
+    }
+
+    heap_depth--;
+    if (heap_depth == 0)
+    {
+        heap_owner = 0;
+        mutex_unlock(&heap_mutex);
+    }
+}
+
+heap_cache_t *_heap_cache_current()
+{
+    // Interrupt handlers and code running with interrupts disabled can't use the
+    // cache, since they could be in the middle of the current thread's own cache
+    // manipulation.
+    if (!heap_locking || irq_state == 0 || _irq_was_disabled(_irq_read_sr()))
+    {
+        return 0;
+    }
+
+    return &irq_state->heap_cache;
+}
+
+int _heap_cache_class(size_t size)
+{
+    for (int class = 0; class < HEAP_CACHE_CLASSES; class++)
+    {
+        if (size <= HEAP_CACHE_SIZE(class))
+        {
+            return class;
+        }
+    }
+
+    // Too big to cache.
+    return -1;
+}
+
+int _heap_cache_block_class(size_t usable)
+{
+    // Find the largest class that this block can satisfy, as long as it isn't
+    // wasting more than the class size doing so.
+    for (int class = HEAP_CACHE_CLASSES - 1; class >= 0; class--)
+    {
+        if (usable >= HEAP_CACHE_SIZE(class))
+        {
+            return usable < (HEAP_CACHE_SIZE(class) * 2) ? class : -1;
+        }
+    }
+
+    // Too small to cache.
+    return -1;
+}
+
+void _heap_cache_flush(heap_cache_t *cache)
+{
+    for (int class = 0; class < HEAP_CACHE_CLASSES; class++)
+    {
+        while (cache->bins[class])
+        {
+            void *ptr = cache->bins[class];
+            cache->bins[class] = *((void **)ptr);
+            _free_r(_REENT, ptr);
+        }
+        cache->counts[class] = 0;
+    }
+}
+
+void *malloc(size_t size)
+{
+    int class = _heap_cache_class(size);
+    if (class >= 0)
+    {
+        heap_cache_t *cache = _heap_cache_current();
+        if (cache && cache->bins[class])
+        {
+            void *ptr = cache->bins[class];
+            cache->bins[class] = *((void **)ptr);
+            cache->counts[class]--;
+            return ptr;
+        }
+
+        // Round up so that this block can go into the cache when it is freed.
+        size = HEAP_CACHE_SIZE(class);
+    }
+
+    return _malloc_r(_REENT, size);
+}
+
+void free(void *ptr)
+{
+    if (ptr == 0)
+    {
+        return;
+    }
+
+    heap_cache_t *cache = _heap_cache_current();
+    if (cache)
+    {
+        // Blocks can come from anywhere, including newlib internals, so look at how big
+        // this block really is. Only cache blocks that are close to a cache class size.
+        int class = _heap_cache_block_class(_malloc_usable_size_r(_REENT, ptr));
+        if (class >= 0 && cache->counts[class] < HEAP_CACHE_DEPTH)
+        {
+            *((void **)ptr) = cache->bins[class];
+            cache->bins[class] = ptr;
+            cache->counts[class]++;
+            return;
+        }
+    }
+
+    _free_r(_REENT, ptr);
+}
@@ -1,9 +1,26 @@
 #ifndef __HOLLY_H
 #define __HOLLY_H
 
+// Interrupt status registers, one each for normal, external and error interrupts.
+// Normal and error interrupts are cleared by writing a 1 to their bit, external
+// interrupts are level triggered and only clear when the source is serviced.
+#define HOLLY_NORMAL_IRQ_STATUS ((volatile uint32_t *)0xA05F6900)
 #define HOLLY_EXTERNAL_IRQ_STATUS ((volatile uint32_t *)0xA05F6904)
-#define HOLLY_EXTERNAL_IRQ_2_MASK ((volatile uint32_t *)0xA05F6914)
+#define HOLLY_ERROR_IRQ_STATUS ((volatile uint32_t *)0xA05F6908)
+#define HOLLY_IRQ_STATUS(type) ((volatile uint32_t *)(0xA05F6900 + ((type) * 4)))
 
-#define HOLLY_INTERRUPT_DIMM_COMMS 0x00000008
+// Interrupt mask registers, which route each interrupt to one of the three levels
+// that HOLLY can raise on the SH-4. Again there is one each for normal, external
+// and error interrupts at every level.
+#define HOLLY_IRQ_MASK(level, type) ((volatile uint32_t *)(0xA05F6910 + ((((level) / 2) - 1) * 0x10) + ((type) * 4)))
+
+// Internal interrupt handlers that release a semaphore with _semaphore_release_irq()
+// return this so that the scheduler gets a chance to run the woken thread.
+#define HOLLY_INTERRUPT_WOKEN 2
+
+// Temporarily mask or unmask a registered interrupt, for drivers that need to finish
+// servicing a level triggered interrupt outside of the interrupt handler.
+void _holly_interrupt_mask(unsigned int type, unsigned int bit);
+void _holly_interrupt_unmask(unsigned int type, unsigned int bit);
 
 #endif
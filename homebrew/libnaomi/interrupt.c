@@ -7,6 +7,9 @@
 #include "naomi/video.h"
 #include "naomi/console.h"
 #include "naomi/thread.h"
+#include "naomi/pool.h"
+#include "naomi/timer.h"
+#include "naomi/trace.h"
 #include "irqstate.h"
 #include "holly.h"
 
@@ -18,14 +21,26 @@ static uint32_t saved_vbr;
 // Size we wish our stack to be.
 #define IRQ_STACK_SIZE 16384
 
+// Thread states are handed out of a fixed pool, one per possible thread, so that
+// creating and destroying threads never touches the heap.
+static irq_state_t state_slab[MAX_THREADS];
+static pool_t state_pool;
+
 // Definitions from sh-crt0.s that we use here.
 extern uint8_t *irq_stack;
 extern irq_state_t *irq_state;
+extern irq_state_t *irq_fpu_owner;
+void _irq_fpu_switch(irq_state_t *state);
 
 #define TRA *((volatile uint32_t *)0xFF000020)
 #define EXPEVT *((volatile uint32_t *)0xFF000024)
 #define INTEVT *((volatile uint32_t *)0xFF000028)
 
+#define SR_FD 0x00008000
+
+#define QACR0 *((volatile uint32_t *)0xFF000038)
+#define QACR1 *((volatile uint32_t *)0xFF00003C)
+
 #define INTC_BASE_ADDRESS 0xFFD00000
 
 #define INTC_IPRA *((volatile uint16_t *)(INTC_BASE_ADDRESS + 0x04))
@@ -33,9 +48,35 @@ extern irq_state_t *irq_state;
 #define INTC_IPRC *((volatile uint16_t *)(INTC_BASE_ADDRESS + 0x0C))
 #define INTC_IPRD *((volatile uint16_t *)(INTC_BASE_ADDRESS + 0x10))
 
+// Handler times in here are kept in monotonic clock ticks, and only converted to
+// microseconds when copied out by irq_stats().
 static irq_stats_t stats;
 static char exception_buffer[1024];
 
+// Should match up with _irq_disabled_stats in sh-crt0.s, which is updated by
+// irq_disable() and irq_restore() directly.
+typedef struct
+{
+    uint32_t enabled;
+    uint32_t start;
+    uint32_t caller;
+    uint32_t max_ticks;
+    uint32_t max_caller;
+} irq_disabled_stats_t;
+
+extern irq_disabled_stats_t irq_disabled_stats;
+
+// When the interrupt we're currently handling came in, and which IRQ_STATS_ index
+// it counts towards. The index is -1 when we aren't inside a handler at all.
+static uint32_t handler_start = 0;
+static int handler_source = -1;
+
+// Every interrupt bumps this, so that code filling the store queues can tell whether
+// anybody else got a chance to use them before it flushed them. Since the contents of
+// the queues can't be read back, rather than saving them per-thread like the address
+// bits below, the store queue code in system.c redoes any line that this changes during.
+volatile uint32_t _irq_store_queue_epoch = 0;
+
 void _irq_display_exception(irq_state_t *cur_state, char *failure, int code)
 {
     // Threads should already be disabled, but lets be sure.
@@ -114,6 +155,17 @@ irq_state_t * _irq_general_exception(irq_state_t *cur_state)
 
             break;
         }
+        case IRQ_EVENT_FPU_DISABLE:
+        case IRQ_EVENT_SLOT_FPU_DISABLE:
+        {
+            // This thread wants the FPU, but its registers aren't the ones in it.
+            // Swap them in, saving the previous owner's. We return to the instruction
+            // that faulted, and since this thread owns the FPU now it will be
+            // re-executed with the FPU enabled.
+            _irq_fpu_switch(cur_state);
+
+            break;
+        }
         default:
         {
             // Empty handler.
@@ -136,26 +188,299 @@ uint32_t _irq_read_vbr();
 // Hardware drivers which need init/free after IRQ setup.
 void _dimm_comms_init();
 void _dimm_comms_free();
-void _dimm_command_handler();
+void _dma_init();
+void _dma_free();
+int _dma_interrupt();
+
+typedef struct
+{
+    holly_interrupt_func_t irq_func;
+    holly_deferred_func_t deferred_func;
+    void *param;
+} holly_handler_t;
+
+#define HOLLY_INTERRUPT_TYPES 3
+
+// Registered handlers for every bit of every HOLLY interrupt type, along with which
+// level each type is routed to. See holly_interrupt_register() for why.
+static holly_handler_t holly_handlers[HOLLY_INTERRUPT_TYPES][32];
+static const unsigned int holly_levels[HOLLY_INTERRUPT_TYPES] = { 4, 2, 6 };
+
+// Deferred handlers are run by a service thread, which is only created the first time
+// somebody registers a deferred handler. Pending work is tracked as a bitmask per type.
+static uint32_t holly_thread = 0;
+static semaphore_t holly_signal;
+static mutex_t holly_thread_mutex;
+static int holly_signalled = 0;
+static uint32_t holly_pending[HOLLY_INTERRUPT_TYPES];
+
+void _holly_init()
+{
+    memset(holly_handlers, 0, sizeof(holly_handlers));
+    memset(holly_pending, 0, sizeof(holly_pending));
+    holly_thread = 0;
+    holly_signalled = 0;
+    mutex_init(&holly_thread_mutex);
+
+    // Start out with nothing routed anywhere, drivers will register what they need.
+    for (unsigned int type = 0; type < HOLLY_INTERRUPT_TYPES; type++)
+    {
+        for (unsigned int level = 2; level <= 6; level += 2)
+        {
+            *HOLLY_IRQ_MASK(level, type) = 0;
+        }
+    }
+}
+
+void _holly_free()
+{
+    for (unsigned int type = 0; type < HOLLY_INTERRUPT_TYPES; type++)
+    {
+        for (unsigned int level = 2; level <= 6; level += 2)
+        {
+            *HOLLY_IRQ_MASK(level, type) = 0;
+        }
+    }
+
+    // The service thread and its semaphore get cleaned up along with every other thread.
+    memset(holly_handlers, 0, sizeof(holly_handlers));
+    memset(holly_pending, 0, sizeof(holly_pending));
+    holly_thread = 0;
+    holly_signalled = 0;
+    mutex_free(&holly_thread_mutex);
+}
+
+int _holly_interrupt(unsigned int level)
+{
+    int woken = 0;
+
+    for (unsigned int type = 0; type < HOLLY_INTERRUPT_TYPES; type++)
+    {
+        uint32_t requested = *HOLLY_IRQ_STATUS(type) & *HOLLY_IRQ_MASK(level, type);
+        if (requested == 0)
+        {
+            continue;
+        }
+
+        if (type != HOLLY_INTERRUPT_TYPE_EXTERNAL)
+        {
+            // Acknowledge up front, so that if it fires again while we're handling it
+            // we will see it again instead of losing it.
+            *HOLLY_IRQ_STATUS(type) = requested;
+        }
+
+        for (uint32_t bits = requested; bits != 0; bits &= bits - 1)
+        {
+            unsigned int bit = __builtin_ctz(bits);
+            holly_handler_t *handler = &holly_handlers[type][bit];
+
+            if (type == HOLLY_INTERRUPT_TYPE_NORMAL)
+            {
+                stats.holly_normal[bit] ++;
+            }
+            else if (type == HOLLY_INTERRUPT_TYPE_EXTERNAL)
+            {
+                stats.holly_external[bit] ++;
+            }
+            else
+            {
+                stats.holly_error[bit] ++;
+            }
+
+            if (handler->irq_func == 0 && handler->deferred_func == 0)
+            {
+                _irq_display_invariant("uncaught holly interrupt", "type %u pending irq status %08lx", type, requested);
+            }
+
+            int defer = HOLLY_INTERRUPT_DEFER;
+            if (handler->irq_func)
+            {
+                defer = handler->irq_func(type, bit, handler->param);
+                if (defer == HOLLY_INTERRUPT_WOKEN)
+                {
+                    woken = 1;
+                }
+            }
+
+            if (defer == HOLLY_INTERRUPT_DEFER && handler->deferred_func)
+            {
+                holly_pending[type] |= 1 << bit;
+                if (type == HOLLY_INTERRUPT_TYPE_EXTERNAL)
+                {
+                    // This will keep firing until it's serviced, so leave it masked
+                    // until the deferred handler has had a chance to do that.
+                    *HOLLY_IRQ_MASK(level, type) &= ~(1 << bit);
+                }
+            }
+        }
+    }
 
-uint32_t _holly_interrupt()
+    // Wake the service thread if there's deferred work it doesn't know about yet.
+    if ((holly_pending[0] | holly_pending[1] | holly_pending[2]) != 0 && !holly_signalled && holly_thread != 0)
+    {
+        holly_signalled = 1;
+        if (_semaphore_release_irq(&holly_signal))
+        {
+            // Inform the scheduler that a thread was woken up.
+            return 1;
+        }
+    }
+
+    return woken;
+}
+
+void *_holly_service(void *param)
 {
-    uint32_t requested = *HOLLY_EXTERNAL_IRQ_STATUS;
-    uint32_t serviced = 0;
+    while ( 1 )
+    {
+        semaphore_acquire(&holly_signal);
+
+        uint32_t old_interrupts = irq_disable();
+        holly_signalled = 0;
+        irq_restore(old_interrupts);
+
+        while ( 1 )
+        {
+            // Grab the next piece of deferred work, lowest type and bit first.
+            unsigned int type = HOLLY_INTERRUPT_TYPES;
+            unsigned int bit = 0;
+            holly_handler_t handler = { 0, 0, 0 };
+
+            old_interrupts = irq_disable();
+            for (unsigned int i = 0; i < HOLLY_INTERRUPT_TYPES; i++)
+            {
+                if (holly_pending[i] != 0)
+                {
+                    type = i;
+                    bit = __builtin_ctz(holly_pending[i]);
+                    holly_pending[i] &= ~(1 << bit);
+                    handler = holly_handlers[i][bit];
+                    break;
+                }
+            }
+            irq_restore(old_interrupts);
+
+            if (type == HOLLY_INTERRUPT_TYPES)
+            {
+                break;
+            }
+
+            if (handler.deferred_func)
+            {
+                handler.deferred_func(type, bit, handler.param);
+            }
+
+            if (type == HOLLY_INTERRUPT_TYPE_EXTERNAL)
+            {
+                // Now that it has been serviced, let it through again if it's still wanted.
+                old_interrupts = irq_disable();
+                if (holly_handlers[type][bit].irq_func || holly_handlers[type][bit].deferred_func)
+                {
+                    *HOLLY_IRQ_MASK(holly_levels[type], type) |= 1 << bit;
+                }
+                irq_restore(old_interrupts);
+            }
+        }
+    }
+
+    return 0;
+}
+
+int holly_interrupt_register(unsigned int type, unsigned int bit, holly_interrupt_func_t irq_func, holly_deferred_func_t deferred_func, void *param)
+{
+    if (type >= HOLLY_INTERRUPT_TYPES || bit >= 32 || (irq_func == 0 && deferred_func == 0))
+    {
+        return -1;
+    }
+    if (type == HOLLY_INTERRUPT_TYPE_NORMAL && bit >= 30)
+    {
+        // These are summaries of the external and error status, not real interrupts.
+        return -1;
+    }
+
+    if (deferred_func != 0)
+    {
+        // Two threads could be registering their first deferred handlers at once, so
+        // only let one of them check for and spin up the service thread at a time.
+        mutex_lock(&holly_thread_mutex);
+        if (holly_thread == 0)
+        {
+            // First deferred handler, so spin up the service thread.
+            semaphore_init_count(&holly_signal, 1, 0);
+            if (holly_signal.id == 0)
+            {
+                mutex_unlock(&holly_thread_mutex);
+                return -2;
+            }
+
+            uint32_t thread = thread_create("holly interrupts", _holly_service, 0);
+            if (thread == 0)
+            {
+                semaphore_free(&holly_signal);
+                mutex_unlock(&holly_thread_mutex);
+                return -2;
+            }
+            thread_priority(thread, MAX_PRIORITY);
+            thread_start(thread);
+            holly_thread = thread;
+        }
+        mutex_unlock(&holly_thread_mutex);
+    }
 
-    if ((requested & HOLLY_INTERRUPT_DIMM_COMMS) != 0)
+    uint32_t old_interrupts = irq_disable();
+    holly_handler_t *handler = &holly_handlers[type][bit];
+    if (handler->irq_func != 0 || handler->deferred_func != 0)
     {
-        _dimm_command_handler();
-        serviced |= HOLLY_INTERRUPT_DIMM_COMMS;
+        irq_restore(old_interrupts);
+        return -3;
     }
 
-    uint32_t left = requested & (~serviced);
-    if (left)
+    handler->irq_func = irq_func;
+    handler->deferred_func = deferred_func;
+    handler->param = param;
+
+    // Don't take an interrupt for something that happened before we cared about it.
+    if (type != HOLLY_INTERRUPT_TYPE_EXTERNAL)
     {
-        _irq_display_invariant("uncaught holly interrupt", "pending irq status %08lx", left);
+        *HOLLY_IRQ_STATUS(type) = 1 << bit;
     }
+    *HOLLY_IRQ_MASK(holly_levels[type], type) |= 1 << bit;
+    irq_restore(old_interrupts);
 
-    return serviced;
+    return 0;
+}
+
+void _holly_interrupt_mask(unsigned int type, unsigned int bit)
+{
+    uint32_t old_interrupts = irq_disable();
+    *HOLLY_IRQ_MASK(holly_levels[type], type) &= ~(1 << bit);
+    irq_restore(old_interrupts);
+}
+
+void _holly_interrupt_unmask(unsigned int type, unsigned int bit)
+{
+    uint32_t old_interrupts = irq_disable();
+    if (holly_handlers[type][bit].irq_func || holly_handlers[type][bit].deferred_func)
+    {
+        *HOLLY_IRQ_MASK(holly_levels[type], type) |= 1 << bit;
+    }
+    irq_restore(old_interrupts);
+}
+
+void holly_interrupt_unregister(unsigned int type, unsigned int bit)
+{
+    if (type >= HOLLY_INTERRUPT_TYPES || bit >= 32)
+    {
+        return;
+    }
+
+    uint32_t old_interrupts = irq_disable();
+    *HOLLY_IRQ_MASK(holly_levels[type], type) &= ~(1 << bit);
+    holly_pending[type] &= ~(1 << bit);
+    holly_handlers[type][bit].irq_func = 0;
+    holly_handlers[type][bit].deferred_func = 0;
+    holly_handlers[type][bit].param = 0;
+    irq_restore(old_interrupts);
 }
 
 irq_state_t * _irq_external_interrupt(irq_state_t *cur_state)
@@ -183,13 +508,35 @@ irq_state_t * _irq_external_interrupt(irq_state_t *cur_state)
             break;
         }
         case IRQ_EVENT_HOLLY_LEVEL2:
+        {
+            int ret = _holly_interrupt(2);
+            cur_state = _syscall_holly(cur_state, ret);
+            break;
+        }
         case IRQ_EVENT_HOLLY_LEVEL4:
+        {
+            int ret = _holly_interrupt(4);
+            cur_state = _syscall_holly(cur_state, ret);
+            break;
+        }
         case IRQ_EVENT_HOLLY_LEVEL6:
         {
-            uint32_t ret = _holly_interrupt();
+            int ret = _holly_interrupt(6);
             cur_state = _syscall_holly(cur_state, ret);
             break;
         }
+        case IRQ_EVENT_DMTE1:
+        {
+            // An asynchronous memcpy finished, which might have woken a thread.
+            int ret = _dma_interrupt();
+            cur_state = _syscall_holly(cur_state, ret);
+            break;
+        }
+        case IRQ_EVENT_DMAE:
+        {
+            _irq_display_exception(cur_state, "DMA address error", INTEVT);
+            break;
+        }
         default:
         {
             // Empty handler.
@@ -202,10 +549,62 @@ irq_state_t * _irq_external_interrupt(irq_state_t *cur_state)
     return cur_state;
 }
 
+int _irq_stats_index(uint32_t source, uint32_t event)
+{
+    if (source == IRQ_SOURCE_INTERRUPT)
+    {
+        switch(event)
+        {
+            case IRQ_EVENT_TMU0:
+                return IRQ_STATS_TMU0;
+            case IRQ_EVENT_TMU1:
+                return IRQ_STATS_TMU1;
+            case IRQ_EVENT_TMU2:
+                return IRQ_STATS_TMU2;
+            case IRQ_EVENT_HOLLY_LEVEL2:
+                return IRQ_STATS_HOLLY_LEVEL2;
+            case IRQ_EVENT_HOLLY_LEVEL4:
+                return IRQ_STATS_HOLLY_LEVEL4;
+            case IRQ_EVENT_HOLLY_LEVEL6:
+                return IRQ_STATS_HOLLY_LEVEL6;
+            case IRQ_EVENT_DMTE1:
+            case IRQ_EVENT_DMAE:
+                return IRQ_STATS_DMAC;
+            default:
+                return IRQ_STATS_OTHER;
+        }
+    }
+
+    return event == IRQ_EVENT_TRAPA ? IRQ_STATS_TRAPA : IRQ_STATS_EXCEPTION;
+}
+
+void _irq_stamp_wake(irq_state_t *state)
+{
+    // Called by the scheduler whenever a waiting thread becomes runnable. Remember which
+    // interrupt did it and when, so we can see how long it takes to actually run. Only
+    // the first wakeup counts if it takes more than one to get the thread going.
+    if (handler_source >= 0 && state != 0 && state->wake_source == 0)
+    {
+        state->wake_ticks = handler_start;
+        state->wake_source = handler_source + 1;
+    }
+}
+
 void _irq_handler(uint32_t source)
 {
+    uint32_t event = source == IRQ_SOURCE_INTERRUPT ? INTEVT : EXPEVT;
+
+    handler_start = (uint32_t)timer_now_ticks();
+    handler_source = _irq_stats_index(source, event);
     stats.last_source = source;
     stats.num_interrupts ++;
+    stats.sources[handler_source].count ++;
+    TRACE_EVENT(TRACE_EVENT_IRQ_ENTER, source, event, 0);
+
+    // Remember where the interrupted code was pointing the store queues, in case we
+    // switch to another thread or something in here uses them.
+    irq_state->qacr[0] = QACR0;
+    irq_state->qacr[1] = QACR1;
 
     if (source == IRQ_SOURCE_GENERAL_EXCEPTION || source == IRQ_SOURCE_TLB_EXCEPTION)
     {
@@ -217,6 +616,38 @@ void _irq_handler(uint32_t source)
         // External interrupts.
         irq_state = _irq_external_interrupt(irq_state);
     }
+
+    uint32_t now = (uint32_t)timer_now_ticks();
+    if (irq_state->wake_source != 0)
+    {
+        // The thread we're about to return to was woken up by an interrupt and is only
+        // now getting to run, so this is the end of its wakeup latency.
+        uint32_t latency = (uint32_t)timer_ticks_to_us(now - irq_state->wake_ticks);
+        unsigned int bucket = latency == 0 ? 0 : 32 - __builtin_clz(latency);
+        if (bucket >= IRQ_LATENCY_BUCKETS)
+        {
+            bucket = IRQ_LATENCY_BUCKETS - 1;
+        }
+
+        stats.sources[irq_state->wake_source - 1].wake_latency[bucket] ++;
+        irq_state->wake_source = 0;
+    }
+
+    uint32_t elapsed = now - handler_start;
+    stats.sources[handler_source].total_time += elapsed;
+    if (elapsed > stats.sources[handler_source].max_time)
+    {
+        stats.sources[handler_source].max_time = elapsed;
+    }
+    handler_source = -1;
+
+    // Give whoever we're returning to their own store queue address bits back, and let
+    // them know that the queue contents might not be theirs anymore.
+    QACR0 = irq_state->qacr[0];
+    QACR1 = irq_state->qacr[1];
+    _irq_store_queue_epoch ++;
+
+    TRACE_EVENT(TRACE_EVENT_IRQ_EXIT, source, event, 0);
 }
 
 void _irq_init()
@@ -235,14 +666,17 @@ void _irq_init()
     irq_disable();
 
     // Initialize our stats.
-    stats.last_source = 0;
-    stats.last_event = 0;
-    stats.num_interrupts = 0;
+    memset(&stats, 0, sizeof(stats));
+    handler_source = -1;
 
     // Allocate space for our interrupt state.
-    irq_state = malloc(sizeof(irq_state_t));
+    pool_init_static(&state_pool, state_slab, sizeof(irq_state_t), MAX_THREADS);
+    irq_state = pool_alloc(&state_pool);
     memset(irq_state, 0, sizeof(irq_state_t));
 
+    // Whatever is in the FPU right now belongs to the code that called us.
+    irq_fpu_owner = irq_state;
+
     // Register the default state with threads since the current
     // running code at the time of init becomes a "thread" as such.
     _thread_register_main(irq_state);
@@ -260,12 +694,19 @@ void _irq_init()
     // Ignore WDT and SCIF2 interrupts.
     INTC_IPRB = 0x0000;
 
-    // Ignore SCIF1 and UDI interrupts.
-    INTC_IPRC = 0x0000;
+    // Allow DMAC interrupts so asynchronous copies can finish, ignore GPIO, SCIF1
+    // and UDI interrupts.
+    INTC_IPRC = 0x0800;
 
     // Allow IRL1-2 interrupts so we can receive interrupts from HOLLY.
     INTC_IPRD = 0x0FF0;
 
+    // Start tracking how long interrupts are disabled for. The monotonic clock that this
+    // relies on was already started by _timer_init().
+    irq_disabled_stats.max_ticks = 0;
+    irq_disabled_stats.max_caller = 0;
+    irq_disabled_stats.enabled = 1;
+
     // Now, enable interrupts for the whole system!
     _irq_enable();
 
@@ -275,7 +716,9 @@ void _irq_init()
     _thread_create_idle();
 
     // Now, set up hardware that needs interrupts from HOLLY
+    _holly_init();
     _dimm_comms_init();
+    _dma_init();
 }
 
 void _irq_free()
@@ -285,7 +728,18 @@ void _irq_free()
     // module, and if not display an error message to the screen.
 
     // Tear down hardware that needed interrupts from HOLLY.
+    _dma_free();
     _dimm_comms_free();
+    _holly_free();
+
+    // The monotonic clock is going away soon, so stop timing disabled sections.
+    irq_disabled_stats.enabled = 0;
+
+    // Make sure our own floating point registers are the ones in the FPU, since we're
+    // about to go back to running with it enabled all the time.
+    irq_disable();
+    _irq_fpu_switch(irq_state);
+    irq_fpu_owner = 0;
 
     // Restore SR and VBR to their pre-init state.
     __asm__(
@@ -302,8 +756,9 @@ void _irq_free()
     free(irq_stack);
     irq_stack = 0;
 
-    // Now, get rid of our interrupt state.
-    free(irq_state);
+    // Now, get rid of our interrupt state. Note that we leave the pool itself alone,
+    // since thread states are given back to it when threads are freed after this.
+    pool_release(&state_pool, irq_state);
     irq_state = 0;
 }
 
@@ -312,17 +767,26 @@ irq_state_t *_irq_new_state(thread_func_t func, void *funcparam, void *stackptr)
     uint32_t old_interrupts = irq_disable();
 
     // Allocate space for our interrupt state.
-    irq_state_t *new_state = malloc(sizeof(irq_state_t));
+    irq_state_t *new_state = pool_alloc(&state_pool);
+    if (new_state == 0)
+    {
+        // We should never have more states than threads.
+        _irq_display_invariant("irq failure", "out of thread states");
+    }
     memset(new_state, 0, sizeof(irq_state_t));
 
     // Now, set up the starting state.
     new_state->pc = (uint32_t)func;
     new_state->gp_regs[4] = (uint32_t)funcparam;
     new_state->gp_regs[15] = (uint32_t)stackptr;
-    new_state->sr = _irq_read_sr() & 0xcfffff0f;
+    new_state->sr = (_irq_read_sr() & 0xcfffff0f) | SR_FD;
     new_state->vbr = _irq_read_vbr();
     new_state->fpscr = 0x40000;
 
+    // Note that we start out not owning the FPU, so the thread's first floating
+    // point instruction swaps the above registers in. That way, threads that never
+    // touch the FPU never pay for saving and restoring floating point registers.
+
     // Now, re-enable interrupts and return the state.
     irq_restore(old_interrupts);
     return new_state;
@@ -337,7 +801,19 @@ void _irq_free_state(irq_state_t *state)
         _irq_display_invariant("irq failure", "tried to free our own state");
     }
 
-    free(state);
+    // If its floating point registers are still in the FPU, they don't belong to
+    // anyone anymore. Otherwise whatever thread gets this state next would start out
+    // owning them.
+    uint32_t old_interrupts = irq_disable();
+    if (irq_fpu_owner == state)
+    {
+        irq_fpu_owner = 0;
+    }
+    irq_restore(old_interrupts);
+
+    // Give back any small blocks this thread was holding on to.
+    _heap_cache_flush(&state->heap_cache);
+    pool_release(&state_pool, state);
 }
 
 irq_stats_t irq_stats()
@@ -346,11 +822,35 @@ irq_stats_t irq_stats()
 
     uint32_t saved_interrupts = irq_disable();
     memcpy(&statscopy, &stats, sizeof(irq_stats_t));
+    statscopy.max_disabled_time = irq_disabled_stats.max_ticks;
+    statscopy.max_disabled_caller = irq_disabled_stats.max_caller;
     irq_restore(saved_interrupts);
 
+    // Convert everything we keep in ticks over to microseconds.
+    for (int i = 0; i < IRQ_STATS_SOURCES; i++)
+    {
+        statscopy.sources[i].total_time = timer_ticks_to_us(statscopy.sources[i].total_time);
+        statscopy.sources[i].max_time = timer_ticks_to_us(statscopy.sources[i].max_time);
+    }
+    statscopy.max_disabled_time = timer_ticks_to_us(statscopy.max_disabled_time);
+
     return statscopy;
 }
 
+void irq_stats_reset()
+{
+    uint32_t saved_interrupts = irq_disable();
+    for (int i = 0; i < IRQ_STATS_SOURCES; i++)
+    {
+        stats.sources[i].total_time = 0;
+        stats.sources[i].max_time = 0;
+        memset(stats.sources[i].wake_latency, 0, sizeof(stats.sources[i].wake_latency));
+    }
+    irq_disabled_stats.max_ticks = 0;
+    irq_disabled_stats.max_caller = 0;
+    irq_restore(saved_interrupts);
+}
+
 int _irq_was_disabled(uint32_t sr)
 {
     return (sr & 0x10000000) != 0 ? 1 : 0;
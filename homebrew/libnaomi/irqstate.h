@@ -6,6 +6,15 @@
 #define MICROSECONDS_IN_ONE_SECOND 1000000
 #define PREEMPTION_HZ 1000
 
+// Per-thread cache of small freed heap blocks, managed by heap.c.
+#define HEAP_CACHE_CLASSES 4
+
+typedef struct
+{
+    void *bins[HEAP_CACHE_CLASSES];
+    unsigned int counts[HEAP_CACHE_CLASSES];
+} heap_cache_t;
+
 // Should match up with save and restore code in sh-crt0.s.
 typedef struct
 {
@@ -38,18 +47,50 @@ typedef struct
     // Saved floating point status and communication registers.
     uint32_t fpscr;
     uint32_t fpul;
+
+    // Back-pointer to the thread that owns this state. This is not touched by
+    // the save and restore code in sh-crt0.s, so it must stay after the above.
+    void *thread;
+
+    // Small heap blocks freed by this thread, ready to be handed back out.
+    heap_cache_t heap_cache;
+
+    // Innermost profiling zone this thread is currently in, managed by profile.c.
+    void *profile_zone;
+
+    // When and by which interrupt this thread was last woken up, managed by interrupt.c.
+    // The source is an IRQ_STATS_ index plus one, or zero when the thread isn't waiting
+    // to run after being woken.
+    uint32_t wake_ticks;
+    int wake_source;
+
+    // This thread's store queue address control registers, QACR0 and QACR1. These are
+    // swapped on every interrupt so that each thread has its own, see interrupt.c.
+    uint32_t qacr[2];
 } irq_state_t;
 
 irq_state_t *_irq_new_state(thread_func_t func, void *funcparam, void *stackptr);
 void _irq_free_state(irq_state_t *state);
+void _irq_stamp_wake(irq_state_t *state);
 
 irq_state_t *_syscall_trapa(irq_state_t *state, unsigned int which);
 irq_state_t *_syscall_timer(irq_state_t *state, int timer);
-irq_state_t *_syscall_holly(irq_state_t *current, uint32_t irq_mask);
+irq_state_t *_syscall_holly(irq_state_t *current, int woken);
 
 void _thread_create_idle();
 void _thread_register_main(irq_state_t *state);
-uint64_t _profile_get_current(uint32_t adjustments);
+void _preempt_request(uint32_t microseconds);
+int _semaphore_release_irq(semaphore_t *semaphore);
+
+// Record a trace event if tracing is running, see naomi/trace.h for the event types.
+// The arguments are not evaluated at all when tracing is off.
+extern int _trace_enabled;
+void _trace_event(uint16_t type, uint16_t code, uint32_t a, uint32_t b);
+#define TRACE_EVENT(type, code, a, b) \
+do { \
+    if (_trace_enabled) { _trace_event((type), (code), (a), (b)); } \
+} while( 0 )
+void _heap_cache_flush(heap_cache_t *cache);
 
 void _irq_display_exception(irq_state_t *cur_state, char *failure, int code);
 void _irq_display_invariant(char *msg, char *failure, ...);
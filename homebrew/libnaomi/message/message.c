@@ -7,6 +7,10 @@
 #endif
 #include "naomi/system.h"
 #include "naomi/interrupt.h"
+#include "naomi/sampler.h"
+#include "naomi/thread.h"
+#include "naomi/timer.h"
+#include "naomi/trace.h"
 #include "naomi/message/message.h"
 #include "naomi/message/packet.h"
 
@@ -441,3 +445,184 @@ void message_stdio_redirect_free()
         unhook_stdio_calls( &message_calls );
     }
 }
+
+#define MESSAGE_HOST_SAMPLES 0x7FFD
+
+int message_send_samples(int flush)
+{
+    int sent = 0;
+
+    // Send every full histogram first, and then the partial one if requested.
+    for (int pass = 0; pass < 2; pass++)
+    {
+        if (pass == 1 && !flush)
+        {
+            break;
+        }
+
+        sampler_histogram_t *histogram;
+        while ((histogram = sampler_next(pass)) != 0)
+        {
+            // The histogram header and packed entries are already laid out the way
+            // the host expects them, so just send the part that's in use.
+            unsigned int length = (sizeof(uint32_t) * 3) + (sizeof(sampler_entry_t) * histogram->count);
+            int result = message_send(MESSAGE_HOST_SAMPLES, histogram, length);
+            sampler_release(histogram);
+            if (result != 0)
+            {
+                return result;
+            }
+            sent++;
+
+            if (pass == 1)
+            {
+                // Only ever cut one partial histogram short.
+                break;
+            }
+        }
+    }
+
+    return sent;
+}
+
+#define MESSAGE_HOST_TRACE 0x7FFC
+
+#define TRACE_MESSAGE_BEGIN 0
+#define TRACE_MESSAGE_EVENTS 1
+#define TRACE_MESSAGE_END 2
+
+// Enough events to fill most of a message, with room for the chunk header.
+#define TRACE_EVENTS_PER_MESSAGE 4000
+#define TRACE_MAX_THREAD_NAMES 128
+
+typedef struct
+{
+    uint32_t id;
+    char name[64];
+} trace_thread_name_t;
+
+static unsigned int __trace_add_thread(uint32_t *threads, unsigned int count, uint32_t id)
+{
+    if (id == 0 || count >= TRACE_MAX_THREAD_NAMES)
+    {
+        return count;
+    }
+    for (unsigned int i = 0; i < count; i++)
+    {
+        if (threads[i] == id)
+        {
+            return count;
+        }
+    }
+
+    threads[count] = id;
+    return count + 1;
+}
+
+static int __trace_send(uint8_t *buffer, uint32_t *threads)
+{
+    unsigned int total = trace_count();
+    trace_event_t *events = (trace_event_t *)(buffer + (sizeof(uint32_t) * 3));
+
+    // Find every thread that shows up in the trace, so the host can name them.
+    unsigned int thread_count = 0;
+    for (unsigned int first = 0; first < total; first += TRACE_EVENTS_PER_MESSAGE)
+    {
+        unsigned int count = trace_read(events, first, TRACE_EVENTS_PER_MESSAGE);
+        for (unsigned int i = 0; i < count; i++)
+        {
+            switch (events[i].type)
+            {
+                case TRACE_EVENT_SWITCH:
+                    thread_count = __trace_add_thread(threads, thread_count, events[i].a);
+                    thread_count = __trace_add_thread(threads, thread_count, events[i].b);
+                    break;
+                case TRACE_EVENT_SYSCALL:
+                case TRACE_EVENT_WAIT:
+                case TRACE_EVENT_WAKE:
+                    thread_count = __trace_add_thread(threads, thread_count, events[i].a);
+                    break;
+            }
+        }
+    }
+
+    // Send a header describing the trace, followed by the name of every thread.
+    unsigned int header_length = (sizeof(uint32_t) * 5) + (sizeof(trace_thread_name_t) * thread_count);
+    uint8_t *header = malloc(header_length);
+    if (header == 0)
+    {
+        return -1;
+    }
+
+    uint32_t *header_words = (uint32_t *)header;
+    header_words[0] = TRACE_MESSAGE_BEGIN;
+    header_words[1] = TIMER_TICKS_PER_SECOND;
+    header_words[2] = total;
+    header_words[3] = (uint32_t)timer_now_ticks();
+    header_words[4] = thread_count;
+
+    trace_thread_name_t *names = (trace_thread_name_t *)(header + (sizeof(uint32_t) * 5));
+    for (unsigned int i = 0; i < thread_count; i++)
+    {
+        thread_info_t info = thread_info(threads[i]);
+        names[i].id = threads[i];
+        memcpy(names[i].name, info.name, sizeof(names[i].name));
+        names[i].name[sizeof(names[i].name) - 1] = 0;
+    }
+
+    int result = message_send(MESSAGE_HOST_TRACE, header, header_length);
+    free(header);
+    if (result != 0)
+    {
+        return result;
+    }
+
+    // Now, send the events themselves, oldest first.
+    for (unsigned int first = 0; first < total; first += TRACE_EVENTS_PER_MESSAGE)
+    {
+        unsigned int count = trace_read(events, first, TRACE_EVENTS_PER_MESSAGE);
+        uint32_t *chunk_words = (uint32_t *)buffer;
+        chunk_words[0] = TRACE_MESSAGE_EVENTS;
+        chunk_words[1] = first;
+        chunk_words[2] = count;
+
+        result = message_send(MESSAGE_HOST_TRACE, buffer, (sizeof(uint32_t) * 3) + (sizeof(trace_event_t) * count));
+        if (result != 0)
+        {
+            return result;
+        }
+    }
+
+    uint32_t end = TRACE_MESSAGE_END;
+    return message_send(MESSAGE_HOST_TRACE, &end, sizeof(end));
+}
+
+int message_send_trace()
+{
+    // Sending generates plenty of events of its own, so hold still while we do it.
+    int was_running = trace_running();
+    trace_stop();
+
+    int result = -1;
+    uint8_t *buffer = malloc((sizeof(uint32_t) * 3) + (sizeof(trace_event_t) * TRACE_EVENTS_PER_MESSAGE));
+    uint32_t *threads = malloc(sizeof(uint32_t) * TRACE_MAX_THREAD_NAMES);
+    if (buffer != 0 && threads != 0)
+    {
+        result = __trace_send(buffer, threads);
+    }
+
+    if (buffer)
+    {
+        free(buffer);
+    }
+    if (threads)
+    {
+        free(threads);
+    }
+    if (was_running)
+    {
+        trace_start(0);
+    }
+
+    return result;
+}
@@ -4,8 +4,14 @@
 #include <string.h>
 #include "naomi/dimmcomms.h"
 #include "naomi/interrupt.h"
+#include "naomi/pool.h"
 #include "naomi/message/packet.h"
 
+// Packets are allocated out of fixed pools instead of the heap, since received packets
+// are created from within the DIMM communications interrupt handler. This bounds the
+// number of packets that can be queued in each direction.
+#define PACKET_POOL_SIZE 32
+
 typedef struct
 {
     packet_t *pending_packets[MAX_OUTSTANDING_PACKETS];
@@ -26,6 +32,10 @@ typedef struct
 } packetlib_state_t;
 
 static packetlib_state_t packetlib_state;
+static packet_t send_slab[PACKET_POOL_SIZE];
+static packet_t recv_slab[PACKET_POOL_SIZE];
+static pool_t send_pool;
+static pool_t recv_pool;
 static int initialized = 0;
 
 // Forward definitions for stuff that needs to be both before and after other functions.
@@ -51,6 +61,8 @@ void packetlib_init()
         packetlib_state.checksum_errors = 0;
         packetlib_state.scratch1 = 0;
         packetlib_state.scratch2 = 0;
+        pool_init_static(&send_pool, send_slab, sizeof(packet_t), PACKET_POOL_SIZE);
+        pool_init_static(&recv_pool, recv_slab, sizeof(packet_t), PACKET_POOL_SIZE);
 
         // Set config register to empty.
         packetlib_set_config(0);
@@ -74,14 +86,16 @@ void packetlib_free()
         // Free any outstanding packets.
         for (int i = 0; i < MAX_OUTSTANDING_PACKETS; i++) {
             if (packetlib_state.pending_packets[i] != 0) {
-                free(packetlib_state.pending_packets[i]);
+                pool_release(&send_pool, packetlib_state.pending_packets[i]);
                 packetlib_state.pending_packets[i] = 0;
             }
-            if (packetlib_state.received_packets[i] == 0) {
-                free(packetlib_state.received_packets[i]);
+            if (packetlib_state.received_packets[i] != 0) {
+                pool_release(&recv_pool, packetlib_state.received_packets[i]);
                 packetlib_state.received_packets[i] = 0;
             }
         }
+        pool_free(&send_pool);
+        pool_free(&recv_pool);
     }
 
     irq_restore(old_interrupts);
@@ -127,9 +141,16 @@ int packetlib_send(void *data, unsigned int length)
     {
         if (packetlib_state.pending_packets[i] == 0)
         {
-            packetlib_state.pending_packets[i] = (packet_t *)malloc(sizeof(packet_t));
-            memcpy(packetlib_state.pending_packets[i]->data, data, length);
-            packetlib_state.pending_packets[i]->len = length;
+            packet_t *packet = pool_alloc(&send_pool);
+            if (packet == 0)
+            {
+                // Out of packets, same as having no free slot.
+                break;
+            }
+
+            memcpy(packet->data, data, length);
+            packet->len = length;
+            packetlib_state.pending_packets[i] = packet;
             retval = 0;
             break;
         }
@@ -153,7 +174,7 @@ int packetlib_recv(void *data, unsigned int *length)
             *length = packetlib_state.received_packets[i]->len;
 
             // Free up the packet for later use.
-            free(packetlib_state.received_packets[i]);
+            pool_release(&recv_pool, packetlib_state.received_packets[i]);
             packetlib_state.received_packets[i] = 0;
 
             // Success!
@@ -192,7 +213,7 @@ void packetlib_discard(int packetno)
     if (packetlib_state.received_packets[packetno] != 0)
     {
         // Free up the packet for later use.
-        free(packetlib_state.received_packets[packetno]);
+        pool_release(&recv_pool, packetlib_state.received_packets[packetno]);
         packetlib_state.received_packets[packetno] = 0;
     }
     irq_restore(old_interrupts);
@@ -270,7 +291,7 @@ uint32_t read_send_status()
                 packetlib_state.pending_send_location = 0;
 
                 // Get rid of the packet on the pending packets buffer.
-                free(packetlib_state.pending_packets[i]);
+                pool_release(&send_pool, packetlib_state.pending_packets[i]);
                 packetlib_state.pending_packets[i] = 0;
                 break;
             }
@@ -357,10 +378,15 @@ void write_data(uint32_t data)
                 {
                     if (packetlib_state.received_packets[j] == 0)
                     {
-                        // Copy the packet information so userspace can read it.
-                        packetlib_state.received_packets[j] = (packet_t *)malloc(sizeof(packet_t));
-                        memcpy(packetlib_state.received_packets[j]->data, packetlib_state.pending_recv_data, packetlib_state.pending_recv_size);
-                        packetlib_state.received_packets[j]->len = packetlib_state.pending_recv_size;
+                        // Copy the packet information so userspace can read it. We made sure
+                        // there was a packet available when this transfer was started.
+                        packet_t *packet = pool_alloc(&recv_pool);
+                        if (packet != 0)
+                        {
+                            memcpy(packet->data, packetlib_state.pending_recv_data, packetlib_state.pending_recv_size);
+                            packet->len = packetlib_state.pending_recv_size;
+                            packetlib_state.received_packets[j] = packet;
+                        }
                         break;
                     }
                 }
@@ -411,9 +437,11 @@ void write_recv_status(uint32_t status)
             if (packetlib_state.pending_recv_size == 0)
             {
                 // Start a new transfer, but only if we have room in our receive queue.
+                // Only this interrupt handler allocates receive packets, so if one is
+                // free now it will still be free when the transfer finishes.
                 for (int i = 0; i < MAX_OUTSTANDING_PACKETS; i++)
                 {
-                    if (packetlib_state.received_packets[i] == 0)
+                    if (packetlib_state.received_packets[i] == 0 && recv_pool.used < recv_pool.capacity)
                     {
                         packetlib_state.pending_recv_size = size;
                         packetlib_state.pending_recv_location = 0;
@@ -0,0 +1,63 @@
+#ifndef __CACHE_H
+#define __CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+// The SH-4 operand cache is copy-back, so anything written through a cached address
+// sits in the cache until it is evicted. Hardware that reads or writes memory on its
+// own (DMA, the PowerVR, the AICA) doesn't see the cache, so code sharing memory with
+// it must either use the uncached mirror at UNCACHED_MIRROR or manage the cache with
+// the functions below. Managing the cache is usually much faster for anything bigger
+// than a handful of words, since uncached accesses each go all the way out to memory.
+// All of these work on whole 32-byte cache lines, so any line that the range touches
+// is affected. Addresses in the uncached mirror are ignored.
+#define CACHE_LINE_SIZE 32
+
+// Write any modified data in the range out to memory, leaving it in the cache. Use this
+// before hardware reads memory that the CPU wrote.
+void cache_writeback(void *addr, unsigned int amount);
+
+// Throw away the range from the cache without writing it out. Use this after hardware
+// has written memory that the CPU is going to read. Anything the CPU wrote to the range
+// that wasn't written back yet is lost, including to other data sharing the first or
+// last cache line.
+void cache_invalidate(void *addr, unsigned int amount);
+
+// Write any modified data in the range out to memory and then throw it away from the
+// cache. This is the safe choice when handing a buffer to hardware that will write it.
+void cache_purge(void *addr, unsigned int amount);
+
+// Start loading the range into the cache in the background, so that it is (hopefully)
+// there by the time it is needed.
+void cache_prefetch(void *addr, unsigned int amount);
+
+// The SH-4 can turn half of its operand cache into 8 KiB of RAM, which is as fast to
+// access as a cache hit and never misses. The rest of the operand cache keeps working
+// as a cache, although it is half the size. The RAM shows up as two 4 KiB pieces that
+// aren't next to each other, so no single allocation can be bigger than 4 KiB.
+#define CACHE_OCRAM_SIZE 8192
+#define CACHE_OCRAM_MAX_ALLOCATION 4096
+
+// Switch half of the operand cache to RAM, writing back the whole cache first. Returns
+// 0 on success or a negative value if it was already enabled.
+int cache_ocram_enable();
+
+// Switch the operand cache back to being entirely a cache. Anything still in the RAM is
+// lost, and any pointers from cache_ocram_malloc() are no longer valid.
+void cache_ocram_disable();
+
+// Allocate and free memory from the operand cache RAM. Allocations are aligned to and
+// rounded up to whole cache lines. Returns NULL if the operand cache RAM isn't enabled
+// or there isn't a large enough free piece left. This is thread and interrupt safe.
+void *cache_ocram_malloc(unsigned int size);
+void cache_ocram_free(void *ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -9,6 +9,8 @@ extern "C" {
 
 // Ensure interrupts are disabled, returning the old SR. When you are done with
 // the code that needs exclusive HW access, restore interrupts with irq_restore().
+// Don't use floating point until interrupts are restored. Threads only get the FPU
+// swapped in when they first use it, and that can't happen with interrupts disabled.
 uint32_t irq_disable();
 
 // Restore interrupts, after calling irq_disable().
@@ -22,6 +24,38 @@ do { \
     irq_restore(old_ints); \
 } while( 0 )
 
+// Indexes into the per-source statistics in irq_stats_t below.
+#define IRQ_STATS_TRAPA 0
+#define IRQ_STATS_EXCEPTION 1
+#define IRQ_STATS_TMU0 2
+#define IRQ_STATS_TMU1 3
+#define IRQ_STATS_TMU2 4
+#define IRQ_STATS_HOLLY_LEVEL2 5
+#define IRQ_STATS_HOLLY_LEVEL4 6
+#define IRQ_STATS_HOLLY_LEVEL6 7
+#define IRQ_STATS_DMAC 8
+#define IRQ_STATS_OTHER 9
+#define IRQ_STATS_SOURCES 10
+
+// Interrupt-to-wake latencies are bucketed by powers of two. Bucket 0 counts wakeups
+// that took under 1uS, bucket N counts wakeups that took at least 2^(N-1)uS but less
+// than 2^N uS, and the last bucket counts everything slower than that.
+#define IRQ_LATENCY_BUCKETS 16
+
+typedef struct
+{
+    // The number of times this source was handled.
+    uint32_t count;
+
+    // Total and worst-case time spent handling this source, in microseconds.
+    uint64_t total_time;
+    uint32_t max_time;
+
+    // Histogram of how long it took from this source firing to a thread it woke up
+    // actually running. That includes time spent waiting behind higher priority threads.
+    uint32_t wake_latency[IRQ_LATENCY_BUCKETS];
+} irq_source_stats_t;
+
 // Statistics about interrupts on the system.
 typedef struct
 {
@@ -33,6 +67,21 @@ typedef struct
 
     // The number of interrupts the system has seen.
     uint32_t num_interrupts;
+
+    // Statistics for each kind of interrupt or exception, indexed by IRQ_STATS_ above.
+    irq_source_stats_t sources[IRQ_STATS_SOURCES];
+
+    // The number of times each bit in the HOLLY normal, external and error interrupt
+    // status registers was handled.
+    uint32_t holly_normal[32];
+    uint32_t holly_external[32];
+    uint32_t holly_error[32];
+
+    // The longest time interrupts were disabled with irq_disable() in microseconds, and
+    // the return address of the irq_disable() call that started it. Use addr2line on
+    // the address to find the culprit. Interrupt handlers themselves are not included.
+    uint32_t max_disabled_time;
+    uint32_t max_disabled_caller;
 } irq_stats_t;
 
 #define IRQ_SOURCE_GENERAL_EXCEPTION 0x100
@@ -47,9 +96,79 @@ typedef struct
 #define IRQ_EVENT_TMU0 0x400
 #define IRQ_EVENT_TMU1 0x420
 #define IRQ_EVENT_TMU2 0x440
+#define IRQ_EVENT_DMTE1 0x660
+#define IRQ_EVENT_DMAE 0x6C0
+#define IRQ_EVENT_FPU_DISABLE 0x800
+#define IRQ_EVENT_SLOT_FPU_DISABLE 0x820
 
+// Return a snapshot of the current interrupt statistics.
 irq_stats_t irq_stats();
 
+// Reset the timing statistics (handler times, wake latencies and the longest time
+// interrupts were disabled), so that a specific section of code can be measured. The
+// counts are left alone since other code compares them against earlier snapshots.
+void irq_stats_reset();
+
+// HOLLY interrupt types, one for each of its status registers.
+#define HOLLY_INTERRUPT_TYPE_NORMAL 0
+#define HOLLY_INTERRUPT_TYPE_EXTERNAL 1
+#define HOLLY_INTERRUPT_TYPE_ERROR 2
+
+// Bits in the HOLLY normal interrupt status that you can register for.
+#define HOLLY_NORMAL_INTERRUPT_RENDER_DONE_VIDEO 0
+#define HOLLY_NORMAL_INTERRUPT_RENDER_DONE_ISP 1
+#define HOLLY_NORMAL_INTERRUPT_RENDER_DONE_TSP 2
+#define HOLLY_NORMAL_INTERRUPT_VBLANK_IN 3
+#define HOLLY_NORMAL_INTERRUPT_VBLANK_OUT 4
+#define HOLLY_NORMAL_INTERRUPT_HBLANK 5
+#define HOLLY_NORMAL_INTERRUPT_TA_YUV_DONE 6
+#define HOLLY_NORMAL_INTERRUPT_TA_OPAQUE_DONE 7
+#define HOLLY_NORMAL_INTERRUPT_TA_OPAQUE_MODIFIER_DONE 8
+#define HOLLY_NORMAL_INTERRUPT_TA_TRANSPARENT_DONE 9
+#define HOLLY_NORMAL_INTERRUPT_TA_TRANSPARENT_MODIFIER_DONE 10
+#define HOLLY_NORMAL_INTERRUPT_PVR_DMA_DONE 11
+#define HOLLY_NORMAL_INTERRUPT_MAPLE_DMA_DONE 12
+#define HOLLY_NORMAL_INTERRUPT_MAPLE_VBLANK_OVER 13
+#define HOLLY_NORMAL_INTERRUPT_G1_DMA_DONE 14
+#define HOLLY_NORMAL_INTERRUPT_G2_AICA_DMA_DONE 15
+#define HOLLY_NORMAL_INTERRUPT_G2_EXT1_DMA_DONE 16
+#define HOLLY_NORMAL_INTERRUPT_G2_EXT2_DMA_DONE 17
+#define HOLLY_NORMAL_INTERRUPT_G2_DEV_DMA_DONE 18
+#define HOLLY_NORMAL_INTERRUPT_CH2_DMA_DONE 19
+#define HOLLY_NORMAL_INTERRUPT_SORT_DMA_DONE 20
+#define HOLLY_NORMAL_INTERRUPT_TA_PUNCHTHRU_DONE 21
+
+// Bits in the HOLLY external interrupt status that you can register for.
+#define HOLLY_EXTERNAL_INTERRUPT_DIMM_COMMS 3
+
+// Return this from an interrupt handler to have its deferred handler run.
+#define HOLLY_INTERRUPT_HANDLED 0
+#define HOLLY_INTERRUPT_DEFER 1
+
+// A handler that runs inside the interrupt itself, with interrupts disabled. Keep these
+// as short as possible and free of floating point, since the FPU registers belong to
+// whatever thread last used them. Do any real work in a deferred handler instead.
+// Returning HOLLY_INTERRUPT_DEFER schedules the deferred handler if one was registered.
+typedef int (*holly_interrupt_func_t)(unsigned int type, unsigned int bit, void *param);
+
+// A handler that runs on a high priority kernel thread some time after the interrupt.
+// These can do anything a regular thread can, including blocking and making syscalls.
+typedef void (*holly_deferred_func_t)(unsigned int type, unsigned int bit, void *param);
+
+// Register handlers for a HOLLY interrupt, given one of the above types and the bit in
+// that type's status register. Either handler can be NULL. With only a deferred handler,
+// the deferred handler runs every time the interrupt fires. Normal and error interrupts
+// are acknowledged before the interrupt handler is called. External interrupts are level
+// triggered, so the interrupt handler must silence the source, and if it is deferred
+// instead the interrupt is masked until the deferred handler has finished. Errors are
+// delivered at HOLLY's highest priority, normal interrupts in the middle and external
+// interrupts at the lowest. Must be called from a thread. Returns 0 on success or a
+// negative value if the interrupt is invalid or already has handlers.
+int holly_interrupt_register(unsigned int type, unsigned int bit, holly_interrupt_func_t irq_func, holly_deferred_func_t deferred_func, void *param);
+
+// Stop handling a HOLLY interrupt that was registered above, masking it off again.
+void holly_interrupt_unregister(unsigned int type, unsigned int bit);
+
 #ifdef __cplusplus
 }
 #endif
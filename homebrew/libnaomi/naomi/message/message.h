@@ -33,6 +33,19 @@ int message_recv(uint16_t *type, void ** data, unsigned int *length);
 void message_stdio_redirect_init();
 void message_stdio_redirect_free();
 
+// Send any histograms that the sampling profiler (see naomi/sampler.h) has finished
+// to a host program, such as netdimm_profile, that will symbolize them. If flush is
+// set, the histogram currently being filled is sent as well. Call this periodically
+// while the sampler is running, such as once a frame. Returns the number of histograms
+// sent, or a negative integer on failure.
+int message_send_samples(int flush);
+
+// Send everything recorded by the scheduler and interrupt tracer (see naomi/trace.h)
+// to a host program, such as netdimm_trace, that will convert it to a Chrome trace.
+// Recording is paused while sending and resumed afterwards if it was running. Returns
+// 0 on success or a negative integer on failure.
+int message_send_trace();
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,74 @@
+#ifndef __POOL_H
+#define __POOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+// Fixed-size object pools. A pool hands out objects of a single size from a slab that
+// is allocated up front, so allocating and releasing an object is O(1) and never touches
+// the heap. Because of this, pool_alloc() and pool_release() are safe to call from
+// interrupt handlers and with interrupts disabled, unlike malloc() and free(). Use these
+// for small objects that are created and destroyed constantly, to avoid fragmenting the
+// heap over long uptimes.
+typedef struct
+{
+    uint8_t *slab;
+    void *free_list;
+    unsigned int object_size;
+    unsigned int capacity;
+    unsigned int used;
+    unsigned int peak;
+    unsigned int failures;
+    int owns_slab;
+} pool_t;
+
+typedef struct
+{
+    // The size in bytes of each object in the pool, after rounding up for alignment.
+    unsigned int object_size;
+
+    // The total number of objects the pool can hand out.
+    unsigned int capacity;
+
+    // The number of objects currently handed out.
+    unsigned int used;
+
+    // The most objects that were ever handed out at once.
+    unsigned int peak;
+
+    // The number of times pool_alloc() failed because the pool was empty.
+    unsigned int failures;
+} pool_stats_t;
+
+// Initialize a pool of count objects of object_size bytes each, allocating the slab
+// from the heap. Must be called from thread context. Returns nonzero on success or
+// zero if the slab could not be allocated.
+int pool_init(pool_t *pool, unsigned int object_size, unsigned int count);
+
+// Initialize a pool of count objects of object_size bytes each out of caller-supplied
+// storage, which must be at least pool_slab_size(object_size, count) bytes and 4-byte
+// aligned. This is safe to call with interrupts disabled, and is useful for pools that
+// must exist before the heap is usable.
+int pool_init_static(pool_t *pool, void *buffer, unsigned int object_size, unsigned int count);
+unsigned int pool_slab_size(unsigned int object_size, unsigned int count);
+
+// Free a pool and its slab, if it was allocated by pool_init(). Any objects still handed
+// out from this pool become invalid.
+void pool_free(pool_t *pool);
+
+// Grab an object from a pool or give it back. pool_alloc() returns 0 if the pool is
+// empty. Both of these are safe to call from any context including interrupt handlers.
+void *pool_alloc(pool_t *pool);
+void pool_release(pool_t *pool, void *object);
+
+// Return usage statistics for a pool.
+pool_stats_t pool_stats(pool_t *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef __PROFILE_H
+#define __PROFILE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+// Named profiling zones. Wrap a block of code in a zone and every time the block runs,
+// the time spent in it is added to that zone's statistics. Zones nest, so a zone entered
+// while another zone is active becomes its child, and the same name under two different
+// parents is tracked as two different zones. Statistics are gathered per frame, so call
+// profile_frame() once per frame (for instance right after video_display_on_vblank())
+// and then look at the previous frame with profile_snapshot() or profile_draw_overlay().
+// Zones are tracked per thread and must only be used from thread context.
+#define MAX_PROFILE_ZONES 64
+
+// Durations are bucketed into a log-scale histogram with four buckets per power of two
+// monotonic clock ticks, for calculating percentiles.
+#define PROFILE_HISTOGRAM_BUCKETS 96
+
+// Where a zone was entered from, used to cache the zone lookup. Use PROFILE_ZONE()
+// instead of making one of these yourself.
+typedef struct
+{
+    const char *name;
+    void *parent;
+    void *zone;
+} profile_site_t;
+
+typedef struct
+{
+    void *zone;
+    void *parent;
+    uint64_t start;
+} profile_scope_t;
+
+// Profile everything from this point until the end of the enclosing block under the
+// given name. The name must be a string that lives forever, such as a literal.
+#define __PROFILE_CONCAT2(a, b) a##b
+#define __PROFILE_CONCAT(a, b) __PROFILE_CONCAT2(a, b)
+#define PROFILE_ZONE(zonename) \
+    static profile_site_t __PROFILE_CONCAT(__profile_site_, __LINE__) = { zonename, 0, 0 }; \
+    profile_scope_t __PROFILE_CONCAT(__profile_scope_, __LINE__) __attribute__((cleanup(profile_zone_end))) = \
+        profile_zone_begin(&__PROFILE_CONCAT(__profile_site_, __LINE__))
+
+// Zones inside libnaomi itself use this instead, so they only show up in a program's
+// profile when libnaomi was built with LIBNAOMI_PROFILE defined (make PROFILE_LIBNAOMI=1).
+#ifdef LIBNAOMI_PROFILE
+#define LIBNAOMI_PROFILE_ZONE(zonename) PROFILE_ZONE(zonename)
+#else
+#define LIBNAOMI_PROFILE_ZONE(zonename) do { } while (0)
+#endif
+
+// The functions behind PROFILE_ZONE(), for when a zone needs to start and end in
+// different blocks. Every profile_zone_begin() must be matched with a profile_zone_end()
+// on the same thread, in reverse order of nesting.
+profile_scope_t profile_zone_begin(profile_site_t *site);
+void profile_zone_end(profile_scope_t *scope);
+
+typedef struct
+{
+    // The name the zone was created with.
+    const char *name;
+
+    // How deeply nested this zone is, where zero is a top-level zone, and the index of
+    // the parent zone in the same snapshot, or -1 for top-level zones.
+    unsigned int depth;
+    int parent;
+
+    // How many times the zone was entered during the last frame, and the total, shortest
+    // and longest time in microseconds spent in it.
+    uint32_t count;
+    uint32_t total;
+    uint32_t min;
+    uint32_t max;
+
+    // Percentiles of the time spent in microseconds per entry to the zone, across every
+    // frame since the last profile_reset(). These are upper bounds, accurate to within
+    // a quarter of a power of two.
+    uint32_t p50;
+    uint32_t p90;
+    uint32_t p99;
+} profile_zone_stats_t;
+
+// Mark the end of a frame. Statistics for the frame that just ended become available
+// to profile_snapshot() and gathering for the next frame starts.
+void profile_frame();
+
+// Copy the statistics for up to max zones from the last completed frame into stats,
+// returning the number of zones copied. Zones are returned in tree order, so each zone
+// comes right before its children.
+int profile_snapshot(profile_zone_stats_t *stats, int max);
+
+// Clear every zone's statistics and histogram.
+void profile_reset();
+
+// Draw the last completed frame's statistics as debug text, starting at x, y.
+void profile_draw_overlay(int x, int y);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef __ROMFS_H
+#define __ROMFS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+// A read-only filesystem that lives in the ROM alongside the executable. Build an image
+// out of a directory with tools/romfs.py, and then hand it to scripts/makerom.py with
+// --romfs. At startup the image is found and its index is loaded into RAM, after which
+// the standard open(), read(), lseek(), fstat(), stat() and close() calls, and thus
+// fopen() and friends, work on the files inside it. Paths are relative to the directory
+// that was packed, use '/' as a separator, are case-sensitive and may start with a '/'.
+// File data stays on the cartridge (or net DIMM) until it is read, so only the files
+// that are actually used are ever copied into RAM. None of this is safe to call from
+// an interrupt handler or with interrupts disabled.
+#define MAX_ROMFS_FILES 32
+
+// Returns nonzero if a ROMFS image was found in the ROM at startup, or zero if this
+// ROM doesn't have one.
+int romfs_present();
+
+// Load an entire file and return a pointer to it, or NULL if the file doesn't exist or
+// there isn't enough memory. If size is not NULL, the size of the file in bytes is
+// written to it. The cartridge isn't directly addressable by the SH-4, so the file is
+// read straight from the cartridge into the returned buffer with no other copies made.
+// The buffer is 32-byte aligned so it can be handed to hw_memcpy() or hw_memcpy_async()
+// as-is, for instance to upload a texture. Release it with romfs_unmap().
+void *romfs_map(const char *path, unsigned int *size);
+void romfs_unmap(void *ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef __SAMPLER_H
+#define __SAMPLER_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+// Statistical sampling profiler. Once started, a timer interrupt periodically records
+// where the running thread was (its PC, and PR which is usually the return address into
+// its caller) into a histogram. Over enough samples, the histogram shows where time is
+// actually going without having to instrument any code. Code that runs with interrupts
+// disabled can't be sampled, so its time shows up at the point interrupts were enabled.
+//
+// Histograms fill up a small ring, and whenever one runs out of room the sampler moves on
+// to the next free one. Pull finished histograms out with sampler_next() and hand them
+// back with sampler_release() when done, or use message_send_samples() from the message
+// library to stream them to the host for symbolization.
+#define SAMPLER_ENTRIES 1024
+#define SAMPLER_HISTOGRAMS 4
+
+typedef struct
+{
+    uint32_t pc;
+    uint32_t pr;
+    uint32_t count;
+} sampler_entry_t;
+
+typedef struct
+{
+    // Total number of samples taken into this histogram.
+    uint32_t samples;
+
+    // Number of samples that were thrown away since the last histogram because
+    // there was nowhere to put them.
+    uint32_t dropped;
+
+    // Number of valid entries, which are packed at the start of the entry array.
+    uint32_t count;
+    sampler_entry_t entries[SAMPLER_ENTRIES];
+} sampler_histogram_t;
+
+// The fastest sampling rate allowed. Every sample costs a timer interrupt, so much more
+// than this and the sampler would mostly be measuring itself.
+#define SAMPLER_MAX_HZ 10000
+
+// Start sampling the given number of times per second, up to SAMPLER_MAX_HZ. Returns 0 on
+// success or a negative value if the sampler could not be started. Must be called from
+// thread context.
+int sampler_start(uint32_t hz);
+
+// Stop sampling and free all histograms. Any histogram still held from sampler_next()
+// stays valid until it is given back with sampler_release(), which frees it then.
+void sampler_stop();
+
+// Grab the oldest full histogram, or 0 if there are none. If flush is set and there are
+// no full histograms, the histogram currently being filled is returned instead, as long
+// as it has any samples in it. The histogram must be given back with sampler_release().
+sampler_histogram_t *sampler_next(int flush);
+void sampler_release(sampler_histogram_t *histogram);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
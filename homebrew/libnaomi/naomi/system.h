@@ -1,6 +1,8 @@
 #ifndef __SYSTEM_H
 #define __SYSTEM_H
 
+#include "naomi/thread.h"
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -28,16 +30,66 @@ extern "C" {
 #define STORE_QUEUE_BASE 0xE0000000
 #define STORE_QUEUE_SIZE 0x4000000
 
-// A 32-byte aligned and 32-byte multiple hardware memset that is about 3x faster than
-// the fastest tight loop that you can write in software. Returns nonzero if the copy was
-// successful or 0 if the HW was unavailable.
+// The standard malloc(), free() and friends are thread safe. A thread that finds the heap
+// in use by another thread sleeps until it is free. Because of that, they must not be called
+// from an interrupt handler or with interrupts disabled, since there is no way to wait for
+// the heap there. If another thread happens to be using the heap at that point, the system
+// halts with a "heap failure" screen rather than corrupt it. Use a pool from naomi/pool.h
+// for anything that has to be allocated or freed from those places.
+
+// A memset that fills with a 32-bit value instead of a byte, picking the fastest way to
+// do it based on the size and destination. Cached RAM is filled a cache line at a time
+// without reading it first, while VRAM, sound RAM and other uncached memory goes through
+// the store queues, which is about 3x faster than the fastest tight loop you can write in
+// software. Any alignment and amount is fine. The value is lined up with 4-byte boundaries,
+// so a byte at an address that is 1 past a 4-byte boundary is set to the second byte of
+// value. Threads can use this at the same time as each other or from inside interrupts,
+// since every thread gets its own store queue settings. Always returns nonzero, the
+// return value is only kept for older code which checked it.
 int hw_memset(void *addr, uint32_t value, unsigned int amount);
 
-// A 32-byte aligned and 32-byte multiple hardware memcpy that is similarly faster than
-// the fastest tight loop that you can write in software. Returns nonzero if the copy
-// was successful or 0 if the HW was unavailable.
+// A memcpy that picks the fastest way to copy based on the size, alignment and where the
+// destination is, similar to hw_memset() above. Large enough copies that DMA can handle
+// put the calling thread to sleep until the DMA is done, so other threads can run. Any
+// alignment and amount is fine, although copies where the source and destination don't
+// share the same alignment within 4 bytes can only go a word at a time. Always returns
+// nonzero, the return value is only kept for older code which checked it.
 int hw_memcpy(void *addr, void *src, unsigned int amount);
 
+// Note that libnaomi also replaces the standard memset() and memcpy() with the above, so
+// there is usually no need to call these directly except to fill with a 32-bit value or
+// to let a large copy use DMA. The standard memcpy() never uses DMA, so it never sleeps.
+
+// The maximum number of hw_memcpy_async() requests that can be outstanding at once.
+#define MAX_DMA_REQUESTS 32
+
+// Copies smaller than this are done right away with the store queues instead of DMA
+// when nothing else is queued up, since setting up the DMA costs more than it saves.
+#define HW_MEMCPY_ASYNC_MINIMUM 1024
+
+// Called when an asynchronous copy finishes. This runs with interrupts disabled and is
+// usually called from inside the DMA interrupt, so it must not block. It is safe to
+// queue up another copy from here.
+typedef void (*hw_memcpy_callback_t)(void *param);
+
+// A 32-byte aligned and 32-byte multiple memcpy that runs in the background using DMA,
+// so that the CPU can get on with something else. The destination can be in main RAM,
+// VRAM or sound RAM and the source must be in main RAM. Requests are performed in the
+// order they were made. Neither the source nor the destination should be touched until
+// the copy is finished. If done is not NULL it will be released when the copy finishes,
+// so it should be a semaphore with a count of 1 that starts out at 0, as set up with
+// semaphore_init_count(). Acquiring it then waits for the copy. Returns nonzero if the
+// copy was queued or 0 if the arguments were bad or there were already MAX_DMA_REQUESTS
+// outstanding.
+int hw_memcpy_async(void *addr, void *src, unsigned int amount, semaphore_t *done);
+
+// The same as hw_memcpy_async() but calls callback with param when the copy finishes
+// instead of releasing a semaphore.
+int hw_memcpy_async_callback(void *addr, void *src, unsigned int amount, hw_memcpy_callback_t callback, void *param);
+
+// Return the number of asynchronous copies that have not finished yet.
+int hw_memcpy_async_pending();
+
 // Call code that is outside of our C runtime, such as another program or something
 // in the BIOS that does not return. Takes care of safely shutting down interrupts,
 // threads and anything else going on so that the new code can execute without any
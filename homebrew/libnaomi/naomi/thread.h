@@ -34,6 +34,11 @@ typedef struct
 } semaphore_t;
 
 void semaphore_init(semaphore_t *semaphore, uint32_t count);
+
+// The same as semaphore_init(), but only initial of the count is available to begin
+// with. Start at 0 to have the first acquire wait for a release, such as for signalling
+// that something happened from another thread or from an interrupt.
+void semaphore_init_count(semaphore_t *semaphore, uint32_t count, uint32_t initial);
 void semaphore_acquire(semaphore_t *semaphore);
 void semaphore_release(semaphore_t *semaphore);
 void semaphore_free(semaphore_t *semaphore);
@@ -64,6 +69,7 @@ void mutex_free(mutex_t *mutex);
 // safe.
 #define MAX_THREADS 64
 #define THREAD_STACK_SIZE (128 * 1024)
+#define THREAD_MIN_STACK_SIZE (4 * 1024)
 
 typedef struct
 {
@@ -84,6 +90,11 @@ typedef struct
 
     // The percentage of CPU this thread has consumed recently, between 0 and 1 inclusive.
     float cpu_percentage;
+
+    // The size of the thread's stack in bytes, and the most of it that the thread has
+    // ever used. Both are zero for the main thread, whose stack size isn't known.
+    uint32_t stack_size;
+    uint32_t stack_used;
 } thread_info_t;
 
 // Create or destroy a thread object. Threads start in the stopped state and should only
@@ -95,6 +106,13 @@ uint32_t thread_create(char *name, thread_func_t function, void *param);
 void *thread_join(uint32_t tid);
 void thread_destroy(uint32_t tid);
 
+// Identical to thread_create(), but with a stack of at least stack_size bytes instead of
+// THREAD_STACK_SIZE. Stacks are rounded up to a size class and recycled between threads,
+// and sizes below THREAD_MIN_STACK_SIZE are rounded up to it. Use the stack_used field
+// from thread_info() to find out how much stack a thread really needs. Returns 0 if
+// the thread could not be created.
+uint32_t thread_create_ex(char *name, thread_func_t function, void *param, uint32_t stack_size);
+
 #define MAX_PRIORITY 1000
 #define MIN_PRIORITY -1000
 
@@ -106,6 +124,12 @@ void thread_priority(uint32_t tid, int priority);
 void thread_start(uint32_t tid);
 void thread_stop(uint32_t tid);
 
+// Enable or disable tickless scheduling. When enabled (the default), the preemption timer
+// is only programmed for the next sleeping thread's wakeup or the end of the current time
+// slice, and is stopped entirely when only one thread is able to run. When disabled, the
+// scheduler is instead preempted at a fixed rate regardless of what is running.
+void thread_set_tickless(int tickless);
+
 // Yield to the thread scheduler, which can choose a new thread to schedule.
 void thread_yield();
 
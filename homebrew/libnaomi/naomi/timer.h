@@ -9,6 +9,22 @@ extern "C" {
 
 #define MAX_TIMERS 64
 
+// The monotonic clock counts at this rate, giving 80ns of resolution. It starts at zero
+// when the system starts and runs continuously without ever wrapping around, regardless
+// of whether interrupts are enabled or not. None of the below functions use floating
+// point, so they are safe to call from anywhere including interrupt handlers.
+#define TIMER_TICKS_PER_SECOND 12500000
+
+// Return the current value of the monotonic clock in ticks, nanoseconds or microseconds.
+uint64_t timer_now_ticks();
+uint64_t timer_now_ns();
+uint64_t timer_now_us();
+
+// Convert between monotonic clock ticks and real time units.
+uint64_t timer_ticks_to_ns(uint64_t ticks);
+uint64_t timer_ticks_to_us(uint64_t ticks);
+uint64_t timer_us_to_ticks(uint64_t microseconds);
+
 // Wait for the specified number of microseconds in a spin loop. This works both
 // with interrupts enabled and disabled and has no restrictions on the number of
 // microseconds as it handles both states internally.
@@ -32,9 +48,51 @@ uint32_t timer_left(int timer);
 // Return the number of microseconds elapsed on an active timer.
 uint32_t timer_elapsed(int timer);
 
+// Software timers, which call a function when they expire instead of needing to be
+// polled. Any number of these can be active at once, since they are all multiplexed
+// onto a single hardware timer. Each timer's callback runs in one of two contexts,
+// chosen when the timer is created:
+//
+// SOFT_TIMER_IRQ - The callback runs inside the timer interrupt with interrupts disabled.
+// This has the lowest latency, but the callback must be short and may only call functions
+// that are safe from interrupts (no malloc, no floating point, no blocking on semaphores
+// or mutexes).
+//
+// SOFT_TIMER_DEFERRED - The callback runs on a high-priority service thread shortly after
+// the timer expires, so it can do anything a normal thread can. If the service thread
+// falls behind, multiple expirations of the same timer are coalesced into one callback.
+#define SOFT_TIMER_IRQ 0
+#define SOFT_TIMER_DEFERRED 1
+
+typedef struct soft_timer soft_timer_t;
+typedef void (*soft_timer_func_t)(soft_timer_t *timer, void *param);
+
+// Create a software timer that calls func(timer, param) in the given context when it
+// expires. The timer starts out stopped. Returns 0 if the timer could not be created.
+// Must be called from thread context.
+soft_timer_t *soft_timer_create(soft_timer_func_t func, void *param, int context);
+
+// Arm a timer to expire after the given number of microseconds. If period is nonzero,
+// the timer then keeps expiring every period microseconds until stopped. Starting a timer
+// that is already armed moves its deadline. Safe to call from any context, including from
+// a timer callback to re-arm itself.
+void soft_timer_start(soft_timer_t *timer, uint32_t microseconds, uint32_t period);
+
+// Disarm a timer, cancelling any deferred callback that has not started running yet.
+// Safe to call from any context.
+void soft_timer_stop(soft_timer_t *timer);
+
+// Returns nonzero if the timer is armed or has a deferred callback waiting to run.
+int soft_timer_active(soft_timer_t *timer);
+
+// Stop and free a timer. If its deferred callback is currently running, this waits for
+// it to finish first. Must be called from thread context, although a deferred callback
+// may destroy its own timer.
+void soft_timer_destroy(soft_timer_t *timer);
+
 #define MAX_PROFILERS 64
 
-// Start a timer for the purpose of profiling code. This has granularity up to 1 second.
+// Start a timer for the purpose of profiling code, based on the monotonic clock above.
 // If a negative value is returned, then profiling could not start. It is safe to pass
 // a negative value into a profile_end() call.
 int profile_start();
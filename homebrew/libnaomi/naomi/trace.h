@@ -0,0 +1,73 @@
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+// Scheduler and interrupt tracing. While tracing is running, the kernel records a small
+// binary event into a ring buffer for every context switch, syscall, interrupt entry and
+// exit, and semaphore or mutex wait and wakeup, each stamped with the monotonic clock.
+// When the ring is full the oldest events are overwritten, so it always holds the most
+// recent history, which is what you want when looking for the cause of a latency spike.
+// Use message_send_trace() from the message library along with the netdimm_trace script
+// to get a Chrome trace / Perfetto JSON file out of it. Recording an event costs a handful
+// of instructions inside the interrupt handler, and nothing at all when tracing is off.
+#define TRACE_EVENT_SWITCH 1
+#define TRACE_EVENT_SYSCALL 2
+#define TRACE_EVENT_IRQ_ENTER 3
+#define TRACE_EVENT_IRQ_EXIT 4
+#define TRACE_EVENT_WAIT 5
+#define TRACE_EVENT_WAKE 6
+#define TRACE_EVENT_MARK 7
+
+typedef struct
+{
+    // The low 32 bits of the monotonic clock (see timer_now_ticks()) when this happened.
+    uint32_t timestamp;
+
+    // One of the above TRACE_EVENT_ types.
+    uint16_t type;
+
+    // Event-specific data:
+    // TRACE_EVENT_SWITCH - thread ID switched away from in a, thread ID switched to in b.
+    // TRACE_EVENT_SYSCALL - trapa number in code, thread ID in a, first parameter in b.
+    // TRACE_EVENT_IRQ_ENTER/EXIT - exception source in code, EXPEVT or INTEVT in a.
+    // TRACE_EVENT_WAIT - thread ID in a, semaphore or mutex ID in b.
+    // TRACE_EVENT_WAKE - thread ID in a, semaphore or mutex ID in b.
+    // TRACE_EVENT_MARK - whatever was passed to trace_mark().
+    uint16_t code;
+    uint32_t a;
+    uint32_t b;
+} trace_event_t;
+
+// Start recording into a ring of the given number of events, or resume recording into
+// the existing ring if events is zero and tracing was started before. Returns 0 on
+// success or a negative value if the ring could not be allocated.
+int trace_start(unsigned int events);
+
+// Pause recording, keeping everything that was recorded so far.
+void trace_stop();
+
+// Stop recording and free the ring.
+void trace_free();
+
+// Returns nonzero if events are currently being recorded.
+int trace_running();
+
+// Record a custom event, for marking points of interest such as the start of a frame.
+void trace_mark(uint16_t code, uint32_t a, uint32_t b);
+
+// Return the number of events currently in the ring, and copy out up to max of them
+// starting at the given index, where index zero is the oldest event. Returns the number
+// of events copied. Stop tracing first to get a consistent copy.
+unsigned int trace_count();
+unsigned int trace_read(trace_event_t *events, unsigned int first, unsigned int max);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
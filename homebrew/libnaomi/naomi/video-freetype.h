@@ -10,6 +10,7 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include "naomi/pool.h"
 
 #define FONT_CACHE_SIZE 1024
 #define MAX_FALLBACK_SIZE 10
@@ -34,6 +35,7 @@ typedef struct
     font_cache_entry_t **cache;
     unsigned int cachesize;
     unsigned int cacheloc;
+    pool_t cachepool;
 } font_t;
 
 typedef struct
@@ -20,11 +20,40 @@ void video_init_simple();
 // call.
 void video_free();
 
-// Wait for an appropriate time to swap buffers and then do so. Also fills
-// the next screen's background with a previously set background color if
-// a background color was set, while waiting for vblank to happen.
+// Wait for an appropriate time to swap buffers and then do so. The calling
+// thread sleeps until the vblank interrupt has put the finished frame on the
+// screen. Also fills the next screen's background with a previously set
+// background color if a background color was set.
 void video_display_on_vblank();
 
+// Turn triple buffering on or off. It is off by default. With it on,
+// video_display_on_vblank() queues the finished frame to be put on the screen at the
+// next vblank and returns right away, so you can start drawing the next frame into the
+// third buffer. It only blocks if the previously queued frame hasn't been displayed
+// yet, which keeps you from running faster than the display. A frame that takes a bit
+// longer than one refresh then costs a single repeated frame instead of dropping the
+// whole game to half the frame rate.
+void video_set_triple_buffering(int enabled);
+
+// Block the calling thread until the next vblank starts. Other threads get to run while
+// we wait, since this is driven by the vblank interrupt.
+void video_wait_vblank();
+
+// The number of vblanks that have happened since video was initialized, for frame pacing.
+uint32_t video_vblank_count();
+
+// Register a function to be called at the start (VIDEO_VBLANK_IN) or the end
+// (VIDEO_VBLANK_OUT) of every vblank. Callbacks run inside the vblank interrupt, so they
+// must be short and cannot block or call into the thread API. Up to 8 callbacks can be
+// registered for each event. Returns 0 on success or a negative value on failure.
+#define VIDEO_VBLANK_IN 0
+#define VIDEO_VBLANK_OUT 1
+
+typedef void (*video_vblank_func_t)(int event, void *param);
+
+int video_register_vblank_callback(int event, video_vblank_func_t func, void *param);
+void video_unregister_vblank_callback(int event, video_vblank_func_t func, void *param);
+
 // Request that every frame be cleared to this color (use rgb() or
 // rgba() to generate the color for this). Without this, you are
 // responsible for clearing previous-frame garbage using video_fill_screen()
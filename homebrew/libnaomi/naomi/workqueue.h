@@ -0,0 +1,49 @@
+#ifndef __WORKQUEUE_H
+#define __WORKQUEUE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "naomi/thread.h"
+
+// Work queues, for running jobs in the background on a fixed set of persistent worker
+// threads instead of creating a thread per job. Jobs are queued in priority order (higher
+// priority jobs run first, jobs of equal priority run in the order submitted) and picked
+// up by whichever worker is free. Each queued job gets a handle that can be waited on
+// to get the job's return value, or detached if nobody cares about the result.
+typedef struct workqueue workqueue_t;
+typedef struct workqueue_job job_t;
+
+// Create a work queue with the given number of worker threads, each with a stack of
+// stack_size bytes (see thread_create_ex()), and room for queue_size jobs that are not
+// yet running. Returns 0 if the queue could not be created.
+workqueue_t *workqueue_create(char *name, unsigned int workers, unsigned int queue_size, uint32_t stack_size);
+
+// Destroy a work queue. Any jobs still in the queue are run to completion first, and the
+// worker threads are then stopped and freed. Every job submitted to this queue must be
+// waited on or detached before calling this, after which job handles are invalid.
+void workqueue_destroy(workqueue_t *queue);
+
+// Submit a job to run function(param) on a worker thread. If the queue is full, this
+// blocks until there is room. Returns a handle that must eventually be passed to either
+// job_wait() or job_detach(), or 0 if the job could not be queued.
+job_t *workqueue_submit(workqueue_t *queue, thread_func_t function, void *param, int priority);
+
+// Returns nonzero if the job has finished running.
+int job_done(job_t *job);
+
+// Block until the job has finished and return the value that the job function returned.
+// This also frees the job, so the handle is invalid afterwards.
+void *job_wait(job_t *job);
+
+// Let go of a job handle without waiting for it. The job will still run, and will be
+// freed automatically when it finishes. The handle is invalid afterwards.
+void job_detach(job_t *job);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,149 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "naomi/interrupt.h"
+#include "naomi/thread.h"
+#include "naomi/pool.h"
+#include "irqstate.h"
+
+unsigned int _pool_object_size(unsigned int object_size)
+{
+    // Every object needs to be able to hold the free list link, and needs to be
+    // aligned so that the next object in the slab is aligned as well.
+    if (object_size < sizeof(void *))
+    {
+        object_size = sizeof(void *);
+    }
+    return (object_size + 3) & ~3;
+}
+
+unsigned int pool_slab_size(unsigned int object_size, unsigned int count)
+{
+    return _pool_object_size(object_size) * count;
+}
+
+void _pool_setup(pool_t *pool, uint8_t *slab, unsigned int object_size, unsigned int count)
+{
+    pool->slab = slab;
+    pool->object_size = _pool_object_size(object_size);
+    pool->capacity = count;
+    pool->used = 0;
+    pool->peak = 0;
+    pool->failures = 0;
+
+    // Thread every object onto the free list, lowest address first.
+    pool->free_list = 0;
+    for (unsigned int i = count; i > 0; i--)
+    {
+        void *object = slab + ((i - 1) * pool->object_size);
+        *((void **)object) = pool->free_list;
+        pool->free_list = object;
+    }
+}
+
+int pool_init(pool_t *pool, unsigned int object_size, unsigned int count)
+{
+    if (pool == 0)
+    {
+        return 0;
+    }
+
+    uint8_t *slab = malloc(pool_slab_size(object_size, count));
+    if (slab == 0)
+    {
+        memset(pool, 0, sizeof(pool_t));
+        return 0;
+    }
+
+    _pool_setup(pool, slab, object_size, count);
+    pool->owns_slab = 1;
+    return 1;
+}
+
+int pool_init_static(pool_t *pool, void *buffer, unsigned int object_size, unsigned int count)
+{
+    if (pool == 0 || buffer == 0 || (((uint32_t)buffer) & 3) != 0)
+    {
+        return 0;
+    }
+
+    _pool_setup(pool, buffer, object_size, count);
+    pool->owns_slab = 0;
+    return 1;
+}
+
+void pool_free(pool_t *pool)
+{
+    if (pool == 0)
+    {
+        return;
+    }
+
+    uint32_t old_interrupts = irq_disable();
+    uint8_t *slab = pool->owns_slab ? pool->slab : 0;
+    memset(pool, 0, sizeof(pool_t));
+    irq_restore(old_interrupts);
+
+    if (slab)
+    {
+        free(slab);
+    }
+}
+
+void *pool_alloc(pool_t *pool)
+{
+    uint32_t old_interrupts = irq_disable();
+    void *object = pool->free_list;
+
+    if (object)
+    {
+        pool->free_list = *((void **)object);
+        pool->used++;
+        if (pool->used > pool->peak)
+        {
+            pool->peak = pool->used;
+        }
+    }
+    else
+    {
+        pool->failures++;
+    }
+
+    irq_restore(old_interrupts);
+    return object;
+}
+
+void pool_release(pool_t *pool, void *object)
+{
+    if (object == 0)
+    {
+        return;
+    }
+
+    uint32_t offset = (uint8_t *)object - pool->slab;
+    if ((uint8_t *)object < pool->slab || offset >= (pool->object_size * pool->capacity) || (offset % pool->object_size) != 0)
+    {
+        _irq_display_invariant("pool failure", "object %08lx does not belong to pool %08lx", (uint32_t)object, (uint32_t)pool);
+    }
+
+    uint32_t old_interrupts = irq_disable();
+    *((void **)object) = pool->free_list;
+    pool->free_list = object;
+    pool->used--;
+    irq_restore(old_interrupts);
+}
+
+pool_stats_t pool_stats(pool_t *pool)
+{
+    pool_stats_t stats;
+
+    uint32_t old_interrupts = irq_disable();
+    stats.object_size = pool->object_size;
+    stats.capacity = pool->capacity;
+    stats.used = pool->used;
+    stats.peak = pool->peak;
+    stats.failures = pool->failures;
+    irq_restore(old_interrupts);
+
+    return stats;
+}
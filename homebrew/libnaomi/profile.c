@@ -0,0 +1,286 @@
+#include <stdint.h>
+#include <string.h>
+#include "naomi/interrupt.h"
+#include "naomi/thread.h"
+#include "naomi/timer.h"
+#include "naomi/video.h"
+#include "naomi/profile.h"
+#include "irqstate.h"
+
+// The state of whatever thread is currently running, as managed by sh-crt0.s.
+extern irq_state_t *irq_state;
+
+typedef struct profile_zone
+{
+    const char *name;
+    unsigned int depth;
+
+    // Links to the rest of the zone tree.
+    struct profile_zone *parent;
+    struct profile_zone *child;
+    struct profile_zone *sibling;
+
+    // Statistics for the frame in progress, in monotonic clock ticks.
+    uint32_t count;
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+
+    // Statistics for the last completed frame.
+    uint32_t last_count;
+    uint64_t last_total;
+    uint64_t last_min;
+    uint64_t last_max;
+
+    // Every duration ever recorded for this zone, for percentiles.
+    uint32_t samples;
+    uint32_t histogram[PROFILE_HISTOGRAM_BUCKETS];
+} profile_zone_t;
+
+static profile_zone_t zones[MAX_PROFILE_ZONES];
+static unsigned int zone_count = 0;
+static profile_zone_t *top_zones = 0;
+
+unsigned int _profile_bucket(uint64_t ticks)
+{
+    if (ticks < 4)
+    {
+        // The first two powers of two are too small to split four ways.
+        return ticks < 2 ? 0 : 4 + (ticks - 2);
+    }
+    if (ticks >= (1ULL << (PROFILE_HISTOGRAM_BUCKETS / 4)))
+    {
+        return PROFILE_HISTOGRAM_BUCKETS - 1;
+    }
+
+    // Bucket by the position of the top bit, then the next two bits below it.
+    unsigned int top = 31 - __builtin_clz((uint32_t)ticks);
+    return (top * 4) + ((ticks >> (top - 2)) & 3);
+}
+
+uint64_t _profile_bucket_limit(unsigned int bucket)
+{
+    // The first duration in ticks that no longer fits in this bucket.
+    unsigned int top = bucket / 4;
+    unsigned int sub = bucket % 4;
+    if (top < 2)
+    {
+        return (1 << top) + sub + 1;
+    }
+    return ((uint64_t)(4 + sub + 1)) << (top - 2);
+}
+
+profile_zone_t *_profile_zone_find(const char *name, profile_zone_t *parent)
+{
+    // Must be called with interrupts disabled.
+    profile_zone_t *zone = parent ? parent->child : top_zones;
+    while (zone != 0)
+    {
+        if (zone->name == name || strcmp(zone->name, name) == 0)
+        {
+            return zone;
+        }
+        zone = zone->sibling;
+    }
+
+    if (zone_count >= MAX_PROFILE_ZONES)
+    {
+        // Out of zones, this one just won't get profiled.
+        return 0;
+    }
+
+    // Add it after any existing siblings so that zones show up in the order they were
+    // first entered.
+    zone = &zones[zone_count++];
+    memset(zone, 0, sizeof(profile_zone_t));
+    zone->name = name;
+    zone->parent = parent;
+    zone->depth = parent ? parent->depth + 1 : 0;
+
+    profile_zone_t **link = parent ? &parent->child : &top_zones;
+    while (*link != 0)
+    {
+        link = &(*link)->sibling;
+    }
+    *link = zone;
+
+    return zone;
+}
+
+profile_scope_t profile_zone_begin(profile_site_t *site)
+{
+    profile_scope_t scope;
+
+    uint32_t old_interrupts = irq_disable();
+    profile_zone_t *parent = irq_state ? irq_state->profile_zone : 0;
+
+    // Most sites are only ever entered from one parent, so remember the last lookup.
+    if (site->zone == 0 || site->parent != parent)
+    {
+        site->zone = _profile_zone_find(site->name, parent);
+        site->parent = parent;
+    }
+
+    scope.zone = site->zone;
+    scope.parent = parent;
+    if (scope.zone && irq_state)
+    {
+        irq_state->profile_zone = scope.zone;
+    }
+    irq_restore(old_interrupts);
+
+    // Grab the time last so that none of the above counts against the zone.
+    scope.start = timer_now_ticks();
+    return scope;
+}
+
+void profile_zone_end(profile_scope_t *scope)
+{
+    uint64_t now = timer_now_ticks();
+    profile_zone_t *zone = scope->zone;
+    if (zone == 0)
+    {
+        return;
+    }
+
+    uint64_t elapsed = now - scope->start;
+
+    uint32_t old_interrupts = irq_disable();
+    if (zone->count == 0 || elapsed < zone->min)
+    {
+        zone->min = elapsed;
+    }
+    if (elapsed > zone->max)
+    {
+        zone->max = elapsed;
+    }
+    zone->count++;
+    zone->total += elapsed;
+    zone->samples++;
+    zone->histogram[_profile_bucket(elapsed)]++;
+
+    if (irq_state)
+    {
+        irq_state->profile_zone = scope->parent;
+    }
+    irq_restore(old_interrupts);
+}
+
+void profile_frame()
+{
+    uint32_t old_interrupts = irq_disable();
+    for (unsigned int i = 0; i < zone_count; i++)
+    {
+        zones[i].last_count = zones[i].count;
+        zones[i].last_total = zones[i].total;
+        zones[i].last_min = zones[i].min;
+        zones[i].last_max = zones[i].max;
+        zones[i].count = 0;
+        zones[i].total = 0;
+        zones[i].min = 0;
+        zones[i].max = 0;
+    }
+    irq_restore(old_interrupts);
+}
+
+void profile_reset()
+{
+    uint32_t old_interrupts = irq_disable();
+    for (unsigned int i = 0; i < zone_count; i++)
+    {
+        zones[i].count = 0;
+        zones[i].total = 0;
+        zones[i].min = 0;
+        zones[i].max = 0;
+        zones[i].last_count = 0;
+        zones[i].last_total = 0;
+        zones[i].last_min = 0;
+        zones[i].last_max = 0;
+        zones[i].samples = 0;
+        memset(zones[i].histogram, 0, sizeof(zones[i].histogram));
+    }
+    irq_restore(old_interrupts);
+}
+
+uint32_t _profile_percentile(profile_zone_t *zone, unsigned int percent)
+{
+    if (zone->samples == 0)
+    {
+        return 0;
+    }
+
+    // Find the first bucket where we've seen at least the requested percent of samples.
+    uint64_t wanted = (((uint64_t)zone->samples * percent) + 99) / 100;
+    uint64_t seen = 0;
+    for (unsigned int bucket = 0; bucket < PROFILE_HISTOGRAM_BUCKETS; bucket++)
+    {
+        seen += zone->histogram[bucket];
+        if (seen >= wanted)
+        {
+            return timer_ticks_to_us(_profile_bucket_limit(bucket));
+        }
+    }
+
+    return timer_ticks_to_us(_profile_bucket_limit(PROFILE_HISTOGRAM_BUCKETS - 1));
+}
+
+int _profile_snapshot_zone(profile_zone_t *zone, int parent, profile_zone_stats_t *stats, int count, int max)
+{
+    // Must be called with interrupts disabled. Walks the tree depth first, so that
+    // every zone comes right before its children.
+    while (zone != 0 && count < max)
+    {
+        int index = count++;
+        stats[index].name = zone->name;
+        stats[index].depth = zone->depth;
+        stats[index].parent = parent;
+        stats[index].count = zone->last_count;
+        stats[index].total = timer_ticks_to_us(zone->last_total);
+        stats[index].min = timer_ticks_to_us(zone->last_min);
+        stats[index].max = timer_ticks_to_us(zone->last_max);
+        stats[index].p50 = _profile_percentile(zone, 50);
+        stats[index].p90 = _profile_percentile(zone, 90);
+        stats[index].p99 = _profile_percentile(zone, 99);
+
+        count = _profile_snapshot_zone(zone->child, index, stats, count, max);
+        zone = zone->sibling;
+    }
+
+    return count;
+}
+
+int profile_snapshot(profile_zone_stats_t *stats, int max)
+{
+    if (stats == 0 || max <= 0)
+    {
+        return 0;
+    }
+
+    uint32_t old_interrupts = irq_disable();
+    int count = _profile_snapshot_zone(top_zones, -1, stats, 0, max);
+    irq_restore(old_interrupts);
+
+    return count;
+}
+
+void profile_draw_overlay(int x, int y)
+{
+    static profile_zone_stats_t stats[MAX_PROFILE_ZONES];
+    int count = profile_snapshot(stats, MAX_PROFILE_ZONES);
+
+    uint32_t color = rgb(255, 255, 0);
+    video_draw_debug_text(x, y, color, "zone                  cnt   total     min     max     p90");
+    y += 8;
+
+    for (int i = 0; i < count; i++)
+    {
+        // Indent children under their parents, keeping the numbers lined up.
+        unsigned int indent = stats[i].depth > 10 ? 10 : stats[i].depth;
+        video_draw_debug_text(
+            x, y, color, "%*s%-*.*s %4lu %7lu %7lu %7lu %7lu",
+            indent, "", 21 - indent, 21 - indent, stats[i].name,
+            stats[i].count, stats[i].total, stats[i].min, stats[i].max, stats[i].p90
+        );
+        y += 8;
+    }
+}
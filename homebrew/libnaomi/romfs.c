@@ -0,0 +1,435 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/errno.h>
+#include "naomi/romfs.h"
+#include "naomi/interrupt.h"
+#include "naomi/thread.h"
+
+// The cartridge isn't mapped into the SH-4's address space. Instead, we set an offset
+// into the ROM and then read it out 16 bits at a time, optionally moving forward after
+// every read. This works the same whether a real cartridge or a net DIMM is inserted.
+#define NAOMI_ROM_OFFSETH ((volatile uint16_t *)0xA05F7000)
+#define NAOMI_ROM_OFFSETL ((volatile uint16_t *)0xA05F7004)
+#define NAOMI_ROM_DATA ((volatile uint16_t *)0xA05F7008)
+
+#define ROM_OFFSETH_AUTOINCREMENT 0x8000
+#define ROM_OFFSETH_MASK 0x1FFF
+
+// Where the main and test executable section tables live in the ROM header. Each has up
+// to 8 entries of offset, load address and length, ending early at an offset of all 1s.
+#define ROM_HEADER_LENGTH 0x500
+#define ROM_MAIN_SECTIONS 0x360
+#define ROM_TEST_SECTIONS 0x3C0
+#define ROM_SECTION_COUNT 8
+#define ROM_SECTION_END 0xFFFFFFFF
+
+// scripts/makerom.py places the image right after the last executable section, aligned
+// to this boundary. This must match ROMFS_ALIGNMENT in that script.
+#define ROMFS_ROM_ALIGNMENT 0x1000
+
+// Layout of the image, which must match tools/romfs.py. Everything is little-endian.
+// The header is followed by bucket_count + 1 bucket starts, then the entries sorted by
+// bucket, then the NUL-terminated names. File data follows the index, with each file
+// aligned to a cache line.
+#define ROMFS_MAGIC 0x53464D52
+#define ROMFS_VERSION 1
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t index_size;
+    uint32_t file_count;
+    uint32_t bucket_count;
+    uint32_t entries_offset;
+    uint32_t names_offset;
+} romfs_header_t;
+
+typedef struct
+{
+    uint32_t hash;
+    uint32_t name;
+    uint32_t offset;
+    uint32_t size;
+} romfs_entry_t;
+
+typedef struct
+{
+    romfs_entry_t *entry;
+    uint32_t position;
+} romfs_file_t;
+
+// The first file descriptor we hand out, since 0-2 are stdin, stdout and stderr.
+#define ROMFS_FD_BASE 3
+
+static uint32_t romfs_base = 0;
+static uint8_t *romfs_index = 0;
+static romfs_header_t *romfs_header = 0;
+static uint32_t *romfs_buckets = 0;
+static romfs_entry_t *romfs_entries = 0;
+static char *romfs_names = 0;
+static romfs_file_t romfs_files[MAX_ROMFS_FILES];
+static mutex_t rom_mutex;
+
+static void _romfs_rom_read(uint32_t offset, void *buffer, unsigned int length)
+{
+    if (length == 0)
+    {
+        return;
+    }
+
+    uint8_t *dest = buffer;
+
+    mutex_lock(&rom_mutex);
+    *NAOMI_ROM_OFFSETH = ROM_OFFSETH_AUTOINCREMENT | ((offset >> 16) & ROM_OFFSETH_MASK);
+    *NAOMI_ROM_OFFSETL = offset & 0xFFFE;
+
+    // The ROM can only be read a halfword at a time, so throw away the first half of
+    // the first halfword if we started in the middle of one.
+    if (offset & 1)
+    {
+        *dest++ = (*NAOMI_ROM_DATA) >> 8;
+        length--;
+    }
+
+    if ((((uint32_t)dest) & 1) == 0)
+    {
+        uint16_t *halfwords = (uint16_t *)dest;
+        while (length >= 2)
+        {
+            *halfwords++ = *NAOMI_ROM_DATA;
+            length -= 2;
+        }
+        dest = (uint8_t *)halfwords;
+    }
+    else
+    {
+        while (length >= 2)
+        {
+            uint16_t data = *NAOMI_ROM_DATA;
+            dest[0] = data & 0xFF;
+            dest[1] = data >> 8;
+            dest += 2;
+            length -= 2;
+        }
+    }
+
+    if (length)
+    {
+        *dest = (*NAOMI_ROM_DATA) & 0xFF;
+    }
+    mutex_unlock(&rom_mutex);
+}
+
+static uint32_t _romfs_rom_uint32(uint32_t offset)
+{
+    uint32_t value;
+    _romfs_rom_read(offset, &value, sizeof(value));
+    return value;
+}
+
+static uint32_t _romfs_find_image()
+{
+    // The image goes directly after whichever executable section ends last.
+    uint32_t end = ROM_HEADER_LENGTH;
+    uint32_t tables[2] = { ROM_MAIN_SECTIONS, ROM_TEST_SECTIONS };
+    for (int table = 0; table < 2; table++)
+    {
+        for (int section = 0; section < ROM_SECTION_COUNT; section++)
+        {
+            uint32_t location = tables[table] + (section * 12);
+            uint32_t offset = _romfs_rom_uint32(location);
+            if (offset == ROM_SECTION_END)
+            {
+                break;
+            }
+
+            uint32_t length = _romfs_rom_uint32(location + 8);
+            if (offset + length > end)
+            {
+                end = offset + length;
+            }
+        }
+    }
+
+    return (end + (ROMFS_ROM_ALIGNMENT - 1)) & ~(ROMFS_ROM_ALIGNMENT - 1);
+}
+
+static uint32_t _romfs_hash(const char *path)
+{
+    // 32-bit FNV-1a, which must match tools/romfs.py.
+    uint32_t hash = 0x811C9DC5;
+    while (*path)
+    {
+        hash ^= (uint8_t)(*path++);
+        hash *= 0x01000193;
+    }
+
+    return hash;
+}
+
+static romfs_entry_t *_romfs_lookup(const char *path)
+{
+    if (romfs_index == 0 || path == 0)
+    {
+        return 0;
+    }
+
+    // Everything is relative to the root of the image.
+    while (*path == '/')
+    {
+        path++;
+    }
+
+    uint32_t hash = _romfs_hash(path);
+    uint32_t bucket = hash & (romfs_header->bucket_count - 1);
+    for (uint32_t i = romfs_buckets[bucket]; i < romfs_buckets[bucket + 1]; i++)
+    {
+        if (romfs_entries[i].hash == hash && strcmp(&romfs_names[romfs_entries[i].name], path) == 0)
+        {
+            return &romfs_entries[i];
+        }
+    }
+
+    return 0;
+}
+
+static romfs_file_t *_romfs_file(int file)
+{
+    if (file < ROMFS_FD_BASE || file >= (ROMFS_FD_BASE + MAX_ROMFS_FILES))
+    {
+        return 0;
+    }
+
+    romfs_file_t *handle = &romfs_files[file - ROMFS_FD_BASE];
+    return handle->entry ? handle : 0;
+}
+
+static void _romfs_stat(romfs_entry_t *entry, struct stat *st)
+{
+    memset(st, 0, sizeof(struct stat));
+    st->st_mode = S_IFREG | S_IRUSR | S_IRGRP | S_IROTH;
+    st->st_nlink = 1;
+    st->st_size = entry->size;
+    st->st_blksize = 512;
+    st->st_blocks = (entry->size + 511) / 512;
+}
+
+int _romfs_open(const char *path, int flags)
+{
+    if ((flags & O_ACCMODE) != O_RDONLY || (flags & (O_CREAT | O_TRUNC | O_APPEND)) != 0)
+    {
+        return -EROFS;
+    }
+
+    romfs_entry_t *entry = _romfs_lookup(path);
+    if (entry == 0)
+    {
+        return -ENOENT;
+    }
+
+    uint32_t old_interrupts = irq_disable();
+    for (int i = 0; i < MAX_ROMFS_FILES; i++)
+    {
+        if (romfs_files[i].entry == 0)
+        {
+            romfs_files[i].entry = entry;
+            romfs_files[i].position = 0;
+            irq_restore(old_interrupts);
+            return ROMFS_FD_BASE + i;
+        }
+    }
+    irq_restore(old_interrupts);
+
+    return -EMFILE;
+}
+
+int _romfs_read(int file, void *ptr, unsigned int len)
+{
+    romfs_file_t *handle = _romfs_file(file);
+    if (handle == 0)
+    {
+        return -EBADF;
+    }
+
+    uint32_t position = handle->position;
+    uint32_t size = handle->entry->size;
+    if (position >= size)
+    {
+        return 0;
+    }
+    if (len > (size - position))
+    {
+        len = size - position;
+    }
+
+    _romfs_rom_read(romfs_base + handle->entry->offset + position, ptr, len);
+    handle->position = position + len;
+    return len;
+}
+
+int _romfs_lseek(int file, int amount, int dir)
+{
+    romfs_file_t *handle = _romfs_file(file);
+    if (handle == 0)
+    {
+        return -EBADF;
+    }
+
+    int position;
+    switch (dir)
+    {
+        case SEEK_SET:
+            position = amount;
+            break;
+        case SEEK_CUR:
+            position = (int)handle->position + amount;
+            break;
+        case SEEK_END:
+            position = (int)handle->entry->size + amount;
+            break;
+        default:
+            return -EINVAL;
+    }
+
+    // Seeking past the end is fine, reads there just return nothing.
+    if (position < 0)
+    {
+        return -EINVAL;
+    }
+
+    handle->position = position;
+    return position;
+}
+
+int _romfs_fstat(int file, struct stat *st)
+{
+    romfs_file_t *handle = _romfs_file(file);
+    if (handle == 0)
+    {
+        return -EBADF;
+    }
+
+    _romfs_stat(handle->entry, st);
+    return 0;
+}
+
+int _romfs_path_stat(const char *path, struct stat *st)
+{
+    romfs_entry_t *entry = _romfs_lookup(path);
+    if (entry == 0)
+    {
+        return -ENOENT;
+    }
+
+    _romfs_stat(entry, st);
+    return 0;
+}
+
+int _romfs_close(int file)
+{
+    uint32_t old_interrupts = irq_disable();
+    romfs_file_t *handle = _romfs_file(file);
+    if (handle == 0)
+    {
+        irq_restore(old_interrupts);
+        return -EBADF;
+    }
+
+    handle->entry = 0;
+    irq_restore(old_interrupts);
+    return 0;
+}
+
+int romfs_present()
+{
+    return romfs_index != 0;
+}
+
+void *romfs_map(const char *path, unsigned int *size)
+{
+    romfs_entry_t *entry = _romfs_lookup(path);
+    if (entry == 0)
+    {
+        return 0;
+    }
+
+    // Always hand back a valid pointer, even for empty files.
+    void *buffer = memalign(32, entry->size ? entry->size : 1);
+    if (buffer == 0)
+    {
+        return 0;
+    }
+
+    _romfs_rom_read(romfs_base + entry->offset, buffer, entry->size);
+    if (size)
+    {
+        *size = entry->size;
+    }
+    return buffer;
+}
+
+void romfs_unmap(void *ptr)
+{
+    free(ptr);
+}
+
+void _romfs_init()
+{
+    mutex_init(&rom_mutex);
+    memset(romfs_files, 0, sizeof(romfs_files));
+
+    // ROMs without a filesystem appended will have something else here, or nothing.
+    uint32_t base = _romfs_find_image();
+    romfs_header_t header;
+    _romfs_rom_read(base, &header, sizeof(header));
+    if (header.magic != ROMFS_MAGIC || header.version != ROMFS_VERSION)
+    {
+        return;
+    }
+    if (header.bucket_count == 0 || (header.bucket_count & (header.bucket_count - 1)) != 0)
+    {
+        return;
+    }
+    if (header.entries_offset > header.index_size || header.names_offset > header.index_size)
+    {
+        return;
+    }
+
+    // Keep the whole index in RAM so lookups never have to touch the ROM.
+    uint8_t *index = malloc(header.index_size);
+    if (index == 0)
+    {
+        return;
+    }
+    _romfs_rom_read(base, index, header.index_size);
+
+    romfs_base = base;
+    romfs_header = (romfs_header_t *)index;
+    romfs_buckets = (uint32_t *)(index + sizeof(romfs_header_t));
+    romfs_entries = (romfs_entry_t *)(index + header.entries_offset);
+    romfs_names = (char *)(index + header.names_offset);
+    romfs_index = index;
+}
+
+void _romfs_free()
+{
+    if (romfs_index)
+    {
+        free(romfs_index);
+        romfs_index = 0;
+        romfs_header = 0;
+        romfs_buckets = 0;
+        romfs_entries = 0;
+        romfs_names = 0;
+    }
+
+    memset(romfs_files, 0, sizeof(romfs_files));
+    mutex_free(&rom_mutex);
+}
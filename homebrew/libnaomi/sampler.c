@@ -0,0 +1,267 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "naomi/interrupt.h"
+#include "naomi/thread.h"
+#include "naomi/timer.h"
+#include "naomi/sampler.h"
+#include "irqstate.h"
+
+// The state of whatever thread is currently running, as managed by sh-crt0.s.
+extern irq_state_t *irq_state;
+
+// Each histogram has an open-addressed hash index alongside it, twice the size of the
+// entry array so that probes stay short and always find an empty slot.
+#define SAMPLER_HASH_SIZE (SAMPLER_ENTRIES * 2)
+
+#define SAMPLER_STATE_FREE 0
+#define SAMPLER_STATE_FILLING 1
+#define SAMPLER_STATE_FULL 2
+#define SAMPLER_STATE_TAKEN 3
+
+typedef struct sampler_slot
+{
+    sampler_histogram_t histogram;
+    uint16_t index[SAMPLER_HASH_SIZE];
+    int state;
+    uint32_t sequence;
+
+    // Only used in the first slot of a set that was stopped while some of its
+    // histograms were still taken, to chain it onto the retired list.
+    struct sampler_slot *retired_next;
+} sampler_slot_t;
+
+static sampler_slot_t *slots = 0;
+static sampler_slot_t *retired = 0;
+static int filling = -1;
+static uint32_t sequence = 0;
+static uint32_t dropped = 0;
+static soft_timer_t *sampler_timer = 0;
+
+int _sampler_rotate()
+{
+    // Must be called with interrupts disabled. Moves on to the next free histogram,
+    // returning nonzero if there was one.
+    for (int i = 0; i < SAMPLER_HISTOGRAMS; i++)
+    {
+        if (slots[i].state == SAMPLER_STATE_FREE)
+        {
+            memset(slots[i].index, 0, sizeof(slots[i].index));
+            slots[i].histogram.samples = 0;
+            slots[i].histogram.dropped = dropped;
+            slots[i].histogram.count = 0;
+            slots[i].state = SAMPLER_STATE_FILLING;
+            slots[i].sequence = sequence++;
+            filling = i;
+            dropped = 0;
+            return 1;
+        }
+    }
+
+    filling = -1;
+    return 0;
+}
+
+void _sampler_cb(soft_timer_t *timer, void *param)
+{
+    // We're running inside the timer interrupt, so the current state is whatever
+    // thread we interrupted.
+    if (slots == 0 || irq_state == 0)
+    {
+        return;
+    }
+
+    uint32_t pc = irq_state->pc;
+    uint32_t pr = irq_state->pr;
+
+    if (filling < 0 && !_sampler_rotate())
+    {
+        // Nobody has picked up any of the full histograms yet.
+        dropped++;
+        return;
+    }
+
+    sampler_slot_t *slot = &slots[filling];
+    unsigned int hash = ((pc >> 1) ^ ((pr * 0x9E3779B1) >> 16)) & (SAMPLER_HASH_SIZE - 1);
+    while (slot->index[hash] != 0)
+    {
+        sampler_entry_t *entry = &slot->histogram.entries[slot->index[hash] - 1];
+        if (entry->pc == pc && entry->pr == pr)
+        {
+            entry->count++;
+            slot->histogram.samples++;
+            return;
+        }
+        hash = (hash + 1) & (SAMPLER_HASH_SIZE - 1);
+    }
+
+    if (slot->histogram.count >= SAMPLER_ENTRIES)
+    {
+        // This one is out of room, so hand it off and try again in the next one.
+        slot->state = SAMPLER_STATE_FULL;
+        filling = -1;
+        _sampler_cb(timer, param);
+        return;
+    }
+
+    unsigned int new_entry = slot->histogram.count++;
+    slot->histogram.entries[new_entry].pc = pc;
+    slot->histogram.entries[new_entry].pr = pr;
+    slot->histogram.entries[new_entry].count = 1;
+    slot->histogram.samples++;
+    slot->index[hash] = new_entry + 1;
+}
+
+int sampler_start(uint32_t hz)
+{
+    if (hz == 0 || hz > SAMPLER_MAX_HZ || slots != 0)
+    {
+        return -1;
+    }
+
+    sampler_slot_t *new_slots = malloc(sizeof(sampler_slot_t) * SAMPLER_HISTOGRAMS);
+    if (new_slots == 0)
+    {
+        return -2;
+    }
+    memset(new_slots, 0, sizeof(sampler_slot_t) * SAMPLER_HISTOGRAMS);
+
+    soft_timer_t *timer = soft_timer_create(_sampler_cb, 0, SOFT_TIMER_IRQ);
+    if (timer == 0)
+    {
+        free(new_slots);
+        return -3;
+    }
+
+    uint32_t old_interrupts = irq_disable();
+    slots = new_slots;
+    filling = -1;
+    sequence = 0;
+    dropped = 0;
+    sampler_timer = timer;
+    irq_restore(old_interrupts);
+
+    soft_timer_start(timer, MICROSECONDS_IN_ONE_SECOND / hz, MICROSECONDS_IN_ONE_SECOND / hz);
+    return 0;
+}
+
+void sampler_stop()
+{
+    if (sampler_timer == 0)
+    {
+        return;
+    }
+
+    soft_timer_destroy(sampler_timer);
+
+    uint32_t old_interrupts = irq_disable();
+    sampler_slot_t *old_slots = slots;
+    slots = 0;
+    filling = -1;
+    sampler_timer = 0;
+
+    for (int i = 0; i < SAMPLER_HISTOGRAMS; i++)
+    {
+        if (old_slots[i].state == SAMPLER_STATE_TAKEN)
+        {
+            // Somebody is still looking at one of these, so hang on to the whole
+            // set until the last one comes back through sampler_release().
+            old_slots[0].retired_next = retired;
+            retired = old_slots;
+            old_slots = 0;
+            break;
+        }
+    }
+    irq_restore(old_interrupts);
+
+    if (old_slots)
+    {
+        free(old_slots);
+    }
+}
+
+sampler_histogram_t *sampler_next(int flush)
+{
+    sampler_histogram_t *histogram = 0;
+
+    uint32_t old_interrupts = irq_disable();
+    if (slots != 0)
+    {
+        int oldest = -1;
+        for (int i = 0; i < SAMPLER_HISTOGRAMS; i++)
+        {
+            if (slots[i].state == SAMPLER_STATE_FULL && (oldest < 0 || (int32_t)(slots[i].sequence - slots[oldest].sequence) < 0))
+            {
+                oldest = i;
+            }
+        }
+
+        if (oldest < 0 && flush && filling >= 0 && slots[filling].histogram.samples > 0)
+        {
+            // Nothing full yet, so cut the current one short.
+            oldest = filling;
+            filling = -1;
+        }
+
+        if (oldest >= 0)
+        {
+            slots[oldest].state = SAMPLER_STATE_TAKEN;
+            histogram = &slots[oldest].histogram;
+        }
+    }
+    irq_restore(old_interrupts);
+
+    return histogram;
+}
+
+void sampler_release(sampler_histogram_t *histogram)
+{
+    sampler_slot_t *done = 0;
+
+    uint32_t old_interrupts = irq_disable();
+    if (slots != 0)
+    {
+        for (int i = 0; i < SAMPLER_HISTOGRAMS; i++)
+        {
+            if (histogram == &slots[i].histogram && slots[i].state == SAMPLER_STATE_TAKEN)
+            {
+                slots[i].state = SAMPLER_STATE_FREE;
+            }
+        }
+    }
+
+    // It might also belong to a set from before the sampler was last stopped.
+    sampler_slot_t **link = &retired;
+    while (*link != 0)
+    {
+        sampler_slot_t *set = *link;
+        int taken = 0;
+        for (int i = 0; i < SAMPLER_HISTOGRAMS; i++)
+        {
+            if (histogram == &set[i].histogram && set[i].state == SAMPLER_STATE_TAKEN)
+            {
+                set[i].state = SAMPLER_STATE_FREE;
+            }
+            if (set[i].state == SAMPLER_STATE_TAKEN)
+            {
+                taken = 1;
+            }
+        }
+
+        if (!taken)
+        {
+            // That was the last one, so the set can finally go.
+            *link = set[0].retired_next;
+            done = set;
+            break;
+        }
+        link = &set[0].retired_next;
+    }
+    irq_restore(old_interrupts);
+
+    // Can't touch the heap with interrupts disabled.
+    if (done)
+    {
+        free(done);
+    }
+}
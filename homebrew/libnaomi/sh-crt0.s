@@ -109,6 +109,47 @@ sr_disable:
     .globl  _irq_restore
 
 _irq_restore:
+    # Whether the FPU is enabled depends on whether this thread currently owns it, which
+    # can have changed since the SR we were given was read. So keep the current FD bit
+    # instead of the one in the parameter.
+    stc     sr,r0
+    mov.l   irq_fd_bit,r1
+    and     r1,r0
+    not     r1,r1
+    and     r1,r4
+    or      r0,r4
+
+    # If the SR we are restoring still has interrupts blocked, or interrupts
+    # weren't blocked to begin with, then no disabled section ends here. Interrupt
+    # handlers run with BL set, so this also skips anything called from them.
+    mov.l   irq_bl_bit,r1
+    tst     r4,r1
+    bf      irq_restore_sr
+    stc     sr,r0
+    tst     r0,r1
+    bt      irq_restore_sr
+
+    # We're about to turn interrupts back on, so work out how long they were off
+    # for. The monotonic clock's TMU channel counts down, so the elapsed ticks are
+    # the start value minus the current value.
+    mov.l   irq_disabled_stats_addr,r2
+    mov.l   @r2,r0
+    tst     r0,r0
+    bt      irq_restore_sr
+    mov.l   irq_clock_tcnt,r1
+    mov.l   @r1,r1
+    mov.l   @(4,r2),r3
+    sub     r1,r3
+
+    # If this is the longest we've seen, remember it and who turned them off.
+    mov.l   @(12,r2),r0
+    cmp/hi  r0,r3
+    bf      irq_restore_sr
+    mov.l   r3,@(12,r2)
+    mov.l   @(8,r2),r0
+    mov.l   r0,@(16,r2)
+
+irq_restore_sr:
     # Load the first parameter into the SR directly. The parameter
     # given sould come from an irq_enable() or irq_disable() call.
     # This is safe to call even inside functions called from an
@@ -158,6 +199,22 @@ _irq_disable:
     or  r2,r1
     ldc r1,sr
 
+    # If interrupts were already blocked, this is a nested call and the outermost
+    # one already noted when the disabled section started.
+    mov.l   irq_bl_bit,r1
+    tst     r0,r1
+    bf      irq_disable_done
+
+    # Otherwise, remember when interrupts went off and who turned them off, so that
+    # irq_restore() can track the longest time they stay that way.
+    mov.l   irq_clock_tcnt,r1
+    mov.l   @r1,r1
+    mov.l   irq_disabled_stats_addr,r2
+    mov.l   r1,@(4,r2)
+    sts     pr,r1
+    mov.l   r1,@(8,r2)
+
+irq_disable_done:
     # Finally, return the old SR value to the caller.
     rts
     nop
@@ -167,12 +224,181 @@ _irq_disable:
 irq_disable_andbits:
     # Going to explicitly set BL, so we are completely blocked from
     # any interrupts or exceptions inside our handler. Also, mask off
-    # the IMASK bits.
+    # the IMASK bits. Note that FD is left alone, so code that runs with
+    # interrupts disabled must not use the FPU. If this thread doesn't own
+    # it, the FPU disable exception would happen with BL set and reset the
+    # CPU.
     .long   0xefffff0f
 irq_disable_orbits:
     # Add back in the mask bits to turn on all IMASK bits to disable
     # interrupts, also set BR to blocked so that exceptions don't work.
     .long   0x100000f0
+irq_bl_bit:
+    # The BL bit in SR, which is set whenever interrupts are blocked.
+    .long   0x10000000
+irq_fd_bit:
+    # The FD bit in SR, which is set whenever the FPU is disabled.
+    .long   0x00008000
+irq_clock_tcnt:
+    # TCNT of TMU channel 0, which _clock_init() in timer.c always claims first
+    # as the free-running monotonic clock.
+    .long   0xFFD8000C
+irq_disabled_stats_addr:
+    .long   _irq_disabled_stats
+
+    .align 4
+    .globl  _irq_disabled_stats
+
+_irq_disabled_stats:
+    # Should match up with irq_disabled_stats_t in interrupt.c. In order, these are
+    # whether tracking is on, the clock when interrupts were last turned off, the
+    # return address of whoever turned them off, the longest time they were off
+    # in clock ticks and the return address of whoever turned them off that time.
+    .long   0
+    .long   0
+    .long   0
+    .long   0
+    .long   0
+
+    .align 4
+    .globl  __irq_fpu_switch
+
+__irq_fpu_switch:
+    # Make the FPU hold the floating point registers saved in the irq_state_t passed
+    # in r4, saving the registers of whoever owned it before into their own state
+    # first. Must be called with interrupts disabled, and leaves the FPU enabled.
+    stc     sr,r0
+    mov.l   fpu_switch_fd_clear,r1
+    and     r1,r0
+    ldc     r0,sr
+
+    # If the registers are already this state's, there's nothing to swap.
+    mov.l   fpu_switch_owner_addr,r2
+    mov.l   @r2,r0
+    cmp/eq  r0,r4
+    bt      fpu_switch_done
+    mov.l   r4,@r2
+
+    # Nobody owned the FPU, so there's nothing to save.
+    tst     r0,r0
+    bt      fpu_switch_load
+
+    # Point at the end of the old owner's irq_state_t, just past fpul, and store
+    # backwards. This is 0xE4 forward, but add only takes an 8-bit signed immediate.
+    add     #0x72,r0
+    add     #0x72,r0
+    sts.l   fpul,@-r0
+    sts.l   fpscr,@-r0
+
+    # Now that the old owner's FPSCR is safe, switch to a known floating point mode
+    # before saving anything else. The old owner could have been in the middle of a
+    # paired move with FPSCR.SZ set, which would turn every fmov.s below into a 64-bit
+    # move and write over the rest of the saved state. This also clears FR, so the
+    # bank we save first is always the one the load below expects it to be.
+    mov.l   fpu_switch_fpscr,r1
+    lds     r1,fpscr
+
+    fmov.s fr15,@-r0
+    fmov.s fr14,@-r0
+    fmov.s fr13,@-r0
+    fmov.s fr12,@-r0
+    fmov.s fr11,@-r0
+    fmov.s fr10,@-r0
+    fmov.s fr9,@-r0
+    fmov.s fr8,@-r0
+    fmov.s fr7,@-r0
+    fmov.s fr6,@-r0
+    fmov.s fr5,@-r0
+    fmov.s fr4,@-r0
+    fmov.s fr3,@-r0
+    fmov.s fr2,@-r0
+    fmov.s fr1,@-r0
+    fmov.s fr0,@-r0
+
+    # We can't accesss banked registers directly, so swap banks and keep storing.
+    frchg
+    fmov.s fr15,@-r0
+    fmov.s fr14,@-r0
+    fmov.s fr13,@-r0
+    fmov.s fr12,@-r0
+    fmov.s fr11,@-r0
+    fmov.s fr10,@-r0
+    fmov.s fr9,@-r0
+    fmov.s fr8,@-r0
+    fmov.s fr7,@-r0
+    fmov.s fr6,@-r0
+    fmov.s fr5,@-r0
+    fmov.s fr4,@-r0
+    fmov.s fr3,@-r0
+    fmov.s fr2,@-r0
+    fmov.s fr1,@-r0
+    fmov.s fr0,@-r0
+    frchg
+
+fpu_switch_load:
+    # Same as above, fmov.s needs to be a 32-bit move and the banks need to line up.
+    mov.l   fpu_switch_fpscr,r1
+    lds     r1,fpscr
+
+    # Now, load the new owner's registers, starting at frbank, which is 0x5C into
+    # irq_state_t. The banked registers come first.
+    mov     r4,r0
+    add     #0x5c,r0
+    frchg
+    fmov.s @r0+,fr0
+    fmov.s @r0+,fr1
+    fmov.s @r0+,fr2
+    fmov.s @r0+,fr3
+    fmov.s @r0+,fr4
+    fmov.s @r0+,fr5
+    fmov.s @r0+,fr6
+    fmov.s @r0+,fr7
+    fmov.s @r0+,fr8
+    fmov.s @r0+,fr9
+    fmov.s @r0+,fr10
+    fmov.s @r0+,fr11
+    fmov.s @r0+,fr12
+    fmov.s @r0+,fr13
+    fmov.s @r0+,fr14
+    fmov.s @r0+,fr15
+
+    # And swap back to get the non-banked registers.
+    frchg
+    fmov.s @r0+,fr0
+    fmov.s @r0+,fr1
+    fmov.s @r0+,fr2
+    fmov.s @r0+,fr3
+    fmov.s @r0+,fr4
+    fmov.s @r0+,fr5
+    fmov.s @r0+,fr6
+    fmov.s @r0+,fr7
+    fmov.s @r0+,fr8
+    fmov.s @r0+,fr9
+    fmov.s @r0+,fr10
+    fmov.s @r0+,fr11
+    fmov.s @r0+,fr12
+    fmov.s @r0+,fr13
+    fmov.s @r0+,fr14
+    fmov.s @r0+,fr15
+
+    # And finally, get the status and communication registers for floating point.
+    lds.l   @r0+,fpscr
+    lds.l   @r0+,fpul
+
+fpu_switch_done:
+    rts
+    nop
+
+    .align 4
+
+fpu_switch_fd_clear:
+    # Mask for clearing the FD bit in SR, enabling the FPU.
+    .long   0xffff7fff
+fpu_switch_owner_addr:
+    .long   _irq_fpu_owner
+fpu_switch_fpscr:
+    # The same FPSCR that _enter() sets up, round to nearest and denormals as zero.
+    .long   0x00040000
 
     .align 4
     .globl  __irq_read_sr
@@ -251,56 +477,17 @@ _irq_base_handler:
     sts.l pr,@-r0
     stc.l spc,@-r0
 
-    # Now, we point at &pc in _irq_state. We want to adjust forward enough to
-    # get to the end of _irq_state so when we store FPUL and FPSCR they go in
-    # the right slots. This is 0xA4 forward, but we can't add that much in one
-    # go since add takes an 8-bit signed immediate. Then, save all the floating
-    # point registers.
-    add #0x60,r0
-    add #0x44,r0
-    sts.l fpul,@-r0
-    sts.l fpscr,@-r0
-    fmov.s fr15,@-r0
-    fmov.s fr14,@-r0
-    fmov.s fr13,@-r0
-    fmov.s fr12,@-r0
-    fmov.s fr11,@-r0
-    fmov.s fr10,@-r0
-    fmov.s fr9,@-r0
-    fmov.s fr8,@-r0
-    fmov.s fr7,@-r0
-    fmov.s fr6,@-r0
-    fmov.s fr5,@-r0
-    fmov.s fr4,@-r0
-    fmov.s fr3,@-r0
-    fmov.s fr2,@-r0
-    fmov.s fr1,@-r0
-    fmov.s fr0,@-r0
-
-    # We can't accesss banked registers directly like we could with R0-R7 above.
-    # So swap banks and keep storing.
-    frchg
-    fmov.s fr15,@-r0
-    fmov.s fr14,@-r0
-    fmov.s fr13,@-r0
-    fmov.s fr12,@-r0
-    fmov.s fr11,@-r0
-    fmov.s fr10,@-r0
-    fmov.s fr9,@-r0
-    fmov.s fr8,@-r0
-    fmov.s fr7,@-r0
-    fmov.s fr6,@-r0
-    fmov.s fr5,@-r0
-    fmov.s fr4,@-r0
-    fmov.s fr3,@-r0
-    fmov.s fr2,@-r0
-    fmov.s fr1,@-r0
-    fmov.s fr0,@-r0
-
-    # Now, swap back just for good measure. I'm not entirely sure this is necessary?
-    # I guess if some interrupted code took a direct pointer to which bank of the
-    # floating point unit it was on, then not doing this could cause problems?
-    frchg
+    # Note that we don't save any floating point state here. The FPU registers belong
+    # to whichever thread last used the FPU, and stay in the FPU until another thread
+    # uses it and _irq_fpu_switch() swaps them out. That means nothing in the handler
+    # may use the FPU. It is still enabled so that a stray floating point instruction
+    # can't reset the CPU by faulting with BL set, but it would clobber the owner's
+    # registers. The interrupted code's SR, including its FD bit, is safely stored in
+    # SSR for when we return.
+    stc sr,r1
+    mov.l fd_clear_bits,r2
+    and r2,r1
+    ldc r1,sr
 
     # Now, set up a small stack for our own routines to use.
     mov.l _irq_stack,r15
@@ -350,47 +537,21 @@ _irq_base_handler:
     lds.l @r0+,macl
     ldc.l @r0+,ssr
 
-    # Now, grab the banked registers for floating-point restoration.
-    frchg
-    fmov.s @r0+,fr0
-    fmov.s @r0+,fr1
-    fmov.s @r0+,fr2
-    fmov.s @r0+,fr3
-    fmov.s @r0+,fr4
-    fmov.s @r0+,fr5
-    fmov.s @r0+,fr6
-    fmov.s @r0+,fr7
-    fmov.s @r0+,fr8
-    fmov.s @r0+,fr9
-    fmov.s @r0+,fr10
-    fmov.s @r0+,fr11
-    fmov.s @r0+,fr12
-    fmov.s @r0+,fr13
-    fmov.s @r0+,fr14
-    fmov.s @r0+,fr15
-
-    # And swap back to get the non-banked registers.
-    frchg
-    fmov.s @r0+,fr0
-    fmov.s @r0+,fr1
-    fmov.s @r0+,fr2
-    fmov.s @r0+,fr3
-    fmov.s @r0+,fr4
-    fmov.s @r0+,fr5
-    fmov.s @r0+,fr6
-    fmov.s @r0+,fr7
-    fmov.s @r0+,fr8
-    fmov.s @r0+,fr9
-    fmov.s @r0+,fr10
-    fmov.s @r0+,fr11
-    fmov.s @r0+,fr12
-    fmov.s @r0+,fr13
-    fmov.s @r0+,fr14
-    fmov.s @r0+,fr15
-
-    # And finally, get the status and communication registers for floating point.
-    lds.l @r0+,fpscr
-    lds.l @r0+,fpul
+    # Now, only let the thread we're returning to use the FPU if its registers are the
+    # ones in it. Anyone else gets the FPU disabled, so that their first floating point
+    # instruction takes an FPU disable exception and swaps their registers in.
+    stc ssr,r1
+    mov.l fd_clear_bits,r4
+    and r4,r1
+    mov.l _irq_state,r2
+    mov.l _irq_fpu_owner,r3
+    cmp/eq r2,r3
+    bt fpu_owner_done
+    not r4,r4
+    or r4,r1
+
+fpu_owner_done:
+    ldc r1,ssr
 
     # Finally, return from interrupts.
     rte
@@ -407,9 +568,20 @@ _irq_stack:
 _irq_state:
     .long 0
 
+    .globl _irq_fpu_owner
+
+_irq_fpu_owner:
+    # The irq_state_t whose floating point registers are currently in the FPU, or
+    # zero if they don't belong to anyone.
+    .long 0
+
 irq_handler_addr:
     .long __irq_handler
 
+fd_clear_bits:
+    # Mask for clearing the FD bit in SR, enabling the FPU.
+    .long 0xffff7fff
+
     .align 4
 
 _irq_vector_table_base:
@@ -12,7 +12,6 @@
 #include "naomi/interrupt.h"
 #include "naomi/thread.h"
 
-#define CCR (*(uint32_t *)0xFF00001C)
 #define QACR0 (*(uint32_t *)0xFF000038)
 #define QACR1 (*(uint32_t *)0xFF00003C)
 
@@ -41,8 +40,13 @@ extern uint32_t __dtors_end;
 /* libgcc floating point stuff */
 extern void __set_fpscr (unsigned long);
 
-/* Global hardware access mutexes. */
-static mutex_t queue_mutex;
+// Whether DMA is available to the memory functions yet. Code that runs before _enter()
+// sets things up, or after we tear them down, only gets the CPU and store queues.
+static int memops_ready = 0;
+
+// Bumped by every interrupt, which also saves and restores the store queue address
+// bits for each thread. See _hw_memcpy_queue() for how this keeps the queues safe.
+extern volatile uint32_t _irq_store_queue_epoch;
 
 /* Provide a weakref to a default test sub for autoconf-purposes. */
 int __test()
@@ -69,12 +73,26 @@ void _exit(int status)
 // Prototypes of functions that we don't want available in the public headers
 void _irq_init();
 void _irq_free();
+void _cache_init();
+void _cache_free();
 void _maple_init();
 void _maple_free();
 void _timer_init();
 void _timer_free();
 void _thread_init();
 void _thread_free();
+void _heap_init();
+void _heap_free();
+void _romfs_init();
+void _romfs_free();
+int _romfs_open(const char *path, int flags);
+int _romfs_read(int file, void *ptr, unsigned int len);
+int _romfs_lseek(int file, int amount, int dir);
+int _romfs_fstat(int file, struct stat *st);
+int _romfs_path_stat(const char *path, struct stat *st);
+int _romfs_close(int file);
+uint32_t _irq_read_sr();
+int _irq_was_disabled(uint32_t sr);
 
 void _enter()
 {
@@ -84,8 +102,8 @@ void _enter()
     register uint32_t boot_mode asm("r3");
     uint32_t _boot_mode = boot_mode;
 
-    // Invalidate cache, as is done in real games.
-    CCR = 0x905;
+    // Invalidate and enable the caches, as is done in real games.
+    _cache_init();
 
     // Set up system DMA to allow for things like Maple to operate. This
     // was kindly copied from the Mvc2 init code after bisecting to it
@@ -118,8 +136,14 @@ void _enter()
     _maple_init();
     _irq_init();
 
-    // Initialize mutexes for hardware that needs exclusive access.
-    mutex_init(&queue_mutex);
+    // Now that threads can preempt each other, start protecting the heap.
+    _heap_init();
+
+    // Find the ROMFS if this ROM has one, so files can be opened from main/test.
+    _romfs_init();
+
+    // Now that threads can sleep, the memory functions can wait on DMA.
+    memops_ready = 1;
 
     // Execute main/test executable based on boot variable set in
     // sh-crt0.s which comes from the entrypoint used to start the code.
@@ -133,7 +157,9 @@ void _enter()
         status = test();
     }
 
-    mutex_free(&queue_mutex);
+    memops_ready = 0;
+    _romfs_free();
+    _heap_free();
 
     // Free those things now that we're done. We should usually never get here
     // because it would be unusual to exit from main/test by returning.
@@ -141,161 +167,524 @@ void _enter()
     _maple_free();
     _thread_free();
     _timer_free();
+    _cache_free();
 
     // Finally, exit from the program.
     _exit(status);
 }
 
-int hw_memset(void *addr, uint32_t value, unsigned int amount)
-{
-    int successful = 0;
+// Below this many bytes, the memory functions below don't bother lining up with cache
+// lines and just copy or set things a word or byte at a time.
+#define MEMOPS_BLOCK_MINIMUM 64
 
-    if (mutex_try_lock(&queue_mutex))
-    {
-        // Very similar to a standard memset, but the address pointer must be aligned
-        // to a 32 byte boundary, the amount must be a multiple of 32 bytes and the
-        // value must be 32 bits. No checking of these constraints is done.
+// Copies and sets to uncached memory (VRAM, sound RAM or the uncached mirror of main
+// RAM) switch to the store queues at this size, since they're that much faster.
+#define MEMOPS_QUEUE_MINIMUM 256
 
-        // Set the base queue address pointer to the queue location with address bits
-        // 25:5. The bottom bits should be all 0s since hw_memset requires an alignment
-        // to a 32 byte boundary. We will use both queue areas since SQ0/SQ1 specification
-        // is the same bit as address bit 5. Technically this means the below queue setup
-        // interleaves the data between the two queues, but it really does not matter what
-        // order the hardware copies things.
-        uint32_t *queue = (uint32_t *)(STORE_QUEUE_BASE | (((uint32_t)addr) & 0x03FFFFE0));
-        uint32_t actual_copy_addr = (uint32_t)addr;
-        uint32_t stored_addr_bits = (actual_copy_addr >> 24) & 0x1C;
+// Copies through hw_memcpy() this large that DMA can reach will be done with DMA instead,
+// so that other threads get to run while we wait for it.
+#define MEMOPS_DMA_MINIMUM 16384
 
-        // Set the top address bits (28:26) into the store queue address control registers.
-        QACR0 = stored_addr_bits;
-        QACR1 = stored_addr_bits;
+#define SR_FD 0x00008000
 
-        // Now, set up both store queues to contain the same value that we want to memset.
-        // This is 8 32-bit values per store queue.
-        for (int i = 0; i < 16; i++) {
-            queue[i] = value;
+// Keep GCC from recognizing our own loops as memcpy/memset and calling back into us.
+#define MEMOPS_NO_LIBCALLS __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
+MEMOPS_NO_LIBCALLS
+static void _hw_memset_queue(void *addr, uint32_t value, unsigned int amount)
+{
+    // Very similar to a standard memset, but the address pointer must be aligned
+    // to a 32 byte boundary, the amount must be a multiple of 32 bytes and the
+    // value must be 32 bits. No checking of these constraints is done.
+
+    // Set the base queue address pointer to the queue location with address bits
+    // 25:5. The bottom bits should be all 0s since hw_memset requires an alignment
+    // to a 32 byte boundary. We will use both queue areas since SQ0/SQ1 specification
+    // is the same bit as address bit 5. Technically this means the below queue setup
+    // interleaves the data between the two queues, but it really does not matter what
+    // order the hardware copies things.
+    uint32_t *queue = (uint32_t *)(STORE_QUEUE_BASE | (((uint32_t)addr) & 0x03FFFFE0));
+    uint32_t actual_copy_addr = (uint32_t)addr;
+    uint32_t stored_addr_bits = (actual_copy_addr >> 24) & 0x1C;
+
+    // Set the top address bits (28:26) into the store queue address control registers.
+    QACR0 = stored_addr_bits;
+    QACR1 = stored_addr_bits;
+
+    // Now, set up both store queues to contain the same value that we want to memset.
+    // This is 8 32-bit values per store queue.
+    uint32_t epoch = _irq_store_queue_epoch;
+    for (int i = 0; i < 16; i++) {
+        queue[i] = value;
+    }
+
+    // Now, trigger the hardware to copy the values from the queue to the address we
+    // care about, triggering one 32-byte prefetch at a time.
+    for (int cycles = amount >> 5; cycles > 0; cycles--)
+    {
+        // Make sure we don't wrap around our top address bits.
+        if (((actual_copy_addr >> 24) & 0x1C) != stored_addr_bits)
+        {
+            // Re-init the top address control registers and the queue.
+            stored_addr_bits = (actual_copy_addr >> 24) & 0x1C;
+            QACR0 = stored_addr_bits;
+            QACR1 = stored_addr_bits;
+
+            // Now, set up both store queues to contain the same value that we want to memset.
+            // This is 8 32-bit values per store queue.
+            epoch = _irq_store_queue_epoch;
+            for (int i = 0; i < 16; i++) {
+                queue[i] = value;
+            }
         }
 
-        // Now, trigger the hardware to copy the values from the queue to the address we
-        // care about, triggering one 32-byte prefetch at a time.
-        for (int cycles = amount >> 5; cycles > 0; cycles--)
+        // Perform the actual memset.
+        __asm__("pref @%0" : : "r"(queue) : "memory");
+
+        if (_irq_store_queue_epoch != epoch)
         {
-            // Make sure we don't wrap around our top address bits.
-            if (((actual_copy_addr >> 24) & 0x1C) != stored_addr_bits)
-            {
-                // Re-init the top address control registers and the queue.
-                stored_addr_bits = (actual_copy_addr >> 24) & 0x1C;
-                QACR0 = stored_addr_bits;
-                QACR1 = stored_addr_bits;
-
-                // Now, set up both store queues to contain the same value that we want to memset.
-                // This is 8 32-bit values per store queue.
-                for (int i = 0; i < 16; i++) {
-                    queue[i] = value;
-                }
+            // We were interrupted, so some other code may have used the queues since
+            // we filled them and we might have just written its data instead of ours.
+            // Our address bits were restored for us, so fill them again and redo this line.
+            epoch = _irq_store_queue_epoch;
+            for (int i = 0; i < 16; i++) {
+                queue[i] = value;
             }
+            cycles++;
+            continue;
+        }
 
-            // Perform the actual memset.
-            __asm__("pref @%0" : : "r"(queue));
-            queue += 8;
-            actual_copy_addr += 32;
+        queue += 8;
+        actual_copy_addr += 32;
+    }
+
+    // Finally, attempt a new write to both queues in order to stall the CPU until the
+    // last write is done.
+    queue = (uint32_t *)STORE_QUEUE_BASE;
+    queue[0] = 0;
+    queue[8] = 0;
+}
+
+static void _hw_memcpy_queue(void *dest, const void *src, unsigned int amount)
+{
+    // Very similar to a standard memcpy, but the destination pointer must be aligned
+    // to a 32 byte boundary, the amount must be a multiple of 32 bytes and the source
+    // pointer must be aligned to a 4 byte boundary. No checking of these constraints
+    // is done.
+
+    // Set the base queue address pointer to the queue location with destination bits
+    // 25:5. The bottom bits should be all 0s since hw_memset requires an alignment
+    // to a 32 byte boundary. We will use both queue areas since SQ0/SQ1 specification
+    // is the same bit as destination bit 5. Technically this means the below queue setup
+    // interleaves the data between the two queues, but it really does not matter what
+    // order the hardware copies things.
+    uint32_t *srcptr = (uint32_t *)src;
+    uint32_t *queue = (uint32_t *)(STORE_QUEUE_BASE | (((uint32_t)dest) & 0x03FFFFE0));
+    uint32_t actual_copy_dest = (uint32_t)dest;
+    uint32_t stored_dest_bits = (actual_copy_dest >> 24) & 0x1C;
+
+    // Set the top address bits (28:26) into the store queue address control registers.
+    QACR0 = stored_dest_bits;
+    QACR1 = stored_dest_bits;
+
+    // Now, trigger the hardware to copy the values from the queue to the address we
+    // care about, triggering one 32-byte prefetch at a time.
+    for (int cycles = amount >> 5; cycles > 0; cycles--)
+    {
+        // Make sure we don't wrap around if we were near a memory border.
+        if (((actual_copy_dest >> 24) & 0x1C) != stored_dest_bits)
+        {
+            // Re-init the top address control registers and the queue.
+            stored_dest_bits = (actual_copy_dest >> 24) & 0x1C;
+            QACR0 = stored_dest_bits;
+            QACR1 = stored_dest_bits;
         }
 
-        // Finally, attempt a new write to both queues in order to stall the CPU until the
-        // last write is done.
-        queue = (uint32_t *)STORE_QUEUE_BASE;
-        queue[0] = 0;
-        queue[8] = 0;
+        // First, prefetch the bytes we will need in the next cycle.
+        __asm__("pref @%0" : : "r"(srcptr + 8));
+
+        // Now, load the destination queue with the next 32 bytes from the source.
+        uint32_t epoch = _irq_store_queue_epoch;
+        queue[0] = srcptr[0];
+        queue[1] = srcptr[1];
+        queue[2] = srcptr[2];
+        queue[3] = srcptr[3];
+        queue[4] = srcptr[4];
+        queue[5] = srcptr[5];
+        queue[6] = srcptr[6];
+        queue[7] = srcptr[7];
+
+        // Finally, trigger the store of this data
+        __asm__("pref @%0" : : "r"(queue) : "memory");
+
+        if (_irq_store_queue_epoch != epoch)
+        {
+            // We were interrupted, so some other code may have used the queue since we
+            // started filling it. Our address bits were restored for us, so whatever we
+            // just wrote went to the right place and redoing this line fixes it up.
+            cycles++;
+            continue;
+        }
 
-        // We held the lock and succeeded at memsetting.
-        successful = 1;
-        mutex_unlock(&queue_mutex);
+        srcptr += 8;
+        queue += 8;
+        actual_copy_dest += 32;
     }
 
-    return successful;
+    // Finally, attempt a new write to both queues in order to stall the CPU until the
+    // last write is done.
+    queue = (uint32_t *)STORE_QUEUE_BASE;
+    queue[0] = 0;
+    queue[8] = 0;
 }
 
-int hw_memcpy(void *dest, void *src, unsigned int amount)
+static int _memops_cacheable(uint32_t addr)
+{
+    // Main RAM is copy-back cached everywhere except through the uncached mirror.
+    uint32_t physical = addr & 0x1FFFFFFF;
+    return (addr & 0xE0000000) != UNCACHED_MIRROR && physical >= RAM_BASE && physical < (RAM_BASE + RAM_SIZE);
+}
+
+static int _memops_ocram(uint32_t addr)
+{
+    // Operand cache RAM only exists inside the CPU, so the store queues, DMA and movca
+    // can't reach it. Only plain loads and stores work there.
+    return (addr & 0xFC000000) == 0x7C000000;
+}
+
+static int _memops_can_block()
+{
+    // Waiting for DMA means sleeping, which we can't do from an interrupt or with
+    // interrupts off.
+    return memops_ready && !_irq_was_disabled(_irq_read_sr());
+}
+
+static int _memops_fpu_enabled()
 {
-    int successful = 0;
+    // Only use the FPU if this thread already owns it, which is when it's enabled. We
+    // don't want a memcpy to be the reason another thread's registers get swapped out.
+    // Interrupt handlers run with it enabled no matter who owns it, and code with
+    // interrupts disabled can't take the FPU disable exception, so leave it alone then.
+    uint32_t sr = _irq_read_sr();
+    return (sr & SR_FD) == 0 && !_irq_was_disabled(sr);
+}
 
-    if (mutex_try_lock(&queue_mutex))
+static inline void _memops_movca(uint32_t *addr, uint32_t value)
+{
+    // Allocate the cache line for addr without reading it from memory first, and write
+    // value to its first word. The rest of the line must be written right after.
+    register uint32_t r0 asm("r0") = value;
+    __asm__ volatile("movca.l r0,@%0" : : "r"(addr), "r"(r0) : "memory");
+}
+
+static void _memset_lines(uint32_t *dest, uint32_t value, unsigned int lines)
+{
+    while (lines > 0)
     {
-        // Very similar to a standard memcpy, but the destination pointer must be aligned
-        // to a 32 byte boundary, the amount must be a multiple of 32 bytes and the source
-        // pointer must be aligned to a 4 byte boundary. No checking of these constraints
-        // is done.
+        _memops_movca(dest, value);
+        dest[1] = value;
+        dest[2] = value;
+        dest[3] = value;
+        dest[4] = value;
+        dest[5] = value;
+        dest[6] = value;
+        dest[7] = value;
+        dest += 8;
+        lines--;
+    }
+}
+
+static void _memcpy_lines(uint32_t *dest, const uint32_t *src, unsigned int lines)
+{
+    while (lines > 0)
+    {
+        __asm__("pref @%0" : : "r"(src + 8));
+
+        // Read the whole line before allocating the destination, in case the two
+        // happen to share a cache line index.
+        uint32_t a = src[0];
+        uint32_t b = src[1];
+        uint32_t c = src[2];
+        uint32_t d = src[3];
+        uint32_t e = src[4];
+        uint32_t f = src[5];
+        uint32_t g = src[6];
+        uint32_t h = src[7];
+
+        _memops_movca(dest, a);
+        dest[1] = b;
+        dest[2] = c;
+        dest[3] = d;
+        dest[4] = e;
+        dest[5] = f;
+        dest[6] = g;
+        dest[7] = h;
+        src += 8;
+        dest += 8;
+        lines--;
+    }
+}
+
+static void _memcpy_pairs(void *dest, const void *src, unsigned int lines)
+{
+    // Copies 32 bytes at a time using 64-bit floating point moves, which halves the
+    // number of bus transactions to uncached memory. Both pointers must be 8-byte
+    // aligned and the FPU must be enabled. FPSCR.SZ is flipped for the duration.
+    __asm__ volatile(
+        "fschg\n"
+        "1:\n"
+        "fmov @%1+,dr0\n"
+        "fmov @%1+,dr2\n"
+        "fmov @%1+,dr4\n"
+        "fmov @%1+,dr6\n"
+        "add #32,%0\n"
+        "fmov dr6,@-%0\n"
+        "fmov dr4,@-%0\n"
+        "fmov dr2,@-%0\n"
+        "fmov dr0,@-%0\n"
+        "dt %2\n"
+        "bf/s 1b\n"
+        "add #32,%0\n"
+        "fschg\n"
+        : "+r"(dest), "+r"(src), "+r"(lines)
+        :
+        : "fr0", "fr1", "fr2", "fr3", "fr4", "fr5", "fr6", "fr7", "t", "memory"
+    );
+}
+
+static int _memcpy_dma(void *dest, const void *src, unsigned int amount)
+{
+    // Hand the copy to DMA and sleep until it's done. Returns 0 if DMA couldn't
+    // take it, in which case nothing was copied.
+    semaphore_t done;
+    semaphore_init_count(&done, 1, 0);
+    if (done.id == 0)
+    {
+        return 0;
+    }
 
-        // Set the base queue address pointer to the queue location with destination bits
-        // 25:5. The bottom bits should be all 0s since hw_memset requires an alignment
-        // to a 32 byte boundary. We will use both queue areas since SQ0/SQ1 specification
-        // is the same bit as destination bit 5. Technically this means the below queue setup
-        // interleaves the data between the two queues, but it really does not matter what
-        // order the hardware copies things.
-        uint32_t *srcptr = (uint32_t *)src;
-        uint32_t *queue = (uint32_t *)(STORE_QUEUE_BASE | (((uint32_t)dest) & 0x03FFFFE0));
-        uint32_t actual_copy_dest = (uint32_t)dest;
-        uint32_t stored_dest_bits = (actual_copy_dest >> 24) & 0x1C;
+    int queued = hw_memcpy_async(dest, (void *)src, amount, &done);
+    if (queued)
+    {
+        semaphore_acquire(&done);
+    }
+    semaphore_free(&done);
 
-        // Set the top address bits (28:26) into the store queue address control registers.
-        QACR0 = stored_dest_bits;
-        QACR1 = stored_dest_bits;
+    return queued;
+}
+
+MEMOPS_NO_LIBCALLS
+static void _hw_memset_any(void *addr, uint32_t value, unsigned int amount)
+{
+    uint8_t *dest = (uint8_t *)addr;
+
+    if (amount >= MEMOPS_BLOCK_MINIMUM)
+    {
+        // Line up with a cache line first, a byte and then a word at a time. The value
+        // is anchored to word boundaries, so every byte gets the same part of value that
+        // it would have gotten if we started out aligned.
+        while ((((uint32_t)dest) & 0x3) != 0)
+        {
+            *dest = value >> ((((uint32_t)dest) & 0x3) * 8);
+            dest++;
+            amount--;
+        }
+        while ((((uint32_t)dest) & 0x1F) != 0)
+        {
+            *((uint32_t *)dest) = value;
+            dest += 4;
+            amount -= 4;
+        }
 
-        // Now, trigger the hardware to copy the values from the queue to the address we
-        // care about, triggering one 32-byte prefetch at a time.
-        for (int cycles = amount >> 5; cycles > 0; cycles--)
+        unsigned int lines = amount >> 5;
+        if (_memops_cacheable((uint32_t)dest))
         {
-            // Make sure we don't wrap around if we were near a memory border.
-            if (((actual_copy_dest >> 24) & 0x1C) != stored_dest_bits)
+            // Allocating lines without reading them first beats everything else here.
+            _memset_lines((uint32_t *)dest, value, lines);
+        }
+        else if ((lines << 5) >= MEMOPS_QUEUE_MINIMUM && !_memops_ocram((uint32_t)dest))
+        {
+            _hw_memset_queue(dest, value, lines << 5);
+        }
+        else
+        {
+            uint32_t *word = (uint32_t *)dest;
+            for (unsigned int i = 0; i < (lines << 3); i++)
             {
-                // Re-init the top address control registers and the queue.
-                stored_dest_bits = (actual_copy_dest >> 24) & 0x1C;
-                QACR0 = stored_dest_bits;
-                QACR1 = stored_dest_bits;
+                word[i] = value;
             }
+        }
+
+        dest += lines << 5;
+        amount -= lines << 5;
+    }
 
-            // First, prefetch the bytes we will need in the next cycle.
-            __asm__("pref @%0" : : "r"(srcptr + 8));
+    // Now, whatever is left over.
+    while (amount >= 4 && (((uint32_t)dest) & 0x3) == 0)
+    {
+        *((uint32_t *)dest) = value;
+        dest += 4;
+        amount -= 4;
+    }
+    while (amount > 0)
+    {
+        *dest = value >> ((((uint32_t)dest) & 0x3) * 8);
+        dest++;
+        amount--;
+    }
+}
 
-            // Now, load the destination queue with the next 32 bytes from the source.
-            queue[0] = *srcptr++;
-            queue[1] = *srcptr++;
-            queue[2] = *srcptr++;
-            queue[3] = *srcptr++;
-            queue[4] = *srcptr++;
-            queue[5] = *srcptr++;
-            queue[6] = *srcptr++;
-            queue[7] = *srcptr++;
+MEMOPS_NO_LIBCALLS
+static void _hw_memcpy_any(void *destptr, const void *srcptr, unsigned int amount, int may_block)
+{
+    uint8_t *dest = (uint8_t *)destptr;
+    const uint8_t *src = (const uint8_t *)srcptr;
 
-            // Finally, trigger the store of this data
-            __asm__("pref @%0" : : "r"(queue));
-            queue += 8;
-            actual_copy_dest += 32;
+    // Most real bulk copies can have both sides word aligned at the same time, which
+    // lets us use whole cache lines below.
+    if (amount >= MEMOPS_BLOCK_MINIMUM && ((((uint32_t)dest) ^ ((uint32_t)src)) & 0x3) == 0)
+    {
+        while ((((uint32_t)dest) & 0x3) != 0)
+        {
+            *dest++ = *src++;
+            amount--;
         }
+        while ((((uint32_t)dest) & 0x1F) != 0)
+        {
+            *((uint32_t *)dest) = *((const uint32_t *)src);
+            dest += 4;
+            src += 4;
+            amount -= 4;
+        }
+
+        unsigned int lines = amount >> 5;
+        int copied = 0;
 
-        // Finally, attempt a new write to both queues in order to stall the CPU until the
-        // last write is done.
-        queue = (uint32_t *)STORE_QUEUE_BASE;
-        queue[0] = 0;
-        queue[8] = 0;
+        // Operand cache RAM on either side means a plain CPU copy.
+        int cpu_only = _memops_ocram((uint32_t)dest) || _memops_ocram((uint32_t)src);
 
-        // We held the lock and succeeded at memsetting.
-        successful = 1;
-        mutex_unlock(&queue_mutex);
+        if (may_block && !cpu_only && (lines << 5) >= MEMOPS_DMA_MINIMUM && (((uint32_t)src) & 0x1F) == 0 && _memops_can_block())
+        {
+            // Let other threads run while the copy happens. This fails if DMA can't
+            // reach either side, in which case we carry on below.
+            copied = _memcpy_dma(dest, src, lines << 5);
+        }
+
+        if (!copied)
+        {
+            if (!cpu_only && _memops_cacheable((uint32_t)dest))
+            {
+                _memcpy_lines((uint32_t *)dest, (const uint32_t *)src, lines);
+            }
+            else if (!cpu_only && (lines << 5) >= MEMOPS_QUEUE_MINIMUM)
+            {
+                _hw_memcpy_queue(dest, src, lines << 5);
+            }
+            else if (!cpu_only && lines > 0 && (((uint32_t)src) & 0x7) == 0 && _memops_fpu_enabled())
+            {
+                _memcpy_pairs(dest, src, lines);
+            }
+            else
+            {
+                uint32_t *dword = (uint32_t *)dest;
+                const uint32_t *sword = (const uint32_t *)src;
+                for (unsigned int i = 0; i < (lines << 3); i++)
+                {
+                    dword[i] = sword[i];
+                }
+            }
+        }
+
+        dest += lines << 5;
+        src += lines << 5;
+        amount -= lines << 5;
+    }
+    else if (amount >= MEMOPS_BLOCK_MINIMUM)
+    {
+        // The two sides can never be word aligned at the same time, so line up the
+        // destination and build each word out of the two source words it straddles.
+        while ((((uint32_t)dest) & 0x3) != 0)
+        {
+            *dest++ = *src++;
+            amount--;
+        }
+
+        // Every aligned load stays inside a word that holds at least one byte we're
+        // copying, so this never reads anything a byte copy wouldn't have touched.
+        unsigned int shift = (((uint32_t)src) & 0x3) * 8;
+        const uint32_t *sword = (const uint32_t *)(((uint32_t)src) & ~0x3);
+        uint32_t *dword = (uint32_t *)dest;
+        uint32_t low = *sword++;
+        unsigned int words = amount >> 2;
+        for (unsigned int i = 0; i < words; i++)
+        {
+            uint32_t high = *sword++;
+            dword[i] = (low >> shift) | (high << (32 - shift));
+            low = high;
+        }
+
+        dest += words << 2;
+        src += words << 2;
+        amount -= words << 2;
+    }
+
+    // Now, whatever is left over.
+    while (amount >= 4 && (((uint32_t)dest) & 0x3) == 0 && (((uint32_t)src) & 0x3) == 0)
+    {
+        *((uint32_t *)dest) = *((const uint32_t *)src);
+        dest += 4;
+        src += 4;
+        amount -= 4;
+    }
+    while (amount > 0)
+    {
+        *dest++ = *src++;
+        amount--;
     }
+}
+
+int hw_memset(void *addr, uint32_t value, unsigned int amount)
+{
+    _hw_memset_any(addr, value, amount);
+    return 1;
+}
 
-    return successful;
+int hw_memcpy(void *dest, void *src, unsigned int amount)
+{
+    _hw_memcpy_any(dest, src, amount, 1);
+    return 1;
+}
+
+// Replace newlib's memset and memcpy, so every bulk copy in the program gets the above
+// without having to know about it. Nobody expects memcpy to be somewhere their thread
+// can be put to sleep, so it sticks to the CPU and leaves DMA to hw_memcpy().
+void *memset(void *addr, int value, size_t amount)
+{
+    uint32_t pattern = value & 0xFF;
+    pattern |= pattern << 8;
+    pattern |= pattern << 16;
+    _hw_memset_any(addr, pattern, amount);
+    return addr;
+}
+
+void *memcpy(void *dest, const void *src, size_t amount)
+{
+    _hw_memcpy_any(dest, src, amount, 0);
+    return dest;
 }
 
 void call_unmanaged(void (*call)())
 {
-    mutex_free(&queue_mutex);
+    memops_ready = 0;
+    _romfs_free();
+    _heap_free();
 
     // Shut down everything since we're leaving our executable.
     _irq_free();
     _maple_free();
     _thread_free();
     _timer_free();
+    _cache_free();
 
     // Call it.
     call();
@@ -386,17 +775,32 @@ _ssize_t _read_r(struct _reent *reent, int file, void *ptr, size_t len)
     }
     else
     {
-        // TODO: Implement read once we have FS support.
-        reent->_errno = ENOTSUP;
-        return -1;
+        int amount = _romfs_read(file, ptr, len);
+        if (amount < 0)
+        {
+            reent->_errno = -amount;
+            return -1;
+        }
+        return amount;
     }
 }
 
 _off_t _lseek_r(struct _reent *reent, int file, _off_t amount, int dir)
 {
-    // TODO: Implement seek once we have FS support.
-    reent->_errno = ENOTSUP;
-    return -1;
+    if( file == 0 || file == 1 || file == 2 )
+    {
+        /* Can't seek on stdio */
+        reent->_errno = ESPIPE;
+        return -1;
+    }
+
+    int position = _romfs_lseek(file, amount, dir);
+    if (position < 0)
+    {
+        reent->_errno = -position;
+        return -1;
+    }
+    return position;
 }
 
 _ssize_t _write_r(struct _reent *reent, int file, const void * ptr, size_t len)
@@ -441,9 +845,20 @@ _ssize_t _write_r(struct _reent *reent, int file, const void * ptr, size_t len)
 
 int _close_r(struct _reent *reent, int file)
 {
-    // TODO: Implement close once we have FS support.
-    reent->_errno = ENOTSUP;
-    return -1;
+    if( file == 0 || file == 1 || file == 2 )
+    {
+        // TODO: Implement close for stdio once we have a use for it.
+        reent->_errno = ENOTSUP;
+        return -1;
+    }
+
+    int result = _romfs_close(file);
+    if (result < 0)
+    {
+        reent->_errno = -result;
+        return -1;
+    }
+    return 0;
 }
 
 int _link_r(struct _reent *reent, const char *old, const char *new)
@@ -495,9 +910,20 @@ void *_sbrk_r(struct _reent *reent, ptrdiff_t incr)
 
 int _fstat_r(struct _reent *reent, int file, struct stat *st)
 {
-    // TODO: Implement fstat once we have FS support.
-    reent->_errno = ENOTSUP;
-    return -1;
+    if( file == 0 || file == 1 || file == 2 )
+    {
+        // TODO: Implement fstat for stdio once we have a use for it.
+        reent->_errno = ENOTSUP;
+        return -1;
+    }
+
+    int result = _romfs_fstat(file, st);
+    if (result < 0)
+    {
+        reent->_errno = -result;
+        return -1;
+    }
+    return 0;
 }
 
 int _mkdir_r(struct _reent *reent, const char *path, int flags)
@@ -509,9 +935,14 @@ int _mkdir_r(struct _reent *reent, const char *path, int flags)
 
 int _open_r(struct _reent *reent, const char *path, int flags, int unk)
 {
-    // TODO: Implement open once we have FS support.
-    reent->_errno = ENOTSUP;
-    return -1;
+    // The only filesystem we have is the read-only ROMFS.
+    int file = _romfs_open(path, flags);
+    if (file < 0)
+    {
+        reent->_errno = -file;
+        return -1;
+    }
+    return file;
 }
 
 int _unlink_r(struct _reent *reent, const char *path)
@@ -550,9 +981,13 @@ int _getpid_r(struct _reent *reent)
 
 int _stat_r(struct _reent *reent, const char *path, struct stat *st)
 {
-    // TODO: Implement stat once we have FS support.
-    reent->_errno = ENOTSUP;
-    return -1;
+    int result = _romfs_path_stat(path, st);
+    if (result < 0)
+    {
+        reent->_errno = -result;
+        return -1;
+    }
+    return 0;
 }
 
 int _fork_r(struct _reent *reent)
@@ -5,12 +5,87 @@
 #include "naomi/interrupt.h"
 #include "naomi/thread.h"
 #include "naomi/timer.h"
+#include "naomi/trace.h"
 #include "irqstate.h"
 
+// Standby control register, used to make sure that the idle thread's sleep
+// instruction puts the CPU into sleep mode instead of standby mode.
+#define STBCR *((volatile uint8_t *)0xFFC00004)
+#define STBCR_STBY 0x80
+
+// Handles given out for threads, semaphores, mutexes and global counters encode the
+// slot that the object lives in as well as a generation count for that slot. This
+// makes lookups a single indexed load, and means that a stale handle to an object
+// that was freed (even if its slot was since reused) is detected instead of
+// silently referring to the new object. The generation is never zero, so a valid
+// handle is never zero either.
+#define HANDLE_INDEX_BITS 12
+#define HANDLE_INDEX_MASK ((1 << HANDLE_INDEX_BITS) - 1)
+#define HANDLE_GENERATION_MASK (0xFFFFFFFF >> HANDLE_INDEX_BITS)
+
+typedef struct
+{
+    unsigned int size;
+    unsigned int free_count;
+    uint32_t *generations;
+    uint16_t *free_slots;
+} handle_table_t;
+
+void _handle_table_init(handle_table_t *table)
+{
+    // Stack up free slots so that the lowest slot is handed out first.
+    for (unsigned int i = 0; i < table->size; i++)
+    {
+        table->generations[i] = 1;
+        table->free_slots[i] = table->size - (i + 1);
+    }
+    table->free_count = table->size;
+}
+
+int _handle_alloc(handle_table_t *table)
+{
+    if (table->free_count == 0)
+    {
+        // Out of slots.
+        return -1;
+    }
+
+    table->free_count--;
+    return table->free_slots[table->free_count];
+}
+
+void _handle_release(handle_table_t *table, int index)
+{
+    // Bump the generation so that any outstanding handles to this slot go stale.
+    uint32_t generation = (table->generations[index] + 1) & HANDLE_GENERATION_MASK;
+    table->generations[index] = generation ? generation : 1;
+    table->free_slots[table->free_count] = index;
+    table->free_count++;
+}
+
+uint32_t _handle_get(handle_table_t *table, int index)
+{
+    return (table->generations[index] << HANDLE_INDEX_BITS) | index;
+}
+
+int _handle_index(handle_table_t *table, uint32_t handle)
+{
+    unsigned int index = handle & HANDLE_INDEX_MASK;
+    if (index >= table->size || table->generations[index] != (handle >> HANDLE_INDEX_BITS))
+    {
+        // Not a handle we ever gave out, or one to an object that's since been freed.
+        return -1;
+    }
+
+    return index;
+}
+
 #define SEM_TYPE_MUTEX 1
 #define SEM_TYPE_SEMAPHORE 2
 #define MAX_SEM_AND_MUTEX (MAX_SEMAPHORES + MAX_MUTEXES)
 
+struct thread;
+
 typedef struct
 {
     void *public;
@@ -18,22 +93,28 @@ typedef struct
     uint32_t max;
     uint32_t current;
     uint32_t irq_disabled;
+
+    // Threads parked on this semaphore, in the order that they tried to acquire it.
+    struct thread *waiters_head;
+    struct thread *waiters_tail;
 } semaphore_internal_t;
 
 static semaphore_internal_t *semaphores[MAX_SEM_AND_MUTEX];
-static uint32_t semaphore_counter = 1;
-static uint32_t mutex_counter = 1;
+static uint32_t semaphore_generations[MAX_SEM_AND_MUTEX];
+static uint16_t semaphore_free_slots[MAX_SEM_AND_MUTEX];
+static handle_table_t semaphore_handles = { MAX_SEM_AND_MUTEX, 0, semaphore_generations, semaphore_free_slots };
+static unsigned int semaphore_count = 0;
+static unsigned int mutex_count = 0;
 
 semaphore_internal_t *_semaphore_find(void * semaphore, unsigned int type)
 {
     if (semaphore != 0)
     {
-        for (unsigned int i = 0; i < MAX_SEM_AND_MUTEX; i++)
+        // Semaphores and mutexes both store their handle as the first member.
+        int index = _handle_index(&semaphore_handles, ((semaphore_t *)semaphore)->id);
+        if (index >= 0 && semaphores[index] != 0 && semaphores[index]->public == semaphore && semaphores[index]->type == type)
         {
-            if (semaphores[i] != 0 && semaphores[i]->public == semaphore && semaphores[i]->type == type)
-            {
-                return semaphores[i];
-            }
+            return semaphores[index];
         }
     }
 
@@ -55,7 +136,7 @@ semaphore_internal_t *_semaphore_find(void * semaphore, unsigned int type)
 // Thread is waiting for a resource.
 #define THREAD_STATE_WAITING 4
 
-typedef struct
+typedef struct thread
 {
     // Basic thread stuff.
     char name[64];
@@ -63,52 +144,410 @@ typedef struct
     int priority;
     int state;
 
-    // Thread statistics.
+    // Thread statistics, in monotonic clock ticks.
     uint64_t running_time;
-    uint32_t running_time_recent;
-    float cpu_percentage;
+    uint64_t running_time_recent;
+
+    // Share of the CPU this thread got over the last stats period, in 1/65536ths. This
+    // is worked out in the timer interrupt, which can't use the FPU, so it isn't a float.
+    uint32_t cpu_usage;
 
     // Any resources this thread is waiting on.
     semaphore_internal_t * waiting_semaphore;
+    struct thread *wait_next;
     uint32_t waiting_thread;
-    uint32_t waiting_timer;
+
+    // Absolute time in monotonic clock ticks that a sleeping thread should wake up at, and
+    // its links in the deadline-ordered sleep queue. Zero when not sleeping.
+    uint64_t waiting_timer;
+    struct thread *sleep_next;
+    struct thread *sleep_prev;
+
+    // Run queue bookkeeping. Threads that are in the running state are linked
+    // into the run queue for their priority band. When not in a run queue, the
+    // band is set to -1.
+    int run_band;
+    struct thread *run_next;
+    struct thread *run_prev;
 
     // The actual context of the thread, including all of the registers and such.
     int main_thread;
     irq_state_t *context;
     uint8_t *stack;
+    uint32_t stack_size;
     void *retval;
 } thread_t;
 
 // Calculate stats every second.
-#define STATS_DENOMINATOR 1000000
+#define STATS_DENOMINATOR TIMER_TICKS_PER_SECOND
 
 static uint64_t running_time_denominator = 0;
 static uint64_t current_profile = 0;
 static thread_t *threads[MAX_THREADS];
+static uint32_t thread_generations[MAX_THREADS];
+static uint16_t thread_free_slots[MAX_THREADS];
+static handle_table_t thread_handles = { MAX_THREADS, 0, thread_generations, thread_free_slots };
 
 thread_t *_thread_find_by_context(irq_state_t *context)
 {
-    for (unsigned int i = 0; i < MAX_THREADS; i++)
+    if (context != 0)
+    {
+        return context->thread;
+    }
+
+    return 0;
+}
+
+// Threads whose priority has been temporarily bumped in order to be scheduled
+// promptly after waking live in a separate set of bands above all regular ones.
+#define INVERSION_AMOUNT 100000
+
+// One band for the idle thread, one for every regular priority and one for every
+// inverted priority. Bands are ordered so that a higher band always means a higher
+// effective priority.
+#define PRIORITY_RANGE (MAX_PRIORITY - MIN_PRIORITY + 1)
+#define PRIORITY_BANDS (1 + (PRIORITY_RANGE * 2))
+#define BAND_WORDS ((PRIORITY_BANDS + 31) / 32)
+#define BAND_SUMMARY_WORDS ((BAND_WORDS + 31) / 32)
+
+// Circular doubly-linked run queue per band, with the head being the next thread
+// to schedule in a round-robin fashion. Alongside that, a two-level bitmap of which
+// bands are non-empty so that we can find the highest runnable band in constant time.
+static thread_t *run_queues[PRIORITY_BANDS];
+static uint32_t band_bitmap[BAND_WORDS];
+static uint32_t band_summary[BAND_SUMMARY_WORDS];
+
+int _thread_band(int priority)
+{
+    if (priority == INT_MIN)
+    {
+        // Idle thread gets the lowest band all to itself.
+        return 0;
+    }
+    if (priority >= (INVERSION_AMOUNT + MIN_PRIORITY))
+    {
+        return 1 + PRIORITY_RANGE + (priority - (INVERSION_AMOUNT + MIN_PRIORITY));
+    }
+
+    return 1 + (priority - MIN_PRIORITY);
+}
+
+int _thread_band_highest(int limit)
+{
+    // Find the highest non-empty band strictly below limit, or -1 if there is none.
+    if (limit <= 0)
     {
-        if (threads[i] != 0 && threads[i]->context == context)
+        return -1;
+    }
+
+    // First, check the word the limit falls into, masking off bands at or above the limit.
+    int band = limit - 1;
+    int word = band >> 5;
+    uint32_t bits = band_bitmap[word] & (0xFFFFFFFF >> (31 - (band & 31)));
+    if (bits)
+    {
+        return (word << 5) + (31 - __builtin_clz(bits));
+    }
+    if (word == 0)
+    {
+        return -1;
+    }
+
+    // Now, walk the summary to find the next lowest word with any bands set.
+    word--;
+    int summary = word >> 5;
+    bits = band_summary[summary] & (0xFFFFFFFF >> (31 - (word & 31)));
+    while (1)
+    {
+        if (bits)
         {
-            return threads[i];
+            word = (summary << 5) + (31 - __builtin_clz(bits));
+            return (word << 5) + (31 - __builtin_clz(band_bitmap[word]));
         }
+        if (summary == 0)
+        {
+            return -1;
+        }
+
+        summary--;
+        bits = band_summary[summary];
     }
+}
 
-    return 0;
+void _thread_enqueue(thread_t *thread)
+{
+    if (thread->run_band >= 0)
+    {
+        // Already on a run queue.
+        return;
+    }
+
+    int band = _thread_band(thread->priority);
+    thread_t *head = run_queues[band];
+
+    if (head == 0)
+    {
+        // First thread in this band, mark the band as runnable.
+        thread->run_next = thread;
+        thread->run_prev = thread;
+        run_queues[band] = thread;
+        band_bitmap[band >> 5] |= (1U << (band & 31));
+        band_summary[band >> 10] |= (1U << ((band >> 5) & 31));
+    }
+    else
+    {
+        // Insert at the tail, which is just before the head.
+        thread->run_next = head;
+        thread->run_prev = head->run_prev;
+        head->run_prev->run_next = thread;
+        head->run_prev = thread;
+    }
+
+    thread->run_band = band;
 }
 
-thread_t *_thread_find_by_id(uint32_t id)
+void _thread_dequeue(thread_t *thread)
 {
-    for (unsigned int i = 0; i < MAX_THREADS; i++)
+    int band = thread->run_band;
+    if (band < 0)
     {
-        if (threads[i] != 0 && threads[i]->id == id)
+        // Not on any run queue.
+        return;
+    }
+
+    if (thread->run_next == thread)
+    {
+        // Last thread in this band, mark the band as empty.
+        run_queues[band] = 0;
+        band_bitmap[band >> 5] &= ~(1U << (band & 31));
+        if (band_bitmap[band >> 5] == 0)
         {
-            return threads[i];
+            band_summary[band >> 10] &= ~(1U << ((band >> 5) & 31));
         }
     }
+    else
+    {
+        thread->run_prev->run_next = thread->run_next;
+        thread->run_next->run_prev = thread->run_prev;
+        if (run_queues[band] == thread)
+        {
+            run_queues[band] = thread->run_next;
+        }
+    }
+
+    thread->run_band = -1;
+    thread->run_next = 0;
+    thread->run_prev = 0;
+}
+
+void _thread_set_state(thread_t *thread, int state)
+{
+    // Keep the run queues in sync with whether the thread is runnable.
+    if (state == THREAD_STATE_RUNNING)
+    {
+        if (thread->state == THREAD_STATE_WAITING)
+        {
+            // Note when this thread was woken, so we can track how long it takes to run.
+            _irq_stamp_wake(thread->context);
+        }
+        _thread_enqueue(thread);
+    }
+    else
+    {
+        _thread_dequeue(thread);
+    }
+
+    thread->state = state;
+}
+
+void _thread_set_priority(thread_t *thread, int priority)
+{
+    if (thread->run_band >= 0)
+    {
+        // Move the thread to the run queue for its new band.
+        _thread_dequeue(thread);
+        thread->priority = priority;
+        _thread_enqueue(thread);
+    }
+    else
+    {
+        thread->priority = priority;
+    }
+}
+
+// Sleeping threads, sorted by ascending wakeup deadline so that the preemption
+// timer only ever needs to look at the threads that are actually due.
+static thread_t *sleep_queue = 0;
+
+void _thread_sleep_insert(thread_t *thread, uint64_t deadline)
+{
+    // A zero deadline means not sleeping, so never use it as a real deadline.
+    thread->waiting_timer = deadline ? deadline : 1;
+
+    // Find the first thread that wakes strictly after us so that threads with the
+    // same deadline wake in the order that they went to sleep.
+    thread_t *prev = 0;
+    thread_t *next = sleep_queue;
+    while (next != 0 && next->waiting_timer <= thread->waiting_timer)
+    {
+        prev = next;
+        next = next->sleep_next;
+    }
+
+    thread->sleep_prev = prev;
+    thread->sleep_next = next;
+    if (next)
+    {
+        next->sleep_prev = thread;
+    }
+    if (prev)
+    {
+        prev->sleep_next = thread;
+    }
+    else
+    {
+        sleep_queue = thread;
+    }
+}
+
+void _thread_sleep_remove(thread_t *thread)
+{
+    if (thread->waiting_timer == 0)
+    {
+        // Not sleeping.
+        return;
+    }
+
+    if (thread->sleep_prev)
+    {
+        thread->sleep_prev->sleep_next = thread->sleep_next;
+    }
+    else
+    {
+        sleep_queue = thread->sleep_next;
+    }
+    if (thread->sleep_next)
+    {
+        thread->sleep_next->sleep_prev = thread->sleep_prev;
+    }
+
+    thread->waiting_timer = 0;
+    thread->sleep_next = 0;
+    thread->sleep_prev = 0;
+}
+
+void _semaphore_park(semaphore_internal_t *semaphore, thread_t *thread)
+{
+    // Put the thread at the back of the line for this semaphore.
+    thread->waiting_semaphore = semaphore;
+    thread->wait_next = 0;
+    if (semaphore->waiters_tail)
+    {
+        semaphore->waiters_tail->wait_next = thread;
+    }
+    else
+    {
+        semaphore->waiters_head = thread;
+    }
+    semaphore->waiters_tail = thread;
+    _thread_set_state(thread, THREAD_STATE_WAITING);
+    TRACE_EVENT(TRACE_EVENT_WAIT, semaphore->type, thread->id, *((uint32_t *)semaphore->public));
+}
+
+void _semaphore_unpark(thread_t *thread)
+{
+    semaphore_internal_t *semaphore = thread->waiting_semaphore;
+    if (semaphore == 0)
+    {
+        // Not waiting on a semaphore.
+        return;
+    }
+
+    // Find the thread in the line for this semaphore and unlink it.
+    thread_t *prev = 0;
+    thread_t *cur = semaphore->waiters_head;
+    while (cur != 0 && cur != thread)
+    {
+        prev = cur;
+        cur = cur->wait_next;
+    }
+
+    if (cur != 0)
+    {
+        if (prev)
+        {
+            prev->wait_next = thread->wait_next;
+        }
+        else
+        {
+            semaphore->waiters_head = thread->wait_next;
+        }
+        if (semaphore->waiters_tail == thread)
+        {
+            semaphore->waiters_tail = prev;
+        }
+    }
+
+    thread->waiting_semaphore = 0;
+    thread->wait_next = 0;
+}
+
+void _semaphore_detach_waiters(semaphore_internal_t *semaphore)
+{
+    // The semaphore is going away, so make sure no thread points at it anymore.
+    // Any threads still waiting on it will never be woken up.
+    thread_t *thread = semaphore->waiters_head;
+    while (thread != 0)
+    {
+        thread_t *next = thread->wait_next;
+        thread->waiting_semaphore = 0;
+        thread->wait_next = 0;
+        thread = next;
+    }
+
+    semaphore->waiters_head = 0;
+    semaphore->waiters_tail = 0;
+}
+
+int _semaphore_handoff(semaphore_internal_t *semaphore)
+{
+    if (semaphore == 0)
+    {
+        // Shouldn't be possible, but lets not crash.
+        _irq_display_invariant("wake failure", "target semaphore is NULL");
+        return 0;
+    }
+
+    thread_t *thread = semaphore->waiters_head;
+    if (thread == 0)
+    {
+        // Nobody is waiting on this semaphore.
+        return 0;
+    }
+
+    // Hand ownership of the released slot directly to the thread that has been
+    // waiting the longest, so there is no need for it to retry the acquire.
+    semaphore->waiters_head = thread->wait_next;
+    if (semaphore->waiters_head == 0)
+    {
+        semaphore->waiters_tail = 0;
+    }
+    thread->waiting_semaphore = 0;
+    thread->wait_next = 0;
+    semaphore->irq_disabled = 0;
+    _thread_set_state(thread, THREAD_STATE_RUNNING);
+    TRACE_EVENT(TRACE_EVENT_WAKE, semaphore->type, thread->id, *((uint32_t *)semaphore->public));
+
+    return 1;
+}
+
+thread_t *_thread_find_by_id(uint32_t id)
+{
+    int index = _handle_index(&thread_handles, id);
+    if (index >= 0)
+    {
+        return threads[index];
+    }
 
     return 0;
 }
@@ -120,59 +559,197 @@ typedef struct
 } global_counter_t;
 
 static global_counter_t *global_counters[MAX_GLOBAL_COUNTERS];
-static uint32_t global_counter_counter = 1;
+static uint32_t global_counter_generations[MAX_GLOBAL_COUNTERS];
+static uint16_t global_counter_free_slots[MAX_GLOBAL_COUNTERS];
+static handle_table_t global_counter_handles = { MAX_GLOBAL_COUNTERS, 0, global_counter_generations, global_counter_free_slots };
 
 global_counter_t *_global_counter_find(uint32_t counterid)
 {
-    for (unsigned int i = 0; i < MAX_GLOBAL_COUNTERS; i++)
+    int index = _handle_index(&global_counter_handles, counterid);
+    if (index >= 0)
+    {
+        return global_counters[index];
+    }
+
+    return 0;
+}
+
+// Thread stacks are handed out from a pool of power-of-two size classes, so that
+// destroying a thread and creating another one of a similar size doesn't go back
+// to the heap. Stacks larger than the largest class come straight from malloc().
+// While a stack is sitting in the pool, its first word links to the next free
+// stack in the same class.
+#define STACK_POOL_MIN_SHIFT 12
+#define STACK_POOL_CLASSES 6
+#define STACK_POOL_DEPTH 4
+
+// Stacks are painted with this pattern when they are handed to a thread, so we
+// can later find the deepest point the thread has ever used.
+#define STACK_PAINT_BYTE 0xA5
+#define STACK_PAINT_WORD 0xA5A5A5A5
+
+static uint8_t *stack_pool[STACK_POOL_CLASSES];
+static unsigned int stack_pool_count[STACK_POOL_CLASSES];
+
+int _thread_stack_class(uint32_t size)
+{
+    for (int class = 0; class < STACK_POOL_CLASSES; class++)
     {
-        if (global_counters[i] != 0 && global_counters[i]->id == counterid)
+        if (size <= (1 << (STACK_POOL_MIN_SHIFT + class)))
         {
-            return global_counters[i];
+            return class;
         }
     }
 
-    return 0;
+    // Too big to pool.
+    return -1;
+}
+
+uint8_t *_thread_stack_alloc(uint32_t *size)
+{
+    uint8_t *stack = 0;
+
+    // Round up to the size class, so recycled stacks fit any request in that class.
+    int class = _thread_stack_class(*size);
+    if (class >= 0)
+    {
+        *size = 1 << (STACK_POOL_MIN_SHIFT + class);
+
+        uint32_t old_interrupts = irq_disable();
+        if (stack_pool[class])
+        {
+            stack = stack_pool[class];
+            stack_pool[class] = *((uint8_t **)stack);
+            stack_pool_count[class]--;
+        }
+        irq_restore(old_interrupts);
+    }
+    else
+    {
+        *size = (*size + 7) & ~7;
+    }
+
+    if (stack == 0)
+    {
+        stack = malloc(*size);
+    }
+    if (stack != 0)
+    {
+        memset(stack, STACK_PAINT_BYTE, *size);
+    }
+
+    return stack;
+}
+
+void _thread_stack_release(uint8_t *stack, uint32_t size)
+{
+    // Only stacks that are exactly a class size came from _thread_stack_alloc(),
+    // anything else goes back to the heap.
+    int class = _thread_stack_class(size);
+    if (class >= 0 && size == (1 << (STACK_POOL_MIN_SHIFT + class)))
+    {
+        uint32_t old_interrupts = irq_disable();
+        if (stack_pool_count[class] < STACK_POOL_DEPTH)
+        {
+            *((uint8_t **)stack) = stack_pool[class];
+            stack_pool[class] = stack;
+            stack_pool_count[class]++;
+            stack = 0;
+        }
+        irq_restore(old_interrupts);
+    }
+
+    if (stack)
+    {
+        free(stack);
+    }
+}
+
+void _thread_stack_pool_free()
+{
+    for (int class = 0; class < STACK_POOL_CLASSES; class++)
+    {
+        while (stack_pool[class])
+        {
+            uint8_t *stack = stack_pool[class];
+            stack_pool[class] = *((uint8_t **)stack);
+            free(stack);
+        }
+        stack_pool_count[class] = 0;
+    }
+}
+
+uint32_t _thread_stack_used(thread_t *thread)
+{
+    if (thread->stack_size == 0)
+    {
+        // We don't know anything about this stack (the main thread's stack).
+        return 0;
+    }
+
+    // Stacks grow down, so the untouched paint is at the bottom of the allocation.
+    uint32_t *bottom = (uint32_t *)thread->stack;
+    uint32_t words = thread->stack_size / sizeof(uint32_t);
+    uint32_t untouched = 0;
+    while (untouched < words && bottom[untouched] == STACK_PAINT_WORD)
+    {
+        untouched++;
+    }
+
+    return thread->stack_size - (untouched * sizeof(uint32_t));
 }
 
 void * _idle_thread(void *param)
 {
-    while ( 1 ) { thread_yield(); }
+    // Halt the CPU until the next interrupt. Whenever there is another thread to run,
+    // the interrupt that made it runnable will schedule it in place of us.
+    while ( 1 ) { asm("sleep"); }
 
     return 0;
 }
 
-uint32_t thread_counter;
-
 thread_t *_thread_create(char *name, int priority)
 {
+    // Allocate before disabling interrupts, since the heap lock may need to block.
+    thread_t *thread = malloc(sizeof(thread_t));
+    memset(thread, 0, sizeof(thread_t));
+    thread->priority = priority;
+    thread->state = THREAD_STATE_STOPPED;
+    thread->run_band = -1;
+    strncpy(thread->name, name, 63);
+
     uint32_t old_interrupts = irq_disable();
-    thread_t *thread = 0;
 
-    for (unsigned int i = 0; i < MAX_THREADS; i++)
+    int index = _handle_alloc(&thread_handles);
+    if (index >= 0)
     {
-        if (threads[i] == 0)
-        {
-            thread = malloc(sizeof(thread_t));
-            memset(thread, 0, sizeof(thread_t));
-
-            thread->id = thread_counter++;
-            thread->priority = priority;
-            thread->state = THREAD_STATE_STOPPED;
-            strncpy(thread->name, name, 63);
-
-            threads[i] = thread;
-            break;
-        }
+        thread->id = _handle_get(&thread_handles, index);
+        threads[index] = thread;
     }
 
     irq_restore(old_interrupts);
 
+    if (index < 0)
+    {
+        free(thread);
+        thread = 0;
+    }
+
     return thread;
 }
 
+void _thread_unlink(thread_t *thread)
+{
+    // Make sure we never schedule or wake this thread again. Must be called with
+    // interrupts disabled.
+    _thread_dequeue(thread);
+    _thread_sleep_remove(thread);
+    _semaphore_unpark(thread);
+}
+
 void _thread_destroy(thread_t *thread)
 {
+    // Give back all of the memory associated with a thread that was previously unlinked.
     if (thread->main_thread == 0)
     {
         if (thread->context)
@@ -182,7 +759,7 @@ void _thread_destroy(thread_t *thread)
         }
         if (thread->stack)
         {
-            free(thread->stack);
+            _thread_stack_release(thread->stack, thread->stack_size);
             thread->stack = 0;
         }
     }
@@ -196,28 +773,33 @@ void _thread_register_main(irq_state_t *state)
     thread_t *main_thread = _thread_create("main", 0);
     main_thread->stack = (uint8_t *)0x0E000000;
     main_thread->context = state;
-    main_thread->state = THREAD_STATE_RUNNING;
+    main_thread->context->thread = main_thread;
     main_thread->main_thread = 1;
+    _thread_set_state(main_thread, THREAD_STATE_RUNNING);
 
     irq_restore(old_interrupts);
 }
 
 void _thread_create_idle()
 {
+    // Make sure the idle thread's sleep keeps peripherals such as the timers running.
+    STBCR &= ~STBCR_STBY;
+
     // Create an idle thread.
     thread_t *idle_thread = _thread_create("idle", INT_MIN);
-    idle_thread->stack = malloc(64);
-    idle_thread->context = _irq_new_state(_idle_thread, 0, idle_thread->stack + 64);
-    idle_thread->state = THREAD_STATE_RUNNING;
+    idle_thread->stack_size = 64;
+    idle_thread->stack = malloc(idle_thread->stack_size);
+    memset(idle_thread->stack, STACK_PAINT_BYTE, idle_thread->stack_size);
+    idle_thread->context = _irq_new_state(_idle_thread, 0, idle_thread->stack + idle_thread->stack_size);
+    idle_thread->context->thread = idle_thread;
+    _thread_set_state(idle_thread, THREAD_STATE_RUNNING);
 }
 
-#define INVERSION_AMOUNT 100000
-
 void _thread_enable_inversion(thread_t *thread)
 {
     if (thread->priority >= MIN_PRIORITY && thread->priority <= MAX_PRIORITY)
     {
-        thread->priority += INVERSION_AMOUNT;
+        _thread_set_priority(thread, thread->priority + INVERSION_AMOUNT);
     }
 }
 
@@ -225,160 +807,152 @@ void _thread_disable_inversion(thread_t *thread)
 {
     if (thread->priority >= (INVERSION_AMOUNT + MIN_PRIORITY) && thread->priority <= (INVERSION_AMOUNT + MAX_PRIORITY))
     {
-        thread->priority -= INVERSION_AMOUNT;
+        _thread_set_priority(thread, thread->priority - INVERSION_AMOUNT);
     }
 }
 
-#define THREAD_SCHEDULE_CURRENT 0
-#define THREAD_SCHEDULE_OTHER 1
-#define THREAD_SCHEDULE_ANY 2
+// Whether we only program the preemption timer when we actually need it.
+static int tickless = 1;
 
-irq_state_t *_thread_schedule(irq_state_t *state, int request)
+void _thread_update_preemption(irq_state_t *state)
 {
-    thread_t *current_thread = _thread_find_by_context(state);
-
-    if (current_thread == 0)
+    if (!tickless)
     {
-        // Should never happen.
-        _irq_display_invariant("scheduling failure", "cannot locate current thread to schedule");
-        return state;
+        // Periodic preemption timer is already running.
+        return;
     }
 
-    // Schedule a new thread at this point.
-    if (request == THREAD_SCHEDULE_CURRENT)
+    thread_t *running_thread = _thread_find_by_context(state);
+    uint32_t microseconds = 0;
+
+    // If another thread shares the highest runnable band with the thread we are about
+    // to run, or we are running a lower priority thread because a higher priority one
+    // yielded, we need to come back at the end of the time slice.
+    int band = _thread_band_highest(PRIORITY_BANDS);
+    if (band >= 0 && running_thread != 0)
     {
-        // See if the current thread is applicable to run. Never reschedule the
-        // idle thread, however, unless there is truly nothing else to reschedule.
-        if (current_thread->state == THREAD_STATE_RUNNING && current_thread->priority != INT_MIN)
+        if (running_thread->run_band != band || run_queues[band]->run_next != run_queues[band])
         {
-            // It is, just return it.
-            _thread_disable_inversion(current_thread);
-            return current_thread->context;
+            microseconds = MICROSECONDS_IN_ONE_SECOND / PREEMPTION_HZ;
         }
     }
 
-    // Set the max priority to the idle thread, so if we don't find any
-    // applicable threads then we will choose the idle thread instead.
-    int priority = INT_MIN;
-    int self_priority = INT_MIN;
-
-    // Go through and find the highest priority that is schedulable.
-    for (unsigned int i = 0; i < MAX_THREADS; i++)
+    // If a thread is sleeping, we need to come back when it should wake up.
+    if (sleep_queue != 0)
     {
-        if (threads[i] == 0)
-        {
-            // Not a real thread.
-            continue;
-        }
+        uint64_t now = timer_now_ticks();
+        uint64_t ticks = sleep_queue->waiting_timer > now ? sleep_queue->waiting_timer - now : 1;
 
-        if (threads[i]->state != THREAD_STATE_RUNNING)
+        // Don't bother programming very long waits, we'll get a chance to
+        // reprogram when we wake up early anyway. This also means the conversion
+        // to microseconds fits in 32 bits. Round up so we never wake up early.
+        if (ticks > TIMER_TICKS_PER_SECOND)
         {
-            // This thread isn't runnable.
-            continue;
+            ticks = TIMER_TICKS_PER_SECOND;
         }
-
-        if (request == THREAD_SCHEDULE_OTHER && threads[i] == current_thread)
+        uint32_t delta = ((((uint32_t)ticks) * 2) + 24) / 25;
+        if (microseconds == 0 || delta < microseconds)
         {
-            // Don't include this thread, we specifically requested going to the next thread.
-            self_priority = self_priority > threads[i]->priority ? self_priority : threads[i]->priority;
-            continue;
+            microseconds = delta;
         }
-
-        // Bump the max priority based on this schedulable thread.
-        priority = priority > threads[i]->priority ? priority : threads[i]->priority;
     }
 
-    if (priority == INT_MIN)
-    {
-        // We couldn't schedule any thread. However, if we requested to schedule another
-        // thread aside from ourselves but we were the only one available, take that choice.
-        priority = self_priority;
-    }
-
-    // Now, round robin within the priority band.
-    int found = 0;
-    for (unsigned int i = 0; i < MAX_THREADS; i++)
-    {
-        if (threads[i] == 0)
-        {
-            // Not a real thread.
-            continue;
-        }
-
-        if (threads[i]->state != THREAD_STATE_RUNNING)
-        {
-            // This thread isn't runnable.
-            continue;
-        }
+    // Zero here means that nothing else can run until some other interrupt
+    // makes it runnable, so we stop the preemption timer entirely.
+    _preempt_request(microseconds);
+}
 
-        if (threads[i]->priority != priority)
-        {
-            // Don't care, not the band we're after.
-            continue;
-        }
+#define THREAD_SCHEDULE_CURRENT 0
+#define THREAD_SCHEDULE_OTHER 1
+#define THREAD_SCHEDULE_ANY 2
 
-        if (found)
-        {
-            // Okay, we found our current thread last iteration, so this is
-            // the next applicable thread in a round-robin scheduler.
-            _thread_disable_inversion(threads[i]);
-            return threads[i]->context;
-        }
+irq_state_t *_thread_schedule(irq_state_t *state, int request)
+{
+    thread_t *current_thread = _thread_find_by_context(state);
 
-        if (threads[i] == current_thread)
-        {
-            // We found our thread, return the next thread on the next iteration.
-            found = 1;
-        }
+    if (current_thread == 0)
+    {
+        // Should never happen.
+        _irq_display_invariant("scheduling failure", "cannot locate current thread to schedule");
+        return state;
     }
 
-    // If we got here, then the next available thread is before our current thread.
-    // Just run again and select the first applicable thread. This has the chance
-    // of selecting ourselves if there is no applicable other thread, even if the
-    // request is THREAD_SCHEDULE_OTHER. That should only happen when it is the idle
-    // thread, however, since at any other moment we would have chosen a different
-    // priority band.
-    for (unsigned int i = 0; i < MAX_THREADS; i++)
+    // Schedule a new thread at this point.
+    if (request == THREAD_SCHEDULE_CURRENT)
     {
-        if (threads[i] == 0)
-        {
-            // Not a real thread.
-            continue;
+        // See if the current thread is applicable to run. Never reschedule the
+        // idle thread, however, unless there is truly nothing else to reschedule.
+        if (current_thread->state == THREAD_STATE_RUNNING && current_thread->priority != INT_MIN)
+        {
+            // It is, just return it.
+            _thread_disable_inversion(current_thread);
+            return current_thread->context;
         }
+    }
+
+    // Find the highest priority band that has a runnable thread in it. The head of
+    // that band's run queue is the next thread in round-robin order.
+    int band = _thread_band_highest(PRIORITY_BANDS);
+    thread_t *next_thread = band >= 0 ? run_queues[band] : 0;
 
-        if (threads[i]->state != THREAD_STATE_RUNNING)
+    if (request == THREAD_SCHEDULE_OTHER && next_thread == current_thread)
+    {
+        // We specifically requested going to another thread, so skip ourselves.
+        if (current_thread->run_next != current_thread)
         {
-            // This thread isn't runnable.
-            continue;
+            // There is another thread in our band, so that one is next.
+            next_thread = current_thread->run_next;
         }
-
-        if (threads[i]->priority != priority)
+        else
         {
-            // Don't care, not the band we're after.
-            continue;
+            // We're the only thread in our band, so drop down to the next band.
+            // If we were the only thread available, we take that choice. That
+            // should only happen when it is the idle thread, however, since at
+            // any other moment the idle thread would be in a lower band.
+            int lower = _thread_band_highest(band);
+            if (lower >= 0)
+            {
+                next_thread = run_queues[lower];
+            }
         }
+    }
 
-        // Okay, we found an applicable thread, return it as the scheduled thread.
-        _thread_disable_inversion(threads[i]);
-        return threads[i]->context;
+    if (next_thread == 0)
+    {
+        // We should never ever get here, so display a failure message.
+        _irq_display_invariant("scheduling failure", "cannot locate new thread to schedule");
+        return state;
     }
 
-    // We should never ever get here, so display a failure message.
-    _irq_display_invariant("scheduling failure", "cannot locate new thread to schedule");
-    return state;
+    // Rotate the band so that the chosen thread goes to the back of the line.
+    run_queues[next_thread->run_band] = next_thread->run_next;
+    _thread_disable_inversion(next_thread);
+    if (next_thread != current_thread)
+    {
+        TRACE_EVENT(TRACE_EVENT_SWITCH, 0, current_thread->id, next_thread->id);
+    }
+    return next_thread->context;
 }
 
 void _thread_init()
 {
-    thread_counter = 1;
-    global_counter_counter = 1;
-    semaphore_counter = 1;
-    mutex_counter = 1;
+    _handle_table_init(&thread_handles);
+    _handle_table_init(&global_counter_handles);
+    _handle_table_init(&semaphore_handles);
+    semaphore_count = 0;
+    mutex_count = 0;
     current_profile = 0;
     running_time_denominator = 0;
+    tickless = 1;
     memset(global_counters, 0, sizeof(uint32_t *) * MAX_GLOBAL_COUNTERS);
     memset(semaphores, 0, sizeof(semaphore_internal_t *) * MAX_SEM_AND_MUTEX);
     memset(threads, 0, sizeof(thread_t *) * MAX_THREADS);
+    memset(run_queues, 0, sizeof(thread_t *) * PRIORITY_BANDS);
+    memset(band_bitmap, 0, sizeof(uint32_t) * BAND_WORDS);
+    memset(band_summary, 0, sizeof(uint32_t) * BAND_SUMMARY_WORDS);
+    memset(stack_pool, 0, sizeof(uint8_t *) * STACK_POOL_CLASSES);
+    memset(stack_pool_count, 0, sizeof(unsigned int) * STACK_POOL_CLASSES);
+    sleep_queue = 0;
 }
 
 void _thread_free()
@@ -406,6 +980,7 @@ void _thread_free()
             {
                 ((semaphore_t *)semaphores[i]->public)->id = 0;
             }
+            _semaphore_detach_waiters(semaphores[i]);
             free(semaphores[i]);
             semaphores[i] = 0;
         }
@@ -415,11 +990,22 @@ void _thread_free()
     {
         if (threads[i] != 0)
         {
+            _thread_unlink(threads[i]);
             _thread_destroy(threads[i]);
             threads[i] = 0;
         }
     }
 
+    // Now that every thread has given its stack back, empty out the stack pool.
+    _thread_stack_pool_free();
+
+    // Everything is gone, so invalidate every outstanding handle.
+    _handle_table_init(&thread_handles);
+    _handle_table_init(&global_counter_handles);
+    _handle_table_init(&semaphore_handles);
+    semaphore_count = 0;
+    mutex_count = 0;
+
     irq_restore(old_interrupts);
 }
 
@@ -463,7 +1049,7 @@ void _thread_wake_waiting_threadid(thread_t *thread)
             // for the thread_join() syscall to the thread's retval, and
             // set the current thread to a zombie since it's been waited on.
             threads[i]->waiting_thread = 0;
-            threads[i]->state = THREAD_STATE_RUNNING;
+            _thread_set_state(threads[i], THREAD_STATE_RUNNING);
             if (thread->state == THREAD_STATE_ZOMBIE)
             {
                 // Already outputted the result to another join.
@@ -472,123 +1058,38 @@ void _thread_wake_waiting_threadid(thread_t *thread)
             else
             {
                 threads[i]->context->gp_regs[0] = (uint32_t )thread->retval;
-                thread->state = THREAD_STATE_ZOMBIE;
-            }
-        }
-    }
-}
-
-void _thread_wake_waiting_semaphore(semaphore_internal_t *semaphore)
-{
-    if (semaphore == 0)
-    {
-        // Shouldn't be possible, but lets not crash.
-        _irq_display_invariant("wake failure", "target semaphore is NULL");
-        return;
-    }
-
-    for (unsigned int i = 0; i < MAX_THREADS; i++)
-    {
-        if (threads[i] == 0)
-        {
-            // Not a real thread.
-            continue;
-        }
-
-        if (threads[i]->state != THREAD_STATE_WAITING)
-        {
-            // Not waiting on any resources.
-            continue;
-        }
-
-        // See if the semaphore matches any other threads waiting on it.
-        if (threads[i]->waiting_semaphore == semaphore)
-        {
-            // Yup, the other thread was waiting on this semaphore! Wake it up,
-            // and set it as not waiting for this semaphore anymore.
-            threads[i]->waiting_semaphore = 0;
-            threads[i]->state = THREAD_STATE_RUNNING;
-
-            // Now, since this was an acquire, we need to bookkeep the current
-            // semaphore.
-            semaphore->current--;
-            if (semaphore->current == 0)
-            {
-                // No more slots to acquire, exit before we wake up any
-                // additional threads.
-                break;
+                _thread_set_state(thread, THREAD_STATE_ZOMBIE);
             }
         }
     }
 }
 
-uint32_t _thread_time_elapsed()
-{
-    if (current_profile != 0)
-    {
-        return _profile_get_current(0) - current_profile;
-    }
-    else
-    {
-        return 0;
-    }
-}
-
-uint32_t _thread_wake_waiting_timer()
+uint64_t _thread_wake_waiting_timer()
 {
     // Calculate the time since we did our last adjustments.
-    uint64_t new_profile = _profile_get_current(0);
-    uint32_t time_elapsed = 0;
+    uint64_t new_profile = timer_now_ticks();
+    uint64_t time_elapsed = 0;
     if (current_profile != 0)
     {
         time_elapsed = new_profile - current_profile;
     }
     current_profile = new_profile;
 
-    if (time_elapsed == 0)
-    {
-        // Nothing to do here!
-        return 0;
-    }
-
-    for (unsigned int i = 0; i < MAX_THREADS; i++)
+    // Wake up every thread whose deadline has passed. Since the sleep queue is
+    // sorted, we can stop at the first thread that isn't due yet.
+    while (sleep_queue != 0 && sleep_queue->waiting_timer <= new_profile)
     {
-        if (threads[i] == 0)
-        {
-            // Not a real thread.
-            continue;
-        }
-
-        if (threads[i]->state != THREAD_STATE_WAITING)
-        {
-            // Not waiting on any resources.
-            continue;
-        }
-
-        if (threads[i]->waiting_timer == 0)
-        {
-            // Not waiting on a timer.
-            continue;
-        }
-
-        if (threads[i]->waiting_timer <= time_elapsed)
-        {
-            // We hit our timeout, this thread is now wakeable!
-            threads[i]->waiting_timer = 0;
-            threads[i]->state = THREAD_STATE_RUNNING;
-            _thread_enable_inversion(threads[i]);
-        }
-        else
-        {
-            // This thread hasn't hit our timeout yet.
-            threads[i]->waiting_timer -= time_elapsed;
-        }
+        // We hit our timeout, this thread is now wakeable!
+        thread_t *thread = sleep_queue;
+        _thread_sleep_remove(thread);
+        _thread_set_state(thread, THREAD_STATE_RUNNING);
+        _thread_enable_inversion(thread);
     }
 
     return time_elapsed;
 }
 
-void _thread_calc_stats(irq_state_t *current, uint32_t elapsed)
+void _thread_calc_stats(irq_state_t *current, uint64_t elapsed)
 {
     if (elapsed == 0)
     {
@@ -613,33 +1114,29 @@ void _thread_calc_stats(irq_state_t *current, uint32_t elapsed)
     // First, make sure we know the total running time.
     running_time_denominator += elapsed;
 
-    // Now, go through and find all running threads and see if its time to calculate
-    // percentages.
-    for (unsigned int i = 0; i < MAX_THREADS; i++)
+    if (current_thread->state == THREAD_STATE_RUNNING)
     {
-        if (threads[i] == 0)
-        {
-            // Not a real thread.
-            continue;
-        }
+        // We spent the last elapsed ticks on this thread.
+        current_thread->running_time += elapsed;
+        current_thread->running_time_recent += elapsed;
+    }
 
-        if (threads[i] == current_thread && threads[i]->state == THREAD_STATE_RUNNING)
+    if (running_time_denominator >= STATS_DENOMINATOR)
+    {
+        // Now, go through and find all threads and calculate percentages
+        // based on recent running time.
+        for (unsigned int i = 0; i < MAX_THREADS; i++)
         {
-            // We spent the last elapsed us on this thread.
-            threads[i]->running_time += elapsed;
-            threads[i]->running_time_recent += elapsed;
-        }
+            if (threads[i] == 0)
+            {
+                // Not a real thread.
+                continue;
+            }
 
-        if (running_time_denominator >= STATS_DENOMINATOR)
-        {
-            // Calculate CPU percentage based on recent running time.
-            threads[i]->cpu_percentage = (float)threads[i]->running_time_recent / (float)running_time_denominator;
+            threads[i]->cpu_usage = (uint32_t)((threads[i]->running_time_recent << 16) / running_time_denominator);
             threads[i]->running_time_recent = 0;
         }
-    }
 
-    if (running_time_denominator >= STATS_DENOMINATOR)
-    {
         running_time_denominator = 0;
     }
 }
@@ -649,9 +1146,18 @@ irq_state_t *_syscall_timer(irq_state_t *current, int timer)
     if (timer < 0)
     {
         // Periodic preemption timer.
-        uint32_t elapsed = _thread_wake_waiting_timer();
+        uint64_t elapsed = _thread_wake_waiting_timer();
         _thread_calc_stats(current, elapsed);
-        return _thread_schedule(current, THREAD_SCHEDULE_ANY);
+        current = _thread_schedule(current, THREAD_SCHEDULE_ANY);
+        _thread_update_preemption(current);
+        return current;
+    }
+    else if (timer > 0)
+    {
+        // A timer callback woke up a thread, so see if it should run now.
+        current = _thread_schedule(current, THREAD_SCHEDULE_ANY);
+        _thread_update_preemption(current);
+        return current;
     }
     else
     {
@@ -659,15 +1165,22 @@ irq_state_t *_syscall_timer(irq_state_t *current, int timer)
     }
 }
 
-irq_state_t *_syscall_holly(irq_state_t *current, uint32_t irq_mask)
+irq_state_t *_syscall_holly(irq_state_t *current, int woken)
 {
-    // TODO: Wake up various threads based on HOLLY interrupts here.
+    if (woken)
+    {
+        // A HOLLY interrupt woke up a thread, so see if it should run now.
+        current = _thread_schedule(current, THREAD_SCHEDULE_ANY);
+        _thread_update_preemption(current);
+    }
+
     return current;
 }
 
 irq_state_t *_syscall_trapa(irq_state_t *current, unsigned int which)
 {
     int schedule = THREAD_SCHEDULE_CURRENT;
+    TRACE_EVENT(TRACE_EVENT_SYSCALL, which, current->thread ? ((thread_t *)current->thread)->id : 0, current->gp_regs[4]);
 
     switch (which)
     {
@@ -711,7 +1224,7 @@ irq_state_t *_syscall_trapa(irq_state_t *current, unsigned int which)
             thread_t *thread = _thread_find_by_id(current->gp_regs[4]);
             if (thread && thread->state == THREAD_STATE_STOPPED)
             {
-                thread->state = THREAD_STATE_RUNNING;
+                _thread_set_state(thread, THREAD_STATE_RUNNING);
             }
 
             schedule = THREAD_SCHEDULE_ANY;
@@ -723,7 +1236,7 @@ irq_state_t *_syscall_trapa(irq_state_t *current, unsigned int which)
             thread_t *thread = _thread_find_by_id(current->gp_regs[4]);
             if (thread && thread->state == THREAD_STATE_RUNNING)
             {
-                thread->state = THREAD_STATE_STOPPED;
+                _thread_set_state(thread, THREAD_STATE_STOPPED);
             }
 
             schedule = THREAD_SCHEDULE_ANY;
@@ -744,7 +1257,7 @@ irq_state_t *_syscall_trapa(irq_state_t *current, unsigned int which)
                 {
                     priority = MIN_PRIORITY;
                 }
-                thread->priority = priority;
+                _thread_set_priority(thread, priority);
             }
 
             schedule = THREAD_SCHEDULE_ANY;
@@ -787,7 +1300,7 @@ irq_state_t *_syscall_trapa(irq_state_t *current, unsigned int which)
                         {
                             // Need to stick this thread into waiting until
                             // the other thread is finished.
-                            myself->state = THREAD_STATE_WAITING;
+                            _thread_set_state(myself, THREAD_STATE_WAITING);
                             myself->waiting_thread = other->id;
                             schedule = THREAD_SCHEDULE_OTHER;
                             break;
@@ -796,7 +1309,7 @@ irq_state_t *_syscall_trapa(irq_state_t *current, unsigned int which)
                         {
                             // Thread is already done! We can return immediately.
                             current->gp_regs[0] = (uint32_t )other->retval;
-                            other->state = THREAD_STATE_ZOMBIE;
+                            _thread_set_state(other, THREAD_STATE_ZOMBIE);
                             break;
                         }
                         case THREAD_STATE_ZOMBIE:
@@ -821,7 +1334,7 @@ irq_state_t *_syscall_trapa(irq_state_t *current, unsigned int which)
             thread_t *thread = _thread_find_by_context(current);
             if (thread)
             {
-                thread->state = THREAD_STATE_FINISHED;
+                _thread_set_state(thread, THREAD_STATE_FINISHED);
                 thread->retval = (void *)current->gp_regs[4];
             }
             else
@@ -854,8 +1367,7 @@ irq_state_t *_syscall_trapa(irq_state_t *current, unsigned int which)
                     if (thread)
                     {
                         // Semaphore is used up, park ourselves until its ready.
-                        thread->state = THREAD_STATE_WAITING;
-                        thread->waiting_semaphore = semaphore;
+                        _semaphore_park(semaphore, thread);
                         schedule = THREAD_SCHEDULE_OTHER;
                     }
                     else
@@ -884,21 +1396,26 @@ irq_state_t *_syscall_trapa(irq_state_t *current, unsigned int which)
             semaphore_internal_t *semaphore = _semaphore_find(handle, current->gp_regs[5]);
             if (semaphore)
             {
-                // Safely restore this.
-                semaphore->current += 1;
-
-                if (semaphore->current > semaphore->max)
+                if (_semaphore_handoff(semaphore))
                 {
-                    uint32_t id = handle ? handle->id : 0;
-                    char *msg = current->gp_regs[5] == SEM_TYPE_SEMAPHORE ?
-                        "attempt release unowned semaphore" :
-                        "attempt release unowned mutex";
-                    _irq_display_exception(current, msg, id);
+                    // We gave our slot directly to a waiting thread, so let the
+                    // scheduler decide whether it should run now.
+                    schedule = THREAD_SCHEDULE_ANY;
                 }
+                else
+                {
+                    // Nobody was waiting, so safely restore this.
+                    semaphore->current += 1;
 
-                // Wake up any other threads that were waiting on this thread for a join.
-                _thread_wake_waiting_semaphore(semaphore);
-                schedule = THREAD_SCHEDULE_OTHER;
+                    if (semaphore->current > semaphore->max)
+                    {
+                        uint32_t id = handle ? handle->id : 0;
+                        char *msg = current->gp_regs[5] == SEM_TYPE_SEMAPHORE ?
+                            "attempt release unowned semaphore" :
+                            "attempt release unowned mutex";
+                        _irq_display_exception(current, msg, id);
+                    }
+                }
             }
             else
             {
@@ -919,11 +1436,10 @@ irq_state_t *_syscall_trapa(irq_state_t *current, unsigned int which)
             if (thread)
             {
                 // Put the thread to sleep, waiting for the number of us requested.
-                // Adjust that number based on how close to the periodic interrupt
-                // we are, since when it fires it will not necessarily have lasted
-                // the right amount of time for this particular timer.
-                thread->state = THREAD_STATE_WAITING;
-                thread->waiting_timer = current->gp_regs[4] + _thread_time_elapsed();
+                // The deadline is absolute, so it doesn't matter how close to the
+                // periodic interrupt we are when going to sleep.
+                _thread_set_state(thread, THREAD_STATE_WAITING);
+                _thread_sleep_insert(thread, timer_now_ticks() + timer_us_to_ticks(current->gp_regs[4]));
                 schedule = THREAD_SCHEDULE_OTHER;
             }
             else
@@ -940,38 +1456,41 @@ irq_state_t *_syscall_trapa(irq_state_t *current, unsigned int which)
         }
     }
 
-    uint32_t elapsed = _thread_wake_waiting_timer();
+    uint64_t elapsed = _thread_wake_waiting_timer();
     _thread_calc_stats(current, elapsed);
-    return _thread_schedule(current, schedule);
+    current = _thread_schedule(current, schedule);
+    _thread_update_preemption(current);
+    return current;
 }
 
 void *global_counter_init(uint32_t initial_value)
 {
-    uint32_t old_interrupts = irq_disable();
+    // Create counter. We do this before disabling interrupts since the heap lock may block.
+    global_counter_t *counter = malloc(sizeof(global_counter_t));
     void *retval = 0;
 
-    for (unsigned int i = 0; i < MAX_GLOBAL_COUNTERS; i++)
-    {
-        if (global_counters[i] == 0)
-        {
-            // Create counter.
-            global_counter_t *counter = malloc(sizeof(global_counter_t));
-
-            // Set up the ID and initial value.
-            counter->id = global_counter_counter++;
-            counter->current = initial_value;
+    uint32_t old_interrupts = irq_disable();
 
-            // Put it in our registry.
-            global_counters[i] = counter;
+    int index = _handle_alloc(&global_counter_handles);
+    if (index >= 0)
+    {
+        // Set up the ID and initial value.
+        counter->id = _handle_get(&global_counter_handles, index);
+        counter->current = initial_value;
 
-            // Return it.
-            retval = (void *)counter->id;
+        // Put it in our registry.
+        global_counters[index] = counter;
 
-            break;
-        }
+        // Return it.
+        retval = (void *)counter->id;
     }
 
     irq_restore(old_interrupts);
+
+    if (retval == 0)
+    {
+        free(counter);
+    }
     return retval;
 }
 
@@ -997,67 +1516,69 @@ uint32_t global_counter_value(void *counter)
 
 void global_counter_free(void *counter)
 {
+    global_counter_t *freed = 0;
     uint32_t old_interrupts = irq_disable();
 
-    for (unsigned int i = 0; i < MAX_GLOBAL_COUNTERS; i++)
+    int index = _handle_index(&global_counter_handles, (uint32_t)counter);
+    if (index >= 0 && global_counters[index] != 0)
     {
-        if (global_counters[i] != 0 && global_counters[i]->id == (uint32_t)counter)
-        {
-            free(global_counters[i]);
-            global_counters[i] = 0;
-            break;
-        }
+        freed = global_counters[index];
+        global_counters[index] = 0;
+        _handle_release(&global_counter_handles, index);
     }
 
     irq_restore(old_interrupts);
+
+    if (freed)
+    {
+        free(freed);
+    }
 }
 
 void semaphore_init(semaphore_t *semaphore, uint32_t initial_value)
 {
+    semaphore_init_count(semaphore, initial_value, initial_value);
+}
+
+void semaphore_init_count(semaphore_t *semaphore, uint32_t max, uint32_t initial_value)
+{
+    // Create semaphore. We do this before disabling interrupts since the heap lock may block.
+    semaphore_internal_t *internal = malloc(sizeof(semaphore_internal_t));
+
     uint32_t old_interrupts = irq_disable();
 
-    if (semaphore)
+    // Enforce maximum, since we combine semaphores and mutexes.
+    if (semaphore && semaphore_count < MAX_SEMAPHORES)
     {
-        // Enforce maximum, since we combine semaphores and mutexes.
-        int sem_count = 0;
-        for (unsigned int i = 0; i < MAX_SEM_AND_MUTEX; i++)
-        {
-            if (semaphores[i] != 0 && semaphores[i]->type == SEM_TYPE_SEMAPHORE)
-            {
-                sem_count++;
-            }
-        }
-        if (sem_count >= MAX_SEMAPHORES)
-        {
-            return;
-        }
-
-        for (unsigned int i = 0; i < MAX_SEM_AND_MUTEX; i++)
+        int index = _handle_alloc(&semaphore_handles);
+        if (index >= 0)
         {
-            if (semaphores[i] == 0)
-            {
-                // Assign an ID to this semaphore. This is basically meaningless,
-                // but we might as well do something with the data passed in.
-                semaphore->id = semaphore_counter++;
-
-                // Create semaphore.
-                semaphore_internal_t *internal = malloc(sizeof(semaphore_internal_t));
-
-                // Set up the pointer and initial value.
-                internal->public = semaphore;
-                internal->type = SEM_TYPE_SEMAPHORE;
-                internal->max = initial_value;
-                internal->current = initial_value;
+            // Assign a handle to this semaphore so we can look it up directly.
+            semaphore->id = _handle_get(&semaphore_handles, index);
 
-                // Put it in our registry.
-                semaphores[i] = internal;
+            // Set up the pointer and initial value.
+            internal->public = semaphore;
+            internal->type = SEM_TYPE_SEMAPHORE;
+            internal->max = max;
+            internal->current = initial_value < max ? initial_value : max;
+            internal->irq_disabled = 0;
+            internal->waiters_head = 0;
+            internal->waiters_tail = 0;
 
-                break;
-            }
+            // Put it in our registry.
+            semaphores[index] = internal;
+            semaphore_count++;
+            internal = 0;
         }
     }
 
     irq_restore(old_interrupts);
+
+    if (internal)
+    {
+        // We didn't end up registering this.
+        free(internal);
+    }
 }
 
 void semaphore_acquire(semaphore_t * semaphore)
@@ -1074,73 +1595,108 @@ void semaphore_release(semaphore_t * semaphore)
     asm("trapa #11" : : "r" (syscall_param0), "r" (syscall_param1));
 }
 
-void semaphore_free(semaphore_t *semaphore)
+int _semaphore_release_irq(semaphore_t *semaphore)
 {
-    uint32_t old_interrupts = irq_disable();
+    // Release a semaphore from inside an interrupt handler, where we can't make a
+    // syscall. Returns nonzero if a thread was woken up, in which case the caller
+    // needs to make sure the scheduler runs before returning from the interrupt.
+    semaphore_internal_t *internal = _semaphore_find(semaphore, SEM_TYPE_SEMAPHORE);
+    if (internal == 0)
+    {
+        return 0;
+    }
 
-    if (semaphore)
+    if (_semaphore_handoff(internal))
     {
-        for (unsigned int i = 0; i < MAX_SEM_AND_MUTEX; i++)
-        {
-            if (semaphores[i] != 0 && semaphores[i]->public == semaphore && semaphores[i]->type == SEM_TYPE_SEMAPHORE)
-            {
-                free(semaphores[i]);
-                semaphores[i] = 0;
-                semaphore->id = 0;
-                break;
-            }
-        }
+        return 1;
     }
 
-    irq_restore(old_interrupts);
+    if (internal->current >= internal->max)
+    {
+        _irq_display_invariant("semaphore failure", "attempt release unowned semaphore %lu from interrupt", semaphore->id);
+    }
+    internal->current += 1;
+    return 0;
 }
 
-void mutex_init(mutex_t *mutex)
+semaphore_internal_t *_semaphore_remove(void *semaphore, unsigned int type)
 {
-    uint32_t old_interrupts = irq_disable();
-
-    if (mutex)
+    // Unregisters a semaphore or mutex, returning the internal structure so that
+    // the caller can free it once interrupts are enabled again.
+    semaphore_internal_t *internal = _semaphore_find(semaphore, type);
+    if (internal)
     {
-        // Enforce maximum, since we combine semaphores and mutexes.
-        int mut_count = 0;
-        for (unsigned int i = 0; i < MAX_SEM_AND_MUTEX; i++)
+        int index = ((semaphore_t *)semaphore)->id & HANDLE_INDEX_MASK;
+
+        _semaphore_detach_waiters(internal);
+        semaphores[index] = 0;
+        _handle_release(&semaphore_handles, index);
+        ((semaphore_t *)semaphore)->id = 0;
+
+        if (type == SEM_TYPE_SEMAPHORE)
         {
-            if (semaphores[i] != 0 && semaphores[i]->type == SEM_TYPE_MUTEX)
-            {
-                mut_count++;
-            }
+            semaphore_count--;
         }
-        if (mut_count >= MAX_MUTEXES)
+        else
         {
-            return;
+            mutex_count--;
         }
+    }
 
-        for (unsigned int i = 0; i < MAX_SEM_AND_MUTEX; i++)
-        {
-            if (semaphores[i] == 0)
-            {
-                // Assign an ID to this mutex. This is basically meaningless,
-                // but we might as well do something with the data passed in.
-                mutex->id = mutex_counter++;
+    return internal;
+}
 
-                // Create semaphore.
-                semaphore_internal_t *internal = malloc(sizeof(semaphore_internal_t));
+void semaphore_free(semaphore_t *semaphore)
+{
+    uint32_t old_interrupts = irq_disable();
+    semaphore_internal_t *internal = _semaphore_remove(semaphore, SEM_TYPE_SEMAPHORE);
+    irq_restore(old_interrupts);
 
-                // Set up the pointer and initial value.
-                internal->public = mutex;
-                internal->type = SEM_TYPE_MUTEX;
-                internal->max = 1;
-                internal->current = 1;
+    if (internal)
+    {
+        free(internal);
+    }
+}
 
-                // Put it in our registry.
-                semaphores[i] = internal;
+void mutex_init(mutex_t *mutex)
+{
+    // Create semaphore. We do this before disabling interrupts since the heap lock may block.
+    semaphore_internal_t *internal = malloc(sizeof(semaphore_internal_t));
 
-                break;
-            }
+    uint32_t old_interrupts = irq_disable();
+
+    // Enforce maximum, since we combine semaphores and mutexes.
+    if (mutex && mutex_count < MAX_MUTEXES)
+    {
+        int index = _handle_alloc(&semaphore_handles);
+        if (index >= 0)
+        {
+            // Assign a handle to this mutex so we can look it up directly.
+            mutex->id = _handle_get(&semaphore_handles, index);
+
+            // Set up the pointer and initial value.
+            internal->public = mutex;
+            internal->type = SEM_TYPE_MUTEX;
+            internal->max = 1;
+            internal->current = 1;
+            internal->irq_disabled = 0;
+            internal->waiters_head = 0;
+            internal->waiters_tail = 0;
+
+            // Put it in our registry.
+            semaphores[index] = internal;
+            mutex_count++;
+            internal = 0;
         }
     }
 
     irq_restore(old_interrupts);
+
+    if (internal)
+    {
+        // We didn't end up registering this.
+        free(internal);
+    }
 }
 
 int mutex_try_lock(mutex_t *mutex)
@@ -1149,27 +1705,17 @@ int mutex_try_lock(mutex_t *mutex)
     uint32_t old_interrupts = irq_disable();
     int acquired = 0;
 
-    if (mutex)
+    semaphore_internal_t *internal = _semaphore_find(mutex, SEM_TYPE_MUTEX);
+    if (internal && internal->current > 0)
     {
-        for (unsigned int i = 0; i < MAX_SEM_AND_MUTEX; i++)
-        {
-            if (semaphores[i] != 0 && semaphores[i]->public == mutex && semaphores[i]->type == SEM_TYPE_MUTEX)
-            {
-                // This is the right mutex. See if we can acquire it.
-                if (semaphores[i]->current > 0)
-                {
-                    acquired = 1;
-                    semaphores[i]->current --;
-
-                    // Keep track of whether this was acquired with interrupts disabled or not.
-                    // This is because if it was, the subsequent unlock must be done without
-                    // syscalls as well.
-                    semaphores[i]->irq_disabled = _irq_was_disabled(old_interrupts);
-                }
-
-                break;
-            }
-        }
+        // This is the right mutex and we can acquire it.
+        acquired = 1;
+        internal->current --;
+
+        // Keep track of whether this was acquired with interrupts disabled or not.
+        // This is because if it was, the subsequent unlock must be done without
+        // syscalls as well.
+        internal->irq_disabled = _irq_was_disabled(old_interrupts);
     }
 
     irq_restore(old_interrupts);
@@ -1190,20 +1736,15 @@ void mutex_unlock(mutex_t * mutex)
     // have gotten to the mutex as threads were disabled.
     uint32_t old_interrupts = irq_disable();
 
-    if (mutex)
+    semaphore_internal_t *internal = _semaphore_find(mutex, SEM_TYPE_MUTEX);
+    if (internal && internal->irq_disabled)
     {
-        for (unsigned int i = 0; i < MAX_SEM_AND_MUTEX; i++)
-        {
-            if (semaphores[i] != 0 && semaphores[i]->public == mutex && semaphores[i]->type == SEM_TYPE_MUTEX && semaphores[i]->irq_disabled)
-            {
-                // Unlock the mutex, exit without doing a syscall.
-                semaphores[i]->current ++;
-                semaphores[i]->irq_disabled = 0;
+        // Unlock the mutex, exit without doing a syscall.
+        internal->current ++;
+        internal->irq_disabled = 0;
 
-                irq_restore(old_interrupts);
-                return;
-            }
-        }
+        irq_restore(old_interrupts);
+        return;
     }
 
     // This was locked normally, unlock using a syscall to wake any other threads.
@@ -1216,22 +1757,13 @@ void mutex_unlock(mutex_t * mutex)
 void mutex_free(mutex_t *mutex)
 {
     uint32_t old_interrupts = irq_disable();
+    semaphore_internal_t *internal = _semaphore_remove(mutex, SEM_TYPE_MUTEX);
+    irq_restore(old_interrupts);
 
-    if (mutex)
+    if (internal)
     {
-        for (unsigned int i = 0; i < MAX_SEM_AND_MUTEX; i++)
-        {
-            if (semaphores[i] != 0 && semaphores[i]->public == mutex && semaphores[i]->type == SEM_TYPE_MUTEX)
-            {
-                free(semaphores[i]);
-                semaphores[i] = 0;
-                mutex->id = 0;
-                break;
-            }
-        }
+        free(internal);
     }
-
-    irq_restore(old_interrupts);
 }
 
 typedef struct
@@ -1260,8 +1792,32 @@ void * _thread_run(void *param)
 
 uint32_t thread_create(char *name, thread_func_t function, void *param)
 {
+    return thread_create_ex(name, function, param, THREAD_STACK_SIZE);
+}
+
+uint32_t thread_create_ex(char *name, thread_func_t function, void *param, uint32_t stack_size)
+{
+    if (stack_size < THREAD_MIN_STACK_SIZE)
+    {
+        stack_size = THREAD_MIN_STACK_SIZE;
+    }
+
+    // Grab a stack first, so we don't have to undo thread creation if we're out of memory.
+    uint8_t *stack = _thread_stack_alloc(&stack_size);
+    if (stack == 0)
+    {
+        // Out of memory.
+        return 0;
+    }
+
     // Create a new thread.
     thread_t *thread = _thread_create(name, 0);
+    if (thread == 0)
+    {
+        // Out of thread slots.
+        _thread_stack_release(stack, stack_size);
+        return 0;
+    }
 
     // Create a thread run context so we can return from the thread.
     thread_run_ctx_t *ctx = malloc(sizeof(thread_run_ctx_t));
@@ -1269,8 +1825,10 @@ uint32_t thread_create(char *name, thread_func_t function, void *param)
     ctx->param = param;
 
     // Set up the thread to be runnable.
-    thread->stack = malloc(THREAD_STACK_SIZE);
-    thread->context = _irq_new_state(_thread_run, ctx, thread->stack + THREAD_STACK_SIZE);
+    thread->stack = stack;
+    thread->stack_size = stack_size;
+    thread->context = _irq_new_state(_thread_run, ctx, thread->stack + thread->stack_size);
+    thread->context->thread = thread;
 
     // Return the thread ID.
     return thread->id;
@@ -1278,19 +1836,25 @@ uint32_t thread_create(char *name, thread_func_t function, void *param)
 
 void thread_destroy(uint32_t tid)
 {
+    thread_t *thread = 0;
     uint32_t old_interrupts = irq_disable();
 
-    for (unsigned int i = 0; i < MAX_THREADS; i++)
+    int index = _handle_index(&thread_handles, tid);
+    if (index >= 0 && threads[index] != 0)
     {
-        if (threads[i] != 0 && threads[i]->id == tid)
-        {
-            _thread_destroy(threads[i]);
-            threads[i] = 0;
-            break;
-        }
+        thread = threads[index];
+        _thread_unlink(thread);
+        threads[index] = 0;
+        _handle_release(&thread_handles, index);
     }
 
     irq_restore(old_interrupts);
+
+    // Now that nothing can reach the thread, give back its memory.
+    if (thread)
+    {
+        _thread_destroy(thread);
+    }
 }
 
 void thread_start(uint32_t tid)
@@ -1316,6 +1880,7 @@ thread_info_t thread_info(uint32_t tid)
 {
     thread_info_t info;
     memset(&info, 0, sizeof(thread_info_t));
+    uint32_t cpu_usage = 0;
 
     uint32_t old_interrupts = irq_disable();
     thread_t *thread = _thread_find_by_id(tid);
@@ -1341,15 +1906,35 @@ thread_info_t thread_info(uint32_t tid)
         info.running = thread->state == THREAD_STATE_RUNNING ? 1 : 0;
 
         // CPU stats.
-        info.running_time = thread->running_time;
-        info.cpu_percentage = thread->cpu_percentage;
+        info.running_time = timer_ticks_to_us(thread->running_time);
+        cpu_usage = thread->cpu_usage;
+
+        // Stack stats.
+        info.stack_size = thread->stack_size;
+        info.stack_used = _thread_stack_used(thread);
     }
 
     irq_restore(old_interrupts);
 
+    // Only convert to floating point now that interrupts are back on, since this thread
+    // might not own the FPU.
+    info.cpu_percentage = (float)cpu_usage / 65536.0f;
+
     return info;
 }
 
+void thread_set_tickless(int enabled)
+{
+    uint32_t old_interrupts = irq_disable();
+
+    // Start out with a periodic tick either way. If we're going tickless, the next
+    // preemption interrupt will reprogram the timer to only fire when needed.
+    tickless = enabled ? 1 : 0;
+    _preempt_request(MICROSECONDS_IN_ONE_SECOND / PREEMPTION_HZ);
+
+    irq_restore(old_interrupts);
+}
+
 void thread_yield()
 {
     asm("trapa #3");
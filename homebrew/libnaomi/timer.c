@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include "naomi/timer.h"
 #include "naomi/interrupt.h"
@@ -35,21 +36,31 @@ static unsigned int __tcr[MAX_HW_TIMERS] = {TCR0_OFFSET, TCR1_OFFSET, TCR2_OFFSE
 
 #define TIMER_TCPR2 *((volatile uint32_t *)(TIMER_BASE_ADDRESS + TCPR2_OFFSET))
 
+// Bits in TCR for the prescaler, underflow interrupt enable and underflow status.
+#define TIMER_TCR_PRESCALE_4 0x0
+#define TIMER_TCR_PRESCALE_64 0x2
+#define TIMER_TCR_UNIE 0x20
+#define TIMER_TCR_UNF 0x100
+
 // A timer callback (will happen in interrupt context).
 typedef int (*timer_callback_t)(int timer);
 
-static uint32_t reset_values[MAX_HW_TIMERS];
 static uint32_t timers_used[MAX_HW_TIMERS];
 static timer_callback_t timer_callbacks[MAX_HW_TIMERS];
 
+void _clock_init();
+void _clock_free();
 void _profile_init();
 void _profile_free();
 void _preempt_init();
 void _preempt_free();
 void _user_timer_init();
 void _user_timer_free();
+void _soft_timer_init();
+void _soft_timer_free();
 int _timer_available();
 int _timer_start(int timer, uint32_t microseconds, timer_callback_t callback);
+int _timer_start_ticks(int timer, uint32_t ticks, uint16_t prescaler, timer_callback_t callback);
 int _timer_stop(int timer);
 
 void _timer_init()
@@ -60,12 +71,14 @@ void _timer_init()
 
     for (int i = 0; i < MAX_HW_TIMERS; i++)
     {
-        reset_values[i] = 0;
         timers_used[i] = 0;
         timer_callbacks[i] = 0;
     }
 
-    // Schedule the profiler timer.
+    // Start the free-running monotonic clock, everything else is based on this.
+    _clock_init();
+
+    // Initialize the profilers.
     _profile_init();
 
     // Schedule the periodic preemption timer.
@@ -73,10 +86,16 @@ void _timer_init()
 
     // Initialize user timers.
     _user_timer_init();
+
+    // Claim the hardware timer that drives software timers.
+    _soft_timer_init();
 }
 
 void _timer_free()
 {
+    // Kill software timers.
+    _soft_timer_free();
+
     // Kill user timers.
     _user_timer_free();
 
@@ -86,12 +105,14 @@ void _timer_free()
     // Kill the profiler.
     _profile_free();
 
+    // Kill the monotonic clock.
+    _clock_free();
+
     /* Disable all timers again */
     TIMER_TSTR = 0;
 
     for (int i = 0; i < MAX_HW_TIMERS; i++)
     {
-        reset_values[i] = 0;
         timers_used[i] = 0;
         timer_callbacks[i] = 0;
     }
@@ -102,7 +123,7 @@ int _timer_interrupt(int timer)
     if (timer_callbacks[timer] != 0)
     {
         // Clear the underflow itself.
-        TIMER_TCR(timer) &= ~0x100;
+        TIMER_TCR(timer) &= ~TIMER_TCR_UNF;
 
         // Call the callback.
         return timer_callbacks[timer](timer);
@@ -135,6 +156,32 @@ void _preempt_init()
     irq_restore(old_interrupts);
 }
 
+void _preempt_request(uint32_t microseconds)
+{
+    uint32_t old_interrupts = irq_disable();
+
+    if (preempt_timer >= 0 && preempt_timer < MAX_HW_TIMERS)
+    {
+        // Stop the timer and clear any underflow so that we don't get a stale interrupt.
+        TIMER_TSTR &= ~(1 << preempt_timer);
+        TIMER_TCR(preempt_timer) &= ~TIMER_TCR_UNF;
+
+        if (microseconds > 0)
+        {
+            // The timer counts at peripheral clock / 64, which is 25/32 of a tick per
+            // microsecond. Round up so that we never fire before the requested time.
+            // Since the reset value is the same, if nobody reprograms us this keeps
+            // firing at the same rate.
+            uint32_t rate = (uint32_t)((((uint64_t)microseconds * 25) + 31) / 32);
+            TIMER_TCNT(preempt_timer) = rate;
+            TIMER_TCOR(preempt_timer) = rate;
+            TIMER_TSTR |= (1 << preempt_timer);
+        }
+    }
+
+    irq_restore(old_interrupts);
+}
+
 void _preempt_free()
 {
     if (preempt_timer >= 0 && preempt_timer < MAX_HW_TIMERS)
@@ -146,6 +193,12 @@ void _preempt_free()
 }
 
 int _timer_start(int timer, uint32_t microseconds, timer_callback_t callback)
+{
+    // The timer counts at peripheral clock / 64, which is 25/32 of a tick per microsecond.
+    return _timer_start_ticks(timer, (uint32_t)(((uint64_t)microseconds * 25) / 32), TIMER_TCR_PRESCALE_64, callback);
+}
+
+int _timer_start_ticks(int timer, uint32_t ticks, uint16_t prescaler, timer_callback_t callback)
 {
     // Make sure we only ever check timers used without somebody else maybe calling us.
     uint32_t old_interrupts = irq_disable();
@@ -158,28 +211,23 @@ int _timer_start(int timer, uint32_t microseconds, timer_callback_t callback)
         return -1;
     }
 
-    /* Calculate microsecond rate based on peripheral clock divided by 64.
-     * According to online docs the DC and the Naomi have the same clock
-     * speed so the calculation from KallistiOS should work here. */
-    uint32_t rate = (uint32_t)((double)(50000000) * ((double)microseconds / (double)64000000));
-    reset_values[timer] = microseconds;
     timers_used[timer] = 1;
 
-    /* Count on peripheral clock / 64, no interrupt support for now */
+    /* Count on the requested peripheral clock division, with interrupts if we have a callback. */
     if (callback == 0)
     {
-        TIMER_TCR(timer) = 0x2;
+        TIMER_TCR(timer) = prescaler;
         timer_callbacks[timer] = 0;
     }
     else
     {
-        TIMER_TCR(timer) = 0x22;
+        TIMER_TCR(timer) = prescaler | TIMER_TCR_UNIE;
         timer_callbacks[timer] = callback;
     }
 
     /* Initialize the initial count */
-    TIMER_TCNT(timer) = rate;
-    TIMER_TCOR(timer) = rate;
+    TIMER_TCNT(timer) = ticks;
+    TIMER_TCOR(timer) = ticks;
 
     /* Start the timer */
     TIMER_TSTR |= (1 << timer);
@@ -205,10 +253,9 @@ int _timer_stop(int timer)
     TIMER_TSTR &= ~(1 << timer);
 
     /* Clear the underflow value */
-    TIMER_TCR(timer) &= ~0x100;
+    TIMER_TCR(timer) &= ~TIMER_TCR_UNF;
 
     // Clear our bookkeeping.
-    reset_values[timer] = 0;
     timers_used[timer] = 0;
     timer_callbacks[timer] = 0;
 
@@ -218,49 +265,6 @@ int _timer_stop(int timer)
     return 0;
 }
 
-uint32_t _timer_left(int timer)
-{
-    // Make sure to safely check timers used.
-    uint32_t old_interrupts = irq_disable();
-
-    /* Shouldn't be an issue but lets be cautious. */
-    if (timer < 0 || timer >= MAX_HW_TIMERS || (!timers_used[timer])) {
-        irq_restore(old_interrupts);
-        return 0;
-    }
-
-    if (TIMER_TCR(timer) & 0x100) {
-        /* Timer expired, no time left */
-        irq_restore(old_interrupts);
-        return 0;
-    }
-
-    /* Grab the value, convert back to microseconds. */
-    uint32_t current = TIMER_TCNT(timer);
-
-    // Safely restore interrupts and return the value.
-    irq_restore(old_interrupts);
-    return (uint32_t)(((double)current / (double)50000000) * (double)64000000);
-}
-
-uint32_t _timer_elapsed(int timer)
-{
-    // Make sure to safely check timers used.
-    uint32_t old_interrupts = irq_disable();
-
-    /* Shouldn't be an issue but lets be cautious. */
-    if (timer < 0 || timer >= MAX_HW_TIMERS || (!timers_used[timer])) {
-        irq_restore(old_interrupts);
-        return 0;
-    }
-
-    // Grab elapsed time, restore interrupts.
-    uint32_t elapsed = reset_values[timer] - _timer_left(timer);
-    irq_restore(old_interrupts);
-
-    return elapsed;
-}
-
 int _timer_available()
 {
     int timer = -1;
@@ -285,63 +289,126 @@ int _timer_available()
     return timer;
 }
 
-// Maximum number of microseconds a timer can be set to before an interrupt
-// occurs to reset it. Higher numbers equal fewer interrupts but less accuracy.
-#define MAX_PROFILE_MICROSECONDS MICROSECONDS_IN_ONE_SECOND
-
-static uint64_t profile_timers[MAX_PROFILERS];
-static uint64_t profile_current;
-static int profile_timer = -1;
+// The monotonic clock runs on its own timer at peripheral clock / 4, counting down through
+// the full 32-bit range. That gives us 80ns resolution and an underflow interrupt only
+// every few minutes, which we count to extend the clock to 64 bits.
+static uint32_t clock_wraps;
+static int clock_timer = -1;
 
-int _profile_cb(int timer)
+int _clock_cb(int timer)
 {
-    profile_current += MAX_PROFILE_MICROSECONDS;
+    clock_wraps++;
 
     // Inform the scheduler that this was a regular callback.
     return 0;
 }
 
-void _profile_init()
+void _clock_init()
 {
     // Make sure that we safely ask for a new timer.
     uint32_t old_interrupts = irq_disable();
 
-    memset(profile_timers, 0, sizeof(uint64_t) * MAX_PROFILERS);
-    profile_current = 0;
-    profile_timer = _timer_available();
-    if (profile_timer >= 0 && profile_timer < MAX_HW_TIMERS)
+    clock_wraps = 0;
+    clock_timer = _timer_available();
+    if (clock_timer >= 0 && clock_timer < MAX_HW_TIMERS)
     {
-        _timer_start(profile_timer, MAX_PROFILE_MICROSECONDS, _profile_cb);
+        _timer_start_ticks(clock_timer, 0xFFFFFFFF, TIMER_TCR_PRESCALE_4, _clock_cb);
     }
 
     // Enable interrupts again now that we're done.
     irq_restore(old_interrupts);
 }
 
-void _profile_free()
+void _clock_free()
 {
-    if (profile_timer >= 0 && profile_timer < MAX_HW_TIMERS)
+    if (clock_timer >= 0 && clock_timer < MAX_HW_TIMERS)
     {
-        _timer_stop(profile_timer);
+        _timer_stop(clock_timer);
     }
 
-    memset(profile_timers, 0, sizeof(uint64_t) * MAX_PROFILERS);
-    profile_current = 0;
-    profile_timer = -1;
+    clock_wraps = 0;
+    clock_timer = -1;
 }
 
-uint64_t _profile_get_current(uint32_t adjustments)
+uint64_t timer_now_ticks()
 {
     uint32_t old_interrupts = irq_disable();
-    uint64_t amount = 0;
+    uint64_t ticks = 0;
 
-    if (profile_timer >= 0 && profile_timer < MAX_HW_TIMERS)
+    if (clock_timer >= 0 && clock_timer < MAX_HW_TIMERS)
     {
-        amount = profile_current + _timer_elapsed(profile_timer) + (adjustments * MAX_PROFILE_MICROSECONDS);
+        uint32_t wraps = clock_wraps;
+        uint32_t count = TIMER_TCNT(clock_timer);
+
+        if (TIMER_TCR(clock_timer) & TIMER_TCR_UNF)
+        {
+            // The counter underflowed but the interrupt hasn't counted it yet, either
+            // because interrupts are disabled or because we're racing it. The count
+            // we read may be from before or after the underflow, but if we read it
+            // again now it is definitely after.
+            count = TIMER_TCNT(clock_timer);
+            wraps++;
+        }
+
+        ticks = (((uint64_t)wraps) << 32) | (0xFFFFFFFF - count);
     }
 
     irq_restore(old_interrupts);
-    return amount;
+    return ticks;
+}
+
+uint64_t timer_ticks_to_ns(uint64_t ticks)
+{
+    return ticks * (1000000000 / TIMER_TICKS_PER_SECOND);
+}
+
+uint64_t timer_ticks_to_us(uint64_t ticks)
+{
+    // There are 12.5 ticks per microsecond, so we need ticks * 2 / 25. A 64-bit division
+    // is a slow libgcc call, so instead fold the high word down using the fact that
+    // 2^32 = (25 * 171798691) + 21 until what's left fits in 32 bits, and then divide
+    // that by 25 with a multiply by the reciprocal.
+    uint64_t value = ticks * 2;
+    uint64_t quotient = 0;
+
+    while (value >> 32)
+    {
+        uint32_t high = value >> 32;
+        uint32_t low = value;
+        quotient += (uint64_t)high * 171798691;
+        value = ((uint64_t)high * 21) + low;
+    }
+
+    return quotient + ((((uint64_t)((uint32_t)value)) * 0x51EB851F) >> 35);
+}
+
+uint64_t timer_us_to_ticks(uint64_t microseconds)
+{
+    return (microseconds * 25) / 2;
+}
+
+uint64_t timer_now_ns()
+{
+    return timer_ticks_to_ns(timer_now_ticks());
+}
+
+uint64_t timer_now_us()
+{
+    return timer_ticks_to_us(timer_now_ticks());
+}
+
+static uint64_t profile_timers[MAX_PROFILERS];
+
+void _profile_init()
+{
+    uint32_t old_interrupts = irq_disable();
+    memset(profile_timers, 0, sizeof(uint64_t) * MAX_PROFILERS);
+    irq_restore(old_interrupts);
+}
+
+void _profile_free()
+{
+    memset(profile_timers, 0, sizeof(uint64_t) * MAX_PROFILERS);
 }
 
 int profile_start()
@@ -349,13 +416,14 @@ int profile_start()
     uint32_t old_interrupts = irq_disable();
     int profile_slot = -1;
 
-    if (profile_timer >= 0 && profile_timer < MAX_HW_TIMERS)
+    if (clock_timer >= 0 && clock_timer < MAX_HW_TIMERS)
     {
         for (int slot = 0; slot < MAX_PROFILERS; slot++)
         {
             if (profile_timers[slot] == 0)
             {
-                profile_timers[slot] = _profile_get_current(0);
+                // Zero marks a free slot, so make sure we never store it.
+                profile_timers[slot] = timer_now_ticks() | 1;
                 profile_slot = slot;
                 break;
             }
@@ -373,80 +441,51 @@ uint64_t profile_end(int profile)
 
     if (profile >= 0 && profile < MAX_PROFILERS && profile_timers[profile] != 0)
     {
-        elapsed = _profile_get_current(0) - profile_timers[profile];
+        uint64_t now = timer_now_ticks();
+        elapsed = now > profile_timers[profile] ? now - profile_timers[profile] : 0;
         profile_timers[profile] = 0;
     }
 
     // Safe to re-enable interrupts now.
     irq_restore(old_interrupts);
-    return elapsed;
+    return timer_ticks_to_us(elapsed);
 }
 
 void timer_wait(uint32_t microseconds)
 {
-    // First, figure out if interrupts are disabled (have to manually increment
-    // the profiler in this case).
-    uint32_t old_interrupts = irq_disable();
-    unsigned int irq_disabled = _irq_was_disabled(old_interrupts);
-    int timer = profile_timer;
-    irq_restore(old_interrupts);
-
-    // Now, wait until the profile timer has passed our elapsed microseconds.
-    if (timer >= 0 && timer < MAX_HW_TIMERS)
+    // The monotonic clock works the same whether interrupts are enabled or not,
+    // so we can just spin on it.
+    if (clock_timer >= 0 && clock_timer < MAX_HW_TIMERS)
     {
-        // We base this busyloop wait on the profile timer.
-        uint64_t old_value = _profile_get_current(0);
-        uint32_t adjustments = 0;
-
-        while ((_profile_get_current(adjustments) - old_value) < microseconds)
-        {
-            if (irq_disabled && (TIMER_TCR(timer) & 0x100))
-            {
-                // This should not clear any pending interrupts for the timer, so
-                // we don't adjust the profiler timer itself as it will make an
-                // adjustment to its own counter inside the profile interrupt handler
-                // callback.
-                TIMER_TCR(timer) &= ~0x100;
-                adjustments++;
-            }
-        }
-
-        // Its possible that the profiler would miss an interrupt if we had interrupts
-        // disabled and waited for a REALLY long time. So, fix that here.
-        if (adjustments > 1)
-        {
-            profile_current += ((adjustments - 1) * MAX_PROFILE_MICROSECONDS);
-        }
+        uint64_t deadline = timer_now_ticks() + timer_us_to_ticks(microseconds);
+        while (timer_now_ticks() < deadline) { ; }
     }
 }
 
 typedef struct
 {
     unsigned int handle;
-    unsigned int irq_disabled;
-    unsigned int adjustments;
     uint32_t microseconds;
-    uint64_t profile_start;
-} timer_t;
+    uint64_t start;
+} user_timer_t;
 
-static timer_t timers[MAX_TIMERS];
+static user_timer_t timers[MAX_TIMERS];
 static unsigned int timer_counter = 1;
 
 void _user_timer_init()
 {
     timer_counter = 1;
-    memset(timers, 0, sizeof(timer_t) * MAX_TIMERS);
+    memset(timers, 0, sizeof(user_timer_t) * MAX_TIMERS);
 }
 
 void _user_timer_free()
 {
-    memset(timers, 0, sizeof(timer_t) * MAX_TIMERS);
+    memset(timers, 0, sizeof(user_timer_t) * MAX_TIMERS);
 }
 
 int timer_start(uint32_t microseconds)
 {
     uint32_t old_interrupts = irq_disable();
-    unsigned int irq_disabled = _irq_was_disabled(old_interrupts);
     int timer = -1;
 
     for (unsigned int i = 0; i < MAX_TIMERS; i++)
@@ -456,9 +495,7 @@ int timer_start(uint32_t microseconds)
             // Found a timer!
             timer = timer_counter++;
             timers[i].handle = timer;
-            timers[i].profile_start = _profile_get_current(0);
-            timers[i].adjustments = 0;
-            timers[i].irq_disabled = irq_disabled;
+            timers[i].start = timer_now_ticks();
             timers[i].microseconds = microseconds;
             break;
         }
@@ -480,9 +517,7 @@ void timer_stop(int timer)
             {
                 // Found the previously allocated timer.
                 timers[i].handle = 0;
-                timers[i].profile_start = 0;
-                timers[i].adjustments = 0;
-                timers[i].irq_disabled = 0;
+                timers[i].start = 0;
                 timers[i].microseconds = 0;
                 break;
             }
@@ -506,30 +541,9 @@ uint32_t _timer_elapsed_or_left(int timer, int which)
         {
             if (timers[i].handle == timer)
             {
-                // Found the previously allocated timer.
-                if (timers[i].irq_disabled && (TIMER_TCR(timer) & 0x100))
-                {
-                    // This should not clear any pending interrupts for the timer, so
-                    // we don't adjust the profiler timer itself as it will make an
-                    // adjustment to its own counter inside the profile interrupt handler
-                    // callback. Note, however, that if you wait a very long time (more
-                    // than a second) between two calls to timer_left or timer_elapsed
-                    // and you are running with interrupts disabled, the return values for
-                    // timer_left and timer_elapsed could be wrong (we don't know how many
-                    // adjustments to add here, since we don't know how many overflows occured).
-                    // It is not recommended to run for that amount of time without interrupts,
-                    // however, as many other things in the system will break, such as the
-                    // profile timer.
-                    TIMER_TCR(timer) &= ~0x100;
-                    timers[i].adjustments++;
-                }
-
-                // Calculate actual delta.
-                calculated = _profile_get_current(timers[i].adjustments) - timers[i].profile_start;
-                if (calculated > timers[i].microseconds)
-                {
-                    calculated = timers[i].microseconds;
-                }
+                // Found the previously allocated timer, calculate the actual delta.
+                uint64_t elapsed = timer_ticks_to_us(timer_now_ticks() - timers[i].start);
+                calculated = elapsed > timers[i].microseconds ? timers[i].microseconds : elapsed;
 
                 // Flip it if we are requested to.
                 if (which == CALCULATE_LEFT)
@@ -553,3 +567,520 @@ uint32_t timer_elapsed(int timer)
 {
     return _timer_elapsed_or_left(timer, CALCULATE_ELAPSED);
 }
+
+struct soft_timer
+{
+    soft_timer_func_t func;
+    void *param;
+    int context;
+
+    // Absolute deadline and period in monotonic clock ticks. A period of zero
+    // means that this is a one-shot timer.
+    uint64_t deadline;
+    uint64_t period;
+
+    // Position in the deadline heap, or -1 when the timer isn't armed.
+    int heap_index;
+
+    // Link in the list of deferred callbacks waiting for the service thread.
+    int pending;
+    struct soft_timer *pending_next;
+};
+
+// Software timers live in a binary min-heap ordered by deadline, and the hardware
+// timer is always programmed to fire at the earliest one. The heap array is only
+// ever grown from thread context when a timer is created, so that arming a timer
+// never needs to allocate.
+static int soft_timer_hw = -1;
+static soft_timer_t **soft_timer_heap = 0;
+static unsigned int soft_timer_heap_size = 0;
+static unsigned int soft_timer_heap_capacity = 0;
+static unsigned int soft_timer_count = 0;
+
+// Deferred callbacks are handed off to a service thread, which is only created
+// the first time somebody asks for a deferred timer.
+static uint32_t soft_timer_thread = 0;
+static semaphore_t soft_timer_signal;
+static int soft_timer_signalled = 0;
+static soft_timer_t *soft_timer_pending_head = 0;
+static soft_timer_t *soft_timer_pending_tail = 0;
+static soft_timer_t *soft_timer_running = 0;
+
+int _soft_timer_cb(int timer);
+
+void _soft_timer_init()
+{
+    uint32_t old_interrupts = irq_disable();
+
+    soft_timer_heap = 0;
+    soft_timer_heap_size = 0;
+    soft_timer_heap_capacity = 0;
+    soft_timer_count = 0;
+    soft_timer_thread = 0;
+    soft_timer_signalled = 0;
+    soft_timer_pending_head = 0;
+    soft_timer_pending_tail = 0;
+    soft_timer_running = 0;
+
+    // Claim the channel, but leave it stopped until a timer is armed.
+    soft_timer_hw = _timer_available();
+    if (soft_timer_hw >= 0 && soft_timer_hw < MAX_HW_TIMERS)
+    {
+        _timer_start_ticks(soft_timer_hw, 0xFFFFFFFF, TIMER_TCR_PRESCALE_4, _soft_timer_cb);
+        TIMER_TSTR &= ~(1 << soft_timer_hw);
+    }
+
+    irq_restore(old_interrupts);
+}
+
+void _soft_timer_free()
+{
+    if (soft_timer_hw >= 0 && soft_timer_hw < MAX_HW_TIMERS)
+    {
+        _timer_stop(soft_timer_hw);
+    }
+    soft_timer_hw = -1;
+
+    // The service thread and its semaphore were already cleaned up along with
+    // every other thread. Timers themselves belong to their creators.
+    if (soft_timer_heap)
+    {
+        free(soft_timer_heap);
+    }
+    soft_timer_heap = 0;
+    soft_timer_heap_size = 0;
+    soft_timer_heap_capacity = 0;
+    soft_timer_count = 0;
+    soft_timer_thread = 0;
+    soft_timer_pending_head = 0;
+    soft_timer_pending_tail = 0;
+    soft_timer_running = 0;
+}
+
+void _soft_timer_heap_swap(unsigned int a, unsigned int b)
+{
+    soft_timer_t *timer = soft_timer_heap[a];
+    soft_timer_heap[a] = soft_timer_heap[b];
+    soft_timer_heap[b] = timer;
+    soft_timer_heap[a]->heap_index = a;
+    soft_timer_heap[b]->heap_index = b;
+}
+
+void _soft_timer_heap_up(unsigned int index)
+{
+    while (index > 0)
+    {
+        unsigned int parent = (index - 1) / 2;
+        if (soft_timer_heap[parent]->deadline <= soft_timer_heap[index]->deadline)
+        {
+            break;
+        }
+
+        _soft_timer_heap_swap(parent, index);
+        index = parent;
+    }
+}
+
+void _soft_timer_heap_down(unsigned int index)
+{
+    while (1)
+    {
+        unsigned int smallest = index;
+        unsigned int left = (index * 2) + 1;
+        unsigned int right = left + 1;
+
+        if (left < soft_timer_heap_size && soft_timer_heap[left]->deadline < soft_timer_heap[smallest]->deadline)
+        {
+            smallest = left;
+        }
+        if (right < soft_timer_heap_size && soft_timer_heap[right]->deadline < soft_timer_heap[smallest]->deadline)
+        {
+            smallest = right;
+        }
+        if (smallest == index)
+        {
+            break;
+        }
+
+        _soft_timer_heap_swap(smallest, index);
+        index = smallest;
+    }
+}
+
+void _soft_timer_heap_insert(soft_timer_t *timer)
+{
+    // There is always room, since the heap is grown to fit every timer on creation.
+    timer->heap_index = soft_timer_heap_size;
+    soft_timer_heap[soft_timer_heap_size++] = timer;
+    _soft_timer_heap_up(timer->heap_index);
+}
+
+void _soft_timer_heap_remove(soft_timer_t *timer)
+{
+    if (timer->heap_index < 0)
+    {
+        // Not armed.
+        return;
+    }
+
+    unsigned int index = timer->heap_index;
+    unsigned int last = soft_timer_heap_size - 1;
+    if (index != last)
+    {
+        _soft_timer_heap_swap(index, last);
+    }
+    soft_timer_heap_size--;
+    timer->heap_index = -1;
+
+    // Whatever we moved into the hole might need to go either way.
+    if (index < soft_timer_heap_size)
+    {
+        soft_timer_t *moved = soft_timer_heap[index];
+        _soft_timer_heap_up(index);
+        _soft_timer_heap_down(moved->heap_index);
+    }
+}
+
+void _soft_timer_pending_remove(soft_timer_t *timer)
+{
+    if (!timer->pending)
+    {
+        return;
+    }
+
+    soft_timer_t *prev = 0;
+    soft_timer_t *cur = soft_timer_pending_head;
+    while (cur != 0 && cur != timer)
+    {
+        prev = cur;
+        cur = cur->pending_next;
+    }
+
+    if (cur != 0)
+    {
+        if (prev)
+        {
+            prev->pending_next = timer->pending_next;
+        }
+        else
+        {
+            soft_timer_pending_head = timer->pending_next;
+        }
+        if (soft_timer_pending_tail == timer)
+        {
+            soft_timer_pending_tail = prev;
+        }
+    }
+
+    timer->pending = 0;
+    timer->pending_next = 0;
+}
+
+void _soft_timer_program()
+{
+    // Must be called with interrupts disabled.
+    if (soft_timer_hw < 0 || soft_timer_hw >= MAX_HW_TIMERS)
+    {
+        return;
+    }
+
+    // Stop the timer and clear any underflow so that we don't get a stale interrupt.
+    TIMER_TSTR &= ~(1 << soft_timer_hw);
+    TIMER_TCR(soft_timer_hw) &= ~TIMER_TCR_UNF;
+
+    if (soft_timer_heap_size > 0)
+    {
+        // The channel counts monotonic clock ticks, so the deadline delta can be
+        // programmed directly, up to a few minutes out. Anything longer will just
+        // fire early, find nothing to do and reprogram.
+        uint64_t now = timer_now_ticks();
+        uint64_t deadline = soft_timer_heap[0]->deadline;
+        uint64_t delta = deadline > now ? deadline - now : 1;
+        if (delta > 0xFFFFFFFF)
+        {
+            delta = 0xFFFFFFFF;
+        }
+
+        TIMER_TCNT(soft_timer_hw) = delta;
+        TIMER_TCOR(soft_timer_hw) = delta;
+        TIMER_TSTR |= (1 << soft_timer_hw);
+    }
+}
+
+int _soft_timer_cb(int timer)
+{
+    uint64_t now = timer_now_ticks();
+
+    while (soft_timer_heap_size > 0 && soft_timer_heap[0]->deadline <= now)
+    {
+        soft_timer_t *expired = soft_timer_heap[0];
+        _soft_timer_heap_remove(expired);
+
+        if (expired->period)
+        {
+            // Re-arm periodic timers before running the callback so that the callback
+            // is free to stop them. If we fell behind, skip the missed periods instead
+            // of firing a burst of callbacks to catch up.
+            expired->deadline += expired->period;
+            if (expired->deadline <= now)
+            {
+                expired->deadline = now + expired->period;
+            }
+            _soft_timer_heap_insert(expired);
+        }
+
+        if (expired->context == SOFT_TIMER_DEFERRED)
+        {
+            // If the service thread hasn't gotten to the last expiration yet, the
+            // two are coalesced into one callback.
+            if (!expired->pending)
+            {
+                expired->pending = 1;
+                expired->pending_next = 0;
+                if (soft_timer_pending_tail)
+                {
+                    soft_timer_pending_tail->pending_next = expired;
+                }
+                else
+                {
+                    soft_timer_pending_head = expired;
+                }
+                soft_timer_pending_tail = expired;
+            }
+        }
+        else
+        {
+            expired->func(expired, expired->param);
+        }
+    }
+
+    _soft_timer_program();
+
+    // Wake the service thread if there's deferred work it doesn't know about yet.
+    if (soft_timer_pending_head != 0 && !soft_timer_signalled && soft_timer_thread != 0)
+    {
+        soft_timer_signalled = 1;
+        if (_semaphore_release_irq(&soft_timer_signal))
+        {
+            // Inform the scheduler that a thread was woken up.
+            return 1;
+        }
+    }
+
+    // Inform the scheduler that this was a regular callback.
+    return 0;
+}
+
+void *_soft_timer_service(void *param)
+{
+    while ( 1 )
+    {
+        semaphore_acquire(&soft_timer_signal);
+
+        uint32_t old_interrupts = irq_disable();
+        soft_timer_signalled = 0;
+        irq_restore(old_interrupts);
+
+        while ( 1 )
+        {
+            // Grab the next callback to run, keeping track of it so that it can't
+            // be destroyed out from under us while it runs.
+            old_interrupts = irq_disable();
+            soft_timer_t *timer = soft_timer_pending_head;
+            if (timer)
+            {
+                soft_timer_pending_head = timer->pending_next;
+                if (soft_timer_pending_head == 0)
+                {
+                    soft_timer_pending_tail = 0;
+                }
+                timer->pending = 0;
+                timer->pending_next = 0;
+                soft_timer_running = timer;
+            }
+            irq_restore(old_interrupts);
+
+            if (timer == 0)
+            {
+                break;
+            }
+
+            timer->func(timer, timer->param);
+
+            old_interrupts = irq_disable();
+            soft_timer_running = 0;
+            irq_restore(old_interrupts);
+        }
+    }
+
+    return 0;
+}
+
+soft_timer_t *soft_timer_create(soft_timer_func_t func, void *param, int context)
+{
+    if (func == 0 || (context != SOFT_TIMER_IRQ && context != SOFT_TIMER_DEFERRED))
+    {
+        return 0;
+    }
+
+    if (context == SOFT_TIMER_DEFERRED && soft_timer_thread == 0)
+    {
+        // First deferred timer, so spin up the service thread.
+        semaphore_init_count(&soft_timer_signal, 1, 0);
+        if (soft_timer_signal.id == 0)
+        {
+            return 0;
+        }
+
+        uint32_t thread = thread_create("soft timers", _soft_timer_service, 0);
+        if (thread == 0)
+        {
+            semaphore_free(&soft_timer_signal);
+            return 0;
+        }
+        thread_priority(thread, MAX_PRIORITY);
+        thread_start(thread);
+        soft_timer_thread = thread;
+    }
+
+    soft_timer_t *timer = malloc(sizeof(soft_timer_t));
+    if (timer == 0)
+    {
+        return 0;
+    }
+    memset(timer, 0, sizeof(soft_timer_t));
+    timer->func = func;
+    timer->param = param;
+    timer->context = context;
+    timer->heap_index = -1;
+
+    // Make sure the heap has room for every timer that could be armed at once.
+    soft_timer_t **newheap = 0;
+    if (soft_timer_count + 1 > soft_timer_heap_capacity)
+    {
+        unsigned int capacity = soft_timer_heap_capacity ? soft_timer_heap_capacity * 2 : 16;
+        newheap = malloc(sizeof(soft_timer_t *) * capacity);
+        if (newheap == 0)
+        {
+            free(timer);
+            return 0;
+        }
+
+        uint32_t old_interrupts = irq_disable();
+        if (soft_timer_heap_size > 0)
+        {
+            memcpy(newheap, soft_timer_heap, sizeof(soft_timer_t *) * soft_timer_heap_size);
+        }
+        soft_timer_t **oldheap = soft_timer_heap;
+        soft_timer_heap = newheap;
+        soft_timer_heap_capacity = capacity;
+        soft_timer_count++;
+        irq_restore(old_interrupts);
+
+        // Now that nothing can be looking at the old heap, get rid of it.
+        if (oldheap)
+        {
+            free(oldheap);
+        }
+    }
+    else
+    {
+        uint32_t old_interrupts = irq_disable();
+        soft_timer_count++;
+        irq_restore(old_interrupts);
+    }
+
+    return timer;
+}
+
+void soft_timer_start(soft_timer_t *timer, uint32_t microseconds, uint32_t period)
+{
+    if (timer == 0)
+    {
+        return;
+    }
+
+    uint32_t old_interrupts = irq_disable();
+
+    // Restarting an armed timer just moves its deadline.
+    _soft_timer_heap_remove(timer);
+
+    uint64_t ticks = timer_us_to_ticks(microseconds);
+    timer->deadline = timer_now_ticks() + (ticks ? ticks : 1);
+    timer->period = timer_us_to_ticks(period);
+    _soft_timer_heap_insert(timer);
+
+    // Only bother touching the hardware if this is the new earliest deadline.
+    if (timer->heap_index == 0)
+    {
+        _soft_timer_program();
+    }
+
+    irq_restore(old_interrupts);
+}
+
+void soft_timer_stop(soft_timer_t *timer)
+{
+    if (timer == 0)
+    {
+        return;
+    }
+
+    uint32_t old_interrupts = irq_disable();
+    int was_first = timer->heap_index == 0;
+    _soft_timer_heap_remove(timer);
+    _soft_timer_pending_remove(timer);
+    if (was_first)
+    {
+        _soft_timer_program();
+    }
+    irq_restore(old_interrupts);
+}
+
+int soft_timer_active(soft_timer_t *timer)
+{
+    if (timer == 0)
+    {
+        return 0;
+    }
+
+    uint32_t old_interrupts = irq_disable();
+    int active = timer->heap_index >= 0 || timer->pending;
+    irq_restore(old_interrupts);
+
+    return active;
+}
+
+void soft_timer_destroy(soft_timer_t *timer)
+{
+    if (timer == 0)
+    {
+        return;
+    }
+
+    soft_timer_stop(timer);
+
+    // If the service thread is in the middle of running this timer's callback, wait
+    // for it to finish, unless that's us destroying the timer from its own callback.
+    if (soft_timer_thread != 0 && thread_id() != soft_timer_thread)
+    {
+        while ( 1 )
+        {
+            uint32_t old_interrupts = irq_disable();
+            int running = soft_timer_running == timer;
+            irq_restore(old_interrupts);
+
+            if (!running)
+            {
+                break;
+            }
+            thread_yield();
+        }
+    }
+
+    uint32_t old_interrupts = irq_disable();
+    soft_timer_count--;
+    irq_restore(old_interrupts);
+
+    free(timer);
+}
@@ -0,0 +1,130 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "naomi/interrupt.h"
+#include "naomi/thread.h"
+#include "naomi/timer.h"
+#include "naomi/trace.h"
+#include "irqstate.h"
+
+// Checked by the TRACE_EVENT() macro before doing anything else, so that tracing
+// costs nothing when it isn't running.
+int _trace_enabled = 0;
+
+static trace_event_t *ring = 0;
+static unsigned int ring_size = 0;
+static unsigned int ring_next = 0;
+static unsigned int ring_count = 0;
+
+void _trace_event(uint16_t type, uint16_t code, uint32_t a, uint32_t b)
+{
+    uint32_t old_interrupts = irq_disable();
+
+    if (ring != 0)
+    {
+        trace_event_t *event = &ring[ring_next];
+        event->timestamp = (uint32_t)timer_now_ticks();
+        event->type = type;
+        event->code = code;
+        event->a = a;
+        event->b = b;
+
+        ring_next = ring_next + 1 == ring_size ? 0 : ring_next + 1;
+        if (ring_count < ring_size)
+        {
+            ring_count++;
+        }
+    }
+
+    irq_restore(old_interrupts);
+}
+
+int trace_start(unsigned int events)
+{
+    if (events == 0)
+    {
+        // Resume tracing into the ring we already have.
+        uint32_t old_interrupts = irq_disable();
+        _trace_enabled = ring != 0;
+        irq_restore(old_interrupts);
+        return ring != 0 ? 0 : -1;
+    }
+
+    trace_event_t *new_ring = malloc(sizeof(trace_event_t) * events);
+    if (new_ring == 0)
+    {
+        return -2;
+    }
+
+    uint32_t old_interrupts = irq_disable();
+    trace_event_t *old_ring = ring;
+    ring = new_ring;
+    ring_size = events;
+    ring_next = 0;
+    ring_count = 0;
+    _trace_enabled = 1;
+    irq_restore(old_interrupts);
+
+    if (old_ring)
+    {
+        free(old_ring);
+    }
+    return 0;
+}
+
+void trace_stop()
+{
+    _trace_enabled = 0;
+}
+
+void trace_free()
+{
+    uint32_t old_interrupts = irq_disable();
+    trace_event_t *old_ring = ring;
+    _trace_enabled = 0;
+    ring = 0;
+    ring_size = 0;
+    ring_next = 0;
+    ring_count = 0;
+    irq_restore(old_interrupts);
+
+    if (old_ring)
+    {
+        free(old_ring);
+    }
+}
+
+int trace_running()
+{
+    return _trace_enabled;
+}
+
+void trace_mark(uint16_t code, uint32_t a, uint32_t b)
+{
+    TRACE_EVENT(TRACE_EVENT_MARK, code, a, b);
+}
+
+unsigned int trace_count()
+{
+    return ring_count;
+}
+
+unsigned int trace_read(trace_event_t *events, unsigned int first, unsigned int max)
+{
+    unsigned int copied = 0;
+
+    uint32_t old_interrupts = irq_disable();
+    if (ring != 0)
+    {
+        // The oldest event is right where the next one will go once the ring is full.
+        unsigned int oldest = ring_count < ring_size ? 0 : ring_next;
+        while (copied < max && (first + copied) < ring_count)
+        {
+            events[copied] = ring[(oldest + first + copied) % ring_size];
+            copied++;
+        }
+    }
+    irq_restore(old_interrupts);
+
+    return copied;
+}
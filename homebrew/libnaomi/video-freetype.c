@@ -8,6 +8,7 @@
 #include FT_FREETYPE_H
 #include "naomi/system.h"
 #include "naomi/video.h"
+#include "naomi/profile.h"
 #include "video-internal.h"
 
 #ifndef min
@@ -48,6 +49,7 @@ font_t * video_font_add(void *buffer, unsigned int size)
     font->cacheloc = 0;
     font->cache = malloc(sizeof(font_cache_entry_t *) * font->cachesize);
     memset(font->cache, 0, sizeof(font_cache_entry_t *) * font->cachesize);
+    pool_init(&font->cachepool, sizeof(font_cache_entry_t), font->cachesize);
 
     video_font_set_size(font, 12);
 
@@ -84,7 +86,7 @@ void __cache_discard(font_t *fontface)
     for (int i = 0; i < fontface->cacheloc; i++)
     {
         free(fontface->cache[i]->buffer);
-        free(fontface->cache[i]);
+        pool_release(&fontface->cachepool, fontface->cache[i]);
         fontface->cache[i] = 0;
     }
 
@@ -110,7 +112,7 @@ font_cache_entry_t *__cache_lookup(font_t *fontface, uint32_t index)
 
 int __cache_add(font_t *fontface, font_cache_entry_t *entry)
 {
-    if (fontface->cacheloc == fontface->cachesize)
+    if (entry == 0 || fontface->cacheloc == fontface->cachesize)
     {
         return 0;
     }
@@ -119,9 +121,16 @@ int __cache_add(font_t *fontface, font_cache_entry_t *entry)
     return 1;
 }
 
-font_cache_entry_t *__cache_create(uint32_t index, int advancex, int advancey, int bitmap_left, int bitmap_top, int width, int height, int mode, uint8_t *buffer)
+font_cache_entry_t *__cache_create(font_t *fontface, uint32_t index, int advancex, int advancey, int bitmap_left, int bitmap_top, int width, int height, int mode, uint8_t *buffer)
 {
-    font_cache_entry_t *entry = malloc(sizeof(font_cache_entry_t));
+    font_cache_entry_t *entry = pool_alloc(&fontface->cachepool);
+    if (entry == 0)
+    {
+        // Cache entries come out of a pool the size of the cache, so this only
+        // happens if we failed to allocate the pool in the first place.
+        return 0;
+    }
+
     entry->index = index;
     entry->advancex = advancex;
     entry->advancey = advancey;
@@ -149,6 +158,7 @@ void video_font_discard(font_t *fontface)
             }
         }
         __cache_discard(fontface);
+        pool_free(&fontface->cachepool);
         free(fontface->cache);
         free(fontface->faces);
         free(fontface);
@@ -398,6 +408,7 @@ int __video_draw_calc_character(int x, int y, font_t *fontface, uint32_t color,
             if (fontface->cacheloc < fontface->cachesize)
             {
                 entry = __cache_create(
+                    fontface,
                     ch,
                     slot->advance.x >> 6,
                     slot->advance.y >> 6,
@@ -481,6 +492,7 @@ int __video_draw_calc_text(int x, int y, font_t *fontface, uint32_t color, const
                         if (fontface->cacheloc < fontface->cachesize)
                         {
                             entry = __cache_create(
+                                fontface,
                                 *text,
                                 slot->advance.x >> 6,
                                 slot->advance.y >> 6,
@@ -563,6 +575,7 @@ int __video_draw_calc_text(int x, int y, font_t *fontface, uint32_t color, const
                         if (fontface->cacheloc < fontface->cachesize)
                         {
                             entry = __cache_create(
+                                fontface,
                                 *text,
                                 slot->advance.x >> 6,
                                 slot->advance.y >> 6,
@@ -608,6 +621,8 @@ int video_draw_character(int x, int y, font_t *fontface, uint32_t color, int ch)
 
 int video_draw_text(int x, int y, font_t *fontface, uint32_t color, const char * const msg, ...)
 {
+    LIBNAOMI_PROFILE_ZONE("video_draw_text");
+
     if (msg)
     {
         char buffer[2048];
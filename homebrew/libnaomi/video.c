@@ -9,7 +9,9 @@
 #include "naomi/eeprom.h"
 #include "naomi/console.h"
 #include "naomi/interrupt.h"
+#include "naomi/thread.h"
 #include "video-internal.h"
+#include "holly.h"
 #include "font.h"
 
 #define POWERVR2_BASE 0xA05F8000
@@ -34,6 +36,7 @@
 #define POWERVR2_VIDEO_CFG (0x0E8 >> 2)
 #define POWERVR2_HPOS (0x0EC >> 2)
 #define POWERVR2_VPOS (0x0F0 >> 2)
+#define POWERVR2_VBLANK_INT (0x0CC >> 2)
 #define POWERVR2_SYNC_CFG (0x0D0 >> 2)
 #define POWERVR2_SYNC_STAT (0x10C >> 2)
 
@@ -62,14 +65,17 @@
 // Static members that don't need to be accessed anywhere else.
 static int buffer_loc = 0;
 static uint32_t global_background_color = 0;
-static uint32_t global_background_fill_start = 0;
-static uint32_t global_background_fill_end = 0;
 static uint32_t global_background_fill_color = 0;
 static unsigned int global_background_set = 0;
 
-// We only use two of these for rendering. The third is so we can
-// give a pointer out to scratch VRAM for other code to use.
-static uint32_t global_buffer_offset[3] = { 0, 0, 0 };
+// We use two of these for rendering, or three with triple buffering on. The
+// last one is so we can give a pointer out to scratch VRAM for other code to use.
+#define SCRATCH_BUFFER 3
+static uint32_t global_buffer_offset[4] = { 0, 0, 0, 0 };
+
+// Which buffer is on the screen right now, and whether we're triple buffering.
+static volatile int display_buffer = 0;
+static int triple_buffering = 0;
 
 // Nonstatic so that other video modules can use it as well.
 unsigned int global_video_width = 0;
@@ -80,59 +86,261 @@ unsigned int global_video_depth = 0;
 unsigned int global_video_vertical = 0;
 void *buffer_base = 0;
 
-void video_display_on_vblank()
+// Prototypes of functions we don't want in the public headers.
+uint32_t _irq_read_sr();
+int _irq_was_disabled(uint32_t sr);
+int _semaphore_release_irq(semaphore_t *semaphore);
+
+// Vblank tracking. Threads waiting for a vblank register themselves in vblank_waiters
+// and then block on the semaphore, and the vblank in interrupt releases it once for
+// every waiting thread.
+#define MAX_VBLANK_CALLBACKS 8
+
+typedef struct
+{
+    video_vblank_func_t func;
+    void *param;
+} vblank_callback_t;
+
+static semaphore_t vblank_semaphore;
+static unsigned int vblank_waiters = 0;
+static volatile uint32_t vblank_count = 0;
+static int vblank_registered = 0;
+static int vblank_out_registered = 0;
+static vblank_callback_t vblank_callbacks[2][MAX_VBLANK_CALLBACKS];
+
+// A buffer that has been handed to us for display, to be latched at the next vblank.
+static volatile int flip_pending = 0;
+static int flip_buffer = 0;
+
+void _video_set_display_buffer(int buffer)
 {
     volatile unsigned int *videobase = (volatile unsigned int *)POWERVR2_BASE;
 
-    // Draw any registered console to the screen.
-    console_render();
+    videobase[POWERVR2_FB_DISPLAY_ADDR_1] = global_buffer_offset[buffer];
+    videobase[POWERVR2_FB_DISPLAY_ADDR_2] = global_buffer_offset[buffer] + (global_video_width * global_video_depth);
+}
 
-    // Handle filling the background of the other screen while we wait.
-    if (global_background_set) {
-        global_background_fill_start = ((VRAM_BASE + global_buffer_offset[buffer_loc ? 0 : 1]) | 0xA0000000);
-        global_background_fill_end = global_background_fill_start + ((global_video_width * global_video_height * global_video_depth));
-    }
-
-    // TODO: This is completely wrong. We shouldn't break threads while waiting for
-    // vblank, but if we don't do this then we can get preempted during the busy
-    // loop and miss a vblank period. What really should happen is the thread should
-    // be parked, until the "in vblank" interrupt fires, then we should wake up,
-    // disable threads, busyloop while we're in the vblank period and then swap buffers.
-    // This will require us to support priority inversion of threads, and I'm not sure
-    // how to safely clear the next frame during this time. We might want to kick off
-    // another thread for that, then kill that thread when we wake back up and manually
-    // do the rest ourselves.
-    uint32_t old_interrupts = irq_disable();
+void _video_run_vblank_callbacks(int event)
+{
+    for (int i = 0; i < MAX_VBLANK_CALLBACKS; i++)
+    {
+        if (vblank_callbacks[event][i].func)
+        {
+            vblank_callbacks[event][i].func(event, vblank_callbacks[event][i].param);
+        }
+    }
+}
 
-    while(!(videobase[POWERVR2_SYNC_STAT] & 0x01ff)) {
-        if (global_background_fill_start < global_background_fill_end) {
-            if (hw_memset((void *)global_background_fill_start, global_background_fill_color, 32))
-            {
-                global_background_fill_start += 32;
-            }
+int _video_vblank_in(unsigned int type, unsigned int bit, void *param)
+{
+    vblank_count++;
+
+    // If somebody finished a frame, now is the time to put it on the screen.
+    if (flip_pending)
+    {
+        _video_set_display_buffer(flip_buffer);
+        display_buffer = flip_buffer;
+        flip_pending = 0;
+    }
+
+    _video_run_vblank_callbacks(VIDEO_VBLANK_IN);
+
+    // Wake up everyone who was waiting for this.
+    int woken = 0;
+    if (vblank_semaphore.id != 0)
+    {
+        while (vblank_waiters > 0)
+        {
+            vblank_waiters--;
+            woken |= _semaphore_release_irq(&vblank_semaphore);
+        }
+    }
+
+    return woken ? HOLLY_INTERRUPT_WOKEN : HOLLY_INTERRUPT_HANDLED;
+}
+
+int _video_vblank_out(unsigned int type, unsigned int bit, void *param)
+{
+    _video_run_vblank_callbacks(VIDEO_VBLANK_OUT);
+    return HOLLY_INTERRUPT_HANDLED;
+}
+
+int _video_can_block()
+{
+    // We can only park the current thread if the vblank interrupt is hooked up and we
+    // aren't being called with interrupts disabled, such as from an exception handler.
+    return vblank_registered && vblank_semaphore.id != 0 && !_irq_was_disabled(_irq_read_sr());
+}
+
+void _video_wait_vblank_spin()
+{
+    volatile unsigned int *videobase = (volatile unsigned int *)POWERVR2_BASE;
+
+    while(!(videobase[POWERVR2_SYNC_STAT] & 0x01ff)) { ; }
+    while((videobase[POWERVR2_SYNC_STAT] & 0x01ff)) { ; }
+}
+
+void _video_block_until(int flip)
+{
+    while ( 1 )
+    {
+        uint32_t old_interrupts = irq_disable();
+        if (flip && !flip_pending)
+        {
+            // The frame we were waiting on already made it to the screen.
+            irq_restore(old_interrupts);
+            return;
+        }
+        vblank_waiters++;
+        irq_restore(old_interrupts);
+
+        semaphore_acquire(&vblank_semaphore);
+        if (!flip)
+        {
+            return;
         }
     }
-    while((videobase[POWERVR2_SYNC_STAT] & 0x01ff)) {
-        // Don't clear here, as this can cause us to miss the vblank swap period.
+}
+
+void video_wait_vblank()
+{
+    if (_video_can_block())
+    {
+        _video_block_until(0);
     }
+    else
+    {
+        _video_wait_vblank_spin();
+    }
+}
 
-    // Swap buffers in HW.
-    videobase[POWERVR2_FB_DISPLAY_ADDR_1] = global_buffer_offset[buffer_loc];
-    videobase[POWERVR2_FB_DISPLAY_ADDR_2] = global_buffer_offset[buffer_loc] + (global_video_width * global_video_depth);
+uint32_t video_vblank_count()
+{
+    return vblank_count;
+}
 
-    // Swap buffer pointer in SW.
-    buffer_loc = buffer_loc ? 0 : 1;
-    buffer_base = (void *)((VRAM_BASE + global_buffer_offset[buffer_loc]) | 0xA0000000);
+int video_register_vblank_callback(int event, video_vblank_func_t func, void *param)
+{
+    if ((event != VIDEO_VBLANK_IN && event != VIDEO_VBLANK_OUT) || func == 0)
+    {
+        return -1;
+    }
 
-    // Safe for interrupts to be re-enabled at this point.
+    int ret = -2;
+    uint32_t old_interrupts = irq_disable();
+    for (int i = 0; i < MAX_VBLANK_CALLBACKS; i++)
+    {
+        if (vblank_callbacks[event][i].func == 0)
+        {
+            vblank_callbacks[event][i].func = func;
+            vblank_callbacks[event][i].param = param;
+            ret = 0;
+            break;
+        }
+    }
     irq_restore(old_interrupts);
 
-    // Finish filling in the background.
-    if (global_background_fill_start < global_background_fill_end) {
-        while (hw_memset((void *)global_background_fill_start, global_background_fill_color, global_background_fill_end - global_background_fill_start) == 0) { ; }
+    if (ret == 0 && event == VIDEO_VBLANK_OUT && !vblank_out_registered)
+    {
+        // We only take the vblank out interrupt if somebody actually wants it.
+        vblank_out_registered = holly_interrupt_register(HOLLY_INTERRUPT_TYPE_NORMAL, HOLLY_NORMAL_INTERRUPT_VBLANK_OUT, _video_vblank_out, 0, 0) == 0;
+    }
+
+    return ret;
+}
+
+void video_unregister_vblank_callback(int event, video_vblank_func_t func, void *param)
+{
+    if (event != VIDEO_VBLANK_IN && event != VIDEO_VBLANK_OUT)
+    {
+        return;
+    }
+
+    uint32_t old_interrupts = irq_disable();
+    for (int i = 0; i < MAX_VBLANK_CALLBACKS; i++)
+    {
+        if (vblank_callbacks[event][i].func == func && vblank_callbacks[event][i].param == param)
+        {
+            vblank_callbacks[event][i].func = 0;
+            vblank_callbacks[event][i].param = 0;
+        }
     }
-    global_background_fill_start = 0;
-    global_background_fill_end = 0;
+    irq_restore(old_interrupts);
+}
+
+void video_display_on_vblank()
+{
+    // Draw any registered console to the screen.
+    console_render();
+
+    if (_video_can_block())
+    {
+        if (triple_buffering)
+        {
+            // If the last frame we queued still hasn't made it to the screen, we're
+            // running faster than the display, so wait for it. Otherwise this won't block.
+            _video_block_until(1);
+
+            // Queue this frame up for the vblank interrupt to put on the screen, and carry
+            // on drawing into whichever buffer is neither on the screen nor queued.
+            uint32_t old_interrupts = irq_disable();
+            flip_buffer = buffer_loc;
+            flip_pending = 1;
+            buffer_loc = 3 - (display_buffer + flip_buffer);
+            irq_restore(old_interrupts);
+        }
+        else
+        {
+            // Hand the finished frame to the vblank interrupt and sleep until it's on the
+            // screen, so other threads get to run in the meantime.
+            uint32_t old_interrupts = irq_disable();
+            int old_display = display_buffer;
+            flip_buffer = buffer_loc;
+            flip_pending = 1;
+            irq_restore(old_interrupts);
+
+            _video_block_until(1);
+
+            // Draw into whatever just came off the screen.
+            buffer_loc = old_display;
+        }
+    }
+    else
+    {
+        // No interrupts to lean on, so wait for the start of the next frame by hand. If a
+        // frame was still queued, it never got a chance to display, so just replace it.
+        uint32_t old_interrupts = irq_disable();
+        int old_display = display_buffer;
+        flip_pending = 0;
+        irq_restore(old_interrupts);
+
+        _video_wait_vblank_spin();
+        _video_set_display_buffer(buffer_loc);
+        display_buffer = buffer_loc;
+        buffer_loc = old_display;
+    }
+
+    buffer_base = (void *)((VRAM_BASE + global_buffer_offset[buffer_loc]) | 0xA0000000);
+
+    // The buffer we're about to draw to is off the screen now, so fill in the background.
+    if (global_background_set) {
+        uint32_t fill_start = ((VRAM_BASE + global_buffer_offset[buffer_loc]) | 0xA0000000);
+        uint32_t fill_amount = global_video_width * global_video_height * global_video_depth;
+        hw_memset((void *)fill_start, global_background_fill_color, fill_amount);
+    }
+}
+
+void video_set_triple_buffering(int enabled)
+{
+    if (!enabled && triple_buffering && _video_can_block())
+    {
+        // Let the queued frame reach the screen so we're back to one buffer on the
+        // screen and one being drawn to.
+        _video_block_until(1);
+    }
+
+    triple_buffering = enabled ? 1 : 0;
 }
 
 unsigned int video_width()
@@ -158,6 +366,15 @@ unsigned int video_is_vertical()
 // TODO: This function assumes 640x480 VGA, we should support more varied options.
 void video_init_simple()
 {
+    // Set up what vblank waiters sleep on before the vblank interrupt gets hooked up below,
+    // and before disabling interrupts since this needs the heap. There can never be more
+    // waiters than threads, and nobody is woken to begin with. If we're re-initializing,
+    // we still have it from last time.
+    if (vblank_semaphore.id == 0)
+    {
+        semaphore_init_count(&vblank_semaphore, MAX_THREADS, 0);
+    }
+
     uint32_t old_interrupts = irq_disable();
     volatile unsigned int *videobase = (volatile unsigned int *)POWERVR2_BASE;
 
@@ -169,6 +386,7 @@ void video_init_simple()
     global_buffer_offset[0] = 0;
     global_buffer_offset[1] = global_buffer_offset[0] + (global_video_width * global_video_height * global_video_depth);
     global_buffer_offset[2] = global_buffer_offset[1] + (global_video_width * global_video_height * global_video_depth);
+    global_buffer_offset[3] = global_buffer_offset[2] + (global_video_width * global_video_height * global_video_depth);
 
     // First, read the EEPROM and figure out if we're vertical orientation.
     eeprom_t eeprom;
@@ -188,11 +406,7 @@ void video_init_simple()
 
     // Now, zero out the screen so there's no garbage if we never display.
     void *zero_base = (void *)(VRAM_BASE | 0xA0000000);
-    if (!hw_memset(zero_base, 0, global_video_width * global_video_height * global_video_depth * 2))
-    {
-        // Gotta do the slow method.
-        memset(zero_base, 0, global_video_width * global_video_height * global_video_depth * 2);
-    }
+    hw_memset(zero_base, 0, global_video_width * global_video_height * global_video_depth * 3);
 
     // Set up video timings copied from Naomi BIOS.
     videobase[POWERVR2_VRAM_CFG3] = 0x15D1C955;
@@ -221,11 +435,12 @@ void video_init_simple()
     );
 
     // Set up even/odd field video base address, shifted by bpp.
-    videobase[POWERVR2_FB_DISPLAY_ADDR_1] = global_buffer_offset[buffer_loc];
-    videobase[POWERVR2_FB_DISPLAY_ADDR_2] = global_buffer_offset[buffer_loc] + (global_video_width * global_video_depth);
+    flip_pending = 0;
+    display_buffer = 0;
+    _video_set_display_buffer(display_buffer);
 
-    // Swap buffer pointer in SW.
-    buffer_loc = buffer_loc ? 0 : 1;
+    // Start drawing to the next buffer.
+    buffer_loc = 1;
     buffer_base = (void *)((VRAM_BASE + global_buffer_offset[buffer_loc]) | 0xA0000000);
 
     // Set up render modulo, (bpp * width) / 8.
@@ -272,9 +487,22 @@ void video_init_simple()
     // Set up vertical clipping to within 0-480.
     videobase[POWERVR2_FB_CLIP_Y] = (global_video_height << 16) | (0 << 0);
 
+    // Raise vblank in when we leave the bottom border and vblank out when we reach
+    // the top border again.
+    videobase[POWERVR2_VBLANK_INT] = (
+        40 << 16 |                       // Vblank out.
+        (global_video_height + 40) << 0  // Vblank in.
+    );
+
     // Wait for vblank like games do.
-    while(!(videobase[POWERVR2_SYNC_STAT] & 0x01ff)) { ; }
-    while((videobase[POWERVR2_SYNC_STAT] & 0x01ff)) { ; }
+    _video_wait_vblank_spin();
+
+    // Now, hook up the vblank interrupt so that waiting for vblank doesn't need to spin.
+    // If we're re-initializing, then our handlers are still registered from last time.
+    if (!vblank_registered)
+    {
+        vblank_registered = holly_interrupt_register(HOLLY_INTERRUPT_TYPE_NORMAL, HOLLY_NORMAL_INTERRUPT_VBLANK_IN, _video_vblank_in, 0, 0) == 0;
+    }
     irq_restore(old_interrupts);
 }
 
@@ -286,6 +514,27 @@ void video_free()
     // Reset video.
     videobase[POWERVR2_RESET] = 0;
 
+    // Stop listening for vblanks, and let go of anybody who was still waiting on one.
+    if (vblank_registered)
+    {
+        holly_interrupt_unregister(HOLLY_INTERRUPT_TYPE_NORMAL, HOLLY_NORMAL_INTERRUPT_VBLANK_IN);
+        vblank_registered = 0;
+    }
+    if (vblank_out_registered)
+    {
+        holly_interrupt_unregister(HOLLY_INTERRUPT_TYPE_NORMAL, HOLLY_NORMAL_INTERRUPT_VBLANK_OUT);
+        vblank_out_registered = 0;
+    }
+    if (vblank_semaphore.id != 0)
+    {
+        while (vblank_waiters > 0)
+        {
+            vblank_waiters--;
+            _semaphore_release_irq(&vblank_semaphore);
+        }
+    }
+    flip_pending = 0;
+
     // De-init our globals.
     global_video_width = 0;
     global_video_height = 0;
@@ -295,6 +544,7 @@ void video_free()
     global_buffer_offset[0] = 0;
     global_buffer_offset[1] = 0;
     global_buffer_offset[2] = 0;
+    global_buffer_offset[3] = 0;
     irq_restore(old_interrupts);
 }
 
@@ -369,17 +619,11 @@ void video_fill_screen(uint32_t color)
 {
     if(global_video_depth == 2)
     {
-        if (!hw_memset(buffer_base, (color & 0xFFFF) | ((color << 16) & 0xFFFF0000), global_video_width * global_video_height * 2))
-        {
-            memset(buffer_base, (color & 0xFFFF) | ((color << 16) & 0xFFFF0000), global_video_width * global_video_height * 2);
-        }
+        hw_memset(buffer_base, (color & 0xFFFF) | ((color << 16) & 0xFFFF0000), global_video_width * global_video_height * 2);
     }
     else if(global_video_depth == 4)
     {
-        if (!hw_memset(buffer_base, color, global_video_width * global_video_height * 4))
-        {
-            memset(buffer_base, color, global_video_width * global_video_height * 4);
-        }
+        hw_memset(buffer_base, color, global_video_width * global_video_height * 4);
     }
 }
 
@@ -918,5 +1162,5 @@ void video_draw_debug_text(int x, int y, uint32_t color, const char * const msg,
 
 void *video_scratch_area()
 {
-    return(void *)((VRAM_BASE + global_buffer_offset[2]) | 0xA0000000);
+    return(void *)((VRAM_BASE + global_buffer_offset[SCRATCH_BUFFER]) | 0xA0000000);
 }
@@ -0,0 +1,290 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "naomi/thread.h"
+#include "naomi/workqueue.h"
+
+struct workqueue_job
+{
+    workqueue_t *queue;
+    thread_func_t function;
+    void *param;
+    int priority;
+    void *result;
+
+    // Set once the job has finished running.
+    int done;
+
+    // Set if nobody will ever wait on this job, so the worker should free it.
+    int detached;
+
+    // Semaphore that a thread blocked in job_wait() is sleeping on, if any.
+    semaphore_t *waiter;
+
+    // Link to the next job in priority order while the job is queued.
+    struct workqueue_job *next;
+};
+
+struct workqueue
+{
+    // Protects everything in the queue and the state of any job from it.
+    mutex_t lock;
+
+    // Counts queued jobs for the workers to pick up, and free spots in the queue
+    // for submitters to fill.
+    semaphore_t items;
+    semaphore_t slots;
+
+    job_t *head;
+    int stopping;
+
+    unsigned int worker_count;
+    uint32_t *workers;
+};
+
+void *_workqueue_worker(void *param)
+{
+    workqueue_t *queue = param;
+
+    while ( 1 )
+    {
+        // Wait for something to do, then grab the highest priority job.
+        semaphore_acquire(&queue->items);
+        mutex_lock(&queue->lock);
+        job_t *job = queue->head;
+        if (job)
+        {
+            queue->head = job->next;
+        }
+        mutex_unlock(&queue->lock);
+
+        if (job == 0)
+        {
+            // We were woken up with nothing left to do, so the queue is being destroyed.
+            break;
+        }
+
+        // There's room in the queue again now that we took this job out.
+        semaphore_release(&queue->slots);
+
+        void *result = job->function(job->param);
+
+        mutex_lock(&queue->lock);
+        job->result = result;
+        job->done = 1;
+        semaphore_t *waiter = job->waiter;
+        int detached = job->detached;
+        mutex_unlock(&queue->lock);
+
+        // Once we wake the waiter, the job belongs to it and we can't touch it anymore.
+        if (waiter)
+        {
+            semaphore_release(waiter);
+        }
+        else if (detached)
+        {
+            free(job);
+        }
+    }
+
+    return 0;
+}
+
+workqueue_t *workqueue_create(char *name, unsigned int workers, unsigned int queue_size, uint32_t stack_size)
+{
+    if (workers == 0 || queue_size == 0)
+    {
+        return 0;
+    }
+
+    workqueue_t *queue = malloc(sizeof(workqueue_t));
+    if (queue == 0)
+    {
+        return 0;
+    }
+    memset(queue, 0, sizeof(workqueue_t));
+    queue->workers = malloc(sizeof(uint32_t) * workers);
+    if (queue->workers == 0)
+    {
+        free(queue);
+        return 0;
+    }
+
+    // The items semaphore needs to be able to count a wakeup for every worker on top
+    // of a full queue when we are destroyed. It starts out with nothing to do.
+    mutex_init(&queue->lock);
+    semaphore_init_count(&queue->items, queue_size + workers, 0);
+    semaphore_init(&queue->slots, queue_size);
+    if (queue->lock.id == 0 || queue->items.id == 0 || queue->slots.id == 0)
+    {
+        // Ran out of semaphores or mutexes.
+        mutex_free(&queue->lock);
+        semaphore_free(&queue->items);
+        semaphore_free(&queue->slots);
+        free(queue->workers);
+        free(queue);
+        return 0;
+    }
+
+    for (unsigned int i = 0; i < workers; i++)
+    {
+        uint32_t worker = thread_create_ex(name, _workqueue_worker, queue, stack_size);
+        if (worker == 0)
+        {
+            // Ran out of threads, make do with what we have.
+            break;
+        }
+
+        queue->workers[queue->worker_count++] = worker;
+        thread_start(worker);
+    }
+
+    if (queue->worker_count == 0)
+    {
+        workqueue_destroy(queue);
+        return 0;
+    }
+
+    return queue;
+}
+
+void workqueue_destroy(workqueue_t *queue)
+{
+    if (queue == 0)
+    {
+        return;
+    }
+
+    // Wake every worker once more than there are jobs. Each worker will keep
+    // picking up jobs until it finds the queue empty, and then exit.
+    mutex_lock(&queue->lock);
+    queue->stopping = 1;
+    mutex_unlock(&queue->lock);
+
+    for (unsigned int i = 0; i < queue->worker_count; i++)
+    {
+        semaphore_release(&queue->items);
+    }
+    for (unsigned int i = 0; i < queue->worker_count; i++)
+    {
+        thread_join(queue->workers[i]);
+        thread_destroy(queue->workers[i]);
+    }
+
+    mutex_free(&queue->lock);
+    semaphore_free(&queue->items);
+    semaphore_free(&queue->slots);
+    free(queue->workers);
+    free(queue);
+}
+
+job_t *workqueue_submit(workqueue_t *queue, thread_func_t function, void *param, int priority)
+{
+    if (queue == 0 || function == 0)
+    {
+        return 0;
+    }
+
+    job_t *job = malloc(sizeof(job_t));
+    if (job == 0)
+    {
+        return 0;
+    }
+    memset(job, 0, sizeof(job_t));
+    job->queue = queue;
+    job->function = function;
+    job->param = param;
+    job->priority = priority;
+
+    // Wait for room in the queue.
+    semaphore_acquire(&queue->slots);
+
+    mutex_lock(&queue->lock);
+    if (queue->stopping)
+    {
+        mutex_unlock(&queue->lock);
+        semaphore_release(&queue->slots);
+        free(job);
+        return 0;
+    }
+
+    // Insert behind every job of the same or higher priority.
+    job_t **link = &queue->head;
+    while (*link && (*link)->priority >= priority)
+    {
+        link = &(*link)->next;
+    }
+    job->next = *link;
+    *link = job;
+    mutex_unlock(&queue->lock);
+
+    // Let a worker know there's something to do.
+    semaphore_release(&queue->items);
+
+    return job;
+}
+
+int job_done(job_t *job)
+{
+    if (job == 0)
+    {
+        return 1;
+    }
+
+    mutex_lock(&job->queue->lock);
+    int done = job->done;
+    mutex_unlock(&job->queue->lock);
+
+    return done;
+}
+
+void *job_wait(job_t *job)
+{
+    if (job == 0)
+    {
+        return 0;
+    }
+
+    workqueue_t *queue = job->queue;
+    mutex_lock(&queue->lock);
+    if (!job->done)
+    {
+        // Set up a semaphore for the worker to release when the job is done. We only
+        // need one while actually waiting, so there's no per-job semaphore cost.
+        semaphore_t done;
+        semaphore_init_count(&done, 1, 0);
+        job->waiter = &done;
+        mutex_unlock(&queue->lock);
+
+        semaphore_acquire(&done);
+        semaphore_free(&done);
+    }
+    else
+    {
+        mutex_unlock(&queue->lock);
+    }
+
+    void *result = job->result;
+    free(job);
+    return result;
+}
+
+void job_detach(job_t *job)
+{
+    if (job == 0)
+    {
+        return;
+    }
+
+    workqueue_t *queue = job->queue;
+    mutex_lock(&queue->lock);
+    int done = job->done;
+    job->detached = 1;
+    mutex_unlock(&queue->lock);
+
+    if (done)
+    {
+        // The worker already finished with it, so it's ours to free.
+        free(job);
+    }
+}
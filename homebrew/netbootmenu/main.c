@@ -4,6 +4,7 @@
 #include "naomi/system.h"
 #include "naomi/eeprom.h"
 #include "naomi/timer.h"
+#include "naomi/profile.h"
 #include "naomi/message/message.h"
 #include "config.h"
 #include "screens.h"
@@ -73,19 +74,24 @@ void main()
         state.animation_counter = animation_counter;
 
         // Now, draw the current screen.
-        int profile = profile_start();
-        draw_screen(&state);
-        uint32_t draw_time = profile_end(profile);
+        {
+            PROFILE_ZONE("draw_screen");
+            draw_screen(&state);
+        }
 
         // Display some debugging info.
         if (state.config->enable_debug)
         {
             video_draw_debug_text((video_width() / 2) - (18 * 4), video_height() - 16, rgb(0, 200, 255), "FPS: %.01f, %dx%d", fps_value, video_width(), video_height());
-            video_draw_debug_text((video_width() / 2) - (18 * 4), video_height() - 24, rgb(0, 200, 255), "uS full draw: %d", draw_time);
+            profile_draw_overlay(24, 24);
         }
 
         // Actually draw the buffer.
-        video_display_on_vblank();
+        {
+            PROFILE_ZONE("video_display_on_vblank");
+            video_display_on_vblank();
+        }
+        profile_frame();
 
         // Calcualte instantaneous FPS, adjust animation counters.
         uint32_t uspf = profile_end(fps);
@@ -0,0 +1,152 @@
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include "naomi/system.h"
+#include "naomi/cache.h"
+
+#define test_cache_writeback_duration 50
+void test_cache_writeback(test_context_t *context)
+{
+    uint32_t *buffer = malloc(256);
+    ASSERT(buffer != 0, "Failed to allocate buffer!");
+    ASSERT((((uint32_t)buffer) & 0xE0000000) != UNCACHED_MIRROR, "Buffer is not cacheable!");
+    volatile uint32_t *uncached = (volatile uint32_t *)((((uint32_t)buffer) & 0x1FFFFFFF) | UNCACHED_MIRROR);
+
+    // Make sure memory and the cache agree to start with.
+    for (int i = 0; i < (256 / 4); i++)
+    {
+        buffer[i] = 0;
+    }
+    cache_purge(buffer, 256);
+
+    // Write through the cache, and then make sure it got out to memory.
+    for (int i = 0; i < (256 / 4); i++)
+    {
+        buffer[i] = 0xDEADBEEF + i;
+    }
+    cache_writeback(buffer, 256);
+
+    for (int i = 0; i < (256 / 4); i++)
+    {
+        ASSERT(uncached[i] == 0xDEADBEEF + i, "Unexpected value %08lx in memory location %d", uncached[i], i * 4);
+    }
+
+    free(buffer);
+}
+
+#define test_cache_invalidate_duration 50
+void test_cache_invalidate(test_context_t *context)
+{
+    // Invalidating throws away whole cache lines, so the buffer can't share one with
+    // anything else on the heap.
+    uint32_t *buffer = memalign(32, 256);
+    ASSERT(buffer != 0, "Failed to allocate buffer!");
+    volatile uint32_t *uncached = (volatile uint32_t *)((((uint32_t)buffer) & 0x1FFFFFFF) | UNCACHED_MIRROR);
+
+    // Get the buffer into the cache with a known value.
+    for (int i = 0; i < (256 / 4); i++)
+    {
+        buffer[i] = 0x12345678;
+    }
+    cache_writeback(buffer, 256);
+    cache_prefetch(buffer, 256);
+
+    // Change memory behind the cache's back, like hardware would.
+    for (int i = 0; i < (256 / 4); i++)
+    {
+        uncached[i] = 0xCAFEBABE - i;
+    }
+
+    // Now, throw away what we have cached and make sure we see the new values.
+    cache_invalidate(buffer, 256);
+    for (int i = 0; i < (256 / 4); i++)
+    {
+        ASSERT(((volatile uint32_t *)buffer)[i] == 0xCAFEBABE - i, "Unexpected value %08lx in cached location %d", buffer[i], i * 4);
+    }
+
+    free(buffer);
+}
+
+#define test_cache_ocram_duration 50
+void test_cache_ocram(test_context_t *context)
+{
+    ASSERT(cache_ocram_malloc(32) == 0, "Got operand cache RAM without enabling it!");
+    ASSERT(cache_ocram_enable() == 0, "Failed to enable operand cache RAM!");
+    ASSERT(cache_ocram_enable() != 0, "Enabled operand cache RAM twice!");
+
+    // Each piece is only 4 KiB, so we should get two of these but not a third.
+    uint32_t *first = cache_ocram_malloc(3000);
+    uint32_t *second = cache_ocram_malloc(3000);
+    ASSERT(first != 0, "Failed to allocate first buffer!");
+    ASSERT(second != 0, "Failed to allocate second buffer!");
+    ASSERT(cache_ocram_malloc(3000) == 0, "Allocated more operand cache RAM than there is!");
+    ASSERT((((uint32_t)first) & 0x1F) == 0, "First buffer is not 32-byte aligned");
+    ASSERT((((uint32_t)second) & 0x1F) == 0, "Second buffer is not 32-byte aligned");
+
+    // The smaller leftovers should still be usable.
+    uint32_t *third = cache_ocram_malloc(1000);
+    ASSERT(third != 0, "Failed to allocate third buffer!");
+
+    for (int i = 0; i < (3000 / 4); i++)
+    {
+        first[i] = 0x11111111 * (i & 0xF);
+        second[i] = ~(0x11111111 * (i & 0xF));
+    }
+    for (int i = 0; i < (1000 / 4); i++)
+    {
+        third[i] = i;
+    }
+    for (int i = 0; i < (3000 / 4); i++)
+    {
+        ASSERT(first[i] == 0x11111111 * (i & 0xF), "Unexpected value %08lx in first location %d", first[i], i * 4);
+        ASSERT(second[i] == ~(0x11111111 * (i & 0xF)), "Unexpected value %08lx in second location %d", second[i], i * 4);
+    }
+    for (int i = 0; i < (1000 / 4); i++)
+    {
+        ASSERT(third[i] == i, "Unexpected value %08lx in third location %d", third[i], i * 4);
+    }
+
+    // The memory functions have to stick to plain CPU accesses here, since the store
+    // queues, DMA and cache line allocation can't reach operand cache RAM.
+    memset(first, 0xA5, 3000);
+    for (int i = 0; i < (3000 / 4); i++)
+    {
+        ASSERT(first[i] == 0xA5A5A5A5, "Unexpected value %08lx in first location %d after memset", first[i], i * 4);
+    }
+    memcpy(second, first, 3000);
+    for (int i = 0; i < (3000 / 4); i++)
+    {
+        ASSERT(second[i] == 0xA5A5A5A5, "Unexpected value %08lx in second location %d after memcpy", second[i], i * 4);
+    }
+
+    uint32_t *ram = malloc(1024);
+    ASSERT(ram != 0, "Failed to allocate RAM buffer!");
+    for (int i = 0; i < (1000 / 4); i++)
+    {
+        ram[i] = 0xBEEF0000 | i;
+    }
+    memcpy(third, ram, 1000);
+    for (int i = 0; i < (1000 / 4); i++)
+    {
+        ASSERT(third[i] == (0xBEEF0000 | i), "Unexpected value %08lx in third location %d after memcpy", third[i], i * 4);
+    }
+    memset(ram, 0, 1024);
+    memcpy(ram, third, 1000);
+    for (int i = 0; i < (1000 / 4); i++)
+    {
+        ASSERT(ram[i] == (0xBEEF0000 | i), "Unexpected value %08lx in RAM location %d after memcpy", ram[i], i * 4);
+    }
+    free(ram);
+
+    // Freeing should let us have the space back.
+    cache_ocram_free(first);
+    first = cache_ocram_malloc(3000);
+    ASSERT(first != 0, "Failed to reallocate first buffer!");
+
+    cache_ocram_free(first);
+    cache_ocram_free(second);
+    cache_ocram_free(third);
+    cache_ocram_disable();
+
+    ASSERT(cache_ocram_malloc(32) == 0, "Got operand cache RAM after disabling it!");
+}
@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include "naomi/interrupt.h"
 #include "naomi/thread.h"
+#include "naomi/timer.h"
 
 void test_interrupts_basic(test_context_t *context)
 {
@@ -33,3 +34,90 @@ void test_interrupts_basic(test_context_t *context)
     newstats = irq_stats();
     ASSERT(oldstats.num_interrupts < newstats.num_interrupts, "Didn't get any interrupts!");
 }
+
+void test_interrupts_tickless(test_context_t *context)
+{
+    // With only one thread able to run, the scheduler should not be ticking.
+    irq_stats_t oldstats = irq_stats();
+    timer_wait(100000);
+    irq_stats_t newstats = irq_stats();
+
+    unsigned int count = newstats.num_interrupts - oldstats.num_interrupts;
+    ASSERT(count < 50, "Got %d interrupts while only one thread was runnable!", count);
+
+    // With tickless mode off, we should be preempted at a regular rate.
+    thread_set_tickless(0);
+    oldstats = irq_stats();
+    timer_wait(100000);
+    newstats = irq_stats();
+    thread_set_tickless(1);
+
+    count = newstats.num_interrupts - oldstats.num_interrupts;
+    ASSERT(count >= 50, "Got only %d interrupts with periodic preemption!", count);
+}
+
+void test_interrupts_source_stats(test_context_t *context)
+{
+    // Syscalls should be counted against trapa.
+    irq_stats_t oldstats = irq_stats();
+    void *counter = global_counter_init(0);
+    global_counter_increment(counter);
+    global_counter_free(counter);
+    irq_stats_t newstats = irq_stats();
+
+    unsigned int count = newstats.sources[IRQ_STATS_TRAPA].count - oldstats.sources[IRQ_STATS_TRAPA].count;
+    ASSERT(count >= 3, "Got only %d syscalls counted!", count);
+
+    // Spinning with interrupts off should show up as the worst case.
+    irq_stats_reset();
+    uint32_t old_interrupts = irq_disable();
+    timer_wait(1000);
+    irq_restore(old_interrupts);
+    newstats = irq_stats();
+
+    ASSERT(newstats.max_disabled_time >= 1000, "Interrupts disabled for only %lu uS!", newstats.max_disabled_time);
+    ASSERT(newstats.max_disabled_time < 2000, "Interrupts disabled for %lu uS!", newstats.max_disabled_time);
+    ASSERT(newstats.max_disabled_caller != 0, "Didn't record who disabled interrupts!");
+
+    // Sleeping gets us woken up by an interrupt, which should show up in the latencies.
+    irq_stats_reset();
+    thread_sleep(1000);
+    newstats = irq_stats();
+
+    unsigned int wakes = 0;
+    for (int i = 0; i < IRQ_STATS_SOURCES; i++)
+    {
+        for (int j = 0; j < IRQ_LATENCY_BUCKETS; j++)
+        {
+            wakes += newstats.sources[i].wake_latency[j];
+        }
+    }
+    ASSERT(wakes >= 1, "Didn't record any wakeups!");
+}
+
+void _test_interrupts_deferred(unsigned int type, unsigned int bit, void *param)
+{
+    // We're on the service thread, so we're free to do thread things here.
+    global_counter_increment(param);
+}
+
+void test_interrupts_holly_deferred(test_context_t *context)
+{
+    void *counter = global_counter_init(0);
+    int ret = holly_interrupt_register(HOLLY_INTERRUPT_TYPE_NORMAL, HOLLY_NORMAL_INTERRUPT_VBLANK_OUT, 0, _test_interrupts_deferred, counter);
+    ASSERT(ret == 0, "Failed to register interrupt handler, got %d!", ret);
+
+    ret = holly_interrupt_register(HOLLY_INTERRUPT_TYPE_NORMAL, HOLLY_NORMAL_INTERRUPT_VBLANK_OUT, 0, _test_interrupts_deferred, counter);
+    ASSERT(ret < 0, "Registered the same interrupt twice!");
+
+    // We should see roughly one vblank every 16ms.
+    thread_sleep(100000);
+    holly_interrupt_unregister(HOLLY_INTERRUPT_TYPE_NORMAL, HOLLY_NORMAL_INTERRUPT_VBLANK_OUT);
+    uint32_t count = global_counter_value(counter);
+    ASSERT(count >= 3 && count <= 8, "Got %lu vblank handler calls in 100ms!", count);
+
+    // Nothing else should come in after unregistering.
+    thread_sleep(50000);
+    ASSERT(global_counter_value(counter) == count, "Handler was called after unregistering!");
+    global_counter_free(counter);
+}
@@ -1,5 +1,7 @@
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
+#include "naomi/thread.h"
 
 #define test_malloc_duration 10
 void test_malloc(test_context_t *context)
@@ -18,3 +20,61 @@ void test_malloc(test_context_t *context)
     free((void *)firstmalloc);
     free((void *)secondmalloc);
 }
+
+void test_malloc_small_reuse(test_context_t *context)
+{
+    // Small blocks that we free should be handed right back to us.
+    void *first = malloc(24);
+    ASSERT(first != 0, "Failed to allocate small block!");
+    free(first);
+
+    void *second = malloc(20);
+    ASSERT(second == first, "Small block %08lx was not reused, got %08lx!", (uint32_t)first, (uint32_t)second);
+    free(second);
+}
+
+void *malloc_thread(void *param)
+{
+    // Hammer the heap with a mix of small and large allocations.
+    void *blocks[16];
+    for (unsigned int round = 0; round < 200; round++)
+    {
+        for (unsigned int i = 0; i < 16; i++)
+        {
+            unsigned int size = (i & 1) ? 8 + (i * 8) : 256 + (round * 4);
+            blocks[i] = malloc(size);
+            if (blocks[i] == 0)
+            {
+                return (void *)1;
+            }
+            memset(blocks[i], (uint32_t)param, size);
+        }
+        for (unsigned int i = 0; i < 16; i++)
+        {
+            if (((uint8_t *)blocks[i])[4] != (uint32_t)param)
+            {
+                return (void *)1;
+            }
+            free(blocks[i]);
+        }
+    }
+
+    return 0;
+}
+
+void test_malloc_threads(test_context_t *context)
+{
+    uint32_t threads[4];
+    for (unsigned int i = 0; i < 4; i++)
+    {
+        threads[i] = thread_create("malloc", malloc_thread, (void *)(0x10 + i));
+        thread_start(threads[i]);
+    }
+
+    for (unsigned int i = 0; i < 4; i++)
+    {
+        uint32_t result = (uint32_t)thread_join(threads[i]);
+        ASSERT(result == 0, "Thread %d saw heap corruption!", i);
+        thread_destroy(threads[i]);
+    }
+}
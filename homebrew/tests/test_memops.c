@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 #include "naomi/video.h"
 #include "naomi/system.h"
 
@@ -66,3 +67,241 @@ void test_hw_memcpy(test_context_t *context)
         ASSERT(dest[i] == exp, "Unexpected value in VRAM location %d, %08lx != %08lx", i * 4, dest[i], exp);
     }
 }
+
+#define test_hw_memset_unaligned_duration 100
+void test_hw_memset_unaligned(test_context_t *context)
+{
+    uint8_t *scratch = (uint8_t *)video_scratch_area();
+    uint8_t *ram = malloc(1024);
+    uint8_t *regions[2] = { scratch, ram };
+    uint8_t expected[4] = { 0x44, 0x33, 0x22, 0x11 };
+
+    for (int region = 0; region < 2; region++)
+    {
+        uint8_t *base = regions[region];
+
+        // Odd start and odd length, with guard bytes on either side.
+        ASSERT(hw_memset(base, 0, 1024), "Failed to get hardware for memset!");
+        hw_memset(base + 3, 0x11223344, 601);
+
+        for (int i = 0; i < 1024; i++)
+        {
+            uint8_t exp = (i >= 3 && i < 604) ? expected[(((uint32_t)base) + i) & 0x3] : 0;
+            ASSERT(base[i] == exp, "Unexpected value %02x at offset %d in region %d", base[i], i, region);
+        }
+    }
+
+    // The libc memset should agree.
+    memset(ram, 0xAA, 1024);
+    memset(ram + 7, 0x5C, 999);
+    for (int i = 0; i < 1024; i++)
+    {
+        uint8_t exp = (i >= 7 && i < 1006) ? 0x5C : 0xAA;
+        ASSERT(ram[i] == exp, "Unexpected value %02x at offset %d", ram[i], i);
+    }
+
+    free(ram);
+}
+
+#define test_hw_memcpy_unaligned_duration 100
+void test_hw_memcpy_unaligned(test_context_t *context)
+{
+    uint8_t *scratch = (uint8_t *)video_scratch_area();
+    uint8_t *src = malloc(1024);
+    uint8_t *ram = malloc(1024);
+    uint8_t *regions[2] = { scratch, ram };
+
+    for (int i = 0; i < 1024; i++)
+    {
+        src[i] = (i * 7) + 3;
+    }
+
+    for (int region = 0; region < 2; region++)
+    {
+        uint8_t *base = regions[region];
+
+        // Try the source and destination sharing alignment, and then every way of
+        // them being off from each other.
+        for (int srcoff = 1; srcoff <= 4; srcoff++)
+        {
+            memset(base, 0, 1024);
+            hw_memcpy(base + 5, src + srcoff, 801);
+
+            for (int i = 0; i < 1024; i++)
+            {
+                uint8_t exp = (i >= 5 && i < 806) ? src[(i - 5) + srcoff] : 0;
+                ASSERT(base[i] == exp, "Unexpected value %02x at offset %d in region %d with source offset %d", base[i], i, region, srcoff);
+            }
+        }
+    }
+
+    // The libc memcpy should agree.
+    memset(ram, 0, 1024);
+    memcpy(ram + 9, src + 1, 1000);
+    for (int i = 0; i < 1024; i++)
+    {
+        uint8_t exp = (i >= 9 && i < 1009) ? src[(i - 9) + 1] : 0;
+        ASSERT(ram[i] == exp, "Unexpected value %02x at offset %d", ram[i], i);
+    }
+
+    free(src);
+    free(ram);
+}
+
+void *_test_hw_memset_contention_thread(void *param)
+{
+    // Fill the second half of the scratch area over and over, hoping to get preempted
+    // in the middle of the store queues at least a few times.
+    uint32_t *half = (uint32_t *)param;
+    for (int i = 0; i < 200; i++)
+    {
+        hw_memset(half, 0x5A5A0000 | i, 4096);
+    }
+
+    return 0;
+}
+
+#define test_hw_memset_contention_duration 500
+void test_hw_memset_contention(test_context_t *context)
+{
+    uint32_t *scratch = video_scratch_area();
+    uint32_t *half = scratch + (4096 / 4);
+
+    uint32_t thread = thread_create("memset", _test_hw_memset_contention_thread, half);
+    thread_start(thread);
+
+    // Meanwhile, do the same to the first half from this thread.
+    for (int i = 0; i < 200; i++)
+    {
+        hw_memset(scratch, 0xA5A50000 | i, 4096);
+    }
+    thread_join(thread);
+    thread_destroy(thread);
+
+    // Neither thread should have stepped on the other, even though both were using
+    // the store queues at the same time.
+    for (int i = 0; i < (4096 / 4); i++)
+    {
+        ASSERT(scratch[i] == 0xA5A500C7, "Unexpected value %08lx in VRAM location %d", scratch[i], i * 4);
+        ASSERT(half[i] == 0x5A5A00C7, "Unexpected value %08lx in VRAM location %d", half[i], 4096 + (i * 4));
+    }
+}
+
+static void *_test_hw_memcpy_fpu_thread(void *param)
+{
+    // Small enough to skip the store queues, so a copy to VRAM goes through the paired
+    // floating point moves, which run with FPSCR.SZ set.
+    uint32_t *dest = param;
+    uint32_t srcmem[(224 / 4) + 2];
+    uint32_t *src = (uint32_t *)((((uint32_t)srcmem) + 7) & 0xFFFFFFF8);
+
+    // Use the FPU right before every copy below so that this thread usually owns it
+    // when copying, and keep a value live in a floating point register across them all.
+    float accum = 0.0;
+    for (int i = 0; i < 2000; i++)
+    {
+        for (int j = 0; j < (224 / 4); j++)
+        {
+            src[j] = ((uint32_t)dest) ^ (i << 8) ^ j;
+        }
+
+        accum += 1.5;
+        hw_memcpy(dest, src, 224);
+
+        for (int j = 0; j < (224 / 4); j++)
+        {
+            if (dest[j] != src[j])
+            {
+                return (void *)1;
+            }
+        }
+        if (accum != (1.5 * (i + 1)))
+        {
+            return (void *)2;
+        }
+    }
+
+    return 0;
+}
+
+#define test_hw_memcpy_fpu_preempt_duration 1000
+void test_hw_memcpy_fpu_preempt(test_context_t *context)
+{
+    uint32_t *scratch = video_scratch_area();
+
+    // Two threads doing the same thing get preempted in the middle of each other's
+    // copies, which must not scramble either one's saved registers.
+    uint32_t first = thread_create("fpu memcpy 1", _test_hw_memcpy_fpu_thread, scratch);
+    uint32_t second = thread_create("fpu memcpy 2", _test_hw_memcpy_fpu_thread, scratch + (256 / 4));
+    thread_start(first);
+    thread_start(second);
+
+    int first_result = (int)thread_join(first);
+    int second_result = (int)thread_join(second);
+    thread_destroy(first);
+    thread_destroy(second);
+
+    ASSERT(first_result == 0, "First thread failed with %d", first_result);
+    ASSERT(second_result == 0, "Second thread failed with %d", second_result);
+}
+
+static void _test_hw_memcpy_async_cb(void *param)
+{
+    *((volatile int *)param) += 1;
+}
+
+#define test_hw_memcpy_async_duration 150
+void test_hw_memcpy_async(test_context_t *context)
+{
+    // Big enough that it goes through DMA and not the store queues.
+    unsigned int size = 4096;
+    void *srcmem = malloc(size + 32);
+    void *destmem = malloc(size + 32);
+    uint32_t *src = (uint32_t *)((((uint32_t)srcmem) + 31) & 0xFFFFFFE0);
+    uint32_t *dest = (uint32_t *)((((uint32_t)destmem) + 31) & 0xFFFFFFE0);
+    uint32_t *scratch = video_scratch_area();
+
+    for (int i = 0; i < (size / 4); i++)
+    {
+        src[i] = 0xC0DE0000 | i;
+        dest[i] = 0;
+    }
+    ASSERT(hw_memset(scratch, 0, size), "Failed to get hardware for memset!");
+
+    // Copy to VRAM, waiting with a semaphore.
+    semaphore_t done;
+    semaphore_init_count(&done, 1, 0);
+    ASSERT(hw_memcpy_async(scratch, src, size, &done), "Failed to queue DMA to VRAM!");
+    semaphore_acquire(&done);
+    ASSERT(hw_memcpy_async_pending() == 0, "Unexpected %d pending copies", hw_memcpy_async_pending());
+
+    for (int i = 0; i < (size / 4); i++)
+    {
+        ASSERT(scratch[i] == (0xC0DE0000 | i), "Unexpected value %08lx in VRAM location %d", scratch[i], i * 4);
+    }
+
+    // Copy to RAM, finding out with a callback.
+    volatile int called = 0;
+    ASSERT(hw_memcpy_async_callback(dest, src, size, _test_hw_memcpy_async_cb, (void *)&called), "Failed to queue DMA to RAM!");
+    while (hw_memcpy_async_pending() > 0) { thread_yield(); }
+    ASSERT(called == 1, "Callback was called %d times", called);
+
+    for (int i = 0; i < (size / 4); i++)
+    {
+        ASSERT(dest[i] == (0xC0DE0000 | i), "Unexpected value %08lx in RAM location %d", dest[i], i * 4);
+    }
+
+    // Small copies should still complete, even though they skip DMA.
+    called = 0;
+    ASSERT(hw_memcpy_async_callback(scratch, src + 64, 256, _test_hw_memcpy_async_cb, (void *)&called), "Failed to queue small copy!");
+    while (hw_memcpy_async_pending() > 0) { thread_yield(); }
+    ASSERT(called == 1, "Callback was called %d times", called);
+    ASSERT(scratch[0] == (0xC0DE0000 | 64), "Unexpected value %08lx in VRAM location 0", scratch[0]);
+
+    // Bad alignment should be rejected outright.
+    ASSERT(!hw_memcpy_async(scratch + 1, src, size, 0), "Unaligned copy was queued!");
+
+    semaphore_free(&done);
+    free(srcmem);
+    free(destmem);
+}
@@ -0,0 +1,61 @@
+#include <stdlib.h>
+#include "naomi/pool.h"
+
+void test_pool(test_context_t *context)
+{
+    pool_t pool;
+    ASSERT(pool_init(&pool, 10, 4), "Failed to initialize pool!");
+
+    pool_stats_t stats = pool_stats(&pool);
+    ASSERT(stats.object_size == 12, "Pool object size %d was not rounded up!", stats.object_size);
+    ASSERT(stats.capacity == 4, "Pool has wrong capacity %d!", stats.capacity);
+    ASSERT(stats.used == 0, "Pool has %d objects in use already!", stats.used);
+
+    // Drain the pool, making sure every object is distinct.
+    void *objects[4];
+    for (int i = 0; i < 4; i++)
+    {
+        objects[i] = pool_alloc(&pool);
+        ASSERT(objects[i] != 0, "Failed to allocate object %d from pool!", i);
+        for (int j = 0; j < i; j++)
+        {
+            ASSERT(objects[i] != objects[j], "Pool handed out object %d twice!", j);
+        }
+    }
+
+    ASSERT(pool_alloc(&pool) == 0, "Pool handed out more objects than its capacity!");
+
+    stats = pool_stats(&pool);
+    ASSERT(stats.used == 4, "Pool reports %d objects in use!", stats.used);
+    ASSERT(stats.peak == 4, "Pool reports peak usage of %d!", stats.peak);
+    ASSERT(stats.failures == 1, "Pool reports %d failed allocations!", stats.failures);
+
+    // Give one back, we should get the same one again.
+    pool_release(&pool, objects[2]);
+    ASSERT(pool_alloc(&pool) == objects[2], "Pool did not reuse released object!");
+
+    for (int i = 0; i < 4; i++)
+    {
+        pool_release(&pool, objects[i]);
+    }
+
+    stats = pool_stats(&pool);
+    ASSERT(stats.used == 0, "Pool reports %d objects in use after releasing all!", stats.used);
+    ASSERT(stats.peak == 4, "Pool reports peak usage of %d!", stats.peak);
+
+    pool_free(&pool);
+}
+
+void test_pool_static(test_context_t *context)
+{
+    uint32_t buffer[8];
+    pool_t pool;
+    ASSERT(pool_init_static(&pool, buffer, 8, 4), "Failed to initialize static pool!");
+    ASSERT(pool_slab_size(8, 4) == sizeof(buffer), "Pool slab size calculation is wrong!");
+
+    uint8_t *object = pool_alloc(&pool);
+    ASSERT(object >= (uint8_t *)buffer && object < ((uint8_t *)buffer) + sizeof(buffer), "Static pool object is outside of buffer!");
+
+    pool_release(&pool, object);
+    pool_free(&pool);
+}
@@ -0,0 +1,61 @@
+#include <stdlib.h>
+#include <string.h>
+#include "naomi/profile.h"
+
+void _test_profile_inner()
+{
+    PROFILE_ZONE("test_profile_inner");
+    timer_wait(100);
+}
+
+void test_profile_zones(test_context_t *context)
+{
+    profile_reset();
+
+    // Run one frame with nested zones.
+    {
+        PROFILE_ZONE("test_profile_outer");
+        for (int i = 0; i < 3; i++)
+        {
+            _test_profile_inner();
+        }
+    }
+    profile_frame();
+
+    profile_zone_stats_t stats[MAX_PROFILE_ZONES];
+    int count = profile_snapshot(stats, MAX_PROFILE_ZONES);
+
+    int outer = -1;
+    int inner = -1;
+    for (int i = 0; i < count; i++)
+    {
+        if (strcmp(stats[i].name, "test_profile_outer") == 0)
+        {
+            outer = i;
+        }
+        if (strcmp(stats[i].name, "test_profile_inner") == 0)
+        {
+            inner = i;
+        }
+    }
+
+    ASSERT(outer >= 0, "Did not find outer zone in snapshot!");
+    ASSERT(inner >= 0, "Did not find inner zone in snapshot!");
+    ASSERT(stats[inner].parent == outer, "Inner zone has parent %d instead of %d!", stats[inner].parent, outer);
+    ASSERT(stats[inner].depth == stats[outer].depth + 1, "Inner zone has wrong depth %u!", stats[inner].depth);
+    ASSERT(stats[outer].count == 1, "Outer zone was counted %lu times!", stats[outer].count);
+    ASSERT(stats[inner].count == 3, "Inner zone was counted %lu times!", stats[inner].count);
+    // Other threads can preempt us in the middle of a zone, so there's no upper bound on
+    // how long each one takes, only a lower one.
+    ASSERT(stats[inner].min >= 100 && stats[inner].max >= stats[inner].min, "Inner zone took between %lu and %lu us!", stats[inner].min, stats[inner].max);
+    ASSERT(stats[outer].total >= stats[inner].total, "Outer zone total %lu is less than inner zone total %lu!", stats[outer].total, stats[inner].total);
+    ASSERT(stats[inner].p50 >= 100, "Inner zone median is %lu us!", stats[inner].p50);
+
+    // The next frame didn't enter any zones, so it should be empty.
+    profile_frame();
+    count = profile_snapshot(stats, MAX_PROFILE_ZONES);
+    ASSERT(count > inner, "Zones disappeared from snapshot!");
+    ASSERT(stats[inner].count == 0, "Inner zone was counted %lu times in an empty frame!", stats[inner].count);
+
+    profile_reset();
+}
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "naomi/romfs.h"
+
+#define test_romfs_fopen_duration 50
+void test_romfs_fopen(test_context_t *context)
+{
+    ASSERT(romfs_present(), "Did not find the ROMFS attached to the test ROM!");
+
+    FILE *fp = fopen("/hello.txt", "r");
+    ASSERT(fp != 0, "Failed to open hello.txt, errno %d!", errno);
+
+    char line[64];
+    ASSERT(fgets(line, sizeof(line), fp) != 0, "Failed to read from hello.txt!");
+    ASSERT(strcmp(line, "Hello from the ROMFS!\n") == 0, "Unexpected contents \"%s\" in hello.txt!", line);
+    ASSERT(fgets(line, sizeof(line), fp) == 0, "Read past the end of hello.txt!");
+    ASSERT(feof(fp), "Expected to be at the end of hello.txt!");
+    fclose(fp);
+
+    // The leading slash is optional, but it can't be opened for writing.
+    fp = fopen("hello.txt", "rb");
+    ASSERT(fp != 0, "Failed to open hello.txt without a leading slash, errno %d!", errno);
+    fclose(fp);
+
+    ASSERT(fopen("hello.txt", "w") == 0, "Opened a ROMFS file for writing!");
+    ASSERT(errno == EROFS, "Unexpected errno %d opening a ROMFS file for writing!", errno);
+    ASSERT(fopen("/missing.txt", "r") == 0, "Opened a file that doesn't exist!");
+    ASSERT(errno == ENOENT, "Unexpected errno %d opening a missing file!", errno);
+}
+
+#define test_romfs_seek_duration 50
+void test_romfs_seek(test_context_t *context)
+{
+    int fd = open("/data/numbers.txt", O_RDONLY);
+    ASSERT(fd >= 0, "Failed to open data/numbers.txt, errno %d!", errno);
+
+    struct stat st;
+    ASSERT(fstat(fd, &st) == 0, "Failed to stat data/numbers.txt, errno %d!", errno);
+    ASSERT(st.st_size == 3890, "Unexpected size %ld for data/numbers.txt!", (long)st.st_size);
+    ASSERT(S_ISREG(st.st_mode), "Unexpected mode %08lx for data/numbers.txt!", (uint32_t)st.st_mode);
+
+    // Each number below 10 takes up 2 bytes, and each number below 100 takes up 3.
+    char buffer[8];
+    ASSERT(lseek(fd, 20 + (3 * 32), SEEK_SET) == 116, "Failed to seek into data/numbers.txt!");
+    ASSERT(read(fd, buffer, 3) == 3, "Failed to read from data/numbers.txt!");
+    ASSERT(memcmp(buffer, "42\n", 3) == 0, "Unexpected contents at offset 116 in data/numbers.txt!");
+
+    // Odd offsets and odd destinations need special care when reading out of the ROM.
+    ASSERT(lseek(fd, -4, SEEK_CUR) == 115, "Failed to seek backwards in data/numbers.txt!");
+    ASSERT(read(fd, buffer + 1, 5) == 5, "Failed to read from data/numbers.txt!");
+    ASSERT(memcmp(buffer + 1, "\n42\n4", 5) == 0, "Unexpected contents at offset 115 in data/numbers.txt!");
+
+    // Reads are cut short at the end of the file.
+    ASSERT(lseek(fd, -4, SEEK_END) == 3886, "Failed to seek from the end of data/numbers.txt!");
+    ASSERT(read(fd, buffer, 8) == 4, "Expected a short read at the end of data/numbers.txt!");
+    ASSERT(memcmp(buffer, "999\n", 4) == 0, "Unexpected contents at the end of data/numbers.txt!");
+    ASSERT(read(fd, buffer, 8) == 0, "Expected nothing left to read in data/numbers.txt!");
+
+    ASSERT(close(fd) == 0, "Failed to close data/numbers.txt, errno %d!", errno);
+    ASSERT(read(fd, buffer, 1) < 0, "Read from a closed file!");
+
+    ASSERT(stat("/data/numbers.txt", &st) == 0 && st.st_size == 3890, "Failed to stat data/numbers.txt by name!");
+    ASSERT(stat("/data", &st) != 0, "Directories should not be found by stat!");
+}
+
+#define test_romfs_map_duration 50
+void test_romfs_map(test_context_t *context)
+{
+    unsigned int size = 0;
+    char *data = romfs_map("/data/numbers.txt", &size);
+    ASSERT(data != 0, "Failed to map data/numbers.txt!");
+    ASSERT((((uint32_t)data) & 0x1F) == 0, "Mapped data/numbers.txt is not 32-byte aligned!");
+    ASSERT(size == 3890, "Unexpected size %d for mapped data/numbers.txt!", size);
+
+    // Walk the whole file and make sure every number is where we expect.
+    unsigned int offset = 0;
+    for (int i = 0; i < 1000; i++)
+    {
+        char expected[8];
+        int length = sprintf(expected, "%d\n", i);
+        ASSERT(offset + length <= size, "Ran out of data at number %d!", i);
+        ASSERT(memcmp(data + offset, expected, length) == 0, "Unexpected contents for number %d!", i);
+        offset += length;
+    }
+
+    romfs_unmap(data);
+    ASSERT(romfs_map("/missing.txt", &size) == 0, "Mapped a file that doesn't exist!");
+}
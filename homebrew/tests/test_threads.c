@@ -1,6 +1,7 @@
 // vim: set fileencoding=utf-8
 #include <stdlib.h>
 #include <math.h>
+#include "naomi/interrupt.h"
 #include "naomi/thread.h"
 
 void *basic_thread(void *param)
@@ -36,6 +37,30 @@ void test_threads_basic(test_context_t *context)
     global_counter_free(counter);
 }
 
+void test_threads_stale_handles(test_context_t *context)
+{
+    // Free a thread and a counter, then create new ones which will reuse their slots.
+    uint32_t thread = thread_create("stale", basic_thread, 0);
+    void *counter = global_counter_init(1);
+    thread_destroy(thread);
+    global_counter_free(counter);
+
+    uint32_t newthread = thread_create("new", basic_thread, 0);
+    void *newcounter = global_counter_init(2);
+
+    ASSERT(thread != newthread, "Reused thread has same ID as destroyed thread!");
+    ASSERT(counter != newcounter, "Reused counter has same handle as freed counter!");
+
+    // Make sure the old handles don't refer to the new objects.
+    thread_info_t info = thread_info(thread);
+    ASSERT(info.alive == 0, "Destroyed thread handle refers to a live thread!");
+    ASSERT(global_counter_value(counter) == 0, "Freed counter handle refers to a live counter!");
+    ASSERT(global_counter_value(newcounter) == 2, "Got wrong value back from counter!");
+
+    thread_destroy(newthread);
+    global_counter_free(newcounter);
+}
+
 void *semaphore_thread(void *param)
 {
     int profile = profile_start();
@@ -114,6 +139,45 @@ void test_threads_semaphore(test_context_t *context)
     semaphore_free(&semaphore);
 }
 
+static volatile unsigned int semaphore_count_progress = 0;
+
+void *semaphore_count_thread(void *param)
+{
+    semaphore_t *semaphore = param;
+
+    semaphore_acquire(semaphore);
+    semaphore_count_progress++;
+    semaphore_acquire(semaphore);
+    semaphore_count_progress++;
+
+    return 0;
+}
+
+void test_threads_semaphore_count(test_context_t *context)
+{
+    semaphore_t semaphore;
+    semaphore_init_count(&semaphore, 2, 0);
+    semaphore_count_progress = 0;
+
+    uint32_t thread = thread_create("count", semaphore_count_thread, &semaphore);
+    thread_start(thread);
+
+    // Nothing is available to begin with, so the thread should be stuck until we release.
+    thread_sleep(10000);
+    ASSERT(semaphore_count_progress == 0, "Thread acquired a semaphore that started out empty!");
+
+    semaphore_release(&semaphore);
+    thread_sleep(10000);
+    ASSERT(semaphore_count_progress == 1, "Unexpected progress %d after one release!", semaphore_count_progress);
+
+    semaphore_release(&semaphore);
+    thread_join(thread);
+    ASSERT(semaphore_count_progress == 2, "Unexpected progress %d after two releases!", semaphore_count_progress);
+
+    thread_destroy(thread);
+    semaphore_free(&semaphore);
+}
+
 void *mutex_try_thread(void *param)
 {
     mutex_t *mutex = param;
@@ -207,6 +271,143 @@ void test_threads_mutex_lock(test_context_t *context)
     mutex_free(&mutex);
 }
 
+static mutex_t fifo_mutex;
+static unsigned int fifo_order[3];
+static unsigned int fifo_position = 0;
+
+void *mutex_fifo_thread(void *param)
+{
+    mutex_lock(&fifo_mutex);
+    fifo_order[fifo_position++] = (unsigned int)param;
+    mutex_unlock(&fifo_mutex);
+
+    return 0;
+}
+
+void test_threads_mutex_fifo(test_context_t *context)
+{
+    mutex_init(&fifo_mutex);
+    fifo_position = 0;
+
+    uint32_t threads[3];
+    mutex_lock(&fifo_mutex);
+
+    // Start each thread and give it a chance to block on the mutex, so we know
+    // the order that they started waiting in.
+    for(unsigned int i = 0; i < (sizeof(threads) / sizeof(threads[0])); i++)
+    {
+        threads[i] = thread_create("test", mutex_fifo_thread, (void *)i);
+        thread_start(threads[i]);
+        thread_sleep(1000);
+    }
+
+    mutex_unlock(&fifo_mutex);
+
+    for(unsigned int i = 0; i < (sizeof(threads) / sizeof(threads[0])); i++)
+    {
+        thread_join(threads[i]);
+        thread_destroy(threads[i]);
+    }
+    mutex_free(&fifo_mutex);
+
+    ASSERT(fifo_position == 3, "Expected all threads to acquire the mutex!");
+    ASSERT(
+        fifo_order[0] == 0 && fifo_order[1] == 1 && fifo_order[2] == 2,
+        "Expected threads to acquire the mutex in the order they waited, got %d, %d, %d!",
+        fifo_order[0], fifo_order[1], fifo_order[2]
+    );
+}
+
+static volatile unsigned int low_priority_progress = 0;
+static volatile unsigned int low_priority_stop = 0;
+
+void *low_priority_thread(void *param)
+{
+    while (!low_priority_stop)
+    {
+        low_priority_progress++;
+    }
+
+    return 0;
+}
+
+void *high_priority_thread(void *param)
+{
+    unsigned int start = low_priority_progress;
+
+    for (volatile unsigned int i = 0; i < 1000000; i++) { ; }
+
+    return (void *)(low_priority_progress - start);
+}
+
+void test_threads_priority(test_context_t *context)
+{
+    low_priority_progress = 0;
+    low_priority_stop = 0;
+
+    uint32_t low = thread_create("low", low_priority_thread, 0);
+    uint32_t high = thread_create("high", high_priority_thread, 0);
+    thread_priority(high, 1);
+
+    thread_info_t info = thread_info(high);
+    ASSERT(info.priority == 1, "Thread has wrong priority after being changed!");
+
+    thread_start(low);
+    thread_start(high);
+
+    // The high priority thread should never be preempted by the low priority thread.
+    unsigned int progress = (uint32_t)thread_join(high);
+    ASSERT(progress == 0, "Low priority thread ran %d times while high priority thread was running!", progress);
+
+    // Now, the low priority thread should get a chance to run.
+    thread_sleep(10000);
+    ASSERT(low_priority_progress > 0, "Low priority thread never got scheduled!");
+
+    low_priority_stop = 1;
+    thread_join(low);
+
+    thread_destroy(low);
+    thread_destroy(high);
+}
+
+void *stack_thread(void *param)
+{
+    // Touch a known amount of stack so that it shows up in the high-water mark.
+    volatile uint8_t buffer[4096];
+    for (unsigned int i = 0; i < sizeof(buffer); i++)
+    {
+        buffer[i] = i;
+    }
+
+    return (void *)(uint32_t)buffer[100];
+}
+
+void test_threads_stack(test_context_t *context)
+{
+    uint32_t thread = thread_create_ex("stack", stack_thread, 0, 10000);
+    ASSERT(thread != 0, "Failed to create thread with custom stack size!");
+
+    thread_info_t info = thread_info(thread);
+    ASSERT(info.stack_size == 16384, "Thread has wrong stack size %d!", info.stack_size);
+    ASSERT(info.stack_used == 0, "Thread used %d bytes of stack before starting!", info.stack_used);
+
+    thread_start(thread);
+    uint32_t retval = (uint32_t)thread_join(thread);
+    ASSERT(retval == 100, "Thread did not return correct value!");
+
+    info = thread_info(thread);
+    ASSERT(info.stack_used >= 4096, "Thread reports only %d bytes of stack used!", info.stack_used);
+    ASSERT(info.stack_used < info.stack_size, "Thread reports %d bytes of stack used!", info.stack_used);
+    thread_destroy(thread);
+
+    // A recycled stack should be repainted for the new thread.
+    thread = thread_create_ex("stack", stack_thread, 0, 16384);
+    info = thread_info(thread);
+    ASSERT(info.stack_size == 16384, "Thread has wrong stack size %d!", info.stack_size);
+    ASSERT(info.stack_used == 0, "Recycled stack was not repainted, %d bytes used!", info.stack_used);
+    thread_destroy(thread);
+}
+
 void *wait_thread(void *param)
 {
     timer_wait(250000);
@@ -245,3 +446,82 @@ void test_threads_sleep(test_context_t *context)
     ASSERT(time_spent > 250000, "Did not wait enough time in thread!");
     ASSERT(time_spent < 251000, "Spent too much time bookkeeping!");
 }
+
+static volatile unsigned int fpu_owner_done = 0;
+
+static uint32_t fpu_owner_sr()
+{
+    uint32_t sr;
+    __asm__ volatile ("stc sr,%0" : "=r" (sr));
+    return sr;
+}
+
+void *fpu_owner_thread(void *param)
+{
+    // New threads don't own the FPU, and disabling interrupts or going through the heap
+    // shouldn't change that.
+    if ((fpu_owner_sr() & 0x8000) == 0)
+    {
+        return (void *)1;
+    }
+    uint32_t old_interrupts = irq_disable();
+    irq_restore(old_interrupts);
+    free(malloc(64));
+    if ((fpu_owner_sr() & 0x8000) == 0)
+    {
+        return (void *)2;
+    }
+
+    // Using it makes us the owner. Keep a value in a register across other threads using
+    // the FPU as well. This is done in assembly so the compiler doesn't spill it to the
+    // stack for us.
+    __asm__ volatile ("fldi1 fr12\n\tfadd fr12,fr12" : : : "memory");
+    if ((fpu_owner_sr() & 0x8000) != 0)
+    {
+        return (void *)3;
+    }
+
+    for (int i = 0; i < 100; i++)
+    {
+        thread_yield();
+    }
+    timer_wait(5000);
+
+    uint32_t result;
+    __asm__ volatile ("flds fr12,fpul\n\tsts fpul,%0" : "=r" (result) : : "memory");
+
+    // 2.0 as a single precision float.
+    return (void *)(result == 0x40000000 ? 0 : 4);
+}
+
+void *fpu_clobber_thread(void *param)
+{
+    while (!fpu_owner_done)
+    {
+        __asm__ volatile ("fldi0 fr12" : : : "fr12");
+        thread_yield();
+    }
+
+    return 0;
+}
+
+void test_threads_fpu_ownership(test_context_t *context)
+{
+    fpu_owner_done = 0;
+
+    uint32_t owner = thread_create("owner", fpu_owner_thread, 0);
+    uint32_t clobber = thread_create("clobber", fpu_clobber_thread, 0);
+    thread_start(owner);
+    thread_start(clobber);
+
+    int result = (int)thread_join(owner);
+    fpu_owner_done = 1;
+    thread_join(clobber);
+    thread_destroy(owner);
+    thread_destroy(clobber);
+
+    ASSERT(result != 1, "New thread started out owning the FPU!");
+    ASSERT(result != 2, "Thread took the FPU without using it!");
+    ASSERT(result != 3, "Thread did not get the FPU after using it!");
+    ASSERT(result != 4, "Lost floating point value when another thread used the FPU!");
+}
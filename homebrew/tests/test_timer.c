@@ -0,0 +1,104 @@
+// vim: set fileencoding=utf-8
+#include <stdlib.h>
+#include "naomi/interrupt.h"
+#include "naomi/thread.h"
+#include "naomi/timer.h"
+
+void test_timer_clock(test_context_t *context)
+{
+    ASSERT(timer_ticks_to_us(TIMER_TICKS_PER_SECOND) == 1000000, "Ticks per second converted to %lu us!", (uint32_t)timer_ticks_to_us(TIMER_TICKS_PER_SECOND));
+    ASSERT(timer_ticks_to_ns(TIMER_TICKS_PER_SECOND) == 1000000000, "Ticks per second converted to %lu ns!", (uint32_t)timer_ticks_to_ns(TIMER_TICKS_PER_SECOND));
+    ASSERT(timer_us_to_ticks(1000000) == TIMER_TICKS_PER_SECOND, "One second converted to %lu ticks!", (uint32_t)timer_us_to_ticks(1000000));
+
+    // The clock should never go backwards.
+    uint64_t last = timer_now_ticks();
+    for (int i = 0; i < 10000; i++)
+    {
+        uint64_t now = timer_now_ticks();
+        ASSERT(now >= last, "Clock went backwards on read %d!", i);
+        last = now;
+    }
+
+    // Waiting should advance the clock by about as much as we waited.
+    uint64_t start = timer_now_us();
+    timer_wait(10000);
+    uint64_t waited = timer_now_us() - start;
+    ASSERT(waited >= 10000 && waited < 11000, "Clock advanced %lu us during a 10000 us wait!", (uint32_t)waited);
+
+    // It should work the same with interrupts disabled.
+    uint32_t old_interrupts = irq_disable();
+    start = timer_now_ns();
+    timer_wait(1000);
+    waited = timer_now_ns() - start;
+    irq_restore(old_interrupts);
+    ASSERT(waited >= 1000000 && waited < 1100000, "Clock advanced %lu ns during a 1000 us wait!", (uint32_t)waited);
+}
+
+void _test_timer_soft_count(soft_timer_t *timer, void *param)
+{
+    (*((volatile int *)param))++;
+}
+
+typedef struct
+{
+    mutex_t mutex;
+    volatile int fired;
+} deferred_param_t;
+
+void _test_timer_soft_deferred(soft_timer_t *timer, void *param)
+{
+    // This runs on a thread, so it should be able to take a mutex.
+    deferred_param_t *deferred = param;
+    mutex_lock(&deferred->mutex);
+    deferred->fired++;
+    mutex_unlock(&deferred->mutex);
+}
+
+void test_timer_soft(test_context_t *context)
+{
+    volatile int oneshot = 0;
+    volatile int periodic = 0;
+
+    soft_timer_t *first = soft_timer_create(_test_timer_soft_count, (void *)&oneshot, SOFT_TIMER_IRQ);
+    soft_timer_t *second = soft_timer_create(_test_timer_soft_count, (void *)&periodic, SOFT_TIMER_IRQ);
+    ASSERT(first != 0 && second != 0, "Failed to create software timers!");
+
+    // A one-shot timer should fire exactly once, and a periodic one repeatedly.
+    soft_timer_start(first, 2000, 0);
+    soft_timer_start(second, 1000, 1000);
+    ASSERT(soft_timer_active(first), "One-shot timer is not active!");
+    timer_wait(10500);
+    soft_timer_stop(second);
+
+    ASSERT(oneshot == 1, "One-shot timer fired %d times!", oneshot);
+    ASSERT(!soft_timer_active(first), "One-shot timer is still active after firing!");
+    ASSERT(periodic >= 9 && periodic <= 11, "Periodic timer fired %d times in 10.5ms!", periodic);
+
+    // A stopped timer should never fire.
+    int stopped = periodic;
+    soft_timer_start(first, 1000, 0);
+    soft_timer_stop(first);
+    timer_wait(3000);
+    ASSERT(oneshot == 1, "Stopped one-shot timer fired!");
+    ASSERT(periodic == stopped, "Stopped periodic timer fired!");
+
+    soft_timer_destroy(first);
+    soft_timer_destroy(second);
+}
+
+void test_timer_soft_deferred(test_context_t *context)
+{
+    deferred_param_t param;
+    mutex_init(&param.mutex);
+    param.fired = 0;
+
+    soft_timer_t *timer = soft_timer_create(_test_timer_soft_deferred, &param, SOFT_TIMER_DEFERRED);
+    ASSERT(timer != 0, "Failed to create deferred software timer!");
+
+    soft_timer_start(timer, 1000, 0);
+    thread_sleep(5000);
+    ASSERT(param.fired == 1, "Deferred timer fired %d times!", param.fired);
+
+    soft_timer_destroy(timer);
+    mutex_free(&param.mutex);
+}
@@ -0,0 +1,52 @@
+// vim: set fileencoding=utf-8
+#include "naomi/video.h"
+#include "naomi/thread.h"
+#include "naomi/timer.h"
+
+void _test_video_vblank_cb(int event, void *param)
+{
+    (*((volatile int *)param))++;
+}
+
+void test_video_wait_vblank(test_context_t *context)
+{
+    volatile int calls = 0;
+    int ret = video_register_vblank_callback(VIDEO_VBLANK_IN, _test_video_vblank_cb, (void *)&calls);
+    ASSERT(ret == 0, "Failed to register vblank callback, got %d!", ret);
+
+    uint32_t before = video_vblank_count();
+    uint64_t start = timer_now_us();
+    for (int i = 0; i < 3; i++)
+    {
+        video_wait_vblank();
+    }
+    uint64_t elapsed = timer_now_us() - start;
+    uint32_t after = video_vblank_count();
+    video_unregister_vblank_callback(VIDEO_VBLANK_IN, _test_video_vblank_cb, (void *)&calls);
+
+    ASSERT(after - before == 3, "Expected 3 vblanks, saw %lu!", after - before);
+    ASSERT(calls == 3, "Expected 3 vblank callbacks, got %d!", calls);
+
+    // Three frames at 60hz, give or take one for where we started.
+    ASSERT(elapsed >= 33000 && elapsed <= 51000, "Waiting for 3 vblanks took %lu uS!", (uint32_t)elapsed);
+}
+
+void test_video_triple_buffering(test_context_t *context)
+{
+    video_set_triple_buffering(1);
+
+    // With nothing queued yet, handing off a frame shouldn't wait for the display.
+    video_wait_vblank();
+    uint64_t start = timer_now_us();
+    video_display_on_vblank();
+    uint64_t elapsed = timer_now_us() - start;
+    ASSERT(elapsed < 8000, "Queueing a frame took %lu uS!", (uint32_t)elapsed);
+
+    // Queueing another before the first made it to the screen has to wait for it.
+    start = timer_now_us();
+    video_display_on_vblank();
+    elapsed = timer_now_us() - start;
+    ASSERT(elapsed >= 8000, "Queueing a second frame only took %lu uS!", (uint32_t)elapsed);
+
+    video_set_triple_buffering(0);
+}
@@ -0,0 +1,88 @@
+#include <stdlib.h>
+#include "naomi/thread.h"
+#include "naomi/workqueue.h"
+
+void *square_job(void *param)
+{
+    uint32_t value = (uint32_t)param;
+    return (void *)(value * value);
+}
+
+void *increment_job(void *param)
+{
+    global_counter_increment(param);
+    return 0;
+}
+
+void test_workqueue_basic(test_context_t *context)
+{
+    workqueue_t *queue = workqueue_create("worker", 4, 8, 16384);
+    ASSERT(queue != 0, "Failed to create work queue!");
+
+    // Submit more jobs than the queue can hold at once, so we block on a full queue.
+    job_t *jobs[32];
+    for (uint32_t i = 0; i < 32; i++)
+    {
+        jobs[i] = workqueue_submit(queue, square_job, (void *)i, 0);
+        ASSERT(jobs[i] != 0, "Failed to submit job %d!", i);
+    }
+
+    for (uint32_t i = 0; i < 32; i++)
+    {
+        uint32_t result = (uint32_t)job_wait(jobs[i]);
+        ASSERT(result == i * i, "Job %d returned %d instead of %d!", i, result, i * i);
+    }
+
+    // Detached jobs should still run to completion before we're destroyed.
+    void *counter = global_counter_init(0);
+    for (uint32_t i = 0; i < 8; i++)
+    {
+        job_detach(workqueue_submit(queue, increment_job, counter, 0));
+    }
+
+    workqueue_destroy(queue);
+    ASSERT(global_counter_value(counter) == 8, "Only %d detached jobs ran!", global_counter_value(counter));
+    global_counter_free(counter);
+}
+
+static uint32_t job_order[3];
+static unsigned int job_order_count;
+
+void *blocking_job(void *param)
+{
+    thread_sleep(10000);
+    return 0;
+}
+
+void *order_job(void *param)
+{
+    job_order[job_order_count++] = (uint32_t)param;
+    return 0;
+}
+
+void test_workqueue_priority(test_context_t *context)
+{
+    job_order_count = 0;
+    workqueue_t *queue = workqueue_create("worker", 1, 8, 16384);
+    ASSERT(queue != 0, "Failed to create work queue!");
+
+    // Keep the only worker busy while we queue up jobs of different priorities.
+    job_t *blocker = workqueue_submit(queue, blocking_job, 0, 0);
+    thread_yield();
+
+    job_t *low = workqueue_submit(queue, order_job, (void *)1, -5);
+    job_t *mid = workqueue_submit(queue, order_job, (void *)2, 0);
+    job_t *high = workqueue_submit(queue, order_job, (void *)3, 5);
+
+    job_wait(blocker);
+    job_wait(low);
+    ASSERT(job_done(mid), "Higher priority job did not finish before lower priority job!");
+    ASSERT(job_done(high), "Higher priority job did not finish before lower priority job!");
+    job_wait(mid);
+    job_wait(high);
+
+    ASSERT(job_order_count == 3, "Only %d jobs ran!", job_order_count);
+    ASSERT(job_order[0] == 3 && job_order[1] == 2 && job_order[2] == 1, "Jobs ran in wrong order %d, %d, %d!", job_order[0], job_order[1], job_order[2]);
+
+    workqueue_destroy(queue);
+}
@@ -0,0 +1,126 @@
+#! /usr/bin/env python3
+import argparse
+import os
+import os.path
+import struct
+import sys
+from typing import List, Tuple
+
+
+# These must match the definitions in libnaomi/romfs.c.
+ROMFS_MAGIC = b"RMFS"
+ROMFS_VERSION = 1
+ROMFS_HEADER_LENGTH = 32
+ROMFS_ENTRY_LENGTH = 16
+ROMFS_DATA_ALIGNMENT = 32
+
+
+def fnv1a(data: bytes) -> int:
+    value = 0x811C9DC5
+    for b in data:
+        value ^= b
+        value = (value * 0x01000193) & 0xFFFFFFFF
+    return value
+
+
+def align(value: int, alignment: int) -> int:
+    return (value + (alignment - 1)) & ~(alignment - 1)
+
+
+def collect(directory: str) -> List[Tuple[bytes, str]]:
+    files: List[Tuple[bytes, str]] = []
+    for root, dirs, filenames in os.walk(directory):
+        # Walk in a stable order so that images are reproducible.
+        dirs.sort()
+        for filename in sorted(filenames):
+            path = os.path.join(root, filename)
+            name = os.path.relpath(path, directory).replace(os.path.sep, "/")
+            files.append((name.encode('utf-8'), path))
+    return files
+
+
+def build(files: List[Tuple[bytes, str]]) -> bytes:
+    # Use a power of two bucket count so lookups can mask instead of divide.
+    bucket_count = 1
+    while bucket_count < len(files):
+        bucket_count *= 2
+
+    # Entries are sorted by bucket so each bucket is just a range of entries.
+    hashed = sorted(
+        ((fnv1a(name), name, path) for name, path in files),
+        key=lambda entry: (entry[0] & (bucket_count - 1), entry[1]),
+    )
+
+    buckets = [0] * (bucket_count + 1)
+    for hashval, _, _ in hashed:
+        buckets[(hashval & (bucket_count - 1)) + 1] += 1
+    for i in range(bucket_count):
+        buckets[i + 1] += buckets[i]
+
+    entries_offset = ROMFS_HEADER_LENGTH + (len(buckets) * 4)
+    names_offset = entries_offset + (len(hashed) * ROMFS_ENTRY_LENGTH)
+
+    names = b""
+    name_offsets: List[int] = []
+    for _, name, _ in hashed:
+        name_offsets.append(len(names))
+        names += name + b"\0"
+
+    index_size = align(names_offset + len(names), ROMFS_DATA_ALIGNMENT)
+
+    entries = b""
+    data = b""
+    for (hashval, _, path), name_offset in zip(hashed, name_offsets):
+        with open(path, "rb") as bfp:
+            filedata = bfp.read()
+
+        entries += struct.pack("<IIII", hashval, name_offset, index_size + len(data), len(filedata))
+        data += filedata + (b"\0" * (align(len(filedata), ROMFS_DATA_ALIGNMENT) - len(filedata)))
+
+    header = struct.pack(
+        "<4sIIIIIII",
+        ROMFS_MAGIC,
+        ROMFS_VERSION,
+        index_size + len(data),
+        index_size,
+        len(hashed),
+        bucket_count,
+        entries_offset,
+        names_offset,
+    )
+    index = header + b"".join(struct.pack("<I", b) for b in buckets) + entries + names
+    index += b"\0" * (index_size - len(index))
+
+    return index + data
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(
+        description="Utility for packing a directory into a ROMFS image that can be attached to a ROM with makerom.",
+    )
+    parser.add_argument(
+        'img',
+        metavar='IMG',
+        type=str,
+        help='The ROMFS image we should generate.',
+    )
+    parser.add_argument(
+        'dir',
+        metavar='DIR',
+        type=str,
+        help='The directory we should pack. Files will be accessible relative to this directory.',
+    )
+    args = parser.parse_args()
+
+    if not os.path.isdir(args.dir):
+        print(f"{args.dir} is not a directory!", file=sys.stderr)
+        return 1
+
+    with open(args.img, "wb") as bfp:
+        bfp.write(build(collect(args.dir)))
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -20,6 +20,8 @@ from netdimm.message import (
     send_message,
     MAX_PACKET_LENGTH,
     MAX_MESSAGE_LENGTH,
+    MESSAGE_HOST_TRACE,
+    MESSAGE_HOST_SAMPLES,
     MESSAGE_HOST_STDOUT,
     MESSAGE_HOST_STDERR,
 )
@@ -44,6 +46,8 @@ __all__ = [
     "send_message",
     "MAX_PACKET_LENGTH",
     "MAX_MESSAGE_LENGTH",
+    "MESSAGE_HOST_TRACE",
+    "MESSAGE_HOST_SAMPLES",
     "MESSAGE_HOST_STDOUT",
     "MESSAGE_HOST_STDERR",
 ]
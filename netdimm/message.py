@@ -259,6 +259,8 @@ MAX_MESSAGE_DATA_LENGTH: int = MAX_PACKET_LENGTH - MESSAGE_HEADER_LENGTH
 MAX_MESSAGE_LENGTH: int = 0xFFFF
 
 
+MESSAGE_HOST_TRACE: int = 0x7FFC
+MESSAGE_HOST_SAMPLES: int = 0x7FFD
 MESSAGE_HOST_STDOUT: int = 0x7FFE
 MESSAGE_HOST_STDERR: int = 0x7FFF
 
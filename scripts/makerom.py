@@ -8,6 +8,10 @@ from typing import List
 from naomi import NaomiRom, NaomiRomRegionEnum, NaomiExecutable, NaomiRomSection
 
 
+# Where an attached ROMFS image starts, relative to the end of the executable sections.
+ROMFS_ALIGNMENT = 0x1000
+
+
 def main() -> int:
     # Create the argument parser
     parser = argparse.ArgumentParser(
@@ -128,6 +132,18 @@ def main() -> int:
         help='Mark that the main binary also includes the test binary entrypoint.',
     )
 
+    parser.add_argument(
+        '-r',
+        '--romfs',
+        metavar="IMG",
+        type=str,
+        default=None,
+        help=(
+            'Attach this ROMFS image, as generated by homebrew/tools/romfs.py, so that libnaomi '
+            'can open the files inside it at runtime.'
+        ),
+    )
+
     parser.add_argument(
         '-b',
         '--pad-before-data',
@@ -269,6 +285,18 @@ def main() -> int:
         entrypoint=int(args.test_entrypoint, 16)
     )
 
+    # Now, attach the ROMFS directly after the executable sections. This must stay
+    # in sync with how libnaomi/romfs.c finds the image at runtime.
+    if args.romfs:
+        amount = ((romoffset + (ROMFS_ALIGNMENT - 1)) & ~(ROMFS_ALIGNMENT - 1)) - romoffset
+        romdata += b'\0' * amount
+        romoffset += amount
+
+        with open(args.romfs, "rb") as fpb:
+            romfsdata = fpb.read()
+        romoffset += len(romfsdata)
+        romdata += romfsdata
+
     # Now, pad the ROM out to any requested padding.
     if args.pad_before_data and romoffset < int(args.pad_before_data, 16):
         amount = int(args.pad_before_data, 16) - romoffset
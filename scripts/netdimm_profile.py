@@ -0,0 +1,190 @@
+#!/usr/bin/env python3
+import argparse
+import signal
+import struct
+import subprocess
+import sys
+import time
+from typing import Dict, List, Tuple
+
+from netdimm import NetDimm, receive_message, MESSAGE_HOST_SAMPLES, MESSAGE_HOST_STDOUT, MESSAGE_HOST_STDERR
+
+
+class Symbolizer:
+    def __init__(self, elf: str, addr2line: str) -> None:
+        self.elf = elf
+        self.addr2line = addr2line
+        self.cache: Dict[int, Tuple[str, str]] = {}
+
+    def resolve(self, addresses: List[int]) -> None:
+        missing = sorted({a for a in addresses if a not in self.cache})
+        if not missing:
+            return
+
+        # addr2line prints the function on one line and the file:line on the next for
+        # every address we give it, in the same order.
+        output = subprocess.run(
+            [self.addr2line, "-f", "-C", "-e", self.elf] + [hex(a) for a in missing],
+            stdout=subprocess.PIPE,
+            check=True,
+        ).stdout.decode('utf-8').splitlines()
+        for i, address in enumerate(missing):
+            function = output[i * 2].strip() if (i * 2) < len(output) else "??"
+            location = output[(i * 2) + 1].strip() if ((i * 2) + 1) < len(output) else "??:0"
+            if function == "??":
+                function = hex(address)
+            self.cache[address] = (function, location)
+
+    def function(self, address: int) -> str:
+        return self.cache[address][0]
+
+    def location(self, address: int) -> str:
+        return self.cache[address][1]
+
+
+def parse_histogram(data: bytes) -> Tuple[int, int, List[Tuple[int, int, int]]]:
+    if len(data) < 12:
+        raise Exception("Sample histogram is too short!")
+    samples, dropped, count = struct.unpack("<III", data[0:12])
+    entries = []
+    for i in range(count):
+        offset = 12 + (i * 12)
+        entries.append(struct.unpack("<III", data[offset:(offset + 12)]))
+    return samples, dropped, entries
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description="Receive sampling profiler histograms from a Naomi binary running libnaomimessage and symbolize them.")
+    parser.add_argument(
+        "ip",
+        metavar="IP",
+        type=str,
+        help="The IP address that the NetDimm is configured on.",
+    )
+    parser.add_argument(
+        "elf",
+        metavar="ELF",
+        type=str,
+        nargs="?",
+        default="build/naomi.elf",
+        help="The ELF file of the running binary, for symbolizing. Defaults to 'build/naomi.elf'.",
+    )
+    parser.add_argument(
+        "--addr2line",
+        metavar="BINARY",
+        type=str,
+        default="sh4-linux-gnu-addr2line",
+        help="The addr2line binary to symbolize with. Defaults to 'sh4-linux-gnu-addr2line'.",
+    )
+    parser.add_argument(
+        "--duration",
+        metavar="SECONDS",
+        type=float,
+        default=0.0,
+        help="Stop collecting after this many seconds. Defaults to collecting until interrupted with Ctrl-C.",
+    )
+    parser.add_argument(
+        "--format",
+        type=str,
+        choices=["flat", "lines", "folded"],
+        default="flat",
+        help=(
+            "Output format. 'flat' lists functions by samples, 'lines' lists source lines by samples and 'folded' "
+            "outputs caller;callee stacks suitable for flamegraph.pl or speedscope. Defaults to 'flat'."
+        ),
+    )
+    parser.add_argument(
+        "--output",
+        metavar="FILE",
+        type=str,
+        default=None,
+        help="Write the profile to this file instead of stdout.",
+    )
+    parser.add_argument(
+        '--verbose',
+        action="store_true",
+        help="Display verbose debugging information.",
+    )
+
+    args = parser.parse_args()
+    verbose = args.verbose
+
+    # Raw (pc, pr) -> samples, accumulated across every histogram we receive.
+    counts: Dict[Tuple[int, int], int] = {}
+    total = 0
+    dropped = 0
+
+    stopping = False
+
+    def stop(signum: int, frame: object) -> None:
+        nonlocal stopping
+        stopping = True
+
+    signal.signal(signal.SIGINT, stop)
+
+    netdimm = NetDimm(args.ip, log=print if verbose else None)
+    start = time.time()
+    with netdimm.connection():
+        while not stopping:
+            if args.duration > 0.0 and (time.time() - start) >= args.duration:
+                break
+
+            msg = receive_message(netdimm, verbose=verbose)
+            if msg:
+                if msg.id == MESSAGE_HOST_SAMPLES:
+                    samples, lost, entries = parse_histogram(msg.data)
+                    total += samples
+                    dropped += lost
+                    for pc, pr, count in entries:
+                        counts[(pc, pr)] = counts.get((pc, pr), 0) + count
+                    if verbose:
+                        print(f"Received {samples} samples in {len(entries)} entries, {lost} dropped.", file=sys.stderr)
+                elif msg.id == MESSAGE_HOST_STDOUT:
+                    print(msg.data.decode('utf-8'), end="", file=sys.stderr)
+                elif msg.id == MESSAGE_HOST_STDERR:
+                    print(msg.data.decode('utf-8'), end="", file=sys.stderr)
+
+    if total == 0:
+        print("No samples received!", file=sys.stderr)
+        return 1
+
+    symbolizer = Symbolizer(args.elf, args.addr2line)
+    symbolizer.resolve([pc for pc, _ in counts] + [pr for _, pr in counts])
+
+    lines: List[str] = []
+    if args.format == "folded":
+        stacks: Dict[str, int] = {}
+        for (pc, pr), count in counts.items():
+            callee = symbolizer.function(pc)
+            caller = symbolizer.function(pr)
+
+            # PR is only the caller's return address in leaf functions or before the
+            # function has called anything else, so don't make up a caller out of it
+            # when it points back into the same function.
+            stack = callee if caller == callee else f"{caller};{callee}"
+            stacks[stack] = stacks.get(stack, 0) + count
+        for stack, count in sorted(stacks.items()):
+            lines.append(f"{stack} {count}")
+    else:
+        flat: Dict[str, int] = {}
+        for (pc, _), count in counts.items():
+            key = symbolizer.function(pc) if args.format == "flat" else f"{symbolizer.location(pc)} ({symbolizer.function(pc)})"
+            flat[key] = flat.get(key, 0) + count
+
+        lines.append(f"{total} samples, {dropped} dropped")
+        lines.append("")
+        lines.append(" samples  percent  symbol")
+        for key, count in sorted(flat.items(), key=lambda item: item[1], reverse=True):
+            lines.append(f"{count:8} {(count * 100.0) / total:7.2f}%  {key}")
+
+    if args.output:
+        with open(args.output, "w") as fp:
+            fp.write("\n".join(lines) + "\n")
+    else:
+        print("\n".join(lines))
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
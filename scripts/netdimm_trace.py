@@ -0,0 +1,209 @@
+#!/usr/bin/env python3
+import argparse
+import json
+import struct
+import sys
+from typing import Any, Dict, List, Optional, Tuple
+
+from netdimm import NetDimm, receive_message, MESSAGE_HOST_TRACE, MESSAGE_HOST_STDOUT, MESSAGE_HOST_STDERR
+
+
+TRACE_MESSAGE_BEGIN = 0
+TRACE_MESSAGE_EVENTS = 1
+TRACE_MESSAGE_END = 2
+
+TRACE_EVENT_SWITCH = 1
+TRACE_EVENT_SYSCALL = 2
+TRACE_EVENT_IRQ_ENTER = 3
+TRACE_EVENT_IRQ_EXIT = 4
+TRACE_EVENT_WAIT = 5
+TRACE_EVENT_WAKE = 6
+TRACE_EVENT_MARK = 7
+
+SEM_TYPE_MUTEX = 1
+
+SYSCALLS: Dict[int, str] = {
+    0: "global_counter_increment",
+    1: "global_counter_decrement",
+    2: "global_counter_value",
+    3: "thread_yield",
+    4: "thread_start",
+    5: "thread_stop",
+    6: "thread_priority",
+    7: "thread_id",
+    8: "thread_join",
+    9: "thread_exit",
+    10: "semaphore_acquire",
+    11: "semaphore_release",
+    12: "thread_sleep",
+}
+
+IRQ_EVENTS: Dict[int, str] = {
+    0x160: "trapa",
+    0x1C0: "nmi",
+    0x320: "holly level 6",
+    0x360: "holly level 4",
+    0x3A0: "holly level 2",
+    0x400: "tmu0",
+    0x420: "tmu1",
+    0x440: "tmu2",
+    0x660: "dmte1",
+    0x6C0: "dma address error",
+    0x800: "fpu disable",
+    0x820: "slot fpu disable",
+}
+
+# Process IDs we put tracks under in the output.
+PID_THREADS = 1
+PID_INTERRUPTS = 2
+
+
+class Trace:
+    def __init__(self, ticks_per_second: int, names: Dict[int, str]) -> None:
+        self.ticks_per_second = ticks_per_second
+        self.names = names
+        self.events: List[Tuple[int, int, int, int, int]] = []
+
+    def add(self, data: bytes) -> None:
+        for offset in range(0, len(data), 16):
+            self.events.append(struct.unpack("<IHHII", data[offset:(offset + 16)]))
+
+    def thread_name(self, tid: int) -> str:
+        name = self.names.get(tid, "")
+        return name if name else f"thread {tid:08x}"
+
+    def to_chrome(self) -> Dict[str, Any]:
+        output: List[Dict[str, Any]] = []
+
+        # Name our tracks.
+        output.append({"name": "process_name", "ph": "M", "pid": PID_THREADS, "args": {"name": "Threads"}})
+        output.append({"name": "process_name", "ph": "M", "pid": PID_INTERRUPTS, "args": {"name": "Interrupts"}})
+        output.append({"name": "thread_name", "ph": "M", "pid": PID_INTERRUPTS, "tid": 0, "args": {"name": "Interrupts"}})
+        for tid in self.names:
+            output.append({"name": "thread_name", "ph": "M", "pid": PID_THREADS, "tid": tid, "args": {"name": self.thread_name(tid)}})
+
+        # Timestamps are the low 32 bits of the monotonic clock, so unwrap them as we go.
+        base = 0
+        last = None
+        running: Optional[int] = None
+        running_since = 0.0
+        irq_since: Optional[float] = None
+        blocked: Dict[int, Tuple[float, str]] = {}
+        start: Optional[float] = None
+
+        def slice(pid: int, tid: int, name: str, begin: float, end: float, args: Optional[Dict[str, Any]] = None) -> None:
+            entry: Dict[str, Any] = {"name": name, "ph": "X", "pid": pid, "tid": tid, "ts": begin, "dur": max(end - begin, 0.0)}
+            if args:
+                entry["args"] = args
+            output.append(entry)
+
+        def instant(pid: int, tid: int, name: str, ts: float, args: Optional[Dict[str, Any]] = None) -> None:
+            entry: Dict[str, Any] = {"name": name, "ph": "i", "s": "t", "pid": pid, "tid": tid, "ts": ts}
+            if args:
+                entry["args"] = args
+            output.append(entry)
+
+        for timestamp, evtype, code, a, b in self.events:
+            if last is not None and timestamp < last:
+                base += 1 << 32
+            last = timestamp
+            ts = ((base + timestamp) * 1000000.0) / self.ticks_per_second
+            if start is None:
+                start = ts
+                running_since = ts
+
+            if evtype == TRACE_EVENT_SWITCH:
+                # We might not have seen the outgoing thread get switched to, since the trace
+                # could have started while it was already running.
+                if running is None:
+                    running = a
+                if running is not None:
+                    slice(PID_THREADS, running, "running", running_since, ts)
+                running = b
+                running_since = ts
+            elif evtype == TRACE_EVENT_SYSCALL:
+                instant(PID_THREADS, a, SYSCALLS.get(code, f"syscall {code}"), ts, {"param": f"{b:08x}"})
+            elif evtype == TRACE_EVENT_IRQ_ENTER:
+                irq_since = ts
+            elif evtype == TRACE_EVENT_IRQ_EXIT:
+                if irq_since is not None:
+                    slice(PID_INTERRUPTS, 0, IRQ_EVENTS.get(a, f"event {a:03x}"), irq_since, ts, {"source": f"{code:03x}"})
+                irq_since = None
+            elif evtype == TRACE_EVENT_WAIT:
+                what = "mutex" if code == SEM_TYPE_MUTEX else "semaphore"
+                blocked[a] = (ts, f"blocked on {what} {b:08x}")
+            elif evtype == TRACE_EVENT_WAKE:
+                if a in blocked:
+                    since, name = blocked[a]
+                    slice(PID_THREADS, a, name, since, ts)
+                    del blocked[a]
+                else:
+                    instant(PID_THREADS, a, "woken", ts, {"id": f"{b:08x}"})
+            elif evtype == TRACE_EVENT_MARK:
+                instant(PID_INTERRUPTS, 0, f"mark {code}", ts, {"a": a, "b": b})
+
+        return {"traceEvents": output, "displayTimeUnit": "ns"}
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description="Receive a scheduler and interrupt trace from a Naomi binary running libnaomimessage and convert it to Chrome trace JSON.")
+    parser.add_argument(
+        "ip",
+        metavar="IP",
+        type=str,
+        help="The IP address that the NetDimm is configured on.",
+    )
+    parser.add_argument(
+        "output",
+        metavar="OUTPUT",
+        type=str,
+        help="The JSON file to write, which can be loaded in chrome://tracing or ui.perfetto.dev.",
+    )
+    parser.add_argument(
+        '--verbose',
+        action="store_true",
+        help="Display verbose debugging information.",
+    )
+
+    args = parser.parse_args()
+    verbose = args.verbose
+
+    trace: Optional[Trace] = None
+    netdimm = NetDimm(args.ip, log=print if verbose else None)
+    with netdimm.connection():
+        while True:
+            msg = receive_message(netdimm, verbose=verbose)
+            if not msg:
+                continue
+
+            if msg.id == MESSAGE_HOST_TRACE:
+                kind = struct.unpack("<I", msg.data[0:4])[0]
+                if kind == TRACE_MESSAGE_BEGIN:
+                    ticks_per_second, total, _, thread_count = struct.unpack("<IIII", msg.data[4:20])
+                    names: Dict[int, str] = {}
+                    for i in range(thread_count):
+                        offset = 20 + (i * 68)
+                        tid = struct.unpack("<I", msg.data[offset:(offset + 4)])[0]
+                        names[tid] = msg.data[(offset + 4):(offset + 68)].split(b"\0", 1)[0].decode('utf-8', errors='replace')
+                    trace = Trace(ticks_per_second, names)
+                    if verbose:
+                        print(f"Receiving {total} events from {thread_count} threads.", file=sys.stderr)
+                elif kind == TRACE_MESSAGE_EVENTS and trace is not None:
+                    count = struct.unpack("<I", msg.data[8:12])[0]
+                    trace.add(msg.data[12:(12 + (count * 16))])
+                elif kind == TRACE_MESSAGE_END and trace is not None:
+                    break
+            elif msg.id == MESSAGE_HOST_STDOUT:
+                print(msg.data.decode('utf-8'), end="", file=sys.stderr)
+            elif msg.id == MESSAGE_HOST_STDERR:
+                print(msg.data.decode('utf-8'), end="", file=sys.stderr)
+
+    with open(args.output, "w") as fp:
+        json.dump(trace.to_chrome(), fp)
+    print(f"Wrote {len(trace.events)} events to {args.output}.")
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())